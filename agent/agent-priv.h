@@ -86,6 +86,17 @@ gboolean
 nice_input_message_iter_compare (const NiceInputMessageIter *a,
     const NiceInputMessageIter *b);
 
+/* The agent lock. It is reference counted so that a socket callback which
+ * holds a reference can take it even once the agent is finalised, and then
+ * find that its source was destroyed. */
+typedef struct {
+  GMutex mutex;
+  volatile gint ref_count;
+} AgentMutex;
+
+AgentMutex *agent_mutex_ref (AgentMutex *agent_mutex);
+void agent_mutex_unref (AgentMutex *agent_mutex);
+
 
 #include "socket.h"
 #include "candidate.h"
@@ -114,10 +125,23 @@ nice_input_message_iter_compare (const NiceInputMessageIter *a,
  * MTU and estimated typical sizes of ICE STUN packet */
 #define MAX_STUN_DATAGRAM_PAYLOAD    1300
 
+/* A thread running a main loop, to which the agent assigns streams. */
+typedef struct {
+  GMainContext *context;          /* owned */
+  GMainLoop *loop;                /* owned */
+  GThread *thread;                /* owned */
+  guint n_streams;                /* number of streams assigned to it */
+} AgentWorker;
+
 struct _NiceAgent
 {
   GObject parent;                 /* gobject pointer */
 
+  AgentMutex *agent_mutex;        /* Mutex used for thread-safe lib */
+  GRWLock send_paths_lock;        /* protects send_paths */
+  GHashTable *send_paths;         /* gint64 → owned ComponentSendPath, see
+                                     component_update_send_path() */
+
   gboolean full_mode;             /* property: full-mode */
   GTimeVal next_check_tv;         /* property: next conncheck timestamp */
   gchar *stun_server_ip;          /* property: STUN server IP */
@@ -158,9 +182,14 @@ struct _NiceAgent
   gchar *software_attribute;       /* SOFTWARE attribute */
   gboolean reliable;               /* property: reliable */
   gboolean keepalive_conncheck;    /* property: keepalive_conncheck */
+  gboolean udp_gso;                /* property: udp_gso */
+  gboolean udp_gro;                /* property: udp_gro */
+  gboolean use_epoll;              /* property: epoll */
+  gboolean use_io_uring;           /* property: io-uring */
+  guint n_workers;                 /* property: worker-threads */
+  AgentWorker *workers;            /* owned, @n_workers long */
 
   GQueue pending_signals;
-  guint16 rfc4571_expecting_length;
   gboolean use_ice_udp;
   gboolean use_ice_tcp;
   /* XXX: add pointer to internal data struct for ABI-safe extensions */
@@ -179,8 +208,8 @@ Stream *agent_find_stream (NiceAgent *agent, guint stream_id);
 void agent_gathering_done (NiceAgent *agent);
 void agent_signal_gathering_done (NiceAgent *agent);
 
-void agent_lock (void);
-void agent_unlock (void);
+void agent_lock (NiceAgent *agent);
+void agent_unlock (NiceAgent *agent);
 void agent_unlock_and_emit (NiceAgent *agent);
 
 void agent_signal_new_selected_pair (
@@ -206,8 +235,19 @@ void agent_signal_initial_binding_request_received (NiceAgent *agent, Stream *st
 
 guint64 agent_candidate_pair_priority (NiceAgent *agent, NiceCandidate *local, NiceCandidate *remote);
 
+/* Callback for agent_timeout_add_with_context(), called with the agent lock
+ * held. Returns %G_SOURCE_CONTINUE to keep the timer running. */
+typedef gboolean (*NiceTimeoutLockedCallback) (NiceAgent *agent,
+    gpointer user_data);
+
 void agent_timeout_add_with_context (NiceAgent *agent, GSource **out,
-    const gchar *name, guint interval, GSourceFunc function, gpointer data);
+    const gchar *name, guint interval, NiceTimeoutLockedCallback function,
+    gpointer data);
+void agent_timeout_add_for_stream (NiceAgent *agent, Stream *stream,
+    GSource **out, const gchar *name, guint interval,
+    NiceTimeoutLockedCallback function, gpointer data);
+
+GMainContext *agent_get_stream_context (NiceAgent *agent, Stream *stream);
 
 StunUsageIceCompatibility agent_to_ice_compatibility (NiceAgent *agent);
 StunUsageTurnCompatibility agent_to_turn_compatibility (NiceAgent *agent);
@@ -231,6 +271,8 @@ memcpy_buffer_to_input_message (NiceInputMessage *message,
     const guint8 *buffer, gsize buffer_length);
 guint8 *
 compact_input_message (const NiceInputMessage *message, gsize *buffer_length);
+void
+move_input_message (NiceInputMessage *dest, const NiceInputMessage *src);
 
 guint8 *
 compact_output_message (const NiceOutputMessage *message, gsize *buffer_length);
@@ -110,7 +110,12 @@ enum
   PROP_ICE_UDP,
   PROP_ICE_TCP,
   PROP_BYTESTREAM_TCP,
-  PROP_KEEPALIVE_CONNCHECK
+  PROP_KEEPALIVE_CONNCHECK,
+  PROP_UDP_GSO,
+  PROP_UDP_GRO,
+  PROP_WORKER_THREADS,
+  PROP_EPOLL,
+  PROP_IO_URING
 };
 
 
@@ -133,12 +138,6 @@ enum
 
 static guint signals[N_SIGNALS];
 
-#if GLIB_CHECK_VERSION(2,31,8)
-static GMutex agent_mutex;    /* Mutex used for thread-safe lib */
-#else
-static GStaticMutex agent_mutex = G_STATIC_MUTEX_INIT;
-#endif
-
 static void priv_stop_upnp (NiceAgent *agent);
 
 static void pseudo_tcp_socket_opened (PseudoTcpSocket *sock, gpointer user_data);
@@ -150,35 +149,51 @@ static PseudoTcpWriteResult pseudo_tcp_socket_write_packet (PseudoTcpSocket *soc
     const gchar *buffer, guint32 len, gpointer user_data);
 static void adjust_tcp_clock (NiceAgent *agent, Stream *stream, Component *component);
 
+static void nice_agent_constructed (GObject *object);
 static void nice_agent_dispose (GObject *object);
+static void nice_agent_finalize (GObject *object);
 static void nice_agent_get_property (GObject *object,
   guint property_id, GValue *value, GParamSpec *pspec);
 static void nice_agent_set_property (GObject *object,
   guint property_id, const GValue *value, GParamSpec *pspec);
 
-#if GLIB_CHECK_VERSION(2,31,8)
-void agent_lock (void)
+void agent_lock (NiceAgent *agent)
 {
-  g_mutex_lock (&agent_mutex);
+  g_mutex_lock (&agent->agent_mutex->mutex);
 }
 
-void agent_unlock (void)
+void agent_unlock (NiceAgent *agent)
 {
-  g_mutex_unlock (&agent_mutex);
+  g_mutex_unlock (&agent->agent_mutex->mutex);
 }
 
-#else
-void agent_lock(void)
+static AgentMutex *
+agent_mutex_new (void)
 {
-  g_static_mutex_lock (&agent_mutex);
+  AgentMutex *agent_mutex = g_slice_new0 (AgentMutex);
+
+  g_mutex_init (&agent_mutex->mutex);
+  agent_mutex->ref_count = 1;
+
+  return agent_mutex;
 }
 
-void agent_unlock(void)
+AgentMutex *
+agent_mutex_ref (AgentMutex *agent_mutex)
 {
-  g_static_mutex_unlock (&agent_mutex);
+  g_atomic_int_inc (&agent_mutex->ref_count);
+
+  return agent_mutex;
 }
 
-#endif
+void
+agent_mutex_unref (AgentMutex *agent_mutex)
+{
+  if (g_atomic_int_dec_and_test (&agent_mutex->ref_count)) {
+    g_mutex_clear (&agent_mutex->mutex);
+    g_slice_free (AgentMutex, agent_mutex);
+  }
+}
 
 static GType _nice_agent_stream_ids_get_type (void);
 
@@ -219,7 +234,7 @@ agent_unlock_and_emit (NiceAgent *agent)
   queue = agent->pending_signals;
   g_queue_init (&agent->pending_signals);
 
-  agent_unlock ();
+  agent_unlock (agent);
 
   while ((sig = g_queue_pop_head (&queue))) {
     g_signal_emitv (sig->params, sig->signal_id, 0, NULL);
@@ -367,7 +382,9 @@ nice_agent_class_init (NiceAgentClass *klass)
 
   gobject_class->get_property = nice_agent_get_property;
   gobject_class->set_property = nice_agent_set_property;
+  gobject_class->constructed = nice_agent_constructed;
   gobject_class->dispose = nice_agent_dispose;
+  gobject_class->finalize = nice_agent_finalize;
 
   /* install properties */
   /**
@@ -706,6 +723,117 @@ nice_agent_class_init (NiceAgentClass *klass)
 	FALSE,
         G_PARAM_READWRITE));
 
+  /**
+   * NiceAgent:udp-gso:
+   *
+   * Use UDP generic segmentation offload when sending several messages of
+   * the same size at once on a UDP socket, so that the kernel splits them
+   * into datagrams instead of sending each one separately.
+   *
+   * This is only supported on Linux, and is turned off again for each socket
+   * on which the kernel or network device refuses it.
+   *
+   * Since: 0.1.11
+   */
+   g_object_class_install_property (gobject_class, PROP_UDP_GSO,
+      g_param_spec_boolean (
+        "udp-gso",
+        "Use UDP segmentation offload",
+        "Let the kernel split batches of equal-sized UDP messages into "
+        "datagrams.",
+        FALSE,
+        G_PARAM_READWRITE));
+
+  /**
+   * NiceAgent:udp-gro:
+   *
+   * Use UDP generic receive offload, so that the kernel can coalesce
+   * consecutive datagrams from the same peer and return them with a single
+   * system call. They are split up again before being handled, so this
+   * doesn’t change what is received.
+   *
+   * This is only supported on Linux.
+   *
+   * Since: 0.1.11
+   */
+   g_object_class_install_property (gobject_class, PROP_UDP_GRO,
+      g_param_spec_boolean (
+        "udp-gro",
+        "Use UDP receive offload",
+        "Let the kernel coalesce UDP datagrams from the same peer.",
+        FALSE,
+        G_PARAM_READWRITE));
+
+  /**
+   * NiceAgent:worker-threads:
+   *
+   * The number of worker threads the agent runs, each with its own
+   * #GMainContext. Each new stream is assigned to the worker with the fewest
+   * streams, and its sockets and per-stream timers are handled there, so
+   * that the streams of one agent can use several cores.
+   *
+   * When this is not 0, passing a %NULL context to nice_agent_attach_recv()
+   * selects the worker of the stream, and signals and receive callbacks may
+   * be emitted from the worker threads. If #NiceAgent:main-context is %NULL,
+   * the agent-wide timers run in the first worker.
+   *
+   * <para> See also: nice_agent_new_with_pool() </para>
+   *
+   * Since: 0.1.11
+   */
+   g_object_class_install_property (gobject_class, PROP_WORKER_THREADS,
+      g_param_spec_uint (
+        "worker-threads",
+        "Worker threads",
+        "The number of threads the agent handles its streams in",
+        0, 256,
+        0,
+        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+  /**
+   * NiceAgent:epoll:
+   *
+   * Poll the agent's sockets through one epoll file descriptor per
+   * #GMainContext, driven by a single #GSource, instead of attaching a
+   * #GSource per socket. The cost of each main loop iteration then no longer
+   * grows with the number of sockets, which matters for agents with many
+   * streams or candidates.
+   *
+   * This is only supported on Linux. Elsewhere, or if epoll can't be used
+   * for a socket, the agent silently falls back to a #GSource per socket.
+   *
+   * Since: 0.1.11
+   */
+   g_object_class_install_property (gobject_class, PROP_EPOLL,
+      g_param_spec_boolean (
+        "epoll",
+        "Use epoll",
+        "Poll all the sockets of a main context through a single epoll "
+        "file descriptor.",
+        FALSE,
+        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+  /**
+   * NiceAgent:io-uring:
+   *
+   * Create the agent's UDP sockets on top of io_uring, with a multishot
+   * receive filling a ring of kernel-provided buffers and batched sends, so
+   * that busy sockets need far fewer system calls per packet.
+   *
+   * This needs Linux 6.0 or later and libnice built with liburing. Elsewhere,
+   * the agent silently falls back to plain UDP sockets. It only affects the
+   * sockets created after it is set.
+   *
+   * Since: 0.1.11
+   */
+   g_object_class_install_property (gobject_class, PROP_IO_URING,
+      g_param_spec_boolean (
+        "io-uring",
+        "Use io_uring",
+        "Send and receive on UDP sockets through io_uring.",
+        FALSE,
+        G_PARAM_READWRITE));
+
   /* install signals */
 
   /**
@@ -1011,6 +1139,12 @@ static void priv_generate_tie_breaker (NiceAgent *agent)
 static void
 nice_agent_init (NiceAgent *agent)
 {
+  agent->agent_mutex = agent_mutex_new ();
+
+  g_rw_lock_init (&agent->send_paths_lock);
+  agent->send_paths = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL,
+      (GDestroyNotify) component_send_path_unref);
+
   agent->next_candidate_id = 1;
   agent->next_stream_id = 1;
 
@@ -1032,6 +1166,10 @@ nice_agent_init (NiceAgent *agent)
   agent->reliable = FALSE;
   agent->use_ice_udp = TRUE;
   agent->use_ice_tcp = TRUE;
+  agent->udp_gso = FALSE;
+  agent->udp_gro = FALSE;
+  agent->use_epoll = FALSE;
+  agent->use_io_uring = FALSE;
 
   agent->rng = nice_rng_new ();
   priv_generate_tie_breaker (agent);
@@ -1066,6 +1204,157 @@ nice_agent_new_reliable (GMainContext *ctx, NiceCompatibility compat)
 }
 
 
+NICEAPI_EXPORT NiceAgent *
+nice_agent_new_with_pool (GMainContext *ctx, NiceCompatibility compat,
+    guint n_workers)
+{
+  NiceAgent *agent = g_object_new (NICE_TYPE_AGENT,
+      "compatibility", compat,
+      "main-context", ctx,
+      "reliable", FALSE,
+      "worker-threads", n_workers,
+      NULL);
+
+  return agent;
+}
+
+
+static gpointer
+agent_worker_thread (gpointer data)
+{
+  GMainLoop *loop = data;  /* owned */
+  GMainContext *context = g_main_loop_get_context (loop);
+
+  g_main_context_push_thread_default (context);
+  g_main_loop_run (loop);
+  g_main_context_pop_thread_default (context);
+
+  g_main_loop_unref (loop);
+
+  return NULL;
+}
+
+static gboolean
+agent_worker_quit_cb (gpointer data)
+{
+  GMainLoop *loop = data;
+
+  g_main_loop_quit (loop);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+priv_start_workers (NiceAgent *agent)
+{
+  guint i;
+
+  if (agent->n_workers == 0)
+    return;
+
+  agent->workers = g_new0 (AgentWorker, agent->n_workers);
+
+  for (i = 0; i < agent->n_workers; i++) {
+    AgentWorker *worker = &agent->workers[i];
+
+    worker->context = g_main_context_new ();
+    worker->loop = g_main_loop_new (worker->context, FALSE);
+    worker->thread = g_thread_new ("nice-agent-worker", agent_worker_thread,
+        g_main_loop_ref (worker->loop));
+  }
+}
+
+static void
+priv_stop_workers (NiceAgent *agent)
+{
+  guint i;
+
+  for (i = 0; i < agent->n_workers && agent->workers != NULL; i++) {
+    AgentWorker *worker = &agent->workers[i];
+    GSource *source;
+
+    /* Quit from within the loop, as g_main_loop_quit() is lost if the thread
+     * hasn’t started running the loop yet. */
+    source = g_idle_source_new ();
+    g_source_set_callback (source, agent_worker_quit_cb,
+        g_main_loop_ref (worker->loop), (GDestroyNotify) g_main_loop_unref);
+    g_source_attach (source, worker->context);
+    g_source_unref (source);
+
+    /* The last reference to the agent may be dropped in a worker, which then
+     * exits once this returns. */
+    if (worker->thread == g_thread_self ())
+      g_thread_unref (worker->thread);
+    else
+      g_thread_join (worker->thread);
+
+    g_main_loop_unref (worker->loop);
+    g_main_context_unref (worker->context);
+  }
+
+  g_free (agent->workers);
+  agent->workers = NULL;
+}
+
+/* Assign @stream to the worker with the fewest streams, if there are any
+ * workers. */
+static void
+priv_assign_stream_to_worker (NiceAgent *agent, Stream *stream)
+{
+  AgentWorker *worker;
+  guint i;
+
+  if (agent->n_workers == 0)
+    return;
+
+  worker = &agent->workers[0];
+  for (i = 1; i < agent->n_workers; i++) {
+    if (agent->workers[i].n_streams < worker->n_streams)
+      worker = &agent->workers[i];
+  }
+
+  worker->n_streams++;
+  stream->context = g_main_context_ref (worker->context);
+}
+
+static void
+priv_release_stream_from_worker (NiceAgent *agent, Stream *stream)
+{
+  guint i;
+
+  for (i = 0; i < agent->n_workers; i++) {
+    if (agent->workers[i].context == stream->context) {
+      agent->workers[i].n_streams--;
+      break;
+    }
+  }
+}
+
+/* The context for the sockets and timers of @stream. */
+GMainContext *
+agent_get_stream_context (NiceAgent *agent, Stream *stream)
+{
+  if (stream != NULL && stream->context != NULL)
+    return stream->context;
+
+  return agent->main_context;
+}
+
+static void
+nice_agent_constructed (GObject *object)
+{
+  NiceAgent *agent = NICE_AGENT (object);
+
+  if (G_OBJECT_CLASS (nice_agent_parent_class)->constructed)
+    G_OBJECT_CLASS (nice_agent_parent_class)->constructed (object);
+
+  priv_start_workers (agent);
+
+  if (agent->main_context == NULL && agent->n_workers > 0)
+    agent->main_context = g_main_context_ref (agent->workers[0].context);
+}
+
+
 static void
 nice_agent_get_property (
   GObject *object,
@@ -1075,7 +1364,7 @@ nice_agent_get_property (
 {
   NiceAgent *agent = NICE_AGENT (object);
 
-  agent_lock();
+  agent_lock (agent);
 
   switch (property_id)
     {
@@ -1178,6 +1467,26 @@ nice_agent_get_property (
         g_value_set_boolean (value, agent->keepalive_conncheck);
       break;
 
+    case PROP_UDP_GSO:
+      g_value_set_boolean (value, agent->udp_gso);
+      break;
+
+    case PROP_UDP_GRO:
+      g_value_set_boolean (value, agent->udp_gro);
+      break;
+
+    case PROP_WORKER_THREADS:
+      g_value_set_uint (value, agent->n_workers);
+      break;
+
+    case PROP_EPOLL:
+      g_value_set_boolean (value, agent->use_epoll);
+      break;
+
+    case PROP_IO_URING:
+      g_value_set_boolean (value, agent->use_io_uring);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
@@ -1241,7 +1550,28 @@ nice_agent_reset_all_stun_agents (NiceAgent *agent, gboolean only_software)
         stun_agent_set_software (&component->stun_agent,
             agent->software_attribute);
       else
-        nice_agent_init_stun_agent(agent, &component->stun_agent);
+        component_init_stun_agent (component);
+    }
+  }
+}
+
+static void
+priv_set_udp_offload (NiceAgent *agent)
+{
+  GSList *i, *j, *k;
+
+  for (i = agent->streams; i; i = i->next) {
+    Stream *stream = i->data;
+
+    for (j = stream->components; j; j = j->next) {
+      Component *component = j->data;
+
+      for (k = component->socket_sources; k; k = k->next) {
+        SocketSource *socket_source = k->data;
+
+        nice_udp_bsd_socket_set_gso (socket_source->socket, agent->udp_gso);
+        nice_udp_bsd_socket_set_gro (socket_source->socket, agent->udp_gro);
+      }
     }
   }
 }
@@ -1255,7 +1585,7 @@ nice_agent_set_property (
 {
   NiceAgent *agent = NICE_AGENT (object);
 
-  agent_lock();
+  agent_lock (agent);
 
   switch (property_id)
     {
@@ -1361,6 +1691,28 @@ nice_agent_set_property (
       agent->keepalive_conncheck = g_value_get_boolean (value);
       break;
 
+    case PROP_UDP_GSO:
+      agent->udp_gso = g_value_get_boolean (value);
+      priv_set_udp_offload (agent);
+      break;
+
+    case PROP_UDP_GRO:
+      agent->udp_gro = g_value_get_boolean (value);
+      priv_set_udp_offload (agent);
+      break;
+
+    case PROP_WORKER_THREADS:
+      agent->n_workers = g_value_get_uint (value);
+      break;
+
+    case PROP_EPOLL:
+      agent->use_epoll = g_value_get_boolean (value);
+      break;
+
+    case PROP_IO_URING:
+      agent->use_io_uring = g_value_get_boolean (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
@@ -1773,28 +2125,12 @@ pseudo_tcp_socket_write_packet (PseudoTcpSocket *psocket,
 
 
 static gboolean
-notify_pseudo_tcp_socket_clock (gpointer user_data)
+notify_pseudo_tcp_socket_clock (NiceAgent *agent, gpointer user_data)
 {
   Component *component = user_data;
-  Stream *stream;
-  NiceAgent *agent;
-
-  agent_lock();
-
-  stream = component->stream;
-  agent = component->agent;
-
-  if (g_source_is_destroyed (g_main_current_source ())) {
-    nice_debug ("Source was destroyed. "
-        "Avoided race condition in notify_pseudo_tcp_socket_clock");
-    agent_unlock ();
-    return FALSE;
-  }
 
   pseudo_tcp_socket_notify_clock (component->tcp);
-  adjust_tcp_clock (agent, stream, component);
-
-  agent_unlock_and_emit (agent);
+  adjust_tcp_clock (agent, component->stream, component);
 
   return G_SOURCE_CONTINUE;
 }
@@ -1823,7 +2159,7 @@ adjust_tcp_clock (NiceAgent *agent, Stream *stream, Component *component)
           /* Prevent integer overflows */
           if (interval < 0 || interval > G_MAXINT)
             interval = G_MAXINT;
-          agent_timeout_add_with_context (agent, &component->tcp_clock,
+          agent_timeout_add_for_stream (agent, stream, &component->tcp_clock,
               "Pseudo-TCP clock", interval,
               notify_pseudo_tcp_socket_clock, component);
         }
@@ -1844,13 +2180,13 @@ _tcp_sock_is_writable (NiceSocket *sock, gpointer user_data)
   NiceAgent *agent = component->agent;
   Stream *stream = component->stream;
 
-  agent_lock ();
+  agent_lock (agent);
 
   /* Don't signal writable if the socket that has become writable is not
    * the selected pair */
   if (component->selected_pair.local == NULL ||
       component->selected_pair.local->sockptr != sock) {
-    agent_unlock ();
+    agent_unlock (agent);
     return;
   }
 
@@ -2178,6 +2514,8 @@ priv_add_new_candidate_discovery_stun (NiceAgent *agent,
       (agent->compatibility == NICE_COMPATIBILITY_OC2007 ||
        agent->compatibility == NICE_COMPATIBILITY_OC2007R2) ?
         STUN_AGENT_USAGE_NO_ALIGNED_ATTRIBUTES : 0);
+  stun_agent_set_transaction_storage (&cdisco->stun_agent,
+      cdisco->stun_saved_ids, G_N_ELEMENTS (cdisco->stun_saved_ids));
 
   nice_debug ("Agent %p : Adding new srv-rflx candidate discovery %p\n",
       agent, cdisco);
@@ -2211,9 +2549,15 @@ priv_add_new_candidate_discovery_turn (NiceAgent *agent,
       NiceSocket *new_socket;
       nice_address_set_port (&addr, 0);
 
-      new_socket = nice_udp_bsd_socket_new (&addr);
+      new_socket = NULL;
+      if (agent->use_io_uring)
+        new_socket = nice_udp_uring_socket_new (&addr);
+      if (new_socket == NULL)
+        new_socket = nice_udp_bsd_socket_new (&addr);
       if (new_socket) {
         _priv_set_socket_tos (agent, new_socket, stream->tos);
+        nice_udp_bsd_socket_set_gso (new_socket, agent->udp_gso);
+        nice_udp_bsd_socket_set_gro (new_socket, agent->udp_gro);
         component_attach_socket (component, new_socket);
         nicesock = new_socket;
       }
@@ -2262,8 +2606,8 @@ priv_add_new_candidate_discovery_turn (NiceAgent *agent,
         agent->proxy_ip != NULL &&
         nice_address_set_from_string (&proxy_server, agent->proxy_ip)) {
       nice_address_set_port (&proxy_server, agent->proxy_port);
-      nicesock = nice_tcp_bsd_socket_new (agent->main_context, &local_address,
-          &proxy_server, reliable_tcp);
+      nicesock = nice_tcp_bsd_socket_new (agent_get_stream_context (agent,
+              stream), &local_address, &proxy_server, reliable_tcp);
 
       if (nicesock) {
         _priv_set_socket_tos (agent, nicesock, stream->tos);
@@ -2281,8 +2625,8 @@ priv_add_new_candidate_discovery_turn (NiceAgent *agent,
 
     }
     if (nicesock == NULL) {
-      nicesock = nice_tcp_bsd_socket_new (agent->main_context, &local_address,
-          &turn->server, reliable_tcp);
+      nicesock = nice_tcp_bsd_socket_new (agent_get_stream_context (agent,
+              stream), &local_address, &turn->server, reliable_tcp);
 
       if (nicesock)
         _priv_set_socket_tos (agent, nicesock, stream->tos);
@@ -2341,6 +2685,8 @@ priv_add_new_candidate_discovery_turn (NiceAgent *agent,
         STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS);
   }
   stun_agent_set_software (&cdisco->stun_agent, agent->software_attribute);
+  stun_agent_set_transaction_storage (&cdisco->stun_agent,
+      cdisco->stun_saved_ids, G_N_ELEMENTS (cdisco->stun_saved_ids));
 
   nice_debug ("Agent %p : Adding new relay-rflx candidate discovery %p\n",
       agent, cdisco);
@@ -2357,12 +2703,13 @@ nice_agent_add_stream (
   guint ret = 0;
   guint i;
 
-  agent_lock();
+  agent_lock (agent);
   stream = stream_new (n_components, agent);
 
   agent->streams = g_slist_append (agent->streams, stream);
   stream->id = agent->next_stream_id++;
   nice_debug ("Agent %p : allocating stream id %u (%p)", agent, stream->id, stream);
+  priv_assign_stream_to_worker (agent, stream);
   if (agent->reliable) {
     nice_debug ("Agent %p : reliable stream", agent);
     for (i = 0; i < n_components; i++) {
@@ -2403,7 +2750,7 @@ nice_agent_set_relay_info(NiceAgent *agent,
   g_return_val_if_fail (password, FALSE);
   g_return_val_if_fail (type <= NICE_RELAY_TYPE_TURN_TLS, FALSE);
 
-  agent_lock();
+  agent_lock (agent);
 
   if (!agent_find_component (agent, stream_id, component_id, &stream,
           &component)) {
@@ -2454,18 +2801,8 @@ nice_agent_set_relay_info(NiceAgent *agent,
 
 static void agent_check_upnp_gathering_done (NiceAgent *agent);
 
-static gboolean priv_upnp_timeout_cb (gpointer user_data)
+static gboolean priv_upnp_timeout_cb (NiceAgent *agent, gpointer user_data)
 {
-  NiceAgent *agent = (NiceAgent*)user_data;
-
-  agent_lock();
-
-  /* If the source has been destroyed, we have already freed all mappings. */
-  if (g_source_is_destroyed (g_main_current_source ())) {
-    agent_unlock ();
-    return FALSE;
-  }
-
   nice_debug ("Agent %p : UPnP port mapping timed out", agent);
 
   /* We cannot free priv->upnp here as it may be holding mappings open which
@@ -2475,7 +2812,6 @@ static gboolean priv_upnp_timeout_cb (gpointer user_data)
 
   agent_check_upnp_gathering_done (agent);
 
-  agent_unlock_and_emit (agent);
   return FALSE;
 }
 
@@ -2510,7 +2846,7 @@ static void _upnp_mapped_external_port (GUPnPSimpleIgd *self, gchar *proto,
   NiceCandidateTransport transport;
   GSList *i, *j, *k;
 
-  agent_lock();
+  agent_lock (agent);
 
   if (agent->upnp_timer_source == NULL)
     goto end;
@@ -2576,7 +2912,7 @@ static void _upnp_error_mapping_port (GUPnPSimpleIgd *self, GError *error,
   NiceAddress localaddr;
   GSList *i;
 
-  agent_lock();
+  agent_lock (agent);
 
   nice_debug ("Agent %p : Error mapping %s:%d to %d (%d) : %s", agent, local_ip,
       local_port, external_port, error->domain, error->message);
@@ -2611,7 +2947,7 @@ nice_agent_gather_candidates (
   GSList *local_addresses = NULL;
   gboolean ret = TRUE;
 
-  agent_lock();
+  agent_lock (agent);
 
   stream = agent_find_stream (agent, stream_id);
   if (stream == NULL) {
@@ -2931,7 +3267,7 @@ nice_agent_remove_stream (
 
   Stream *stream;
 
-  agent_lock();
+  agent_lock (agent);
   stream = agent_find_stream (agent, stream_id);
 
   if (!stream) {
@@ -2946,6 +3282,7 @@ nice_agent_remove_stream (
 
   /* Remove the stream and signal its removal. */
   agent->streams = g_slist_remove (agent->streams, stream);
+  priv_release_stream_from_worker (agent, stream);
   stream_close (stream);
 
   if (!agent->streams)
@@ -2971,7 +3308,7 @@ nice_agent_set_port_range (NiceAgent *agent, guint stream_id, guint component_id
   Stream *stream;
   Component *component;
 
-  agent_lock();
+  agent_lock (agent);
 
   if (agent_find_component (agent, stream_id, component_id, &stream,
           &component)) {
@@ -2991,7 +3328,7 @@ nice_agent_add_local_address (NiceAgent *agent, NiceAddress *addr)
 {
   NiceAddress *dupaddr;
 
-  agent_lock();
+  agent_lock (agent);
 
   dupaddr = nice_address_dup (addr);
   nice_address_set_port (dupaddr, 0);
@@ -3120,7 +3457,7 @@ nice_agent_set_remote_credentials (
   Stream *stream;
   gboolean ret = FALSE;
 
-  agent_lock();
+  agent_lock (agent);
 
   stream = agent_find_stream (agent, stream_id);
   /* note: oddly enough, ufrag and pwd can be empty strings */
@@ -3148,7 +3485,7 @@ nice_agent_get_local_credentials (
   Stream *stream;
   gboolean ret = TRUE;
 
-  agent_lock();
+  agent_lock (agent);
 
   stream = agent_find_stream (agent, stream_id);
   if (stream == NULL) {
@@ -3218,7 +3555,7 @@ nice_agent_set_remote_candidates (NiceAgent *agent, guint stream_id, guint compo
 
   nice_debug ("Agent %p: set_remote_candidates %d %d", agent, stream_id, component_id);
 
-  agent_lock();
+  agent_lock (agent);
 
   if (!agent_find_component (agent, stream_id, component_id,
           &stream, &component)) {
@@ -3245,6 +3582,62 @@ typedef enum {
   RECV_SUCCESS = 1,
 } RecvStatus;
 
+static RecvStatus agent_handle_received_message_unlocked (NiceAgent *agent,
+    Stream *stream, Component *component, NiceSocket *nicesock,
+    NiceInputMessage *message);
+
+/* Handle a STUN message which is split over several of @message’s buffers.
+ * The STUN agent checks integrity over the whole message, so it is copied
+ * into a single buffer first. This happens for every STUN message on reliable
+ * agents, which receive into a pseudo-TCP header buffer and a separate body
+ * buffer, as well as when the application passes buffers smaller than the
+ * message. Messages up to MAX_STUN_DATAGRAM_PAYLOAD, which covers all the
+ * agent’s own checks, are copied on the stack, and only larger ones on the
+ * heap. Returns %TRUE if the message was handled. */
+static gboolean
+agent_handle_inbound_stun_vectored (NiceAgent *agent, Stream *stream,
+    Component *component, NiceSocket *nicesock,
+    const NiceInputMessage *message)
+{
+  guint8 stack_buffer[MAX_STUN_DATAGRAM_PAYLOAD];
+  guint8 *buffer;
+  gsize offset = 0;
+  guint i;
+  gboolean handled;
+
+  if (message->length <= sizeof (stack_buffer))
+    buffer = stack_buffer;
+  else
+    buffer = g_malloc (message->length);
+
+  for (i = 0;
+       offset < message->length &&
+       ((message->n_buffers >= 0 && i < (guint) message->n_buffers) ||
+        (message->n_buffers < 0 && message->buffers[i].buffer != NULL));
+       i++) {
+    gsize len = MIN (message->length - offset, message->buffers[i].size);
+    memcpy (buffer + offset, message->buffers[i].buffer, len);
+    offset += len;
+  }
+
+  handled = conn_check_handle_inbound_stun (agent, stream, component,
+      nicesock, message->from, (gchar *) buffer, message->length);
+  if (buffer != stack_buffer)
+    g_free (buffer);
+
+  return handled;
+}
+
+/* Length of the RFC 4571 frame at the start of @buf, header included */
+static gssize
+rfc4571_frame_length (const guint8 *buf, gsize len, gpointer user_data)
+{
+  if (len < sizeof (guint16))
+    return 0;
+
+  return sizeof (guint16) + ((buf[0] << 8) | buf[1]);
+}
+
 /*
  * agent_recv_message_unlocked:
  * @agent: a #NiceAgent
@@ -3275,7 +3668,6 @@ agent_recv_message_unlocked (
   NiceInputMessage *message)
 {
   NiceAddress from;
-  GList *item;
   gint retval;
 
   /* We need an address for packet parsing, below. */
@@ -3290,7 +3682,7 @@ agent_recv_message_unlocked (
      * always return an entire frame, so we must read it as is */
     if (nicesock->type == NICE_SOCKET_TYPE_UDP_TURN_OVER_TCP ||
         nicesock->type == NICE_SOCKET_TYPE_UDP_TURN) {
-      GSList *cand_i;
+      NiceSocket *relay;
       GInputVector *local_bufs;
       NiceInputMessage local_message;
       guint n_bufs = 0;
@@ -3302,18 +3694,10 @@ agent_recv_message_unlocked (
        * on the UDP_TURN_OVER_TCP socket, so in that case, we need to replace
        * the socket we do the recv on to the topmost socket
        */
-      for (cand_i = component->local_candidates; cand_i; cand_i = cand_i->next) {
-        NiceCandidate *cand = cand_i->data;
-
-        if (cand->type == NICE_CANDIDATE_TYPE_RELAYED &&
-            cand->stream_id == stream->id &&
-            cand->component_id == component->id &&
-            ((NiceSocket *)cand->sockptr)->fileno == nicesock->fileno) {
-          nice_debug ("Agent %p : Packet received from a TURN socket.",
-              agent);
-          nicesock = cand->sockptr;
-          break;
-        }
+      relay = component_find_relay_socket (component, nicesock, NULL);
+      if (relay != NULL) {
+        nice_debug ("Agent %p : Packet received from a TURN socket.", agent);
+        nicesock = relay;
       }
       /* Count the number of buffers. */
       if (message->n_buffers == -1) {
@@ -3355,101 +3739,14 @@ agent_recv_message_unlocked (
         }
         retval = 0;
       } else {
-        /* In the case of a real ICE-TCP connection, we can use the socket as a
-         * bytestream and do the read here with caching of data being read
-         */
-        gssize available = g_socket_get_available_bytes (nicesock->fileno);
-
-        /* TODO: Support bytestream reads */
-        message->length = 0;
-        retval = 0;
-        if (available <= 0) {
-          retval = available;
-
-          /* If we don't call check_connect_result on an outbound connection,
-           * then is_connected will always return FALSE. That's why we check
-           * both conditions to make sure g_socket_is_connected returns the
-           * correct result, otherwise we end up closing valid connections
-           */
-          if (g_socket_check_connect_result (nicesock->fileno, NULL) == FALSE ||
-              g_socket_is_connected (nicesock->fileno) == FALSE) {
-            /* If we receive a readable event on a TCP_BSD socket which is
-             * not connected, it means that it failed to connect, so we must
-             * return an error to make the socket fail/closed
-             */
-            retval = -1;
-          } else {
-            gint flags = G_SOCKET_MSG_PEEK;
-
-            /* If available bytes are 0, but the socket is still considered
-             * connected, then either we're just trying to see if there's more
-             * data available or the peer closed the connection.
-             * The only way to know is to do a read, so we do here a peek and
-             * check the return value, if it's 0, it means the peer has closed
-             * the connection, so we must return an error instead of WOULD_BLOCK
-             */
-            if (g_socket_receive_message (nicesock->fileno, NULL,
-                    NULL, 0, NULL, NULL, &flags, NULL, NULL) == 0)
-              retval = -1;
-          }
-        } else if (agent->rfc4571_expecting_length == 0) {
-          if ((gsize) available >= sizeof(guint16)) {
-            guint16 rfc4571_frame;
-            GInputVector local_buf = { &rfc4571_frame, sizeof(guint16)};
-            NiceInputMessage local_message = { &local_buf, 1, message->from, 0};
-
-            retval = nice_socket_recv_messages (nicesock, &local_message, 1);
-            if (retval == 1) {
-              agent->rfc4571_expecting_length = ntohs (rfc4571_frame);
-              available = g_socket_get_available_bytes (nicesock->fileno);
-            }
-          }
-        }
-        if (agent->rfc4571_expecting_length > 0 &&
-            available >= agent->rfc4571_expecting_length) {
-          GInputVector *local_bufs;
-          NiceInputMessage local_message;
-          gsize off;
-          guint n_bufs = 0;
-          guint i;
-
-          /* Count the number of buffers. */
-          if (message->n_buffers == -1) {
-            for (i = 0; message->buffers[i].buffer != NULL; i++)
-              n_bufs++;
-          } else {
-            n_bufs = message->n_buffers;
-          }
-
-          local_bufs = g_malloc_n (n_bufs, sizeof (GInputVector));
-          local_message.buffers = local_bufs;
-          local_message.from = message->from;
-          local_message.length = 0;
-          local_message.n_buffers = 0;
-
-          /* Only read up to the expected number of bytes in the frame */
-          off = 0;
-          for (i = 0; i < n_bufs; i++) {
-            if (message->buffers[i].size < agent->rfc4571_expecting_length - off) {
-              local_bufs[i].buffer = message->buffers[i].buffer;
-              local_bufs[i].size = message->buffers[i].size;
-              local_message.n_buffers++;
-              off += message->buffers[i].size;
-            } else {
-              local_bufs[i].buffer = message->buffers[i].buffer;
-              local_bufs[i].size = MIN (message->buffers[i].size,
-                  agent->rfc4571_expecting_length - off);
-              local_message.n_buffers++;
-              off += local_bufs[i].size;
-            }
-          }
-          retval = nice_socket_recv_messages (nicesock, &local_message, 1);
-          if (retval == 1) {
-            message->length = local_message.length;
-            agent->rfc4571_expecting_length -= local_message.length;
-          }
-          g_free (local_bufs);
-        }
+        /* In the case of a real ICE-TCP connection, the socket is a
+         * bytestream which is read in big chunks, out of which the RFC4571
+         * frames are returned one by one */
+        NiceStreamDeframer *deframer;
+
+        deframer = component_get_stream_deframer (component, nicesock);
+        retval = nice_stream_deframer_recv_message (deframer, nicesock,
+            rfc4571_frame_length, NULL, sizeof (guint16), message);
       }
     }
   } else {
@@ -3475,36 +3772,64 @@ agent_recv_message_unlocked (
     goto done;
   }
 
-  if (nice_debug_is_enabled ()) {
-    gchar tmpbuf[INET6_ADDRSTRLEN];
-    nice_address_to_string (message->from, tmpbuf);
-    nice_debug ("Agent %p : Packet received on local socket %d from [%s]:%u (%" G_GSSIZE_FORMAT " octets).", agent,
-        g_socket_get_fd (nicesock->fileno), tmpbuf,
-        nice_address_get_port (message->from), message->length);
+  retval = agent_handle_received_message_unlocked (agent, stream, component,
+      nicesock, message);
+
+done:
+  /* Clear local modifications. */
+  if (message->from == &from) {
+    message->from = NULL;
   }
 
-  for (item = component->turn_servers; item; item = g_list_next (item)) {
-    TurnServer *turn = item->data;
-    GSList *i = NULL;
+  return retval;
+}
 
-    if (!nice_address_equal (message->from, &turn->server))
-      continue;
+/*
+ * agent_handle_received_message_unlocked:
+ * @agent: a #NiceAgent
+ * @stream: the stream the message was received on
+ * @component: the component the message was received on
+ * @nicesock: the socket the message was received on
+ * @message: a message received from @nicesock, with a non-%NULL
+ * #NiceInputMessage::from and a non-zero #NiceInputMessage::length
+ *
+ * Demultiplex a single message which has already been dequeued from
+ * @nicesock: unwrap TURN framing, handle STUN packets and feed pseudo-TCP.
+ *
+ * This must be called with the agent’s lock held.
+ *
+ * Returns: %RECV_SUCCESS if @message contains data for the client, or
+ * %RECV_OOB if it was handled out-of-band
+ */
+static RecvStatus
+agent_handle_received_message_unlocked (
+  NiceAgent *agent,
+  Stream *stream,
+  Component *component,
+  NiceSocket *nicesock,
+  NiceInputMessage *message)
+{
+  NiceSocket *relay;
+  gint retval = RECV_SUCCESS;
 
-    nice_debug ("Agent %p : Packet received from TURN server candidate.",
-        agent);
+  g_assert (message->from != NULL);
 
-    for (i = component->local_candidates; i; i = i->next) {
-      NiceCandidate *cand = i->data;
+  if (nice_debug_is_enabled ()) {
+    gchar tmpbuf[INET6_ADDRSTRLEN];
+    nice_address_to_string (message->from, tmpbuf);
+    nice_debug ("Agent %p : Packet received on local socket %d from [%s]:%u (%" G_GSSIZE_FORMAT " octets).", agent,
+        g_socket_get_fd (nicesock->fileno), tmpbuf,
+        nice_address_get_port (message->from), message->length);
+  }
 
-      if (cand->type == NICE_CANDIDATE_TYPE_RELAYED &&
-          cand->stream_id == stream->id &&
-          cand->component_id == component->id) {
-        retval = nice_udp_turn_socket_parse_recv_message (cand->sockptr, &nicesock,
-            message);
-        break;
-      }
-    }
-    break;
+  /* Packets from a TURN server are unwrapped by the relay socket reading
+   * from the same socket */
+  relay = component_find_relay_socket (component, nicesock, message->from);
+  if (relay != NULL) {
+    nice_debug ("Agent %p : Packet received from TURN server candidate.",
+        agent);
+    retval = nice_udp_turn_socket_parse_recv_message (relay, &nicesock,
+        message);
   }
 
   if (retval == RECV_OOB)
@@ -3518,39 +3843,40 @@ agent_recv_message_unlocked (
       (StunInputVector *) message->buffers, message->n_buffers, message->length,
       (agent->compatibility != NICE_COMPATIBILITY_OC2007 &&
        agent->compatibility != NICE_COMPATIBILITY_OC2007R2)) == (ssize_t) message->length) {
-    /* Slow path: If this message isn’t obviously *not* a STUN packet, compact
-     * its buffers
-     * into a single monolithic one and parse the packet properly. */
-    guint8 *big_buf;
-    gsize big_buf_len;
+    /* Slow path: If this message isn’t obviously *not* a STUN packet, walk
+     * its attributes in place to check it properly, and only then hand it
+     * over to the connectivity checks. */
     int validated_len;
 
-    big_buf = compact_input_message (message, &big_buf_len);
-
-    validated_len = stun_message_validate_buffer_length (big_buf, big_buf_len,
+    validated_len = stun_message_validate_buffer_length_vectored (
+        (StunInputVector *) message->buffers, message->n_buffers,
+        message->length,
         (agent->compatibility != NICE_COMPATIBILITY_OC2007 &&
          agent->compatibility != NICE_COMPATIBILITY_OC2007R2));
 
-    if (validated_len == (gint) big_buf_len) {
+    if (validated_len == (gint) message->length) {
       gboolean handled;
 
-      handled =
-        conn_check_handle_inbound_stun (agent, stream, component, nicesock,
-            message->from, (gchar *) big_buf, big_buf_len);
+      if (message->buffers[0].size >= message->length) {
+        handled =
+          conn_check_handle_inbound_stun (agent, stream, component, nicesock,
+              message->from, (gchar *) message->buffers[0].buffer,
+              message->length);
+      } else {
+        handled = agent_handle_inbound_stun_vectored (agent, stream,
+            component, nicesock, message);
+      }
 
       if (handled) {
         /* Handled STUN message. */
         nice_debug ("%s: Valid STUN packet received.", G_STRFUNC);
         retval = RECV_OOB;
-        g_free (big_buf);
         goto done;
       }
     }
 
     nice_debug ("%s: Packet passed fast STUN validation but failed "
         "slow validation.", G_STRFUNC);
-
-    g_free (big_buf);
   }
 
   /* Unhandled STUN; try handling TCP data, then pass to the client. */
@@ -3596,11 +3922,6 @@ agent_recv_message_unlocked (
   }
 
 done:
-  /* Clear local modifications. */
-  if (message->from == &from) {
-    message->from = NULL;
-  }
-
   return retval;
 }
 
@@ -3714,6 +4035,57 @@ memcpy_buffer_to_input_message (NiceInputMessage *message,
   return message->length;
 }
 
+/* Copy the valid bytes and sender address of @src over those of @dest, which
+ * must be a different message. Used to compact an array of received messages
+ * in place when some of them were handled out-of-band. Silently drops any data
+ * from @src which doesn’t fit in @dest. */
+void
+move_input_message (NiceInputMessage *dest, const NiceInputMessage *src)
+{
+  guint i = 0, j = 0;
+  gsize src_offset = 0, dest_offset = 0, remaining = src->length;
+
+  dest->length = 0;
+
+  while (remaining > 0 &&
+      ((src->n_buffers >= 0 && i < (guint) src->n_buffers) ||
+       (src->n_buffers < 0 && src->buffers[i].buffer != NULL)) &&
+      ((dest->n_buffers >= 0 && j < (guint) dest->n_buffers) ||
+       (dest->n_buffers < 0 && dest->buffers[j].buffer != NULL))) {
+    const GInputVector *src_buffer = &src->buffers[i];
+    GInputVector *dest_buffer = &dest->buffers[j];
+    gsize len;
+
+    len = MIN (src_buffer->size - src_offset,
+        dest_buffer->size - dest_offset);
+    len = MIN (len, remaining);
+    memmove ((guint8 *) dest_buffer->buffer + dest_offset,
+        (const guint8 *) src_buffer->buffer + src_offset, len);
+
+    src_offset += len;
+    dest_offset += len;
+    remaining -= len;
+    dest->length += len;
+
+    if (src_offset == src_buffer->size) {
+      i++;
+      src_offset = 0;
+    }
+    if (dest_offset == dest_buffer->size) {
+      j++;
+      dest_offset = 0;
+    }
+  }
+
+  if (remaining > 0) {
+    g_warning ("Dropped %" G_GSIZE_FORMAT " bytes of data from the end of "
+        "message %p due to not fitting in message %p", remaining, src, dest);
+  }
+
+  if (src->from != NULL && dest->from != NULL)
+    *dest->from = *src->from;
+}
+
 /* Concatenate all the buffers in the given @message into a single, newly
  * allocated, monolithic buffer which is returned. The length of the new buffer
  * is returned in @buffer_length, and should be equal to the length field of
@@ -3919,6 +4291,149 @@ nice_agent_recv_cancelled_cb (GCancellable *cancellable, gpointer user_data)
   return !g_cancellable_set_error_if_cancelled (cancellable, error);
 }
 
+/* Receives from each stream socket into component->recv_messages until it
+ * would block. Stream sockets read ahead, and the frames they have buffered
+ * don't make them readable again, so waiting on the sockets won't find
+ * them. */
+static void
+priv_recv_buffered_stream_frames (NiceAgent *agent, Stream *stream,
+    Component *component)
+{
+  guint age = component->socket_sources_age;
+  GSList *i;
+
+  /* Messages are received whole, as in component_io_cb(), so don’t trample
+   * over partially-valid buffers. */
+  if (component->recv_messages_iter.buffer != 0 ||
+      component->recv_messages_iter.offset != 0)
+    return;
+
+  for (i = component->socket_sources;
+       i != NULL && age == component->socket_sources_age; i = i->next) {
+    SocketSource *socket_source = i->data;
+    NiceSocket *nicesock = socket_source->socket;
+
+    if (!nice_socket_is_reliable (nicesock) ||
+        nicesock->type == NICE_SOCKET_TYPE_TCP_PASSIVE)
+      continue;
+
+    while (age == component->socket_sources_age &&
+        !nice_input_message_iter_is_at_end (&component->recv_messages_iter,
+            component->recv_messages, component->n_recv_messages)) {
+      RecvStatus retval;
+
+      retval = agent_recv_message_unlocked (agent, stream, component,
+          nicesock,
+          &component->recv_messages[component->recv_messages_iter.message]);
+
+      if (retval == RECV_SUCCESS) {
+        component->recv_messages_iter.message++;
+        g_clear_error (component->recv_buf_error);
+      } else if (retval == RECV_ERROR) {
+        /* The connection failed or was closed: handle it as a HUP would be
+         * in component_io_cb(). */
+        nice_debug ("Agent %p: error receiving from stream socket %p", agent,
+            nicesock);
+        if (component->selected_pair.local &&
+            component->selected_pair.local->sockptr == nicesock &&
+            component->state == NICE_COMPONENT_STATE_READY) {
+          agent_signal_component_state_change (agent,
+              stream->id, component->id, NICE_COMPONENT_STATE_FAILED);
+        }
+        component_detach_socket (component, nicesock);
+        return;
+      } else if (retval != RECV_OOB) {
+        break;
+      }
+    }
+  }
+}
+
+/* Deliver the segments of coalesced GRO datagrams which the component’s
+ * sockets still hold after component_io_cb() ran out of readers. Their file
+ * descriptors may never become readable again, so this is called whenever a
+ * reader appears: segments are fed to pseudo-TCP in reliable mode, copied into
+ * component->recv_messages, or emitted to the I/O callback straight from the
+ * socket’s GRO buffer. No new datagrams are received, so a segment being
+ * handled by an I/O callback on another thread is never overwritten.
+ *
+ * Emitting releases the agent lock, so the component is looked up again
+ * afterwards. */
+static void
+component_recv_gro_pending (NiceAgent *agent, guint stream_id,
+    guint component_id)
+{
+  Stream *stream;
+  Component *component;
+  guint age;
+  GSList *i;
+
+  if (!agent_find_component (agent, stream_id, component_id, &stream,
+          &component))
+    return;
+
+  age = component->socket_sources_age;
+
+  for (i = component->socket_sources; i != NULL; i = i->next) {
+    SocketSource *socket_source = i->data;
+    NiceSocket *nicesock = socket_source->socket;
+
+    while (nice_udp_bsd_socket_has_gro_pending (nicesock)) {
+      guint8 local_buf[MAX_BUFFER_SIZE];
+      GInputVector local_bufs = { local_buf, sizeof (local_buf) };
+      NiceAddress from;
+      NiceInputMessage local_message = { &local_bufs, 1, &from, 0 };
+      RecvStatus retval;
+
+      if (agent->reliable) {
+        retval = agent_recv_message_unlocked (agent, stream, component,
+            nicesock, &local_message);
+      } else if (component->recv_messages != NULL &&
+          component->recv_messages_iter.buffer == 0 &&
+          component->recv_messages_iter.offset == 0 &&
+          !nice_input_message_iter_is_at_end (&component->recv_messages_iter,
+              component->recv_messages, component->n_recv_messages)) {
+        retval = agent_recv_message_unlocked (agent, stream, component,
+            nicesock,
+            &component->recv_messages[component->recv_messages_iter.message]);
+
+        if (retval == RECV_SUCCESS) {
+          component->recv_messages_iter.message++;
+          g_clear_error (component->recv_buf_error);
+        }
+      } else if (component_has_io_callback (component)) {
+        const guint8 *buf;
+
+        if (nice_udp_bsd_socket_recv_gro_segment (nicesock, &local_bufs,
+                &from) <= 0)
+          break;
+
+        buf = local_bufs.buffer;
+        local_message.length = local_bufs.size;
+
+        if (agent_handle_received_message_unlocked (agent, stream, component,
+                nicesock, &local_message) != RECV_SUCCESS ||
+            local_message.length == 0)
+          continue;
+
+        component_emit_io_callback (component, buf, local_message.length);
+
+        if (!agent_find_component (agent, stream_id, component_id, &stream,
+                &component) ||
+            component->socket_sources_age != age)
+          return;
+
+        continue;
+      } else {
+        break;
+      }
+
+      if (retval == RECV_WOULD_BLOCK || retval == RECV_ERROR)
+        break;
+    }
+  }
+}
+
 static gint
 nice_agent_recv_messages_blocking_or_nonblocking (NiceAgent *agent,
   guint stream_id, guint component_id, gboolean blocking,
@@ -3972,7 +4487,7 @@ nice_agent_recv_messages_blocking_or_nonblocking (NiceAgent *agent,
     }
   }
 
-  agent_lock ();
+  agent_lock (agent);
 
   if (!agent_find_component (agent, stream_id, component_id,
           &stream, &component)) {
@@ -4046,6 +4561,17 @@ nice_agent_recv_messages_blocking_or_nonblocking (NiceAgent *agent,
     error_reported = (child_error != NULL);
   }
 
+  /* Then for frames left over by an earlier read on a stream socket, or
+   * segments of a coalesced datagram on a UDP socket. */
+  if (!received_enough && !error_reported) {
+    priv_recv_buffered_stream_frames (agent, stream, component);
+    component_recv_gro_pending (agent, stream_id, component_id);
+
+    received_enough =
+        nice_input_message_iter_is_at_end (&component->recv_messages_iter,
+            component->recv_messages, component->n_recv_messages);
+  }
+
   /* Each iteration of the main context will either receive some data, a
    * cancellation error or a socket error. In non-reliable mode, the iter’s
    * @message counter will be incremented after each read.
@@ -4067,7 +4593,7 @@ nice_agent_recv_messages_blocking_or_nonblocking (NiceAgent *agent,
 
     agent_unlock_and_emit (agent);
     g_main_context_iteration (context, blocking);
-    agent_lock ();
+    agent_lock (agent);
 
     if (!agent_find_component (agent, stream_id, component_id,
             &stream, &component)) {
@@ -4227,6 +4753,35 @@ nice_agent_recv_nonblocking (NiceAgent *agent, guint stream_id,
  * of messages otherwise.
  */
 
+/* Send @messages on the send path published for the component by
+ * component_update_send_path(), without taking the agent lock. Returns %FALSE
+ * if there is none, in which case the caller must take the slow path. */
+static gboolean
+agent_send_messages_fast (NiceAgent *agent, guint stream_id,
+    guint component_id, const NiceOutputMessage *messages, guint n_messages,
+    gint *n_sent)
+{
+  ComponentSendPath *path;
+  gint64 id = COMPONENT_SEND_PATH_ID (stream_id, component_id);
+
+  g_rw_lock_reader_lock (&agent->send_paths_lock);
+  path = g_hash_table_lookup (agent->send_paths, &id);
+  if (path != NULL)
+    component_send_path_ref (path);
+  g_rw_lock_reader_unlock (&agent->send_paths_lock);
+
+  if (path == NULL)
+    return FALSE;
+
+  /* The reference keeps the socket alive even if the path is swapped out or
+   * withdrawn during the send. */
+  *n_sent = nice_socket_send_messages (path->socket, &path->remote_addr,
+      messages, n_messages);
+  component_send_path_unref (path);
+
+  return TRUE;
+}
+
 static gint
 nice_agent_send_messages_nonblocking_internal (
   NiceAgent *agent,
@@ -4245,7 +4800,30 @@ nice_agent_send_messages_nonblocking_internal (
 
   g_assert (n_messages == 1 || !allow_partial);
 
-  agent_lock ();
+  /* Fast path for non-reliable sends on a selected pair, which don’t touch any
+   * agent state, so mustn’t contend with the timers for the agent lock. */
+  if (!agent->reliable &&
+      agent_send_messages_fast (agent, stream_id, component_id, messages,
+          n_messages, &n_sent)) {
+    if (n_sent < 0) {
+      g_set_error (&child_error, G_IO_ERROR, G_IO_ERROR_FAILED,
+          "Error writing data to socket.");
+    } else if (n_sent == 0) {
+      g_set_error_literal (&child_error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
+          g_strerror (EAGAIN));
+      n_sent = -1;
+    } else if (allow_partial) {
+      g_assert (n_messages == 1);
+      n_sent = output_message_get_size (messages);
+    }
+
+    if (child_error != NULL)
+      g_propagate_error (error, child_error);
+
+    return n_sent;
+  }
+
+  agent_lock (agent);
 
   if (!agent_find_component (agent, stream_id, component_id,
           &stream, &component)) {
@@ -4488,7 +5066,7 @@ nice_agent_get_local_candidates (
   GSList * ret = NULL;
   GSList * item = NULL;
 
-  agent_lock();
+  agent_lock (agent);
 
   if (!agent_find_component (agent, stream_id, component_id, NULL, &component)) {
     goto done;
@@ -4512,7 +5090,7 @@ nice_agent_get_remote_candidates (
   Component *component;
   GSList *ret = NULL, *item = NULL;
 
-  agent_lock();
+  agent_lock (agent);
   if (!agent_find_component (agent, stream_id, component_id, NULL, &component))
     {
       goto done;
@@ -4532,7 +5110,7 @@ nice_agent_restart (
 {
   GSList *i;
 
-  agent_lock();
+  agent_lock (agent);
 
   /* step: regenerate tie-breaker value */
   priv_generate_tie_breaker (agent);
@@ -4557,7 +5135,7 @@ nice_agent_restart_stream (
   gboolean res = FALSE;
   Stream *stream;
 
-  agent_lock();
+  agent_lock (agent);
 
   stream = agent_find_stream (agent, stream_id);
   if (!stream) {
@@ -4604,11 +5182,22 @@ nice_agent_dispose (GObject *object)
   g_slist_free (agent->local_addresses);
   agent->local_addresses = NULL;
 
+  /* Close the streams with the lock held, as nice_agent_remove_stream()
+   * does, so that socket callbacks waiting for it find their sources
+   * destroyed. */
+  agent_lock (agent);
   for (i = agent->streams; i; i = i->next)
     {
       Stream *s = i->data;
 
       stream_close (s);
+    }
+  agent_unlock (agent);
+
+  for (i = agent->streams; i; i = i->next)
+    {
+      Stream *s = i->data;
+
       stream_free (s);
     }
 
@@ -4644,6 +5233,9 @@ nice_agent_dispose (GObject *object)
   g_free (agent->software_attribute);
   agent->software_attribute = NULL;
 
+  /* All of the sources in the workers have been destroyed by now. */
+  priv_stop_workers (agent);
+
   if (agent->main_context != NULL)
     g_main_context_unref (agent->main_context);
   agent->main_context = NULL;
@@ -4653,6 +5245,84 @@ nice_agent_dispose (GObject *object)
 
 }
 
+static void
+nice_agent_finalize (GObject *object)
+{
+  NiceAgent *agent = NICE_AGENT (object);
+
+  g_hash_table_unref (agent->send_paths);
+  g_rw_lock_clear (&agent->send_paths_lock);
+  agent_mutex_unref (agent->agent_mutex);
+
+  G_OBJECT_CLASS (nice_agent_parent_class)->finalize (object);
+}
+
+/* Number of datagrams dequeued from a non-reliable socket at once by
+ * component_io_cb(). */
+#define RECV_BATCH_SIZE 16
+
+/* Receive buffers for batching nice_agent_attach_recv() reads. They are too big
+ * to put on the stack, and would waste too much memory if allocated per
+ * Component, so one set is allocated lazily per thread. @in_use guards against
+ * re-entrancy from an I/O callback which iterates the main context. */
+typedef struct {
+  gboolean in_use;
+  NiceInputMessage messages[RECV_BATCH_SIZE];
+  GInputVector buffers[RECV_BATCH_SIZE];
+  NiceAddress from[RECV_BATCH_SIZE];
+  guint8 data[RECV_BATCH_SIZE][MAX_BUFFER_SIZE];
+} RecvBatch;
+
+static GPrivate recv_batch_private = G_PRIVATE_INIT (g_free);
+
+/* Returns %NULL if the current thread’s batch is already in use. */
+static RecvBatch *
+recv_batch_acquire (void)
+{
+  RecvBatch *batch = g_private_get (&recv_batch_private);
+  guint i;
+
+  if (batch == NULL) {
+    batch = g_malloc (sizeof (RecvBatch));
+    batch->in_use = FALSE;
+    g_private_set (&recv_batch_private, batch);
+  } else if (batch->in_use) {
+    return NULL;
+  }
+
+  for (i = 0; i < RECV_BATCH_SIZE; i++) {
+    batch->buffers[i].buffer = batch->data[i];
+    batch->buffers[i].size = sizeof (batch->data[i]);
+    batch->messages[i].buffers = &batch->buffers[i];
+    batch->messages[i].n_buffers = 1;
+    batch->messages[i].from = &batch->from[i];
+    batch->messages[i].length = 0;
+  }
+
+  batch->in_use = TRUE;
+
+  return batch;
+}
+
+static void
+recv_batch_release (RecvBatch *batch)
+{
+  batch->in_use = FALSE;
+}
+
+/* Whether the socket being dispatched has been detached from its Component,
+ * be it polled by a GSource or through epoll. */
+static gboolean
+component_io_source_is_destroyed (void)
+{
+  NiceEpollWatch *watch = nice_epoll_watch_get_current ();
+
+  if (watch != NULL)
+    return nice_epoll_watch_is_destroyed (watch);
+
+  return g_source_is_destroyed (g_main_current_source ());
+}
+
 gboolean
 component_io_cb (GSocket *gsocket, GIOCondition condition, gpointer user_data)
 {
@@ -4662,23 +5332,25 @@ component_io_cb (GSocket *gsocket, GIOCondition condition, gpointer user_data)
   Stream *stream;
   gboolean has_io_callback;
   gboolean remove_source = FALSE;
+  RecvBatch *batch = NULL;
 
-  agent_lock ();
+  /* The source holds a reference on the agent lock, which may outlive the
+   * agent, so only touch the component once the source is known to be
+   * alive. */
+  g_mutex_lock (&socket_source->agent_mutex->mutex);
 
-  if (g_source_is_destroyed (g_main_current_source ())) {
+  if (component_io_source_is_destroyed ()) {
     /* Silently return FALSE. */
     nice_debug ("%s: source %p destroyed", G_STRFUNC, g_main_current_source ());
 
-    agent_unlock ();
+    g_mutex_unlock (&socket_source->agent_mutex->mutex);
     return G_SOURCE_REMOVE;
   }
 
   component = socket_source->component;
-  agent = component->agent;
+  agent = g_object_ref (component->agent);
   stream = component->stream;
 
-  g_object_ref (agent);
-
   /* Remove disconnected sockets when we get a HUP */
   if (condition & G_IO_HUP) {
     nice_debug ("Agent %p: NiceSocket %p has received HUP", agent,
@@ -4693,7 +5365,8 @@ component_io_cb (GSocket *gsocket, GIOCondition condition, gpointer user_data)
     }
 
     component_detach_socket (component, socket_source->socket);
-    agent_unlock ();
+    agent_unlock (agent);
+    g_object_unref (agent);
     return G_SOURCE_REMOVE;
   }
 
@@ -4772,6 +5445,105 @@ component_io_cb (GSocket *gsocket, GIOCondition condition, gpointer user_data)
 
       has_io_callback = component_has_io_callback (component);
     }
+  } else if (has_io_callback &&
+      nice_udp_bsd_socket_uses_gro (socket_source->socket)) {
+    while (has_io_callback) {
+      GInputVector segment;
+      NiceAddress from;
+      NiceInputMessage local_message = { &segment, 1, &from, 0 };
+      const guint8 *buf;
+      gint n_received;
+
+      /* Receive a single segment of a coalesced datagram, pointing into the
+       * socket’s GRO buffer rather than copying it. It stays valid until the
+       * socket is next read from. STUN packets will be parsed in-place. */
+      n_received = nice_udp_bsd_socket_recv_gro_segment (socket_source->socket,
+          &segment, &from);
+
+      if (n_received == 0) {
+        /* EWOULDBLOCK, or GRO was turned off; in which case the socket is
+         * still readable and will be read without it next time. */
+        break;
+      } else if (n_received < 0) {
+        /* Other error. */
+        nice_debug ("%s: error receiving message", G_STRFUNC);
+        remove_source = TRUE;
+        break;
+      }
+
+      buf = segment.buffer;
+      local_message.length = segment.size;
+
+      if (agent_handle_received_message_unlocked (agent, stream, component,
+              socket_source->socket, &local_message) != RECV_SUCCESS ||
+          local_message.length == 0)
+        continue;
+
+      component_emit_io_callback (component, buf, local_message.length);
+
+      if (component_io_source_is_destroyed ()) {
+        nice_debug ("Component IO source disappeared during the callback");
+        goto out;
+      }
+      has_io_callback = component_has_io_callback (component);
+    }
+  } else if (has_io_callback &&
+      !nice_socket_is_reliable (socket_source->socket) &&
+      (batch = recv_batch_acquire ()) != NULL) {
+    while (has_io_callback) {
+      gint n_received, i;
+
+      /* Dequeue as many messages as possible in one go, then handle them in
+       * order. STUN packets will be parsed in-place. */
+      n_received = nice_socket_recv_messages (socket_source->socket,
+          batch->messages, RECV_BATCH_SIZE);
+
+      nice_debug ("%s: %p: received %d messages", G_STRFUNC, agent,
+          n_received);
+
+      if (n_received == 0) {
+        /* EWOULDBLOCK. */
+        break;
+      } else if (n_received < 0) {
+        /* Other error. */
+        nice_debug ("%s: error receiving message", G_STRFUNC);
+        remove_source = TRUE;
+        break;
+      }
+
+      for (i = 0; i < n_received; i++) {
+        NiceInputMessage *message = &batch->messages[i];
+
+        if (agent_handle_received_message_unlocked (agent, stream, component,
+                socket_source->socket, message) != RECV_SUCCESS ||
+            message->length == 0)
+          continue;
+
+        if (!has_io_callback) {
+          /* The I/O callback was detached part-way through the batch. Keep the
+           * remaining data for the next callback or recv() call. */
+          component_queue_io_message (component, batch->data[i],
+              message->length);
+          continue;
+        }
+
+        component_emit_io_callback (component, batch->data[i],
+            message->length);
+
+        if (component_io_source_is_destroyed ()) {
+          nice_debug ("Component IO source disappeared during the callback");
+          recv_batch_release (batch);
+          goto out;
+        }
+        has_io_callback = component_has_io_callback (component);
+      }
+
+      /* The socket’s receive queue has been drained. */
+      if (n_received < RECV_BATCH_SIZE)
+        break;
+    }
+
+    recv_batch_release (batch);
   } else if (has_io_callback) {
     while (has_io_callback) {
       guint8 local_buf[MAX_BUFFER_SIZE];
@@ -4799,12 +5571,83 @@ component_io_cb (GSocket *gsocket, GIOCondition condition, gpointer user_data)
       if (retval == RECV_SUCCESS && local_message.length > 0)
         component_emit_io_callback (component, local_buf, local_message.length);
 
-      if (g_source_is_destroyed (g_main_current_source ())) {
+      if (component_io_source_is_destroyed ()) {
         nice_debug ("Component IO source disappeared during the callback");
         goto out;
       }
       has_io_callback = component_has_io_callback (component);
     }
+  } else if (component->recv_messages != NULL &&
+      !nice_socket_is_reliable (socket_source->socket)) {
+    /* Don’t want to trample over partially-valid buffers. */
+    g_assert (component->recv_messages_iter.buffer == 0);
+    g_assert (component->recv_messages_iter.offset == 0);
+
+    while (!nice_input_message_iter_is_at_end (&component->recv_messages_iter,
+        component->recv_messages, component->n_recv_messages)) {
+      NiceInputMessage *messages =
+          &component->recv_messages[component->recv_messages_iter.message];
+      NiceAddress from[RECV_BATCH_SIZE];
+      guint n_messages, n_valid = 0;
+      gint n_received, i;
+
+      n_messages = MIN (RECV_BATCH_SIZE,
+          component->n_recv_messages - component->recv_messages_iter.message);
+
+      /* We need addresses for packet parsing. */
+      for (i = 0; i < (gint) n_messages; i++) {
+        if (messages[i].from == NULL)
+          messages[i].from = &from[i];
+      }
+
+      /* Receive a batch of messages straight into the user-provided
+       * #NiceInputMessages, which it’s the user’s responsibility to ensure are
+       * big enough to avoid data loss (since we’re in non-reliable mode).
+       * Messages handled out-of-band (e.g. STUN packets, which are parsed
+       * in-place) are then squeezed out of the array. */
+      n_received = nice_socket_recv_messages (socket_source->socket,
+          messages, n_messages);
+
+      nice_debug ("%s: %p: received %d messages", G_STRFUNC, agent,
+          n_received);
+
+      for (i = 0; i < n_received; i++) {
+        if (agent_handle_received_message_unlocked (agent, stream, component,
+                socket_source->socket, &messages[i]) != RECV_SUCCESS)
+          continue;
+
+        if ((guint) i != n_valid)
+          move_input_message (&messages[n_valid], &messages[i]);
+        n_valid++;
+      }
+
+      /* Clear local modifications. */
+      for (i = 0; i < (gint) n_messages; i++) {
+        if (messages[i].from == &from[i])
+          messages[i].from = NULL;
+      }
+
+      if (n_valid > 0) {
+        /* Successfully received at least one message. */
+        component->recv_messages_iter.message += n_valid;
+        g_clear_error (component->recv_buf_error);
+      }
+
+      if (n_received < 0) {
+        /* Error. */
+        remove_source = TRUE;
+        break;
+      } else if ((guint) n_received < n_messages) {
+        /* EWOULDBLOCK. */
+        if (component->recv_messages_iter.message == 0 &&
+            component->recv_buf_error != NULL &&
+            *component->recv_buf_error == NULL) {
+          g_set_error_literal (component->recv_buf_error, G_IO_ERROR,
+              G_IO_ERROR_WOULD_BLOCK, g_strerror (EAGAIN));
+        }
+        break;
+      }
+    }
   } else if (component->recv_messages != NULL) {
     RecvStatus retval;
 
@@ -4848,6 +5691,15 @@ component_io_cb (GSocket *gsocket, GIOCondition condition, gpointer user_data)
     }
   }
 
+  if (!remove_source) {
+    component_recv_gro_pending (agent, stream->id, component->id);
+
+    if (component_io_source_is_destroyed ()) {
+      nice_debug ("Component IO source disappeared during the callback");
+      goto out;
+    }
+  }
+
 done:
   /* If we’re in the middle of a read, don’t emit any signals, or we could cause
    * re-entrancy by (e.g.) emitting component-state-changed and having the
@@ -4855,7 +5707,7 @@ done:
   if (component->n_recv_messages == 0 && component->recv_messages == NULL) {
     agent_unlock_and_emit (agent);
   } else {
-    agent_unlock ();
+    agent_unlock (agent);
   }
 
   g_object_unref (agent);
@@ -4863,8 +5715,8 @@ done:
   return !remove_source;
 
 out:
-  g_object_unref (agent);
   agent_unlock_and_emit (agent);
+  g_object_unref (agent);
   return G_SOURCE_REMOVE;
 }
 
@@ -4881,7 +5733,7 @@ nice_agent_attach_recv (
   Stream *stream = NULL;
   gboolean ret = FALSE;
 
-  agent_lock();
+  agent_lock (agent);
 
   /* attach candidates */
 
@@ -4892,7 +5744,9 @@ nice_agent_attach_recv (
     goto done;
   }
 
-  if (ctx == NULL)
+  if (ctx == NULL && stream->context != NULL)
+    ctx = stream->context;
+  else if (ctx == NULL)
     ctx = g_main_context_default ();
 
   /* Set the component’s I/O context. */
@@ -4910,6 +5764,10 @@ nice_agent_attach_recv (
     if (agent->reliable && !pseudo_tcp_socket_is_closed (component->tcp) &&
         component->tcp_readable)
       pseudo_tcp_socket_readable (component->tcp, component);
+
+    /* Likewise, segments of a coalesced datagram may have been left over when
+     * the callback was detached, and won't make the socket readable again. */
+    component_recv_gro_pending (agent, stream_id, component_id);
   }
 
  done:
@@ -4930,7 +5788,7 @@ nice_agent_set_selected_pair (
   CandidatePair pair;
   gboolean ret = FALSE;
 
-  agent_lock();
+  agent_lock (agent);
 
   /* step: check that params specify an existing pair */
   if (!agent_find_component (agent, stream_id, component_id, &stream, &component)) {
@@ -4975,7 +5833,7 @@ nice_agent_get_selected_pair (NiceAgent *agent, guint stream_id,
   Stream *stream;
   gboolean ret = FALSE;
 
-  agent_lock();
+  agent_lock (agent);
 
   /* step: check that params specify an existing pair */
   if (!agent_find_component (agent, stream_id, component_id,
@@ -5003,7 +5861,7 @@ nice_agent_get_selected_socket (NiceAgent *agent, guint stream_id,
   NiceSocket *nice_socket;
   GSocket *g_socket = NULL;
 
-  agent_lock();
+  agent_lock (agent);
 
   /* Reliable streams are pseudotcp or MUST use RFC 4571 framing */
   if (agent->reliable)
@@ -5034,14 +5892,77 @@ nice_agent_get_selected_socket (NiceAgent *agent, guint stream_id,
   return g_socket;
 }
 
+typedef struct {
+  GWeakRef agent_ref;
+  NiceTimeoutLockedCallback function;
+  gpointer user_data;
+} TimeoutData;
+
+static void
+timeout_data_destroy (TimeoutData *data)
+{
+  g_weak_ref_clear (&data->agent_ref);
+  g_slice_free (TimeoutData, data);
+}
+
+static TimeoutData *
+timeout_data_new (NiceAgent *agent, NiceTimeoutLockedCallback function,
+    gpointer user_data)
+{
+  TimeoutData *data = g_slice_new0 (TimeoutData);
+
+  g_weak_ref_init (&data->agent_ref, agent);
+  data->function = function;
+  data->user_data = user_data;
+
+  return data;
+}
+
+static gboolean
+timeout_cb (gpointer user_data)
+{
+  TimeoutData *data = user_data;
+  NiceAgent *agent;
+  gboolean ret = G_SOURCE_REMOVE;
+
+  /* The agent may be finalised in another thread while this is dispatched, so
+   * it can only be reached through a weak reference. */
+  agent = g_weak_ref_get (&data->agent_ref);
+  if (agent == NULL)
+    return G_SOURCE_REMOVE;
+
+  agent_lock (agent);
+
+  /* A race condition might happen where the mutex above waits for the lock
+   * and in the meantime another thread destroys the source.
+   * In that case, we don't need to run the function since it should
+   * have been cancelled */
+  if (g_source_is_destroyed (g_main_current_source ())) {
+    nice_debug ("Source %p was destroyed. Avoided race condition in "
+        "timeout_cb", g_main_current_source ());
+    goto end;
+  }
+
+  ret = data->function (agent, data->user_data);
+
+ end:
+  agent_unlock_and_emit (agent);
+  g_object_unref (agent);
+
+  return ret;
+}
+
 /* Create a new timer GSource with the given @name, @interval, callback
  * @function and @data, and assign it to @out, destroying and freeing any
- * existing #GSource in @out first.
+ * existing #GSource in @out first. @function is called with the agent lock
+ * held, and only if the source hasn’t been destroyed in the meantime.
  *
  * This guarantees that a timer won’t be overwritten without being destroyed.
  */
-void agent_timeout_add_with_context (NiceAgent *agent, GSource **out,
-    const gchar *name, guint interval, GSourceFunc function, gpointer data)
+static void
+priv_timeout_add_to_context (NiceAgent *agent, GMainContext *context,
+    GSource **out, const gchar *name, guint interval,
+    NiceTimeoutLockedCallback function, gpointer data)
 {
   GSource *source;
 
@@ -5059,13 +5980,33 @@ void agent_timeout_add_with_context (NiceAgent *agent, GSource **out,
   source = g_timeout_source_new (interval);
 
   g_source_set_name (source, name);
-  g_source_set_callback (source, function, data, NULL);
-  g_source_attach (source, agent->main_context);
+  g_source_set_callback (source, timeout_cb,
+      timeout_data_new (agent, function, data),
+      (GDestroyNotify) timeout_data_destroy);
+  g_source_attach (source, context);
 
   /* Return it! */
   *out = source;
 }
 
+void agent_timeout_add_with_context (NiceAgent *agent, GSource **out,
+    const gchar *name, guint interval, NiceTimeoutLockedCallback function,
+    gpointer data)
+{
+  priv_timeout_add_to_context (agent, agent->main_context, out, name,
+      interval, function, data);
+}
+
+/* As agent_timeout_add_with_context(), but for a timer which only concerns
+ * @stream, so it runs in the same context as the stream’s sockets. */
+void agent_timeout_add_for_stream (NiceAgent *agent, Stream *stream,
+    GSource **out, const gchar *name, guint interval,
+    NiceTimeoutLockedCallback function, gpointer data)
+{
+  priv_timeout_add_to_context (agent, agent_get_stream_context (agent, stream),
+      out, name, interval, function, data);
+}
+
 
 NICEAPI_EXPORT gboolean
 nice_agent_set_selected_remote_candidate (
@@ -5091,7 +6032,7 @@ nice_agent_set_selected_remote_candidate (
   g_return_val_if_fail (component_id != 0, FALSE);
   g_return_val_if_fail (candidate != NULL, FALSE);
 
-  agent_lock();
+  agent_lock (agent);
 
   /* step: check if the component exists*/
   if (!agent_find_component (agent, stream_id, component_id, &stream, &component)) {
@@ -5122,6 +6063,7 @@ nice_agent_set_selected_remote_candidate (
     component->selected_pair.local = local;
     component->selected_pair.remote = remote;
     component->selected_pair.priority = priority;
+    component_update_send_path (component);
     goto done;
   }
 
@@ -5166,7 +6108,7 @@ nice_agent_set_stream_tos (NiceAgent *agent,
   GSList *i, *j;
   Stream *stream;
 
-  agent_lock();
+  agent_lock (agent);
 
   stream = agent_find_stream (agent, stream_id);
   if (stream == NULL)
@@ -5190,7 +6132,7 @@ nice_agent_set_stream_tos (NiceAgent *agent,
 NICEAPI_EXPORT void
 nice_agent_set_software (NiceAgent *agent, const gchar *software)
 {
-  agent_lock();
+  agent_lock (agent);
 
   g_free (agent->software_attribute);
   if (software)
@@ -5210,7 +6152,7 @@ nice_agent_set_stream_name (NiceAgent *agent, guint stream_id,
   GSList *i;
   gboolean ret = FALSE;
 
-  agent_lock();
+  agent_lock (agent);
 
   if (name != NULL) {
     for (i = agent->streams; i; i = i->next) {
@@ -5244,7 +6186,7 @@ nice_agent_get_stream_name (NiceAgent *agent, guint stream_id)
   Stream *stream;
   gchar *name = NULL;
 
-  agent_lock();
+  agent_lock (agent);
 
   stream = agent_find_stream (agent, stream_id);
   if (stream == NULL)
@@ -5310,7 +6252,7 @@ nice_agent_get_default_local_candidate (NiceAgent *agent,
   Component *component = NULL;
   NiceCandidate *default_candidate = NULL;
 
-  agent_lock ();
+  agent_lock (agent);
 
   /* step: check if the component exists*/
   if (!agent_find_component (agent, stream_id, component_id,
@@ -5464,7 +6406,7 @@ nice_agent_generate_local_sdp (NiceAgent *agent)
   GString * sdp = g_string_new (NULL);
   GSList *i;
 
-  agent_lock();
+  agent_lock (agent);
 
   for (i = agent->streams; i; i = i->next) {
     Stream *stream = i->data;
@@ -5485,7 +6427,7 @@ nice_agent_generate_local_stream_sdp (NiceAgent *agent, guint stream_id,
   gchar *ret = NULL;
   Stream *stream;
 
-  agent_lock();
+  agent_lock (agent);
 
   stream = agent_find_stream (agent, stream_id);
   if (stream == NULL)
@@ -5509,7 +6451,7 @@ nice_agent_generate_local_candidate_sdp (NiceAgent *agent,
 
   g_return_val_if_fail(candidate, NULL);
 
-  agent_lock();
+  agent_lock (agent);
 
   sdp = g_string_new (NULL);
   _generate_candidate_sdp (agent, candidate, sdp);
@@ -5528,7 +6470,7 @@ nice_agent_parse_remote_sdp (NiceAgent *agent, const gchar *sdp)
   gint i;
   gint ret = 0;
 
-  agent_lock();
+  agent_lock (agent);
 
   for (l = agent->streams; l; l = l->next) {
     Stream *stream = l->data;
@@ -5622,7 +6564,7 @@ nice_agent_parse_remote_stream_sdp (NiceAgent *agent, guint stream_id,
   GSList *candidates = NULL;
   gint i;
 
-  agent_lock();
+  agent_lock (agent);
 
   stream = agent_find_stream (agent, stream_id);
   if (stream == NULL) {
@@ -5797,7 +6739,7 @@ nice_agent_get_io_stream (NiceAgent *agent, guint stream_id,
 
   g_return_val_if_fail (agent->reliable, NULL);
 
-  agent_lock ();
+  agent_lock (agent);
 
   if (!agent_find_component (agent, stream_id, component_id, NULL, &component))
     goto done;
@@ -5823,7 +6765,7 @@ nice_agent_forget_relays (NiceAgent *agent, guint stream_id, guint component_id)
   g_return_val_if_fail (stream_id >= 1, FALSE);
   g_return_val_if_fail (component_id >= 1, FALSE);
 
-  agent_lock ();
+  agent_lock (agent);
 
   if (!agent_find_component (agent, stream_id, component_id, NULL, &component)) {
     ret = FALSE;
@@ -5880,12 +6822,36 @@ nice_agent_get_component_state (NiceAgent *agent,
   NiceComponentState state = NICE_COMPONENT_STATE_FAILED;
   Component *component;
 
-  agent_lock ();
+  agent_lock (agent);
 
   if (agent_find_component (agent, stream_id, component_id, NULL, &component))
     state = component->state;
 
-  agent_unlock ();
+  agent_unlock (agent);
 
   return state;
 }
+
+NICEAPI_EXPORT gboolean
+nice_agent_get_dropped_checks (NiceAgent *agent,
+    guint stream_id, guint component_id,
+    guint64 *n_rate_limited, guint64 *n_unstored)
+{
+  Component *component;
+  gboolean ret = FALSE;
+
+  agent_lock (agent);
+
+  if (agent_find_component (agent, stream_id, component_id, NULL,
+          &component)) {
+    if (n_rate_limited != NULL)
+      *n_rate_limited = component->n_rate_limited_checks;
+    if (n_unstored != NULL)
+      *n_unstored = component->n_unstored_checks;
+    ret = TRUE;
+  }
+
+  agent_unlock (agent);
+
+  return ret;
+}
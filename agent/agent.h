@@ -417,6 +417,31 @@ nice_agent_new (GMainContext *ctx, NiceCompatibility compat);
 NiceAgent *
 nice_agent_new_reliable (GMainContext *ctx, NiceCompatibility compat);
 
+/**
+ * nice_agent_new_with_pool:
+ * @ctx: The Glib Mainloop Context to use for agent-wide timers, or %NULL to
+ * use the first worker's
+ * @compat: The compatibility mode of the agent
+ * @n_workers: The number of worker threads
+ *
+ * Create a new #NiceAgent which runs @n_workers threads, each iterating its
+ * own #GMainContext, and spreads its streams across them. Each stream's
+ * sockets and per-stream timers are handled by its worker, so streams of the
+ * same agent can be serviced on different cores. Pass a %NULL context to
+ * nice_agent_attach_recv() to receive in the stream's worker.
+ *
+ * Signals and receive callbacks may be emitted from the worker threads.
+ * The returned object must be freed with g_object_unref()
+ * <para> See also: #NiceAgent:worker-threads </para>
+ *
+ * Since: 0.1.11
+ *
+ * Returns: The new agent GObject
+ */
+NiceAgent *
+nice_agent_new_with_pool (GMainContext *ctx, NiceCompatibility compat,
+    guint n_workers);
+
 /**
  * nice_agent_add_local_address:
  * @agent: The #NiceAgent Object
@@ -852,7 +877,9 @@ nice_agent_restart_stream (
  * @agent: The #NiceAgent Object
  * @stream_id: The ID of stream
  * @component_id: The ID of the component
- * @ctx: The Glib Mainloop Context to use for listening on the component
+ * @ctx: The Glib Mainloop Context to use for listening on the component, or
+ * %NULL for the default one, or the stream's worker if the agent has
+ * #NiceAgent:worker-threads
  * @func: The callback function to be called when data is received on
  * the stream's component
  * @data: user data associated with the callback
@@ -1527,6 +1554,33 @@ nice_agent_get_component_state (NiceAgent *agent,
     guint stream_id,
     guint component_id);
 
+/**
+ * nice_agent_get_dropped_checks:
+ * @agent: The #NiceAgent Object
+ * @stream_id: The ID of the stream
+ * @component_id: The ID of the component
+ * @n_rate_limited: (out) (allow-none): Return location for the number of
+ * inbound connectivity checks dropped for exceeding the rate limits, or %NULL
+ * @n_unstored: (out) (allow-none): Return location for the number of inbound
+ * connectivity checks received before the remote candidates which were
+ * dropped because too many were already stored, or %NULL
+ *
+ * Retrieves how many inbound connectivity checks a component has dropped
+ * without answering them. This is meant for monitoring: a steadily growing
+ * count points at a peer, or an attacker, sending checks much faster than
+ * ICE paces them.
+ *
+ * Returns: %FALSE if the component could not be found, %TRUE otherwise
+ *
+ * Since: 0.1.11
+ */
+gboolean
+nice_agent_get_dropped_checks (NiceAgent *agent,
+    guint stream_id,
+    guint component_id,
+    guint64 *n_rate_limited,
+    guint64 *n_unstored);
+
 G_END_DECLS
 
 #endif /* _AGENT_H */
@@ -64,6 +64,8 @@ static void
 component_schedule_io_callback (Component *component);
 static void
 component_deschedule_io_callback (Component *component);
+static gint
+_find_socket_source (gconstpointer a, gconstpointer b);
 
 
 void
@@ -73,6 +75,34 @@ incoming_check_free (IncomingCheck *icheck)
   g_slice_free (IncomingCheck, icheck);
 }
 
+static SocketSource *
+socket_source_ref (SocketSource *source)
+{
+  g_atomic_int_inc (&source->ref_count);
+
+  return source;
+}
+
+static void
+socket_source_unref (gpointer data)
+{
+  SocketSource *source = data;
+
+  if (g_atomic_int_dec_and_test (&source->ref_count)) {
+    agent_mutex_unref (source->agent_mutex);
+    g_slice_free (SocketSource, source);
+  }
+}
+
+/* Drops a use of the socket, freeing it if that was the last one. This may
+ * happen without the agent lock held if a send path was the last user. */
+static void
+socket_source_release_socket (SocketSource *source)
+{
+  if (g_atomic_int_dec_and_test (&source->socket_users))
+    nice_socket_free (source->socket);
+}
+
 /* Must *not* take the agent lock, since it’s called from within
  * component_set_io_context(), which holds the Component’s I/O lock. */
 static void
@@ -80,18 +110,36 @@ socket_source_attach (SocketSource *socket_source, GMainContext *context)
 {
   GSource *source;
 
+  g_assert (socket_source->source == NULL && socket_source->watch == NULL);
+
+  /* Sockets with their own kind of source can't be watched through epoll. */
+  if (socket_source->component->agent->use_epoll &&
+      socket_source->socket->create_source == NULL) {
+    socket_source->watch = nice_epoll_watch_new (context,
+        socket_source->socket->fileno, G_IO_IN, component_io_cb,
+        socket_source_ref (socket_source), socket_source_unref);
+
+    if (socket_source->watch != NULL) {
+      nice_debug ("Attaching epoll watch %p (socket %p, FD %d) to context %p",
+          socket_source->watch, socket_source->socket,
+          g_socket_get_fd (socket_source->socket->fileno), context);
+      return;
+    }
+
+    /* Fall back to a GSource. */
+    socket_source_unref (socket_source);
+  }
+
   /* Create a source. */
-  source = g_socket_create_source (socket_source->socket->fileno,
-      G_IO_IN, NULL);
+  source = nice_socket_create_source (socket_source->socket);
   g_source_set_callback (source, (GSourceFunc) component_io_cb,
-      socket_source, NULL);
+      socket_source_ref (socket_source), socket_source_unref);
 
   /* Add the source. */
   nice_debug ("Attaching source %p (socket %p, FD %d) to context %p", source,
       socket_source->socket, g_socket_get_fd (socket_source->socket->fileno),
       context);
 
-  g_assert (socket_source->source == NULL);
   socket_source->source = source;
   g_source_attach (source, context);
 }
@@ -110,15 +158,55 @@ socket_source_detach (SocketSource *source)
     g_source_unref (source->source);
   }
   source->source = NULL;
+
+  if (source->watch != NULL) {
+    nice_epoll_watch_destroy (source->watch);
+    nice_epoll_watch_unref (source->watch);
+  }
+  source->watch = NULL;
+}
+
+/* Withdraw the Component’s published send path if it goes through @nsocket,
+ * either directly or as the base of its TURN socket. Sends still in progress
+ * on it keep @nsocket alive until they finish. */
+static void
+component_withdraw_send_path (Component *component, NiceSocket *nsocket)
+{
+  NiceAgent *agent = component->agent;
+  ComponentSendPath *path;
+  gint64 id;
+
+  id = COMPONENT_SEND_PATH_ID (component->stream->id, component->id);
+
+  g_rw_lock_writer_lock (&agent->send_paths_lock);
+  path = g_hash_table_lookup (agent->send_paths, &id);
+  if (path != NULL && (path->socket == nsocket ||
+          (path->base_socket_source != NULL &&
+           path->base_socket_source->socket == nsocket)))
+    g_hash_table_steal (agent->send_paths, &id);
+  else
+    path = NULL;
+  g_rw_lock_writer_unlock (&agent->send_paths_lock);
+
+  if (path != NULL)
+    component_send_path_unref (path);
+}
+
+static void
+stream_deframer_free (NiceStreamDeframer *deframer)
+{
+  nice_stream_deframer_clear (deframer);
+  g_slice_free (NiceStreamDeframer, deframer);
 }
 
 static void
 socket_source_free (SocketSource *source)
 {
   socket_source_detach (source);
-  nice_socket_free (source->socket);
+  component_withdraw_send_path (source->component, source->socket);
+  socket_source_release_socket (source);
 
-  g_slice_free (SocketSource, source);
+  socket_source_unref (source);
 }
 
 Component *
@@ -137,8 +225,12 @@ component_new (guint id, NiceAgent *agent, Stream *stream)
   component->tcp = NULL;
   component->agent = agent;
   component->stream = stream;
+  component->relay_sockets = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, NULL, (GDestroyNotify) g_slist_free);
+  component->stream_deframers = g_hash_table_new_full (g_direct_hash,
+      g_direct_equal, NULL, (GDestroyNotify) stream_deframer_free);
 
-  nice_agent_init_stun_agent (agent, &component->stun_agent);
+  component_init_stun_agent (component);
 
   g_mutex_init (&component->io_mutex);
   g_queue_init (&component->pending_io_messages);
@@ -227,6 +319,29 @@ component_clear_selected_pair (Component *component)
   }
 
   memset (&component->selected_pair, 0, sizeof(CandidatePair));
+  component_update_send_path (component);
+}
+
+/* (Re)initialises the StunAgent used for the component's connectivity checks
+ * and keepalives. Every check the agent allows may have a request outstanding,
+ * and a triggered check can overlap one which is being retransmitted, so the
+ * transaction storage holds twice max-connectivity-checks entries. */
+void
+component_init_stun_agent (Component *component)
+{
+  NiceAgent *agent = component->agent;
+  gsize n_saved_ids;
+
+  n_saved_ids = MAX (2 * agent->max_conn_checks, STUN_AGENT_MAX_SAVED_IDS);
+  if (n_saved_ids != component->n_stun_saved_ids) {
+    g_free (component->stun_saved_ids);
+    component->stun_saved_ids = g_new (StunAgentSavedIds, n_saved_ids);
+    component->n_stun_saved_ids = n_saved_ids;
+  }
+
+  nice_agent_init_stun_agent (agent, &component->stun_agent);
+  stun_agent_set_transaction_storage (&component->stun_agent,
+      component->stun_saved_ids, component->n_stun_saved_ids);
 }
 
 /* Must be called with the agent lock held as it touches internal Component
@@ -313,6 +428,9 @@ component_free (Component *cmp)
   g_clear_object (&cmp->stop_cancellable);
   g_clear_object (&cmp->iostream);
   g_mutex_clear (&cmp->io_mutex);
+  g_hash_table_destroy (cmp->relay_sockets);
+  g_hash_table_destroy (cmp->stream_deframers);
+  g_free (cmp->stun_saved_ids);
 
   if (cmp->stop_cancellable_source != NULL) {
     g_source_destroy (cmp->stop_cancellable_source);
@@ -400,12 +518,135 @@ component_restart (Component *cmp)
       (GDestroyNotify) incoming_check_free);
   cmp->incoming_checks = NULL;
 
+  /* The credentials change, so the cached responses are stale */
+  memset (cmp->cached_responses, 0, sizeof (cmp->cached_responses));
+
   /* Reset the priority to 0 to make sure we get a new pair */
   cmp->selected_pair.priority = 0;
 
   /* note: component state managed by agent */
 }
 
+/*
+ * Finds the response to a previous, byte-identical copy of the inbound
+ * request 'request' received from 'from' on 'socket', if it is still cached.
+ */
+const CachedStunResponse *
+component_find_cached_response (Component *component, NiceSocket *socket,
+    const NiceAddress *from, const guint8 *request, gsize request_len)
+{
+  gint64 now = 0;
+  guint i;
+
+  for (i = 0; i < COMPONENT_MAX_CACHED_RESPONSES; i++) {
+    const CachedStunResponse *cached = &component->cached_responses[i];
+
+    if (cached->request_len != request_len || cached->socket != socket ||
+        memcmp (cached->request, request, request_len) != 0 ||
+        !nice_address_equal (&cached->from, from))
+      continue;
+
+    if (now == 0)
+      now = g_get_monotonic_time ();
+    if (now < cached->expiry)
+      return cached;
+  }
+
+  return NULL;
+}
+
+/*
+ * Caches 'response' as the answer to the inbound request 'request' received
+ * from 'from' on 'socket', replacing the oldest entry. Messages which don't
+ * fit in an entry aren't cached.
+ */
+void
+component_cache_response (Component *component, NiceSocket *socket,
+    const NiceAddress *from, const guint8 *request, gsize request_len,
+    const guint8 *response, gsize response_len)
+{
+  CachedStunResponse *cached;
+
+  if (request_len == 0 || request_len > COMPONENT_CACHED_STUN_SIZE ||
+      response_len > COMPONENT_CACHED_STUN_SIZE)
+    return;
+
+  cached = &component->cached_responses[component->next_cached_response];
+  component->next_cached_response =
+      (component->next_cached_response + 1) % COMPONENT_MAX_CACHED_RESPONSES;
+
+  cached->socket = socket;
+  cached->from = *from;
+  cached->expiry = g_get_monotonic_time () +
+      COMPONENT_CACHED_RESPONSE_TIMEOUT_MS * 1000;
+  cached->request_len = request_len;
+  cached->response_len = response_len;
+  memcpy (cached->request, request, request_len);
+  memcpy (cached->response, response, response_len);
+}
+
+/* Refills 'bucket' for the time elapsed since it was last used, then takes a
+ * token from it if there is one. An unused bucket starts full. */
+static gboolean
+token_bucket_take (TokenBucket *bucket, gint64 now, guint rate, guint burst)
+{
+  gint64 capacity = (gint64) burst * G_USEC_PER_SEC;
+
+  if (bucket->updated == 0 || now - bucket->updated >= capacity / rate)
+    bucket->tokens = capacity;
+  else
+    bucket->tokens = MIN (capacity,
+        bucket->tokens + (now - bucket->updated) * rate);
+  bucket->updated = now;
+
+  if (bucket->tokens < G_USEC_PER_SEC)
+    return FALSE;
+
+  bucket->tokens -= G_USEC_PER_SEC;
+  return TRUE;
+}
+
+/*
+ * Decides whether an inbound connectivity check from 'from' is worth
+ * validating, or whether it should be dropped because the source or the
+ * component as a whole is sending too many. This is meant to be called before
+ * any expensive processing of the request. Sources which aren't in the table
+ * take the least recently used entry.
+ */
+gboolean
+component_admit_inbound_check (Component *component, const NiceAddress *from)
+{
+  SourceRateLimit *source = NULL;
+  gint64 now = g_get_monotonic_time ();
+  guint i;
+
+  for (i = 0; i < COMPONENT_MAX_RATE_LIMITED_SOURCES; i++) {
+    SourceRateLimit *s = &component->source_rate_limits[i];
+
+    if (s->bucket.updated != 0 && nice_address_equal (&s->from, from)) {
+      source = s;
+      break;
+    }
+    if (source == NULL || s->bucket.updated < source->bucket.updated)
+      source = s;
+  }
+
+  if (i == COMPONENT_MAX_RATE_LIMITED_SOURCES) {
+    source->from = *from;
+    source->bucket.updated = 0;
+  }
+
+  if (!token_bucket_take (&source->bucket, now, COMPONENT_SOURCE_CHECK_RATE,
+          COMPONENT_SOURCE_CHECK_BURST) ||
+      !token_bucket_take (&component->check_rate_limit, now,
+          COMPONENT_CHECK_RATE, COMPONENT_CHECK_BURST)) {
+    component->n_rate_limited_checks++;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
 /*
  * Changes the selected pair for the component to 'pair'. Does not
  * emit the "selected-pair-changed" signal.
@@ -436,6 +677,101 @@ void component_update_selected_pair (Component *component, const CandidatePair *
   component->selected_pair.remote = pair->remote;
   component->selected_pair.priority = pair->priority;
 
+  component_update_send_path (component);
+}
+
+/*
+ * Publishes the selected pair of @component in NiceAgent::send_paths, so that
+ * non-reliable sends can use it without taking the agent lock, or withdraws it
+ * if there is no selected pair, or it can’t be used without the agent lock.
+ * Must be called with the agent lock held, whenever the selected pair changes.
+ */
+void
+component_update_send_path (Component *component)
+{
+  NiceAgent *agent = component->agent;
+  NiceCandidate *local = component->selected_pair.local;
+  NiceCandidate *remote = component->selected_pair.remote;
+  NiceSocket *sock = (local != NULL) ? local->sockptr : NULL;
+  ComponentSendPath *path = NULL, *old_path;
+  GSList *l = NULL, *base_l = NULL;
+  gint64 id;
+
+  id = COMPONENT_SEND_PATH_ID (component->stream->id, component->id);
+
+  /* Only plain UDP sockets, and TURN sockets relaying over them, are safe to
+   * send on from several threads at once. Everything else, including the
+   * pseudo-TCP and RFC 4571 framing of reliable agents and sockets, needs the
+   * agent lock. */
+  if (local != NULL && remote != NULL && !agent->reliable &&
+      (sock->type == NICE_SOCKET_TYPE_UDP_BSD ||
+       sock->type == NICE_SOCKET_TYPE_UDP_URING ||
+       (sock->type == NICE_SOCKET_TYPE_UDP_TURN &&
+        local->turn != NULL && local->turn->type == NICE_RELAY_TYPE_TURN_UDP)))
+    l = g_slist_find_custom (component->socket_sources, sock,
+        _find_socket_source);
+
+  /* A TURN socket sends on its base socket, which must be kept alive too. */
+  if (l != NULL && sock->type == NICE_SOCKET_TYPE_UDP_TURN) {
+    base_l = g_slist_find_custom (component->socket_sources,
+        nice_udp_turn_socket_get_base_socket (sock), _find_socket_source);
+    if (base_l == NULL)
+      l = NULL;
+  }
+
+  /* The path can only keep the socket alive if it has a SocketSource. */
+  if (l != NULL) {
+    path = g_slice_new (ComponentSendPath);
+    path->ref_count = 1;
+    path->id = id;
+    path->socket_source = socket_source_ref (l->data);
+    g_atomic_int_inc (&path->socket_source->socket_users);
+    path->base_socket_source = NULL;
+    if (base_l != NULL) {
+      path->base_socket_source = socket_source_ref (base_l->data);
+      g_atomic_int_inc (&path->base_socket_source->socket_users);
+    }
+    path->socket = sock;
+    path->remote_addr = remote->addr;
+  }
+
+  g_rw_lock_writer_lock (&agent->send_paths_lock);
+  old_path = g_hash_table_lookup (agent->send_paths, &id);
+  if (old_path != NULL)
+    g_hash_table_steal (agent->send_paths, &id);
+  if (path != NULL)
+    g_hash_table_insert (agent->send_paths, &path->id, path);
+  g_rw_lock_writer_unlock (&agent->send_paths_lock);
+
+  /* Senders may still be using the old path, so it is only freed once they
+   * have dropped their references. */
+  if (old_path != NULL)
+    component_send_path_unref (old_path);
+}
+
+ComponentSendPath *
+component_send_path_ref (ComponentSendPath *path)
+{
+  g_atomic_int_inc (&path->ref_count);
+
+  return path;
+}
+
+/* May free the socket if it has already been detached, so the last reference
+ * can be dropped without the agent lock held. A TURN socket is released before
+ * its base socket, as closing it may still send on the base. */
+void
+component_send_path_unref (ComponentSendPath *path)
+{
+  if (g_atomic_int_dec_and_test (&path->ref_count)) {
+    socket_source_release_socket (path->socket_source);
+    socket_source_unref (path->socket_source);
+    if (path->base_socket_source != NULL) {
+      socket_source_release_socket (path->base_socket_source);
+      socket_source_unref (path->base_socket_source);
+    }
+    g_slice_free (ComponentSendPath, path);
+  }
 }
 
 /*
@@ -515,6 +851,8 @@ component_set_selected_remote_candidate (NiceAgent *agent, Component *component,
   component->selected_pair.remote = remote;
   component->selected_pair.priority = priority;
 
+  component_update_send_path (component);
+
   return local;
 }
 
@@ -527,6 +865,79 @@ _find_socket_source (gconstpointer a, gconstpointer b)
   return (source_a->socket == socket_b) ? 0 : 1;
 }
 
+/* Relay sockets share the GSocket of their base socket, so that received
+ * packets can be handed to the right relay socket without looking at every
+ * candidate. */
+static void
+component_add_relay_socket (Component *component, NiceSocket *nicesock)
+{
+  GSList *relays;
+
+  relays = g_hash_table_lookup (component->relay_sockets, nicesock->fileno);
+  g_hash_table_steal (component->relay_sockets, nicesock->fileno);
+  relays = g_slist_append (relays, nicesock);
+  g_hash_table_insert (component->relay_sockets, nicesock->fileno, relays);
+}
+
+static void
+component_remove_relay_socket (Component *component, NiceSocket *nicesock)
+{
+  GSList *relays;
+
+  relays = g_hash_table_lookup (component->relay_sockets, nicesock->fileno);
+  g_hash_table_steal (component->relay_sockets, nicesock->fileno);
+  relays = g_slist_remove (relays, nicesock);
+  if (relays != NULL)
+    g_hash_table_insert (component->relay_sockets, nicesock->fileno, relays);
+}
+
+/*
+ * Finds the attached UDP-TURN socket reading from the same GSocket as
+ * 'nicesock', and talking to 'server', or any server if 'server' is NULL.
+ *
+ * @return the relay socket, or NULL if there is none
+ */
+NiceSocket *
+component_find_relay_socket (Component *component, NiceSocket *nicesock,
+    const NiceAddress *server)
+{
+  GSList *i;
+
+  if (nicesock->fileno == NULL)
+    return NULL;
+
+  i = g_hash_table_lookup (component->relay_sockets, nicesock->fileno);
+  for (; i; i = i->next) {
+    NiceSocket *relay = i->data;
+
+    if (server == NULL ||
+        nice_address_equal (nice_udp_turn_socket_get_server_addr (relay),
+            server))
+      return relay;
+  }
+
+  return NULL;
+}
+
+/*
+ * Returns the deframer splitting the RFC 4571 framed packets received on the
+ * ICE-TCP socket 'nicesock', creating it on first use.
+ */
+NiceStreamDeframer *
+component_get_stream_deframer (Component *component, NiceSocket *nicesock)
+{
+  NiceStreamDeframer *deframer;
+
+  deframer = g_hash_table_lookup (component->stream_deframers, nicesock);
+  if (deframer == NULL) {
+    deframer = g_slice_new (NiceStreamDeframer);
+    nice_stream_deframer_init (deframer, sizeof (guint16) + G_MAXUINT16);
+    g_hash_table_insert (component->stream_deframers, nicesock, deframer);
+  }
+
+  return deframer;
+}
+
 /* This takes ownership of the socket.
  * It creates and attaches a source to the component’s context. */
 void
@@ -555,11 +966,17 @@ component_attach_socket (Component *component, NiceSocket *nicesock)
     socket_source = l->data;
   } else {
     socket_source = g_slice_new0 (SocketSource);
+    socket_source->ref_count = 1;
+    socket_source->socket_users = 1;
+    socket_source->agent_mutex = agent_mutex_ref (component->agent->agent_mutex);
     socket_source->socket = nicesock;
     socket_source->component = component;
     component->socket_sources =
         g_slist_prepend (component->socket_sources, socket_source);
     component->socket_sources_age++;
+
+    if (nicesock->type == NICE_SOCKET_TYPE_UDP_TURN)
+      component_add_relay_socket (component, nicesock);
   }
 
   /* Create and attach a source */
@@ -628,6 +1045,10 @@ component_detach_socket (Component *component, NiceSocket *nicesock)
   component->socket_sources = g_slist_delete_link (component->socket_sources, l);
   component->socket_sources_age++;
 
+  if (nicesock->type == NICE_SOCKET_TYPE_UDP_TURN)
+    component_remove_relay_socket (component, nicesock);
+  g_hash_table_remove (component->stream_deframers, nicesock);
+
   socket_source_detach (socket_source);
   socket_source_free (socket_source);
 }
@@ -657,6 +1078,8 @@ component_free_socket_sources (Component *component)
 {
   nice_debug ("Free socket sources for component %p.", component);
 
+  g_hash_table_remove_all (component->relay_sockets);
+  g_hash_table_remove_all (component->stream_deframers);
   g_slist_free_full (component->socket_sources,
       (GDestroyNotify) socket_source_free);
   component->socket_sources = NULL;
@@ -883,7 +1306,7 @@ component_emit_io_callback (Component *component,
     agent_unlock_and_emit (agent);
     io_callback (agent, stream_id,
         component_id, buf_len, (gchar *) buf, io_user_data);
-    agent_lock ();
+    agent_lock (agent);
   } else {
     IOCallbackData *data;
 
@@ -903,6 +1326,29 @@ component_emit_io_callback (Component *component,
   }
 }
 
+/* Queue @buf to be passed to the client later, either in an I/O callback once
+ * one is attached, or by the next nice_agent_recv_messages() call. Used when
+ * the I/O callback is detached part-way through handling a batch of received
+ * messages, so none of the already-dequeued data is lost.
+ *
+ * This must be called with the agent lock *held*. */
+void
+component_queue_io_message (Component *component,
+    const guint8 *buf, gsize buf_len)
+{
+  g_assert (buf != NULL);
+  g_assert (buf_len > 0);
+
+  g_mutex_lock (&component->io_mutex);
+
+  g_queue_push_tail (&component->pending_io_messages,
+      io_callback_data_new (buf, buf_len));  /* transfer ownership */
+  if (component->io_callback != NULL)
+    component_schedule_io_callback (component);
+
+  g_mutex_unlock (&component->io_mutex);
+}
+
 /* Note: Must be called with the io_mutex held. */
 static void
 component_schedule_io_callback (Component *component)
@@ -988,7 +1434,7 @@ component_source_prepare (GSource *source, gint *timeout_)
     return FALSE;
 
   /* Needed due to accessing the Component. */
-  agent_lock ();
+  agent_lock (agent);
 
   if (!agent_find_component (agent,
           component_source->stream_id, component_source->component_id, NULL,
@@ -1027,8 +1473,7 @@ component_source_prepare (GSource *source, gint *timeout_)
     child_socket_source = g_slice_new0 (SocketSource);
     child_socket_source->socket = parent_socket_source->socket;
     child_socket_source->source =
-        g_socket_create_source (child_socket_source->socket->fileno, G_IO_IN,
-            NULL);
+        nice_socket_create_source (child_socket_source->socket);
     g_source_set_dummy_callback (child_socket_source->source);
     g_source_add_child_source (source, child_socket_source->source);
     g_source_unref (child_socket_source->source);
@@ -52,6 +52,8 @@ typedef struct _Component Component;
 #include "pseudotcp.h"
 #include "stream.h"
 #include "socket.h"
+#include "socket-priv.h"
+#include "epollsource.h"
 
 G_BEGIN_DECLS
 
@@ -103,13 +105,27 @@ incoming_check_free (IncomingCheck *icheck);
  * GSources in a Component must be attached to the same main context:
  * component->ctx.
  *
- * Socket must be non-NULL, but source may be NULL if it has been detached.
+ * If the agent uses epoll, the socket is polled through watch instead, and
+ * source is NULL.
+ *
+ * Socket must be non-NULL, but source and watch may be NULL if it has been
+ * detached.
  *
  * The Component is stored so this may be used as the user data for a GSource
- * callback. */
+ * callback. The source or watch holds a reference on the SocketSource, which
+ * holds one on the agent lock, so the callback can take the lock and check
+ * whether it was destroyed before touching the Component.
+ *
+ * The socket itself is freed when the last of @socket_users is dropped: one
+ * is held by the Component until the SocketSource is freed, and one by each
+ * ComponentSendPath on the socket. */
 typedef struct {
+  volatile gint ref_count;
+  volatile gint socket_users;
+  AgentMutex *agent_mutex;  /* owned */
   NiceSocket *socket;
   GSource *source;
+  NiceEpollWatch *watch;
   Component *component;
 } SocketSource;
 
@@ -132,6 +148,76 @@ typedef struct {
   gsize offset;
 } IOCallbackData;
 
+/* What a non-reliable send on the selected pair of a Component needs, as
+ * published in NiceAgent::send_paths so nice_agent_send() can use it without
+ * taking the agent lock. It is immutable: when the selected pair changes, it is
+ * swapped for a new one under NiceAgent::send_paths_lock rather than modified.
+ * Senders only hold that lock to look the path up and take a reference, and
+ * send without it. The path holds a use of @socket through @socket_source, so
+ * the socket outlives every send which is still using it.
+ *
+ * For relayed candidates, @socket is the TURN socket, which does the TURN
+ * wrapping itself and sends on its base socket. The path holds a use of that
+ * too, through @base_socket_source, as the TURN socket doesn't own it. */
+typedef struct {
+  volatile gint ref_count;
+  gint64 id;  /* key in NiceAgent::send_paths */
+  SocketSource *socket_source;  /* owned */
+  SocketSource *base_socket_source;  /* owned, or NULL */
+  NiceSocket *socket;  /* unowned */
+  NiceAddress remote_addr;
+} ComponentSendPath;
+
+#define COMPONENT_SEND_PATH_ID(stream_id, component_id) \
+  (((gint64) (stream_id) << 32) | (component_id))
+
+ComponentSendPath *
+component_send_path_ref (ComponentSendPath *path);
+void
+component_send_path_unref (ComponentSendPath *path);
+
+/* The response to an inbound connectivity check, kept so that retransmissions
+ * of the request can be answered again without being validated and processed
+ * again (RFC 5389 §7.3.1). Entries are matched on the whole request, so only
+ * byte-identical retransmissions hit. */
+#define COMPONENT_MAX_CACHED_RESPONSES 8
+#define COMPONENT_CACHED_STUN_SIZE 256
+
+/* How long a peer using the default STUN timer retransmits a request for */
+#define COMPONENT_CACHED_RESPONSE_TIMEOUT_MS \
+  (STUN_TIMER_DEFAULT_TIMEOUT * \
+      ((1 << (STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS + 1)) - 1))
+
+typedef struct {
+  NiceSocket *socket;  /* unowned, only compared */
+  NiceAddress from;
+  gint64 expiry;  /* monotonic time, in microseconds */
+  guint16 request_len;  /* 0 if the entry is unused */
+  guint16 response_len;
+  guint8 request[COMPONENT_CACHED_STUN_SIZE];
+  guint8 response[COMPONENT_CACHED_STUN_SIZE];
+} CachedStunResponse;
+
+/* Inbound connectivity checks are rate limited with token buckets, one per
+ * source address and one for the whole component, so that a flood of
+ * requests is dropped before it costs a HMAC computation each. The rates are
+ * well above what a peer pacing its checks as in ICE 5.8 sends. */
+#define COMPONENT_MAX_RATE_LIMITED_SOURCES 16
+#define COMPONENT_SOURCE_CHECK_RATE 100  /* requests per second */
+#define COMPONENT_SOURCE_CHECK_BURST 50
+#define COMPONENT_CHECK_RATE 1000  /* requests per second */
+#define COMPONENT_CHECK_BURST 200
+
+typedef struct {
+  gint64 tokens;  /* in millionths of a request */
+  gint64 updated;  /* monotonic time of the last refill, 0 if unused */
+} TokenBucket;
+
+typedef struct {
+  NiceAddress from;
+  TokenBucket bucket;
+} SourceRateLimit;
+
 IOCallbackData *
 io_callback_data_new (const guint8 *buf, gsize buf_len);
 void
@@ -147,6 +233,10 @@ struct _Component
   GSList *remote_candidates;   /* list of NiceCandidate objs */
   GSList *socket_sources;      /* list of SocketSource objs; must only grow monotonically */
   guint socket_sources_age;    /* incremented when socket_sources changes */
+  GHashTable *relay_sockets;   /* GSocket -> GSList of the attached UDP-TURN
+                                  NiceSockets reading from it, unowned */
+  GHashTable *stream_deframers; /* NiceSocket -> owned NiceStreamDeframer,
+                                   for ICE-TCP sockets */
   GSList *incoming_checks;     /* list of IncomingCheck objs */
   GList *turn_servers;             /* List of TurnServer objs */
   CandidatePair selected_pair; /* independent from checklists, 
@@ -190,6 +280,17 @@ struct _Component
                     * agent lock */
 
   StunAgent stun_agent; /* This stun agent is used to validate all stun requests */
+  StunAgentSavedIds *stun_saved_ids;  /* transaction storage of stun_agent */
+  gsize n_stun_saved_ids;
+
+  CachedStunResponse cached_responses[COMPONENT_MAX_CACHED_RESPONSES];
+  guint next_cached_response;  /* next entry of cached_responses to replace */
+
+  SourceRateLimit source_rate_limits[COMPONENT_MAX_RATE_LIMITED_SOURCES];
+  TokenBucket check_rate_limit;
+  guint64 n_rate_limited_checks;  /* requests dropped by the rate limits */
+  guint64 n_unstored_checks;  /* early requests dropped by the bound on
+                                 incoming_checks */
 
 
   GCancellable *stop_cancellable;
@@ -227,9 +328,26 @@ component_find_pair (Component *cmp, NiceAgent *agent, const gchar *lfoundation,
 void
 component_restart (Component *cmp);
 
+void
+component_init_stun_agent (Component *component);
+
 void
 component_update_selected_pair (Component *component, const CandidatePair *pair);
 
+const CachedStunResponse *
+component_find_cached_response (Component *component, NiceSocket *socket,
+    const NiceAddress *from, const guint8 *request, gsize request_len);
+void
+component_cache_response (Component *component, NiceSocket *socket,
+    const NiceAddress *from, const guint8 *request, gsize request_len,
+    const guint8 *response, gsize response_len);
+
+gboolean
+component_admit_inbound_check (Component *component, const NiceAddress *from);
+
+void
+component_update_send_path (Component *component);
+
 NiceCandidate *
 component_find_remote_candidate (const Component *component, const NiceAddress *addr, NiceCandidateTransport transport);
 
@@ -246,6 +364,13 @@ component_detach_all_sockets (Component *component);
 void
 component_free_socket_sources (Component *component);
 
+NiceSocket *
+component_find_relay_socket (Component *component, NiceSocket *nicesock,
+    const NiceAddress *server);
+
+NiceStreamDeframer *
+component_get_stream_deframer (Component *component, NiceSocket *nicesock);
+
 GSource *
 component_input_source_new (NiceAgent *agent, guint stream_id,
     guint component_id, GPollableInputStream *pollable_istream,
@@ -263,6 +388,9 @@ component_set_io_callback (Component *component,
 void
 component_emit_io_callback (Component *component,
     const guint8 *buf, gsize buf_len);
+void
+component_queue_io_message (Component *component,
+    const guint8 *buf, gsize buf_len);
 
 gboolean
 component_has_io_callback (Component *component);
@@ -467,42 +467,16 @@ static gboolean priv_conn_check_tick_unlocked (NiceAgent *agent)
   return keep_timer_going;
 }
 
-static gboolean priv_conn_check_tick (gpointer pointer)
+static gboolean priv_conn_check_tick (NiceAgent *agent, gpointer pointer)
 {
-  gboolean ret;
-  NiceAgent *agent = pointer;
-
-  agent_lock();
-  if (g_source_is_destroyed (g_main_current_source ())) {
-    nice_debug ("Source was destroyed. "
-        "Avoided race condition in priv_conn_check_tick");
-    agent_unlock ();
-    return FALSE;
-  }
-
-  ret = priv_conn_check_tick_unlocked (agent);
-  agent_unlock_and_emit (agent);
-
-  return ret;
+  return priv_conn_check_tick_unlocked (agent);
 }
 
-static gboolean priv_conn_keepalive_retransmissions_tick (gpointer pointer)
+static gboolean priv_conn_keepalive_retransmissions_tick (NiceAgent *agent,
+    gpointer pointer)
 {
   CandidatePair *pair = (CandidatePair *) pointer;
 
-  agent_lock();
-
-  /* A race condition might happen where the mutex above waits for the lock
-   * and in the meantime another thread destroys the source.
-   * In that case, we don't need to run our retransmission tick since it should
-   * have been cancelled */
-  if (g_source_is_destroyed (g_main_current_source ())) {
-    nice_debug ("Source was destroyed. "
-        "Avoided race condition in priv_conn_keepalive_retransmissions_tick");
-    agent_unlock ();
-    return FALSE;
-  }
-
   g_source_destroy (pair->keepalive.tick_source);
   g_source_unref (pair->keepalive.tick_source);
   pair->keepalive.tick_source = NULL;
@@ -519,7 +493,6 @@ static gboolean priv_conn_keepalive_retransmissions_tick (gpointer pointer)
                 NULL, &component)) {
           nice_debug ("Could not find stream or component in"
               " priv_conn_keepalive_retransmissions_tick");
-          agent_unlock ();
           return FALSE;
         }
 
@@ -549,13 +522,15 @@ static gboolean priv_conn_keepalive_retransmissions_tick (gpointer pointer)
 
       nice_debug ("Agent %p : Retransmitting keepalive conncheck",
           pair->keepalive.agent);
-      agent_timeout_add_with_context (pair->keepalive.agent,
+      agent_timeout_add_for_stream (pair->keepalive.agent,
+          agent_find_stream (agent, pair->keepalive.stream_id),
           &pair->keepalive.tick_source,
           "Pair keepalive", stun_timer_remainder (&pair->keepalive.timer),
           priv_conn_keepalive_retransmissions_tick, pair);
       break;
     case STUN_USAGE_TIMER_RETURN_SUCCESS:
-      agent_timeout_add_with_context (pair->keepalive.agent,
+      agent_timeout_add_for_stream (pair->keepalive.agent,
+          agent_find_stream (agent, pair->keepalive.stream_id),
           &pair->keepalive.tick_source,
           "Pair keepalive", stun_timer_remainder (&pair->keepalive.timer),
           priv_conn_keepalive_retransmissions_tick, pair);
@@ -565,8 +540,6 @@ static gboolean priv_conn_keepalive_retransmissions_tick (gpointer pointer)
       break;
   }
 
-
-  agent_unlock_and_emit (pair->keepalive.agent);
   return FALSE;
 }
 
@@ -598,6 +571,46 @@ static guint32 peer_reflexive_candidate_priority (NiceAgent *agent,
 
 
 
+/*
+ * Whether the previous keepalive request of the selected pair 'p' can be
+ * sent again with a new transaction ID rather than built from scratch: it
+ * must carry the current username and, where the request has them, the
+ * current role and tie-breaker. The priority can't change for a given pair.
+ */
+static gboolean priv_keepalive_is_reusable (NiceAgent *agent,
+    CandidatePair *p, const uint8_t *uname, size_t uname_len)
+{
+  StunMessage *msg = &p->keepalive.stun_message;
+  StunUsageIceCompatibility compat = agent_to_ice_compatibility (agent);
+  const uint8_t *attr;
+  uint16_t attr_len;
+  uint64_t tie;
+  size_t i;
+
+  if (msg->buffer == NULL || stun_message_get_class (msg) != STUN_REQUEST)
+    return FALSE;
+
+  /* Without the magic cookie, the attribute is padded with spaces */
+  attr = stun_message_find (msg, STUN_ATTRIBUTE_USERNAME, &attr_len);
+  if (attr == NULL || attr_len < uname_len || attr_len - uname_len >= 4 ||
+      memcmp (attr, uname, uname_len) != 0)
+    return FALSE;
+  for (i = uname_len; i < attr_len; i++)
+    if (attr[i] != ' ')
+      return FALSE;
+
+  if (compat == STUN_USAGE_ICE_COMPATIBILITY_RFC5245 ||
+      compat == STUN_USAGE_ICE_COMPATIBILITY_WLM2009) {
+    if (stun_message_find64 (msg, agent->controlling_mode ?
+            STUN_ATTRIBUTE_ICE_CONTROLLING : STUN_ATTRIBUTE_ICE_CONTROLLED,
+            &tie) != STUN_MESSAGE_RETURN_SUCCESS ||
+        tie != agent->tie_breaker)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
 /*
  * Timer callback that handles initiating and managing connectivity
  * checks (paced by the Ta timer).
@@ -629,7 +642,7 @@ static gboolean priv_conn_keepalive_tick_unlocked (NiceAgent *agent)
 
         if (agent->compatibility == NICE_COMPATIBILITY_GOOGLE ||
             agent->keepalive_conncheck) {
-          guint32 priority;
+          guint32 priority = 0;
           uint8_t uname[NICE_STREAM_MAX_UNAME];
           size_t uname_len =
               priv_create_username (agent, agent_find_stream (agent, stream->id),
@@ -638,8 +651,11 @@ static gboolean priv_conn_keepalive_tick_unlocked (NiceAgent *agent)
           uint8_t *password = NULL;
           size_t password_len = priv_get_password (agent,
               agent_find_stream (agent, stream->id), p->remote, &password);
+          gboolean reuse = uname_len > 0 &&
+              priv_keepalive_is_reusable (agent, p, uname, uname_len);
 
-          priority = peer_reflexive_candidate_priority (agent, p->local);
+          if (!reuse || nice_debug_is_enabled ())
+            priority = peer_reflexive_candidate_priority (agent, p->local);
 
           if (nice_debug_is_enabled ()) {
             gchar tmpbuf[INET6_ADDRSTRLEN];
@@ -652,7 +668,17 @@ static gboolean priv_conn_keepalive_tick_unlocked (NiceAgent *agent)
                 component->id, (int) uname_len, uname, uname_len,
                 (int) password_len, password, password_len, priority);
           }
-          if (uname_len > 0) {
+          if (reuse) {
+            /* Only the transaction ID, MESSAGE-INTEGRITY and FINGERPRINT of
+             * the previous keepalive need to change. */
+            buf_len = 0;
+            if (stun_agent_init_request_from_template (&component->stun_agent,
+                    &p->keepalive.stun_message, p->keepalive.stun_buffer,
+                    sizeof(p->keepalive.stun_buffer),
+                    &p->keepalive.stun_message))
+              buf_len = stun_agent_finish_message (&component->stun_agent,
+                  &p->keepalive.stun_message, password, password_len);
+          } else if (uname_len > 0) {
             buf_len = stun_usage_ice_conncheck_create (&component->stun_agent,
                 &p->keepalive.stun_message, p->keepalive.stun_buffer,
                 sizeof(p->keepalive.stun_buffer),
@@ -661,7 +687,9 @@ static gboolean priv_conn_keepalive_tick_unlocked (NiceAgent *agent)
                 agent->tie_breaker,
                 NULL,
                 agent_to_ice_compatibility (agent));
+          }
 
+          if (uname_len > 0) {
             nice_debug ("Agent %p: conncheck created %zd - %p",
                 agent, buf_len, p->keepalive.stun_message.buffer);
 
@@ -679,7 +707,7 @@ static gboolean priv_conn_keepalive_tick_unlocked (NiceAgent *agent)
               p->keepalive.component_id = component->id;
               p->keepalive.agent = agent;
 
-              agent_timeout_add_with_context (p->keepalive.agent,
+              agent_timeout_add_for_stream (p->keepalive.agent, stream,
                   &p->keepalive.tick_source, "Pair keepalive",
                   stun_timer_remainder (&p->keepalive.timer),
                   priv_conn_keepalive_retransmissions_tick, p);
@@ -717,6 +745,7 @@ static gboolean priv_conn_keepalive_tick_unlocked (NiceAgent *agent)
         NiceAddress stun_server;
         if (nice_address_set_from_string (&stun_server, agent->stun_server_ip)) {
           StunAgent stun_agent;
+          StunAgentSavedIds stun_saved_ids[1];
           uint8_t stun_buffer[STUN_MAX_MESSAGE_SIZE_IPV6];
           StunMessage stun_message;
           size_t buffer_len = 0;
@@ -729,6 +758,8 @@ static gboolean priv_conn_keepalive_tick_unlocked (NiceAgent *agent)
            * will be forwarded to the application as user data */
           stun_agent_init (&stun_agent, STUN_ALL_KNOWN_ATTRIBUTES,
               STUN_COMPATIBILITY_RFC3489, 0);
+          stun_agent_set_transaction_storage (&stun_agent, stun_saved_ids,
+              G_N_ELEMENTS (stun_saved_ids));
 
           buffer_len = stun_usage_bind_create (&stun_agent,
               &stun_message, stun_buffer, sizeof(stun_buffer));
@@ -760,19 +791,10 @@ static gboolean priv_conn_keepalive_tick_unlocked (NiceAgent *agent)
   return ret;
 }
 
-static gboolean priv_conn_keepalive_tick (gpointer pointer)
+static gboolean priv_conn_keepalive_tick (NiceAgent *agent, gpointer pointer)
 {
-  NiceAgent *agent = pointer;
   gboolean ret;
 
-  agent_lock();
-  if (g_source_is_destroyed (g_main_current_source ())) {
-    nice_debug ("Source was destroyed. "
-        "Avoided race condition in priv_conn_keepalive_tick");
-    agent_unlock ();
-    return FALSE;
-  }
-
   ret = priv_conn_keepalive_tick_unlocked (agent);
   if (ret == FALSE) {
     if (agent->keepalive_timer_source) {
@@ -781,36 +803,19 @@ static gboolean priv_conn_keepalive_tick (gpointer pointer)
       agent->keepalive_timer_source = NULL;
     }
   }
-  agent_unlock_and_emit (agent);
   return ret;
 }
 
 
-static gboolean priv_turn_allocate_refresh_retransmissions_tick (gpointer pointer)
+static gboolean priv_turn_allocate_refresh_retransmissions_tick (
+    NiceAgent *agent, gpointer pointer)
 {
   CandidateRefresh *cand = (CandidateRefresh *) pointer;
-  NiceAgent *agent = NULL;
-
-  agent_lock();
-
-  /* A race condition might happen where the mutex above waits for the lock
-   * and in the meantime another thread destroys the source.
-   * In that case, we don't need to run our retransmission tick since it should
-   * have been cancelled */
-  if (g_source_is_destroyed (g_main_current_source ())) {
-    nice_debug ("Source was destroyed. "
-        "Avoided race condition in priv_turn_allocate_refresh_retransmissions_tick");
-    agent_unlock ();
-    return FALSE;
-  }
-
 
   g_source_destroy (cand->tick_source);
   g_source_unref (cand->tick_source);
   cand->tick_source = NULL;
 
-  agent = g_object_ref (cand->agent);
-
   switch (stun_timer_refresh (&cand->timer)) {
     case STUN_USAGE_TIMER_RETURN_TIMEOUT:
       {
@@ -828,12 +833,12 @@ static gboolean priv_turn_allocate_refresh_retransmissions_tick (gpointer pointe
       agent_socket_send (cand->nicesock, &cand->server,
           stun_message_length (&cand->stun_message), (gchar *)cand->stun_buffer);
 
-      agent_timeout_add_with_context (agent, &cand->tick_source,
+      agent_timeout_add_for_stream (agent, cand->stream, &cand->tick_source,
           "Candidate TURN refresh", stun_timer_remainder (&cand->timer),
           priv_turn_allocate_refresh_retransmissions_tick, cand);
       break;
     case STUN_USAGE_TIMER_RETURN_SUCCESS:
-      agent_timeout_add_with_context (agent, &cand->tick_source,
+      agent_timeout_add_for_stream (agent, cand->stream, &cand->tick_source,
           "Candidate TURN refresh", stun_timer_remainder (&cand->timer),
           priv_turn_allocate_refresh_retransmissions_tick, cand);
       break;
@@ -842,11 +847,6 @@ static gboolean priv_turn_allocate_refresh_retransmissions_tick (gpointer pointe
       break;
   }
 
-
-  agent_unlock_and_emit (agent);
-
-  g_object_unref (agent);
-
   return FALSE;
 }
 
@@ -901,7 +901,8 @@ static void priv_turn_allocate_refresh_tick_unlocked (CandidateRefresh *cand)
     agent_socket_send (cand->nicesock, &cand->server,
         buffer_len, (gchar *)cand->stun_buffer);
 
-    agent_timeout_add_with_context (cand->agent, &cand->tick_source,
+    agent_timeout_add_for_stream (cand->agent, cand->stream,
+        &cand->tick_source,
         "Candidate TURN refresh", stun_timer_remainder (&cand->timer),
         priv_turn_allocate_refresh_retransmissions_tick, cand);
   }
@@ -916,20 +917,12 @@ static void priv_turn_allocate_refresh_tick_unlocked (CandidateRefresh *cand)
  *
  * @return will return FALSE when no more pending timers.
  */
-static gboolean priv_turn_allocate_refresh_tick (gpointer pointer)
+static gboolean priv_turn_allocate_refresh_tick (NiceAgent *agent,
+    gpointer pointer)
 {
   CandidateRefresh *cand = (CandidateRefresh *) pointer;
 
-  agent_lock();
-  if (g_source_is_destroyed (g_main_current_source ())) {
-    nice_debug ("Source was destroyed. "
-        "Avoided race condition in priv_turn_allocate_refresh_tick");
-    agent_unlock ();
-    return FALSE;
-  }
-
   priv_turn_allocate_refresh_tick_unlocked (cand);
-  agent_unlock_and_emit (cand->agent);
 
   return FALSE;
 }
@@ -2160,22 +2153,44 @@ static int priv_store_pending_check (NiceAgent *agent, Component *component,
     const NiceAddress *from, NiceSocket *sockptr, uint8_t *username,
     uint16_t username_len, uint32_t priority, gboolean use_candidate)
 {
-  IncomingCheck *icheck;
+  IncomingCheck *icheck = NULL;
+  GSList *i;
+  guint n_checks = 0;
   nice_debug ("Agent %p : Storing pending check.", agent);
 
-  if (component->incoming_checks &&
-      g_slist_length (component->incoming_checks) >= 
-      NICE_AGENT_MAX_REMOTE_CANDIDATES) {
-    nice_debug ("Agent %p : WARN: unable to store information for early incoming check.", agent);
-    return -1;
+  /* A retransmitted or repeated check replaces the one stored for the same
+   * source, so that retransmissions can't fill up the list */
+  for (i = component->incoming_checks; i; i = i->next) {
+    IncomingCheck *c = i->data;
+
+    if (c->local_socket == sockptr && nice_address_equal (&c->from, from)) {
+      icheck = c;
+      break;
+    }
+    n_checks++;
+  }
+
+  if (icheck == NULL) {
+    if (n_checks >= NICE_AGENT_MAX_REMOTE_CANDIDATES) {
+      component->n_unstored_checks++;
+      nice_debug ("Agent %p : WARN: unable to store information for early "
+          "incoming check (%" G_GUINT64_FORMAT " dropped so far).", agent,
+          component->n_unstored_checks);
+      return -1;
+    }
+
+    icheck = g_slice_new0 (IncomingCheck);
+    component->incoming_checks = g_slist_append (component->incoming_checks,
+        icheck);
+  } else {
+    g_free (icheck->username);
   }
 
-  icheck = g_slice_new0 (IncomingCheck);
-  component->incoming_checks = g_slist_append (component->incoming_checks, icheck);
   icheck->from = *from;
   icheck->local_socket = sockptr;
   icheck->priority = priority;
-  icheck->use_candidate = use_candidate;
+  /* A nomination isn't undone by a later check without USE-CANDIDATE */
+  icheck->use_candidate = icheck->use_candidate || use_candidate;
   icheck->username_len = username_len;
   icheck->username = NULL;
   if (username_len > 0)
@@ -2571,6 +2586,8 @@ priv_add_new_turn_refresh (CandidateDiscovery *cdisco, NiceCandidate *relay_cand
   cand->component = cdisco->component;
   cand->agent = cdisco->agent;
   memcpy (&cand->stun_agent, &cdisco->stun_agent, sizeof(StunAgent));
+  stun_agent_set_transaction_storage (&cand->stun_agent,
+      cand->stun_saved_ids, G_N_ELEMENTS (cand->stun_saved_ids));
 
   /* Use previous stun response for authentication credentials */
   if (cdisco->stun_resp_msg.buffer != NULL) {
@@ -2587,7 +2604,7 @@ priv_add_new_turn_refresh (CandidateDiscovery *cdisco, NiceCandidate *relay_cand
 
   /* step: also start the refresh timer */
   /* refresh should be sent 1 minute before it expires */
-  agent_timeout_add_with_context (agent, &cand->timer_source,
+  agent_timeout_add_for_stream (agent, cand->stream, &cand->timer_source,
       "Candidate TURN refresh",
       (lifetime - 60) * 1000, priv_turn_allocate_refresh_tick, cand);
 
@@ -2833,8 +2850,9 @@ static gboolean priv_map_reply_to_relay_refresh (NiceAgent *agent, StunMessage *
             agent, cand, (int)res);
         if (res == STUN_USAGE_TURN_RETURN_RELAY_SUCCESS) {
           /* refresh should be sent 1 minute before it expires */
-          agent_timeout_add_with_context (cand->agent, &cand->timer_source,
-              "Candidate TURN refresh", (lifetime - 60) * 1000,
+          agent_timeout_add_for_stream (cand->agent, cand->stream,
+              &cand->timer_source, "Candidate TURN refresh",
+              (lifetime - 60) * 1000,
               priv_turn_allocate_refresh_tick, cand);
 
           g_source_destroy (cand->tick_source);
@@ -3039,6 +3057,7 @@ gboolean conn_check_handle_inbound_stun (NiceAgent *agent, Stream *stream,
   NiceCandidate *remote_candidate2 = NULL;
   NiceCandidate *local_candidate = NULL;
   gboolean discovery_msg = FALSE;
+  const CachedStunResponse *cached;
 
   nice_address_copy_to_sockaddr (from, &sockaddr.addr);
 
@@ -3052,6 +3071,34 @@ gboolean conn_check_handle_inbound_stun (NiceAgent *agent, Stream *stream,
         agent, stream->id, component->id, tmpbuf, nice_address_get_port (from), len);
   }
 
+  /* A retransmission of a request which was answered recently gets the same
+   * answer, without being validated and processed again */
+  cached = component_find_cached_response (component, nicesock, from,
+      (const guint8 *) buf, len);
+  if (cached != NULL) {
+    nice_debug ("Agent %p : Retransmitted request, resending the cached "
+        "response.", agent);
+    agent_socket_send (nicesock, from, cached->response_len,
+        (const gchar *) cached->response);
+    return TRUE;
+  }
+
+  /* Requests from a source, or to a component, which is being flooded are
+   * dropped before paying for their validation. Responses and indications
+   * are left alone, as they only match transactions we started. */
+  req.buffer = (uint8_t *) buf;
+  if (stun_message_get_class (&req) == STUN_REQUEST &&
+      !component_admit_inbound_check (component, from)) {
+    if (nice_debug_is_enabled ()) {
+      gchar tmpbuf[INET6_ADDRSTRLEN];
+      nice_address_to_string (from, tmpbuf);
+      nice_debug ("Agent %p : Dropping request from [%s]:%u, rate limit "
+          "exceeded (%" G_GUINT64_FORMAT " dropped so far).", agent, tmpbuf,
+          nice_address_get_port (from), component->n_rate_limited_checks);
+    }
+    return TRUE;
+  }
+
   /* note: ICE  7.2. "STUN Server Procedures" (ID-19) */
 
   valid = stun_agent_validate (&component->stun_agent, &req,
@@ -3305,6 +3352,14 @@ gboolean conn_check_handle_inbound_stun (NiceAgent *agent, Stream *stream,
       priv_reply_to_conn_check (agent, stream, component, remote_candidate,
           from, nicesock, rbuf_len, rbuf, use_candidate);
 
+      /* Requests are only retransmitted over unreliable transports. MSN
+       * rewrites the USERNAME in the request, so it can't be matched. */
+      if (!nice_socket_is_reliable (nicesock) &&
+          agent->compatibility != NICE_COMPATIBILITY_MSN &&
+          agent->compatibility != NICE_COMPATIBILITY_OC2007)
+        component_cache_response (component, nicesock, from,
+            (const guint8 *) buf, len, rbuf, rbuf_len);
+
       if (component->remote_candidates == NULL) {
         /* case: We've got a valid binding request to a local candidate
          *       but we do not yet know remote credentials nor
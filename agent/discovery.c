@@ -556,11 +556,16 @@ HostCandidateResult discovery_add_local_host_candidate (
   /* note: candidate username and password are left NULL as stream
      level ufrag/password are used */
   if (transport == NICE_CANDIDATE_TRANSPORT_UDP) {
-    nicesock = nice_udp_bsd_socket_new (address);
+    if (agent->use_io_uring)
+      nicesock = nice_udp_uring_socket_new (address);
+    if (nicesock == NULL)
+      nicesock = nice_udp_bsd_socket_new (address);
   } else if (transport == NICE_CANDIDATE_TRANSPORT_TCP_ACTIVE) {
-    nicesock = nice_tcp_active_socket_new (agent->main_context, address);
+    nicesock = nice_tcp_active_socket_new (
+        agent_get_stream_context (agent, stream), address);
   } else if (transport == NICE_CANDIDATE_TRANSPORT_TCP_PASSIVE) {
-    nicesock = nice_tcp_passive_socket_new (agent->main_context, address);
+    nicesock = nice_tcp_passive_socket_new (
+        agent_get_stream_context (agent, stream), address);
   } else {
     /* TODO: Add TCP-SO */
   }
@@ -580,6 +585,8 @@ HostCandidateResult discovery_add_local_host_candidate (
   }
 
   _priv_set_socket_tos (agent, nicesock, stream->tos);
+  nice_udp_bsd_socket_set_gso (nicesock, agent->udp_gso);
+  nice_udp_bsd_socket_set_gro (nicesock, agent->udp_gro);
   component_attach_socket (component, nicesock);
 
   *outcandidate = candidate;
@@ -746,7 +753,8 @@ discovery_add_relay_candidate (
   }
 
   /* step: link to the base candidate+socket */
-  relay_socket = nice_udp_turn_socket_new (agent->main_context, address,
+  relay_socket = nice_udp_turn_socket_new (
+      agent_get_stream_context (agent, stream), address,
       base_socket, &turn->server,
       turn->username, turn->password,
       agent_to_turn_socket_compatibility (agent));
@@ -812,6 +820,7 @@ discovery_add_peer_reflexive_candidate (
     candidate->transport = conn_check_match_transport (remote->transport);
   else {
     if (base_socket->type == NICE_SOCKET_TYPE_UDP_BSD ||
+        base_socket->type == NICE_SOCKET_TYPE_UDP_URING ||
         base_socket->type == NICE_SOCKET_TYPE_UDP_TURN)
       candidate->transport = NICE_CANDIDATE_TRANSPORT_UDP;
     else
@@ -911,6 +920,7 @@ NiceCandidate *discovery_learn_remote_peer_reflexive_candidate (
     candidate->transport = conn_check_match_transport (local->transport);
   else {
     if (nicesock->type == NICE_SOCKET_TYPE_UDP_BSD ||
+        nicesock->type == NICE_SOCKET_TYPE_UDP_URING ||
         nicesock->type == NICE_SOCKET_TYPE_UDP_TURN)
       candidate->transport = NICE_CANDIDATE_TRANSPORT_UDP;
     else
@@ -1173,20 +1183,11 @@ static gboolean priv_discovery_tick_unlocked (gpointer pointer)
   return TRUE;
 }
 
-static gboolean priv_discovery_tick (gpointer pointer)
+static gboolean priv_discovery_tick (NiceAgent *agent, gpointer pointer)
 {
-  NiceAgent *agent = pointer;
   gboolean ret;
 
-  agent_lock();
-  if (g_source_is_destroyed (g_main_current_source ())) {
-    nice_debug ("Source was destroyed. "
-        "Avoided race condition in priv_discovery_tick");
-    agent_unlock ();
-    return FALSE;
-  }
-
-  ret = priv_discovery_tick_unlocked (pointer);
+  ret = priv_discovery_tick_unlocked (agent);
   if (ret == FALSE) {
     if (agent->discovery_timer_source != NULL) {
       g_source_destroy (agent->discovery_timer_source);
@@ -1194,7 +1195,6 @@ static gboolean priv_discovery_tick (gpointer pointer)
       agent->discovery_timer_source = NULL;
     }
   }
-  agent_unlock_and_emit (agent);
 
   return ret;
 }
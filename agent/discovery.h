@@ -44,6 +44,10 @@
 #include "stream.h"
 #include "agent.h"
 
+/* Discovery and refresh items have a single request outstanding at a time,
+ * but a retry can briefly overlap the request it replaces. */
+#define DISCOVERY_MAX_SAVED_IDS 8
+
 typedef struct
 {
   NiceAgent *agent;         /* back pointer to owner */
@@ -57,6 +61,7 @@ typedef struct
   Component *component;
   TurnServer *turn;
   StunAgent stun_agent;
+  StunAgentSavedIds stun_saved_ids[DISCOVERY_MAX_SAVED_IDS];
   StunTimer timer;
   uint8_t stun_buffer[STUN_MAX_MESSAGE_SIZE_IPV6];
   StunMessage stun_message;
@@ -73,6 +78,7 @@ typedef struct
   Stream *stream;
   Component *component;
   StunAgent stun_agent;
+  StunAgentSavedIds stun_saved_ids[DISCOVERY_MAX_SAVED_IDS];
   GSource *timer_source;
   GSource *tick_source;
   StunTimer timer;
@@ -0,0 +1,400 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/*
+ * The epoll source of a context holds a reference on it while any socket is
+ * registered, and is removed with its last watch. Ready watches are referenced
+ * for the length of their dispatch, so they may be destroyed from any thread.
+ */
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "epollsource.h"
+#include "agent-priv.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+/* Maximum number of ready sockets dispatched per main loop iteration. Any
+ * others stay ready, and are dispatched in the next iteration. */
+#define MAX_EVENTS 64
+
+typedef struct {
+  GSource source;
+  GPollFD pollfd;  /* for the epoll file descriptor */
+  GMainContext *context;  /* unowned; the source is attached to it */
+  /* Protects @n_watches and the registration of watches, so that ready
+   * watches can be referenced before they are unregistered. */
+  GMutex mutex;
+  guint n_watches;
+} EpollSource;
+
+struct _NiceEpollWatch {
+  volatile gint ref_count;
+  volatile gint destroyed;
+  EpollSource *source;  /* owned */
+  GSocket *socket;  /* owned */
+  GSocketSourceFunc callback;
+  gpointer user_data;
+  GDestroyNotify notify;
+};
+
+/* Protects @sources. Taken before the lock of an EpollSource. */
+static GMutex sources_mutex;
+static GHashTable *sources = NULL;  /* GMainContext → unowned EpollSource */
+
+/* The watch being dispatched by this thread, if any. */
+static GPrivate current_watch = G_PRIVATE_INIT (NULL);
+
+static gboolean
+epoll_source_prepare (GSource *source, gint *timeout)
+{
+  *timeout = -1;
+
+  return FALSE;
+}
+
+static gboolean
+epoll_source_check (GSource *source)
+{
+  EpollSource *esource = (EpollSource *) source;
+
+  return (esource->pollfd.revents & G_IO_IN) != 0;
+}
+
+static gboolean
+epoll_source_dispatch (GSource *source, GSourceFunc callback,
+    gpointer user_data)
+{
+  EpollSource *esource = (EpollSource *) source;
+  struct epoll_event events[MAX_EVENTS];
+  NiceEpollWatch *watches[MAX_EVENTS];
+  gint n_events, i;
+
+  /* Reference the ready watches while the lock stops them being
+   * unregistered, so they survive being destroyed by another thread until
+   * dispatched. */
+  g_mutex_lock (&esource->mutex);
+
+  do {
+    n_events = epoll_wait (esource->pollfd.fd, events, MAX_EVENTS, 0);
+  } while (n_events < 0 && errno == EINTR);
+
+  for (i = 0; i < n_events; i++) {
+    watches[i] = events[i].data.ptr;
+    g_atomic_int_inc (&watches[i]->ref_count);
+  }
+
+  g_mutex_unlock (&esource->mutex);
+
+  for (i = 0; i < n_events; i++) {
+    NiceEpollWatch *watch = watches[i];
+    GIOCondition condition = 0;
+
+    if (events[i].events & EPOLLIN)
+      condition |= G_IO_IN;
+    if (events[i].events & EPOLLOUT)
+      condition |= G_IO_OUT;
+    if (events[i].events & EPOLLERR)
+      condition |= G_IO_ERR;
+    if (events[i].events & EPOLLHUP)
+      condition |= G_IO_HUP;
+
+    if (!nice_epoll_watch_is_destroyed (watch)) {
+      NiceEpollWatch *prev_watch = g_private_get (&current_watch);
+
+      g_private_set (&current_watch, watch);
+      if (!watch->callback (watch->socket, condition, watch->user_data))
+        nice_epoll_watch_destroy (watch);
+      g_private_set (&current_watch, prev_watch);
+    }
+
+    nice_epoll_watch_unref (watch);
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+epoll_source_finalize (GSource *source)
+{
+  EpollSource *esource = (EpollSource *) source;
+
+  close (esource->pollfd.fd);
+  g_mutex_clear (&esource->mutex);
+}
+
+static GSourceFuncs epoll_source_funcs = {
+  epoll_source_prepare,
+  epoll_source_check,
+  epoll_source_dispatch,
+  epoll_source_finalize,
+  NULL,
+  NULL
+};
+
+/* Must be called with @sources_mutex held. */
+static EpollSource *
+epoll_source_get (GMainContext *context)
+{
+  EpollSource *esource;
+  gint fd;
+
+  if (sources == NULL)
+    sources = g_hash_table_new (NULL, NULL);
+
+  esource = g_hash_table_lookup (sources, context);
+  if (esource != NULL)
+    return esource;
+
+  fd = epoll_create1 (EPOLL_CLOEXEC);
+  if (fd < 0) {
+    nice_debug ("Failed to create an epoll file descriptor: %s",
+        g_strerror (errno));
+    return NULL;
+  }
+
+  /* The initial reference is dropped when the last watch is destroyed. */
+  esource = (EpollSource *) g_source_new (&epoll_source_funcs,
+      sizeof (EpollSource));
+  g_source_set_name ((GSource *) esource, "libnice epoll source");
+  g_mutex_init (&esource->mutex);
+  esource->pollfd.fd = fd;
+  esource->pollfd.events = G_IO_IN;
+  g_source_add_poll ((GSource *) esource, &esource->pollfd);
+  esource->context = context;
+  g_source_attach ((GSource *) esource, context);
+
+  g_hash_table_insert (sources, context, esource);
+
+  return esource;
+}
+
+/* Removes @esource once its last watch is gone. The caller must hold a
+ * reference on it, and none of the locks. */
+static void
+epoll_source_remove_if_unused (EpollSource *esource)
+{
+  gboolean unused;
+
+  g_mutex_lock (&sources_mutex);
+  g_mutex_lock (&esource->mutex);
+
+  /* A new watch may have been added meanwhile, or another thread may have
+   * removed the source already. */
+  unused = (esource->n_watches == 0 &&
+      g_hash_table_lookup (sources, esource->context) == esource);
+  if (unused)
+    g_hash_table_remove (sources, esource->context);
+
+  g_mutex_unlock (&esource->mutex);
+  g_mutex_unlock (&sources_mutex);
+
+  if (unused) {
+    g_source_destroy ((GSource *) esource);
+    g_source_unref ((GSource *) esource);
+  }
+}
+
+/* Register @socket with the epoll source of @context, so that @callback is
+ * invoked whenever @condition is met, as for g_socket_create_source(). @notify
+ * is called on @user_data once the watch is destroyed and no longer being
+ * dispatched. Returns %NULL if epoll can’t be used, in which case @notify
+ * isn’t called and the caller should fall back to a #GSocket source. */
+NiceEpollWatch *
+nice_epoll_watch_new (GMainContext *context, GSocket *socket,
+    GIOCondition condition, GSocketSourceFunc callback, gpointer user_data,
+    GDestroyNotify notify)
+{
+  EpollSource *esource;
+  NiceEpollWatch *watch;
+  struct epoll_event event;
+
+  if (context == NULL)
+    context = g_main_context_default ();
+
+  g_mutex_lock (&sources_mutex);
+
+  esource = epoll_source_get (context);
+  if (esource == NULL) {
+    g_mutex_unlock (&sources_mutex);
+    return NULL;
+  }
+
+  /* Count the watch before letting go of @sources_mutex, so that the source
+   * isn’t removed from under it. */
+  g_source_ref ((GSource *) esource);
+  g_mutex_lock (&esource->mutex);
+  esource->n_watches++;
+
+  g_mutex_unlock (&sources_mutex);
+
+  memset (&event, 0, sizeof (event));
+  if (condition & G_IO_IN)
+    event.events |= EPOLLIN;
+  if (condition & G_IO_OUT)
+    event.events |= EPOLLOUT;
+
+  watch = g_slice_new0 (NiceEpollWatch);
+  event.data.ptr = watch;
+
+  if (epoll_ctl (esource->pollfd.fd, EPOLL_CTL_ADD, g_socket_get_fd (socket),
+          &event) < 0) {
+    nice_debug ("Failed to add socket %p to epoll source %p: %s", socket,
+        esource, g_strerror (errno));
+    g_slice_free (NiceEpollWatch, watch);
+    esource->n_watches--;
+    g_mutex_unlock (&esource->mutex);
+    epoll_source_remove_if_unused (esource);
+    g_source_unref ((GSource *) esource);
+    return NULL;
+  }
+
+  /* One reference for the caller, and one for the epoll set. The watch owns
+   * the reference on the source taken above. */
+  watch->ref_count = 2;
+  watch->source = esource;
+  watch->socket = g_object_ref (socket);
+  watch->callback = callback;
+  watch->user_data = user_data;
+  watch->notify = notify;
+
+  g_mutex_unlock (&esource->mutex);
+
+  return watch;
+}
+
+/* Stop dispatching @watch. Its callback may still be running in the thread
+ * which owns the context, so callbacks must check
+ * nice_epoll_watch_is_destroyed() once they have taken their locks, as they
+ * would check g_source_is_destroyed(). This may be called more than once. */
+void
+nice_epoll_watch_destroy (NiceEpollWatch *watch)
+{
+  EpollSource *esource = watch->source;
+  gboolean unregistered = FALSE;
+  gboolean unused = FALSE;
+
+  g_mutex_lock (&esource->mutex);
+
+  if (!g_atomic_int_get (&watch->destroyed)) {
+    g_atomic_int_set (&watch->destroyed, TRUE);
+
+    epoll_ctl (esource->pollfd.fd, EPOLL_CTL_DEL,
+        g_socket_get_fd (watch->socket), NULL);
+
+    esource->n_watches--;
+    unused = (esource->n_watches == 0);
+    unregistered = TRUE;
+  }
+
+  g_mutex_unlock (&esource->mutex);
+
+  /* The caller’s reference on @watch keeps @esource alive until here. */
+  if (unused)
+    epoll_source_remove_if_unused (esource);
+
+  /* Drop the epoll set’s reference. */
+  if (unregistered)
+    nice_epoll_watch_unref (watch);
+}
+
+gboolean
+nice_epoll_watch_is_destroyed (NiceEpollWatch *watch)
+{
+  return g_atomic_int_get (&watch->destroyed);
+}
+
+void
+nice_epoll_watch_unref (NiceEpollWatch *watch)
+{
+  if (!g_atomic_int_dec_and_test (&watch->ref_count))
+    return;
+
+  if (watch->notify != NULL)
+    watch->notify (watch->user_data);
+  g_object_unref (watch->socket);
+  g_source_unref ((GSource *) watch->source);
+  g_slice_free (NiceEpollWatch, watch);
+}
+
+/* The watch whose callback is being dispatched, if the current source is an
+ * epoll source. */
+NiceEpollWatch *
+nice_epoll_watch_get_current (void)
+{
+  NiceEpollWatch *watch = g_private_get (&current_watch);
+
+  /* Ignore it while a callback dispatches some other source itself. */
+  if (watch != NULL && g_main_current_source () != (GSource *) watch->source)
+    return NULL;
+
+  return watch;
+}
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+NiceEpollWatch *
+nice_epoll_watch_new (GMainContext *context, GSocket *socket,
+    GIOCondition condition, GSocketSourceFunc callback, gpointer user_data,
+    GDestroyNotify notify)
+{
+  return NULL;
+}
+
+void
+nice_epoll_watch_destroy (NiceEpollWatch *watch)
+{
+  g_return_if_reached ();
+}
+
+gboolean
+nice_epoll_watch_is_destroyed (NiceEpollWatch *watch)
+{
+  g_return_val_if_reached (TRUE);
+}
+
+void
+nice_epoll_watch_unref (NiceEpollWatch *watch)
+{
+  g_return_if_reached ();
+}
+
+NiceEpollWatch *
+nice_epoll_watch_get_current (void)
+{
+  return NULL;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
@@ -0,0 +1,63 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifndef __NICE_EPOLL_SOURCE_H__
+#define __NICE_EPOLL_SOURCE_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* A registration of a socket with the epoll source of a #GMainContext. All the
+ * sockets registered with a context are polled through one epoll file
+ * descriptor, watched by a single GSource, so the cost of a main loop wakeup
+ * depends on the number of ready sockets rather than the total number.
+ *
+ * @callback is invoked from the epoll source, so g_main_current_source()
+ * doesn’t identify the watch: use nice_epoll_watch_get_current() instead. */
+typedef struct _NiceEpollWatch NiceEpollWatch;
+
+NiceEpollWatch *
+nice_epoll_watch_new (GMainContext *context, GSocket *socket,
+    GIOCondition condition, GSocketSourceFunc callback, gpointer user_data,
+    GDestroyNotify notify);
+void
+nice_epoll_watch_destroy (NiceEpollWatch *watch);
+gboolean
+nice_epoll_watch_is_destroyed (NiceEpollWatch *watch);
+void
+nice_epoll_watch_unref (NiceEpollWatch *watch);
+
+NiceEpollWatch *
+nice_epoll_watch_get_current (void);
+
+G_END_DECLS
+
+#endif /* __NICE_EPOLL_SOURCE_H__ */
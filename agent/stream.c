@@ -91,6 +91,8 @@ stream_free (Stream *stream)
 {
   g_free (stream->name);
   g_slist_free_full (stream->components, (GDestroyNotify) component_free);
+  if (stream->context != NULL)
+    g_main_context_unref (stream->context);
   g_slice_free (Stream, stream);
 
   g_atomic_int_inc (&n_streams_destroyed);
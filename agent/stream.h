@@ -74,6 +74,8 @@ struct _Stream
   gboolean gathering;
   gboolean gathering_started;
   gint tos;
+  GMainContext *context; /* owned; context of the agent worker the stream is
+                          * assigned to, or NULL if there are none */
 };
 
 
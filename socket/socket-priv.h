@@ -113,6 +113,82 @@ gboolean nice_socket_flush_send_queue_to_socket (GSocket *gsock,
  */
 void nice_socket_free_send_queue (GQueue *send_queue);
 
+/**
+ * NiceStreamFrameLengthFunc:
+ * @buf: The bytes at the start of the stream
+ * @len: Number of bytes in @buf
+ * @user_data: User data passed to nice_stream_deframer_recv_message()
+ *
+ * Works out the length of the frame at the start of a stream from its header.
+ *
+ * Returns: The length of the frame, header included, 0 if @buf is too short
+ * to tell, or -1 if the stream is corrupt
+ */
+typedef gssize (*NiceStreamFrameLengthFunc) (const guint8 *buf, gsize len,
+    gpointer user_data);
+
+/**
+ * NiceStreamDeframer:
+ * @buf: Bytes received from the stream and not yet returned
+ * @size: Size of @buf, which bounds the length of a frame
+ * @start: Offset in @buf of the first byte not yet returned
+ * @end: Offset in @buf after the last byte received
+ * @frame_remaining: Number of bytes of the frame at @start not yet returned,
+ * or 0 if no frame has been started
+ * @from: Address the bytes were last received from
+ *
+ * Splits a byte stream into frames, such as RFC 4571 framed packets. The
+ * stream is read in chunks as big as the buffer allows, so that a single
+ * receive can yield several frames. A frame which doesn't fit in the message
+ * it is received into is continued in the next one.
+ */
+typedef struct {
+  guint8 *buf;
+  gsize size;
+  gsize start;
+  gsize end;
+  gsize frame_remaining;
+  NiceAddress from;
+} NiceStreamDeframer;
+
+/**
+ * nice_stream_deframer_init:
+ * @deframer: The deframer to initialise
+ * @size: The size of the longest frame
+ *
+ * Initialises @deframer, allocating its buffer.
+ */
+void nice_stream_deframer_init (NiceStreamDeframer *deframer, gsize size);
+
+/**
+ * nice_stream_deframer_clear:
+ * @deframer: The deframer to clear
+ *
+ * Frees the buffer of @deframer, dropping any bytes still in it.
+ */
+void nice_stream_deframer_clear (NiceStreamDeframer *deframer);
+
+/**
+ * nice_stream_deframer_recv_message:
+ * @deframer: The deframer
+ * @base_socket: The stream socket to receive from
+ * @frame_length: Function working out the length of a frame
+ * @user_data: User data for @frame_length
+ * @header_len: Number of bytes at the start of each frame not to return
+ * @message: The message to receive into
+ *
+ * Receives the next frame of the stream, less its first @header_len bytes,
+ * into @message. @base_socket is only read from if no complete frame is
+ * buffered already. If the frame doesn't fit in @message, the rest of it is
+ * returned by the next call.
+ *
+ * Returns: 1 if a frame, or part of one, was received, 0 if the socket would
+ * block before a frame is complete, or -1 on error
+ */
+gint nice_stream_deframer_recv_message (NiceStreamDeframer *deframer,
+    NiceSocket *base_socket, NiceStreamFrameLengthFunc frame_length,
+    gpointer user_data, gsize header_len, NiceInputMessage *message);
+
 G_END_DECLS
 
 #endif /* _SOCKET_PRIV_H */
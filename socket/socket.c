@@ -265,6 +265,15 @@ nice_socket_set_writable_callback (NiceSocket *sock,
     sock->set_writable_callback (sock, callback, user_data);
 }
 
+GSource *
+nice_socket_create_source (NiceSocket *sock)
+{
+  if (sock->create_source)
+    return sock->create_source (sock);
+
+  return g_socket_create_source (sock->fileno, G_IO_IN, NULL);
+}
+
 void
 nice_socket_free (NiceSocket *sock)
 {
@@ -445,3 +454,114 @@ nice_socket_free_send_queue (GQueue *send_queue)
   g_queue_foreach (send_queue, (GFunc) nice_socket_free_queued_send, NULL);
   g_queue_clear (send_queue);
 }
+
+void
+nice_stream_deframer_init (NiceStreamDeframer *deframer, gsize size)
+{
+  deframer->buf = g_malloc (size);
+  deframer->size = size;
+  deframer->start = 0;
+  deframer->end = 0;
+  deframer->frame_remaining = 0;
+  nice_address_init (&deframer->from);
+}
+
+void
+nice_stream_deframer_clear (NiceStreamDeframer *deframer)
+{
+  g_free (deframer->buf);
+  deframer->buf = NULL;
+  deframer->size = 0;
+  deframer->start = 0;
+  deframer->end = 0;
+  deframer->frame_remaining = 0;
+}
+
+/* Buffers the next complete frame at deframer->start, receiving from
+ * @base_socket if needed. Returns its length, 0 if the socket would block or
+ * -1 on error. */
+static gssize
+nice_stream_deframer_fill (NiceStreamDeframer *deframer,
+    NiceSocket *base_socket, NiceStreamFrameLengthFunc frame_length,
+    gpointer user_data)
+{
+  while (TRUE) {
+    gsize buffered = deframer->end - deframer->start;
+    GInputVector local_buf;
+    NiceInputMessage local_message;
+    gssize len;
+    gint ret;
+
+    len = frame_length (deframer->buf + deframer->start, buffered, user_data);
+    if (len < 0 || (gsize) len > deframer->size)
+      return -1;
+
+    if (len > 0 && (gsize) len <= buffered)
+      return len;
+
+    /* Move the start of the incomplete frame to the front of the buffer,
+     * to make room for the rest of it */
+    if (deframer->start > 0) {
+      memmove (deframer->buf, deframer->buf + deframer->start, buffered);
+      deframer->start = 0;
+      deframer->end = buffered;
+    }
+
+    if (deframer->end == deframer->size)
+      return -1;
+
+    local_buf.buffer = deframer->buf + deframer->end;
+    local_buf.size = deframer->size - deframer->end;
+    local_message.buffers = &local_buf;
+    local_message.n_buffers = 1;
+    local_message.from = &deframer->from;
+    local_message.length = 0;
+
+    ret = nice_socket_recv_messages (base_socket, &local_message, 1);
+    if (ret <= 0)
+      return ret;
+
+    deframer->end += local_message.length;
+  }
+}
+
+gint
+nice_stream_deframer_recv_message (NiceStreamDeframer *deframer,
+    NiceSocket *base_socket, NiceStreamFrameLengthFunc frame_length,
+    gpointer user_data, gsize header_len, NiceInputMessage *message)
+{
+  guint i;
+
+  if (deframer->frame_remaining == 0) {
+    gssize len;
+
+    len = nice_stream_deframer_fill (deframer, base_socket, frame_length,
+        user_data);
+    if (len <= 0)
+      return len;
+
+    header_len = MIN (header_len, (gsize) len);
+    deframer->start += header_len;
+    deframer->frame_remaining = len - header_len;
+  }
+
+  message->length = 0;
+
+  for (i = 0;
+       deframer->frame_remaining > 0 &&
+       ((message->n_buffers >= 0 && i < (guint) message->n_buffers) ||
+        (message->n_buffers < 0 && message->buffers[i].buffer != NULL));
+       i++) {
+    gsize len = MIN (deframer->frame_remaining, message->buffers[i].size);
+
+    memcpy (message->buffers[i].buffer, deframer->buf + deframer->start, len);
+    message->length += len;
+    deframer->start += len;
+    deframer->frame_remaining -= len;
+  }
+
+  if (message->from != NULL)
+    *message->from = deframer->from;
+
+  return 1;
+}
@@ -65,7 +65,8 @@ typedef enum {
   NICE_SOCKET_TYPE_UDP_TURN_OVER_TCP,
   NICE_SOCKET_TYPE_TCP_ACTIVE,
   NICE_SOCKET_TYPE_TCP_PASSIVE,
-  NICE_SOCKET_TYPE_TCP_SO
+  NICE_SOCKET_TYPE_TCP_SO,
+  NICE_SOCKET_TYPE_UDP_URING
 } NiceSocketType;
 
 typedef void (*NiceSocketWritableCb) (NiceSocket *sock, gpointer user_data);
@@ -88,6 +89,8 @@ struct _NiceSocket
   gboolean (*can_send) (NiceSocket *sock, NiceAddress *addr);
   void (*set_writable_callback) (NiceSocket *sock,
       NiceSocketWritableCb callback, gpointer user_data);
+  /* May be %NULL, in which case a #GSocket source on @fileno is used. */
+  GSource * (*create_source) (NiceSocket *sock);
   void (*close) (NiceSocket *sock);
   void *priv;
 };
@@ -124,6 +127,11 @@ void
 nice_socket_set_writable_callback (NiceSocket *sock,
     NiceSocketWritableCb callback, gpointer user_data);
 
+/* Create a source which is dispatched when @sock may have messages to
+ * receive. Its callback is a #GSocketSourceFunc, passed @sock->fileno. */
+GSource *
+nice_socket_create_source (NiceSocket *sock);
+
 void
 nice_socket_free (NiceSocket *sock);
 
@@ -136,6 +144,7 @@ nice_socket_free (NiceSocket *sock);
 #include "http.h"
 #include "udp-turn.h"
 #include "udp-turn-over-tcp.h"
+#include "udp-uring.h"
 
 G_END_DECLS
 
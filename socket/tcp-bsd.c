@@ -55,6 +55,16 @@
 #endif
 
 typedef struct {
+  /* Protects the send queue against socket_send_more(), which may be
+   * dispatched in a thread other than the one owning the socket. Held across
+   * the non-blocking send, so a partial write is queued before anything else
+   * reaches the stream. Always taken after the agent lock. */
+  GMutex mutex;
+  /* One reference is held by the socket and one by @io_source, so
+   * socket_send_more() can still check whether it was destroyed after the
+   * socket is closed. */
+  volatile gint ref_count;
+  NiceSocket *sock;
   NiceAddress remote_addr;
   GQueue send_queue;
   GMainContext *context;
@@ -82,6 +92,25 @@ static void socket_set_writable_callback (NiceSocket *sock,
 static gboolean socket_send_more (GSocket *gsocket, GIOCondition condition,
     gpointer data);
 
+static TcpPriv *
+priv_ref (TcpPriv *priv)
+{
+  g_atomic_int_inc (&priv->ref_count);
+
+  return priv;
+}
+
+static void
+priv_unref (gpointer data)
+{
+  TcpPriv *priv = data;
+
+  if (g_atomic_int_dec_and_test (&priv->ref_count)) {
+    g_mutex_clear (&priv->mutex);
+    g_slice_free (TcpPriv, priv);
+  }
+}
+
 NiceSocket *
 nice_tcp_bsd_socket_new_from_gsock (GMainContext *ctx, GSocket *gsock,
     NiceAddress *local_addr, NiceAddress *remote_addr, gboolean reliable)
@@ -93,6 +122,9 @@ nice_tcp_bsd_socket_new_from_gsock (GMainContext *ctx, GSocket *gsock,
 
   sock = g_slice_new0 (NiceSocket);
   sock->priv = priv = g_slice_new0 (TcpPriv);
+  g_mutex_init (&priv->mutex);
+  priv->ref_count = 1;
+  priv->sock = sock;
 
   if (ctx == NULL)
     ctx = g_main_context_default ();
@@ -199,11 +231,34 @@ nice_tcp_bsd_socket_new (GMainContext *ctx, NiceAddress *local_addr,
 }
 
 
+/* Queues what is left of @message, and watches the socket until it has been
+ * flushed. Must be called with the lock held. */
+static void
+priv_queue_send (TcpPriv *priv, const NiceOutputMessage *message,
+    gsize message_offset, gsize message_len, gboolean head)
+{
+  if (message_offset >= message_len)
+    return;
+
+  if (priv->io_source == NULL) {
+    priv->io_source = g_socket_create_source (priv->sock->fileno, G_IO_OUT,
+        NULL);
+    g_source_set_callback (priv->io_source, (GSourceFunc) socket_send_more,
+        priv_ref (priv), priv_unref);
+    g_source_attach (priv->io_source, priv->context);
+  }
+
+  nice_socket_queue_send_with_callback (&priv->send_queue, message,
+      message_offset, message_len, head, NULL, NULL, NULL, NULL, NULL);
+}
+
 static void
 socket_close (NiceSocket *sock)
 {
   TcpPriv *priv = sock->priv;
 
+  g_mutex_lock (&priv->mutex);
+
   if (sock->fileno) {
     g_socket_close (sock->fileno, NULL);
     g_object_unref (sock->fileno);
@@ -219,7 +274,12 @@ socket_close (NiceSocket *sock)
   if (priv->context)
     g_main_context_unref (priv->context);
 
-  g_slice_free(TcpPriv, sock->priv);
+  priv->sock = NULL;
+  sock->priv = NULL;
+
+  g_mutex_unlock (&priv->mutex);
+
+  priv_unref (priv);
 }
 
 static gint
@@ -294,6 +354,8 @@ socket_send_message (NiceSocket *sock,
 
   message_len = output_message_get_size (message);
 
+  g_mutex_lock (&priv->mutex);
+
   /* First try to send the data, don't send it later if it can be sent now
    * this way we avoid allocating memory on every send */
   if (g_queue_is_empty (&priv->send_queue)) {
@@ -304,27 +366,21 @@ socket_send_message (NiceSocket *sock,
       if (g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK) ||
           g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_FAILED)) {
         /* Queue the message and send it later. */
-        nice_socket_queue_send_with_callback (&priv->send_queue,
-            message, 0, message_len, FALSE, sock->fileno, &priv->io_source,
-            priv->context, (GSourceFunc) socket_send_more, sock);
+        priv_queue_send (priv, message, 0, message_len, FALSE);
         ret = message_len;
       }
 
       g_error_free (gerr);
     } else if ((gsize) ret < message_len) {
       /* Partial send. */
-      nice_socket_queue_send_with_callback (&priv->send_queue,
-          message, ret, message_len, TRUE, sock->fileno, &priv->io_source,
-          priv->context, (GSourceFunc) socket_send_more, sock);
+      priv_queue_send (priv, message, ret, message_len, TRUE);
       ret = message_len;
     }
   } else {
     /* Only queue if we're sending reliably  */
     if (reliable) {
       /* Queue the message and send it later. */
-      nice_socket_queue_send_with_callback (&priv->send_queue,
-          message, 0, message_len, FALSE, sock->fileno, &priv->io_source,
-          priv->context, (GSourceFunc) socket_send_more, sock);
+      priv_queue_send (priv, message, 0, message_len, FALSE);
       ret = message_len;
     } else {
       /* non reliable send, so we shouldn't queue the message */
@@ -332,6 +388,8 @@ socket_send_message (NiceSocket *sock,
     }
   }
 
+  g_mutex_unlock (&priv->mutex);
+
   return ret;
 }
 
@@ -416,18 +474,22 @@ socket_send_more (
   GIOCondition condition,
   gpointer data)
 {
-  NiceSocket *sock = (NiceSocket *) data;
-  TcpPriv *priv = sock->priv;
+  TcpPriv *priv = data;
+  NiceSocket *sock;
+  NiceSocketWritableCb writable_cb;
+  gpointer writable_data;
 
-  agent_lock ();
+  g_mutex_lock (&priv->mutex);
 
   if (g_source_is_destroyed (g_main_current_source ())) {
     nice_debug ("Source was destroyed. "
         "Avoided race condition in tcp-bsd.c:socket_send_more");
-    agent_unlock ();
+    g_mutex_unlock (&priv->mutex);
     return FALSE;
   }
 
+  sock = priv->sock;
+
   /* connection hangs up or queue was emptied */
   if (condition & G_IO_HUP ||
       nice_socket_flush_send_queue_to_socket (sock->fileno,
@@ -436,14 +498,18 @@ socket_send_more (
     g_source_unref (priv->io_source);
     priv->io_source = NULL;
 
-    agent_unlock ();
+    writable_cb = priv->writable_cb;
+    writable_data = priv->writable_data;
+
+    g_mutex_unlock (&priv->mutex);
 
-    if (priv->writable_cb)
-      priv->writable_cb (sock, priv->writable_data);
+    /* Called unlocked, as it takes the agent lock. */
+    if (writable_cb)
+      writable_cb (sock, writable_data);
 
     return FALSE;
   }
 
-  agent_unlock ();
+  g_mutex_unlock (&priv->mutex);
   return TRUE;
 }
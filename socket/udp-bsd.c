@@ -50,11 +50,16 @@
 #include <fcntl.h>
 
 #include "udp-bsd.h"
+#include "agent-priv.h"
 
 #ifndef G_OS_WIN32
 #include <unistd.h>
 #endif
 
+#ifdef HAVE_NETINET_UDP_H
+#include <netinet/udp.h>
+#endif
+
 
 static void socket_close (NiceSocket *sock);
 static gint socket_recv_messages (NiceSocket *sock,
@@ -67,13 +72,54 @@ static gboolean socket_is_reliable (NiceSocket *sock);
 static gboolean socket_can_send (NiceSocket *sock, NiceAddress *addr);
 static void socket_set_writable_callback (NiceSocket *sock,
     NiceSocketWritableCb callback, gpointer user_data);
+#ifdef UDP_GRO
+static gint socket_next_gro_segment (NiceSocket *sock, GInputVector *segment,
+    NiceAddress *from);
+#endif
 
 struct UdpBsdSocketPrivate
 {
+  /* Last destination, cached for g_socket_send_message() on Windows. */
   NiceAddress niceaddr;
   GSocketAddress *gaddr;
+
+  /* Whether to use UDP GSO, and the largest segment size it has been seen to
+   * work with. Sends don’t need the agent lock, so these are only accessed
+   * atomically. */
+  volatile gint gso_enabled;
+  volatile gint gso_max_segment_size;
+
+  /* With UDP GRO, the kernel may return several coalesced datagrams at once.
+   * They are received into @gro_buf and handed out one segment at a time,
+   * either copied into the caller’s messages or pointing into @gro_buf, so
+   * segments which haven’t been handed out yet wait here at @gro_offset. */
+  gboolean gro_enabled;
+  guint8 *gro_buf;
+  gsize gro_len;
+  gsize gro_offset;
+  gsize gro_segment_size;
+  NiceAddress gro_from;
 };
 
+#ifdef G_OS_WIN32
+/* Protects the last destination cache of all sockets. */
+static GMutex gaddr_mutex;
+#endif
+
+/* Maximum number of datagrams passed to a single recvmmsg() or sendmmsg()
+ * call, and the maximum number of buffers per message which can be passed to
+ * the kernel without falling back to the GSocket API. */
+#define UDP_BSD_BATCH_SIZE 32
+#define UDP_BSD_MAX_IOVECS 8
+
+/* Limits on the datagrams the kernel is asked to segment with UDP GSO: the
+ * kernel’s UDP_MAX_SEGMENTS, and the largest UDP payload over IPv6. */
+#define UDP_BSD_GSO_MAX_SEGMENTS 64
+#define UDP_BSD_GSO_MAX_BYTES (65535 - 8 - 40)
+
+/* Size of the buffer coalesced datagrams are received into with UDP GRO. */
+#define UDP_BSD_GRO_BUF_SIZE 65536
+
 NiceSocket *
 nice_udp_bsd_socket_new (NiceAddress *addr)
 {
@@ -159,6 +205,102 @@ nice_udp_bsd_socket_new (NiceAddress *addr)
   return sock;
 }
 
+gboolean
+nice_udp_bsd_socket_set_gso (NiceSocket *sock, gboolean enabled)
+{
+  struct UdpBsdSocketPrivate *priv;
+
+  if (sock->type != NICE_SOCKET_TYPE_UDP_BSD || sock->priv == NULL)
+    return FALSE;
+
+  priv = sock->priv;
+  g_atomic_int_set (&priv->gso_enabled, FALSE);
+
+#if defined (HAVE_SENDMMSG) && defined (UDP_SEGMENT)
+  if (enabled) {
+    gint segment_size = 0;
+
+    /* Check the kernel knows about UDP_SEGMENT. A zero size leaves sends
+     * without the control message unsegmented. */
+    if (setsockopt (g_socket_get_fd (sock->fileno), IPPROTO_UDP, UDP_SEGMENT,
+            &segment_size, sizeof (segment_size)) == 0) {
+      g_atomic_int_set (&priv->gso_max_segment_size, G_MAXUINT16);
+      g_atomic_int_set (&priv->gso_enabled, TRUE);
+    } else {
+      nice_debug ("UDP socket %p: GSO not supported (%s)", sock,
+          g_strerror (errno));
+    }
+  }
+#endif
+
+  return g_atomic_int_get (&priv->gso_enabled);
+}
+
+gboolean
+nice_udp_bsd_socket_set_gro (NiceSocket *sock, gboolean enabled)
+{
+  struct UdpBsdSocketPrivate *priv;
+
+  if (sock->type != NICE_SOCKET_TYPE_UDP_BSD || sock->priv == NULL)
+    return FALSE;
+
+  priv = sock->priv;
+
+#ifdef UDP_GRO
+  if (priv->gro_enabled != enabled) {
+    gint val = enabled;
+
+    if (setsockopt (g_socket_get_fd (sock->fileno), IPPROTO_UDP, UDP_GRO,
+            &val, sizeof (val)) < 0) {
+      nice_debug ("UDP socket %p: could not %s GRO (%s)", sock,
+          enabled ? "enable" : "disable", g_strerror (errno));
+    } else {
+      priv->gro_enabled = enabled;
+
+      /* Any pending segments are still handed out after GRO has been turned
+       * off, and the buffer freed by the next read after them, as the last
+       * segment handed out in place may still be in use. */
+      if (enabled && priv->gro_buf == NULL) {
+        priv->gro_buf = g_malloc (UDP_BSD_GRO_BUF_SIZE);
+        priv->gro_len = priv->gro_offset = 0;
+      }
+    }
+  }
+#endif
+
+  return priv->gro_enabled;
+}
+
+gboolean
+nice_udp_bsd_socket_uses_gro (NiceSocket *sock)
+{
+  struct UdpBsdSocketPrivate *priv = sock->priv;
+
+  return (sock->type == NICE_SOCKET_TYPE_UDP_BSD && priv != NULL &&
+      priv->gro_buf != NULL);
+}
+
+gint
+nice_udp_bsd_socket_recv_gro_segment (NiceSocket *sock, GInputVector *segment,
+    NiceAddress *from)
+{
+#ifdef UDP_GRO
+  if (nice_udp_bsd_socket_uses_gro (sock))
+    return socket_next_gro_segment (sock, segment, from);
+#endif
+
+  return 0;
+}
+
+gboolean
+nice_udp_bsd_socket_has_gro_pending (NiceSocket *sock)
+{
+  struct UdpBsdSocketPrivate *priv = sock->priv;
+
+  return (sock->type == NICE_SOCKET_TYPE_UDP_BSD && priv != NULL &&
+      priv->gro_offset < priv->gro_len);
+}
+
 static void
 socket_close (NiceSocket *sock)
 {
@@ -166,6 +308,7 @@ socket_close (NiceSocket *sock)
 
   if (priv->gaddr)
     g_object_unref (priv->gaddr);
+  g_free (priv->gro_buf);
   g_slice_free (struct UdpBsdSocketPrivate, sock->priv);
   sock->priv = NULL;
 
@@ -176,6 +319,370 @@ socket_close (NiceSocket *sock)
   }
 }
 
+#ifndef G_OS_WIN32
+/* Fill @sa in from @addr, returning the length of the resulting address. */
+static socklen_t
+sockaddr_len_from_address (const NiceAddress *addr, struct sockaddr *sa)
+{
+  nice_address_copy_to_sockaddr (addr, sa);
+
+  return (sa->sa_family == AF_INET6) ?
+      sizeof (struct sockaddr_in6) : sizeof (struct sockaddr_in);
+}
+#endif
+
+#ifdef HAVE_RECVMMSG
+/* Fill @hdr in to receive into @message, with the iovec array @iov. Returns
+ * %FALSE if the message has too many buffers to be received by recvmmsg(). */
+static gboolean
+input_message_to_msghdr (NiceInputMessage *message, struct msghdr *hdr,
+    struct iovec *iov, struct sockaddr_storage *addr)
+{
+  guint i;
+
+  for (i = 0;
+       (message->n_buffers >= 0 && i < (guint) message->n_buffers) ||
+       (message->n_buffers < 0 && message->buffers[i].buffer != NULL);
+       i++) {
+    if (i == UDP_BSD_MAX_IOVECS)
+      return FALSE;
+
+    iov[i].iov_base = message->buffers[i].buffer;
+    iov[i].iov_len = message->buffers[i].size;
+  }
+
+  memset (hdr, 0, sizeof (*hdr));
+  hdr->msg_name = addr;
+  hdr->msg_namelen = sizeof (*addr);
+  hdr->msg_iov = iov;
+  hdr->msg_iovlen = i;
+
+  return TRUE;
+}
+
+/* Receive up to @n_recv_messages datagrams using as few recvmmsg() calls as
+ * possible. Returns the number of valid messages, 0 if the socket would block
+ * and -1 on error; as for socket_recv_messages(). */
+static gint
+socket_recv_messages_mmsg (NiceSocket *sock,
+    NiceInputMessage *recv_messages, guint n_recv_messages)
+{
+  struct mmsghdr hdrs[UDP_BSD_BATCH_SIZE];
+  struct iovec iovs[UDP_BSD_BATCH_SIZE][UDP_BSD_MAX_IOVECS];
+  struct sockaddr_storage addrs[UDP_BSD_BATCH_SIZE];
+  gint fd = g_socket_get_fd (sock->fileno);
+  guint n_valid = 0;
+  gboolean error = FALSE;
+
+  while (n_valid < n_recv_messages) {
+    guint n_batch, i, j;
+    gint ret;
+
+    /* Prepare as many headers as possible, starting from the first message
+     * not yet received into. */
+    for (n_batch = 0;
+         n_batch < UDP_BSD_BATCH_SIZE &&
+         n_valid + n_batch < n_recv_messages;
+         n_batch++) {
+      if (!input_message_to_msghdr (&recv_messages[n_valid + n_batch],
+              &hdrs[n_batch].msg_hdr, iovs[n_batch], &addrs[n_batch]))
+        break;
+      hdrs[n_batch].msg_len = 0;
+    }
+
+    /* A message with too many buffers; let the caller handle it with the slow
+     * path on the next call. */
+    if (n_batch == 0)
+      break;
+
+    do {
+      ret = recvmmsg (fd, hdrs, n_batch, MSG_DONTWAIT, NULL);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        error = TRUE;
+      break;
+    }
+
+    /* Fill in the messages, dropping empty datagrams and compacting the
+     * array over them. */
+    for (i = 0, j = n_valid; i < (guint) ret; i++) {
+      NiceInputMessage *recv_message = &recv_messages[n_valid + i];
+
+      if (hdrs[i].msg_len == 0)
+        continue;
+
+      recv_message->length = hdrs[i].msg_len;
+      if (recv_message->from != NULL)
+        nice_address_set_from_sockaddr (recv_message->from,
+            (struct sockaddr *) &addrs[i]);
+
+      if (j != n_valid + i)
+        move_input_message (&recv_messages[j], recv_message);
+      j++;
+    }
+
+    n_valid = j;
+
+    /* Drained the socket receive queue. */
+    if ((guint) ret < n_batch)
+      break;
+  }
+
+  if (error && n_valid == 0)
+    return -1;
+
+  return n_valid;
+}
+#endif
+
+#ifdef UDP_GRO
+/* Receive the next datagram, which may be several coalesced by GRO, into
+ * @priv->gro_buf. Returns its length, 0 if the socket would block, or -1 on
+ * error. */
+static gssize
+socket_recv_gro_datagram (NiceSocket *sock)
+{
+  struct UdpBsdSocketPrivate *priv = sock->priv;
+  union {
+    struct sockaddr_storage storage;
+    struct sockaddr addr;
+  } sa;
+  union {
+    struct cmsghdr hdr;
+    gchar buf[CMSG_SPACE (sizeof (gint))];
+  } control;
+  struct iovec iov = { priv->gro_buf, UDP_BSD_GRO_BUF_SIZE };
+  struct msghdr hdr;
+  struct cmsghdr *cmsg;
+  gssize len;
+
+  do {
+    memset (&hdr, 0, sizeof (hdr));
+    hdr.msg_name = &sa.storage;
+    hdr.msg_namelen = sizeof (sa);
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.buf;
+    hdr.msg_controllen = sizeof (control.buf);
+
+    len = recvmsg (g_socket_get_fd (sock->fileno), &hdr, MSG_DONTWAIT);
+  } while ((len < 0 && errno == EINTR) || len == 0);  /* Skip empty datagrams. */
+
+  if (len < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+  priv->gro_len = len;
+  priv->gro_offset = 0;
+  priv->gro_segment_size = len;
+  nice_address_set_from_sockaddr (&priv->gro_from, &sa.addr);
+
+  for (cmsg = CMSG_FIRSTHDR (&hdr); cmsg != NULL;
+       cmsg = CMSG_NXTHDR (&hdr, cmsg)) {
+    if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+      gint segment_size;
+
+      memcpy (&segment_size, CMSG_DATA (cmsg), sizeof (segment_size));
+      if (segment_size > 0)
+        priv->gro_segment_size = segment_size;
+    }
+  }
+
+  return len;
+}
+
+/* Take the next segment out of @priv->gro_buf, receiving a new datagram from
+ * the kernel if none are left. Returns 1 on success, 0 if the socket would
+ * block or GRO has been turned off since the last segment was taken, or -1 on
+ * error. */
+static gint
+socket_next_gro_segment (NiceSocket *sock, GInputVector *segment,
+    NiceAddress *from)
+{
+  struct UdpBsdSocketPrivate *priv = sock->priv;
+  gsize len;
+
+  if (priv->gro_offset == priv->gro_len) {
+    gssize recvd;
+
+    /* GRO was turned off with segments still pending. */
+    if (!priv->gro_enabled) {
+      g_free (priv->gro_buf);
+      priv->gro_buf = NULL;
+      return 0;
+    }
+
+    recvd = socket_recv_gro_datagram (sock);
+    if (recvd <= 0)
+      return (recvd < 0) ? -1 : 0;
+  }
+
+  len = MIN (priv->gro_segment_size, priv->gro_len - priv->gro_offset);
+  segment->buffer = priv->gro_buf + priv->gro_offset;
+  segment->size = len;
+  priv->gro_offset += len;
+
+  if (from != NULL)
+    *from = priv->gro_from;
+
+  return 1;
+}
+
+/* Copy @segment into the buffers of @message, truncating it if they are too
+ * small, as the kernel would. */
+static void
+input_message_fill (NiceInputMessage *message, const GInputVector *segment)
+{
+  const guint8 *buf = segment->buffer;
+  gsize remaining = segment->size;
+  guint i;
+
+  message->length = 0;
+
+  for (i = 0;
+       remaining > 0 &&
+       ((message->n_buffers >= 0 && i < (guint) message->n_buffers) ||
+        (message->n_buffers < 0 && message->buffers[i].buffer != NULL));
+       i++) {
+    gsize len = MIN (message->buffers[i].size, remaining);
+
+    memcpy (message->buffers[i].buffer, buf, len);
+    buf += len;
+    remaining -= len;
+    message->length += len;
+  }
+}
+
+/* Hand out one GRO segment per message, receiving more datagrams from the
+ * kernel as needed. Any segments left over are returned by the next call. */
+static gint
+socket_recv_messages_gro (NiceSocket *sock,
+    NiceInputMessage *recv_messages, guint n_recv_messages)
+{
+  struct UdpBsdSocketPrivate *priv = sock->priv;
+  guint i;
+
+  for (i = 0; i < n_recv_messages; i++) {
+    GInputVector segment;
+    gint ret;
+
+    ret = socket_next_gro_segment (sock, &segment, recv_messages[i].from);
+
+    if (ret == 0 && priv->gro_buf == NULL) {
+      /* GRO is off and all its segments have been handed out. */
+      ret = socket_recv_messages (sock, &recv_messages[i],
+          n_recv_messages - i);
+      return (ret < 0) ? ((i > 0) ? (gint) i : -1) : (gint) i + ret;
+    } else if (ret < 0 && i == 0) {
+      return -1;
+    } else if (ret <= 0) {
+      break;
+    }
+
+    input_message_fill (&recv_messages[i], &segment);
+  }
+
+  return i;
+}
+#endif
+
+/* Receive a single datagram into @message. Returns its length, 0 if the
+ * socket would block, or -1 on error. On POSIX systems this avoids allocating
+ * a #GSocketAddress for the sender, and any number of buffers can be used. */
+static gssize
+socket_recv_message (NiceSocket *sock, NiceInputMessage *message)
+{
+#ifndef G_OS_WIN32
+  union {
+    struct sockaddr_storage storage;
+    struct sockaddr addr;
+  } sa;
+  struct msghdr hdr;
+  struct iovec stack_iov[UDP_BSD_MAX_IOVECS];
+  struct iovec *iov;
+  guint i, n_buffers;
+  gssize recvd;
+
+  for (n_buffers = 0;
+       (message->n_buffers >= 0 && n_buffers < (guint) message->n_buffers) ||
+       (message->n_buffers < 0 && message->buffers[n_buffers].buffer != NULL);
+       n_buffers++);
+
+  /* Only messages with unusually many buffers need a heap allocation. */
+  if (n_buffers <= G_N_ELEMENTS (stack_iov))
+    iov = stack_iov;
+  else
+    iov = g_new (struct iovec, n_buffers);
+
+  for (i = 0; i < n_buffers; i++) {
+    iov[i].iov_base = message->buffers[i].buffer;
+    iov[i].iov_len = message->buffers[i].size;
+  }
+
+  memset (&hdr, 0, sizeof (hdr));
+  hdr.msg_name = &sa.storage;
+  hdr.msg_namelen = sizeof (sa);
+  hdr.msg_iov = iov;
+  hdr.msg_iovlen = n_buffers;
+
+  do {
+    recvd = recvmsg (g_socket_get_fd (sock->fileno), &hdr, 0);
+  } while (recvd < 0 && errno == EINTR);
+
+  if (iov != stack_iov) {
+    gint errsv = errno;
+
+    g_free (iov);
+    errno = errsv;
+  }
+
+  message->length = MAX (recvd, 0);
+
+  if (recvd < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+  if (recvd > 0 && message->from != NULL)
+    nice_address_set_from_sockaddr (message->from, &sa.addr);
+
+  return recvd;
+#else
+  GSocketAddress *gaddr = NULL;
+  GError *gerr = NULL;
+  gssize recvd;
+  gint flags = G_SOCKET_MSG_NONE;
+
+  recvd = g_socket_receive_message (sock->fileno,
+      (message->from != NULL) ? &gaddr : NULL,
+      message->buffers, message->n_buffers, NULL, NULL,
+      &flags, NULL, &gerr);
+
+  message->length = MAX (recvd, 0);
+
+  if (recvd < 0) {
+    if (g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+      recvd = 0;
+
+    g_error_free (gerr);
+  }
+
+  if (recvd > 0 && message->from != NULL && gaddr != NULL) {
+    union {
+      struct sockaddr_storage storage;
+      struct sockaddr addr;
+    } sa;
+
+    g_socket_address_to_native (gaddr, &sa.addr, sizeof (sa), NULL);
+    nice_address_set_from_sockaddr (message->from, &sa.addr);
+  }
+
+  if (gaddr != NULL)
+    g_object_unref (gaddr);
+
+  return recvd;
+#endif
+}
+
 static gint
 socket_recv_messages (NiceSocket *sock,
     NiceInputMessage *recv_messages, guint n_recv_messages)
@@ -187,43 +694,34 @@ socket_recv_messages (NiceSocket *sock,
   if (sock->priv == NULL)
     return 0;
 
+#ifdef UDP_GRO
+  if (((struct UdpBsdSocketPrivate *) sock->priv)->gro_buf != NULL)
+    return socket_recv_messages_gro (sock, recv_messages, n_recv_messages);
+#endif
+
+#ifdef HAVE_RECVMMSG
+  /* Fast path: dequeue the whole batch with recvmmsg(). Messages with more
+   * buffers than can be passed to the kernel at once are received one by one
+   * below. */
+  if (n_recv_messages > 0) {
+    struct msghdr hdr;
+    struct iovec iov[UDP_BSD_MAX_IOVECS];
+    struct sockaddr_storage addr;
+
+    if (input_message_to_msghdr (&recv_messages[0], &hdr, iov, &addr))
+      return socket_recv_messages_mmsg (sock, recv_messages, n_recv_messages);
+  }
+#endif
+
   /* Read messages into recv_messages until one fails or would block, or we
    * reach the end. */
   for (i = 0; i < n_recv_messages; i++) {
-    NiceInputMessage *recv_message = &recv_messages[i];
-    GSocketAddress *gaddr = NULL;
-    GError *gerr = NULL;
     gssize recvd;
-    gint flags = G_SOCKET_MSG_NONE;
-
-    recvd = g_socket_receive_message (sock->fileno,
-        (recv_message->from != NULL) ? &gaddr : NULL,
-        recv_message->buffers, recv_message->n_buffers, NULL, NULL,
-        &flags, NULL, &gerr);
-
-    recv_message->length = MAX (recvd, 0);
-
-    if (recvd < 0) {
-      if (g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
-        recvd = 0;
-      else
-        error = TRUE;
 
-      g_error_free (gerr);
-    }
-
-    if (recvd > 0 && recv_message->from != NULL && gaddr != NULL) {
-      union {
-        struct sockaddr_storage storage;
-        struct sockaddr addr;
-      } sa;
+    recvd = socket_recv_message (sock, &recv_messages[i]);
 
-      g_socket_address_to_native (gaddr, &sa.addr, sizeof (sa), NULL);
-      nice_address_set_from_sockaddr (recv_message->from, &sa.addr);
-    }
-
-    if (gaddr != NULL)
-      g_object_unref (gaddr);
+    if (recvd < 0)
+      error = TRUE;
 
     /* Return early on error or EWOULDBLOCK. */
     if (recvd <= 0)
@@ -237,41 +735,107 @@ socket_recv_messages (NiceSocket *sock,
   return i;
 }
 
+/* Send a single datagram. Returns the number of bytes sent, 0 if the socket
+ * would block, or -1 on error. On POSIX systems the destination is passed
+ * straight to sendmsg(), rather than being wrapped in a #GSocketAddress
+ * whenever it changes. */
 static gssize
 socket_send_message (NiceSocket *sock, const NiceAddress *to,
     const NiceOutputMessage *message)
 {
   struct UdpBsdSocketPrivate *priv = sock->priv;
+#ifndef G_OS_WIN32
+  union {
+    struct sockaddr_storage storage;
+    struct sockaddr addr;
+  } sa;
+  struct msghdr hdr;
+  struct iovec stack_iov[UDP_BSD_MAX_IOVECS];
+  struct iovec *iov;
+  guint i, n_buffers;
+  gssize len;
+
+  /* Socket has been closed: */
+  if (priv == NULL)
+    return -1;
+
+  for (n_buffers = 0;
+       (message->n_buffers >= 0 && n_buffers < (guint) message->n_buffers) ||
+       (message->n_buffers < 0 && message->buffers[n_buffers].buffer != NULL);
+       n_buffers++);
+
+  if (n_buffers <= G_N_ELEMENTS (stack_iov))
+    iov = stack_iov;
+  else
+    iov = g_new (struct iovec, n_buffers);
+
+  for (i = 0; i < n_buffers; i++) {
+    iov[i].iov_base = (gpointer) message->buffers[i].buffer;
+    iov[i].iov_len = message->buffers[i].size;
+  }
+
+  memset (&hdr, 0, sizeof (hdr));
+  hdr.msg_name = &sa.addr;
+  hdr.msg_namelen = sockaddr_len_from_address (to, &sa.addr);
+  hdr.msg_iov = iov;
+  hdr.msg_iovlen = n_buffers;
+
+  do {
+    len = sendmsg (g_socket_get_fd (sock->fileno), &hdr, 0);
+  } while (len < 0 && errno == EINTR);
+
+  if (iov != stack_iov) {
+    gint errsv = errno;
+
+    g_free (iov);
+    errno = errsv;
+  }
+
+  if (len < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+  return len;
+#else
   GError *child_error = NULL;
+  GSocketAddress *gaddr;
   gssize len;
 
   /* Socket has been closed: */
   if (priv == NULL)
     return -1;
 
+  /* The agent may send on the socket from several threads at once. */
+  g_mutex_lock (&gaddr_mutex);
+
   if (!nice_address_is_valid (&priv->niceaddr) ||
       !nice_address_equal (&priv->niceaddr, to)) {
     union {
       struct sockaddr_storage storage;
       struct sockaddr addr;
     } sa;
-    GSocketAddress *gaddr;
 
     if (priv->gaddr)
       g_object_unref (priv->gaddr);
 
     nice_address_copy_to_sockaddr (to, &sa.addr);
-    gaddr = g_socket_address_new_from_native (&sa.addr, sizeof(sa));
-    priv->gaddr = gaddr;
+    priv->gaddr = g_socket_address_new_from_native (&sa.addr, sizeof(sa));
 
-    if (gaddr == NULL)
+    if (priv->gaddr == NULL) {
+      nice_address_init (&priv->niceaddr);
+      g_mutex_unlock (&gaddr_mutex);
       return -1;
+    }
 
     priv->niceaddr = *to;
   }
 
-  len = g_socket_send_message (sock->fileno, priv->gaddr, message->buffers,
+  gaddr = g_object_ref (priv->gaddr);
+
+  g_mutex_unlock (&gaddr_mutex);
+
+  len = g_socket_send_message (sock->fileno, gaddr, message->buffers,
       message->n_buffers, NULL, 0, G_SOCKET_MSG_NONE, NULL, &child_error);
+  g_object_unref (gaddr);
 
   if (len < 0) {
     if (g_error_matches (child_error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
@@ -281,8 +845,243 @@ socket_send_message (NiceSocket *sock, const NiceAddress *to,
   }
 
   return len;
+#endif
 }
 
+#ifdef HAVE_SENDMMSG
+/* Fill @iov in with the buffers of @message, of which there may be at most
+ * @max_iovecs. Returns %FALSE if the message is empty or has too many buffers
+ * to be sent by sendmmsg(). Empty messages are left to socket_send_message()
+ * so they are reported the same way whichever path is taken. */
+static gboolean
+output_message_to_iovecs (const NiceOutputMessage *message,
+    struct iovec *iov, guint max_iovecs, guint *n_iovecs, gsize *len)
+{
+  guint i;
+
+  *len = 0;
+
+  for (i = 0;
+       (message->n_buffers >= 0 && i < (guint) message->n_buffers) ||
+       (message->n_buffers < 0 && message->buffers[i].buffer != NULL);
+       i++) {
+    if (i == max_iovecs)
+      return FALSE;
+
+    iov[i].iov_base = (gpointer) message->buffers[i].buffer;
+    iov[i].iov_len = message->buffers[i].size;
+    *len += message->buffers[i].size;
+  }
+
+  *n_iovecs = i;
+
+  return (*len > 0);
+}
+
+#ifdef UDP_SEGMENT
+/* Append the messages following @messages[0] to @hdr, as long as they form a
+ * run of segments of the same size (the last of which may be shorter) which
+ * the kernel can split up again with UDP GSO. Returns the number of messages
+ * in @hdr. */
+static guint
+socket_gso_append_run (struct UdpBsdSocketPrivate *priv, struct msghdr *hdr,
+    gsize segment_size, const NiceOutputMessage *messages, guint n_messages,
+    struct iovec *iov, guint max_iovecs, guint *n_iovecs)
+{
+  guint n_segments = 1;
+  gsize total = segment_size;
+
+  if (!g_atomic_int_get (&priv->gso_enabled) ||
+      segment_size > (gsize) g_atomic_int_get (&priv->gso_max_segment_size))
+    return 1;
+
+  while (n_segments < n_messages && n_segments < UDP_BSD_GSO_MAX_SEGMENTS) {
+    guint n_message_iovecs;
+    gsize len;
+
+    if (!output_message_to_iovecs (&messages[n_segments], &iov[*n_iovecs],
+            MIN (UDP_BSD_MAX_IOVECS, max_iovecs - *n_iovecs),
+            &n_message_iovecs, &len) ||
+        len > segment_size || total + len > UDP_BSD_GSO_MAX_BYTES)
+      break;
+
+    *n_iovecs += n_message_iovecs;
+    hdr->msg_iovlen += n_message_iovecs;
+    total += len;
+    n_segments++;
+
+    /* A shorter segment can only come last. */
+    if (len < segment_size)
+      break;
+  }
+
+  return n_segments;
+}
+
+/* Work out whether a sendmmsg() failure on a GSO message is because the
+ * kernel or device can’t do GSO, or just can’t do it with segments this
+ * large, and stop using it accordingly. Returns %TRUE if the batch should be
+ * retried. */
+static gboolean
+socket_gso_handle_error (NiceSocket *sock, struct msghdr *hdr, gint error)
+{
+  struct UdpBsdSocketPrivate *priv = sock->priv;
+  struct cmsghdr *cmsg;
+  guint16 segment_size;
+
+  if (hdr->msg_controllen == 0)
+    return FALSE;
+
+  cmsg = CMSG_FIRSTHDR (hdr);
+  memcpy (&segment_size, CMSG_DATA (cmsg), sizeof (segment_size));
+
+  switch (error) {
+    case EINVAL:
+    case EMSGSIZE: {
+      gint max_segment_size;
+
+      /* Probably larger than the path MTU. Another thread may have lowered
+       * the limit further in the meantime, so never raise it. */
+      do {
+        max_segment_size = g_atomic_int_get (&priv->gso_max_segment_size);
+      } while (max_segment_size >= segment_size &&
+          !g_atomic_int_compare_and_exchange (&priv->gso_max_segment_size,
+              max_segment_size, segment_size - 1));
+      return TRUE;
+    }
+    case EIO:
+    case EOPNOTSUPP:
+    case ENOPROTOOPT:
+      /* No checksum offload on the device, or no GSO support at all. */
+      nice_debug ("UDP socket %p: disabling GSO (%s)", sock,
+          g_strerror (error));
+      g_atomic_int_set (&priv->gso_enabled, FALSE);
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+#endif
+
+/* Send as many of @messages as possible using as few sendmmsg() calls as
+ * possible, stopping at the first message which can’t be passed to the kernel
+ * in one go. If GSO is enabled, runs of messages of the same size are passed
+ * to the kernel as single UDP_SEGMENT messages. Returns the number of
+ * messages sent, or -1 if nothing could be sent due to an error. @blocked is
+ * set if the kernel stopped early because the socket would block or failed,
+ * rather than because of such a message. */
+static gint
+socket_send_messages_mmsg (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages, gboolean *blocked)
+{
+  struct mmsghdr hdrs[UDP_BSD_BATCH_SIZE];
+  guint hdr_n_messages[UDP_BSD_BATCH_SIZE];
+  struct iovec iovs[UDP_BSD_BATCH_SIZE * UDP_BSD_MAX_IOVECS];
+#ifdef UDP_SEGMENT
+  struct UdpBsdSocketPrivate *priv = sock->priv;
+  union {
+    struct cmsghdr hdr;
+    gchar buf[CMSG_SPACE (sizeof (guint16))];
+  } cmsgs[UDP_BSD_BATCH_SIZE];
+#endif
+  union {
+    struct sockaddr_storage storage;
+    struct sockaddr addr;
+  } sa;
+  socklen_t namelen;
+  gint fd = g_socket_get_fd (sock->fileno);
+  guint n_sent = 0;
+
+  *blocked = FALSE;
+
+  namelen = sockaddr_len_from_address (to, &sa.addr);
+
+  while (n_sent < n_messages) {
+    guint n_batch, n_batched_messages = 0, n_iovecs = 0;
+    gint ret, i;
+
+    for (n_batch = 0;
+         n_batch < UDP_BSD_BATCH_SIZE &&
+             n_sent + n_batched_messages < n_messages;
+         n_batch++) {
+      const NiceOutputMessage *message = &messages[n_sent + n_batched_messages];
+      struct msghdr *hdr = &hdrs[n_batch].msg_hdr;
+      guint n_message_iovecs;
+      gsize len;
+
+      if (!output_message_to_iovecs (message, &iovs[n_iovecs],
+              MIN (UDP_BSD_MAX_IOVECS, G_N_ELEMENTS (iovs) - n_iovecs),
+              &n_message_iovecs, &len))
+        break;
+
+      memset (hdr, 0, sizeof (*hdr));
+      hdr->msg_name = &sa.addr;
+      hdr->msg_namelen = namelen;
+      hdr->msg_iov = &iovs[n_iovecs];
+      hdr->msg_iovlen = n_message_iovecs;
+      hdrs[n_batch].msg_len = 0;
+      hdr_n_messages[n_batch] = 1;
+      n_iovecs += n_message_iovecs;
+
+#ifdef UDP_SEGMENT
+      hdr_n_messages[n_batch] = socket_gso_append_run (priv, hdr, len, message,
+          n_messages - n_sent - n_batched_messages, iovs,
+          G_N_ELEMENTS (iovs), &n_iovecs);
+
+      if (hdr_n_messages[n_batch] > 1) {
+        struct cmsghdr *cmsg;
+        guint16 segment_size = len;
+
+        hdr->msg_control = cmsgs[n_batch].buf;
+        hdr->msg_controllen = sizeof (cmsgs[n_batch].buf);
+
+        cmsg = CMSG_FIRSTHDR (hdr);
+        cmsg->cmsg_level = IPPROTO_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN (sizeof (segment_size));
+        memcpy (CMSG_DATA (cmsg), &segment_size, sizeof (segment_size));
+      }
+#endif
+
+      n_batched_messages += hdr_n_messages[n_batch];
+    }
+
+    /* Let the caller deal with the next message. */
+    if (n_batch == 0)
+      break;
+
+    do {
+      ret = sendmmsg (fd, hdrs, n_batch, MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+#ifdef UDP_SEGMENT
+      if (socket_gso_handle_error (sock, &hdrs[0].msg_hdr, errno))
+        continue;
+#endif
+
+      *blocked = TRUE;
+
+      /* Errors are only reported if nothing at all was sent. */
+      if (errno != EAGAIN && errno != EWOULDBLOCK && n_sent == 0)
+        return -1;
+      break;
+    }
+
+    for (i = 0; i < ret; i++)
+      n_sent += hdr_n_messages[i];
+
+    /* The kernel stops at the first message which fails or would block. */
+    if ((guint) ret < n_batch) {
+      *blocked = TRUE;
+      break;
+    }
+  }
+
+  return n_sent;
+}
+#endif
+
 static gint
 socket_send_messages (NiceSocket *sock, const NiceAddress *to,
     const NiceOutputMessage *messages, guint n_messages)
@@ -293,11 +1092,34 @@ socket_send_messages (NiceSocket *sock, const NiceAddress *to,
   if (sock->priv == NULL)
     return -1;
 
-  for (i = 0; i < n_messages; i++) {
-    const NiceOutputMessage *message = &messages[i];
+  for (i = 0; i < n_messages;) {
     gssize len;
 
-    len = socket_send_message (sock, to, message);
+#ifdef HAVE_SENDMMSG
+    {
+      gboolean blocked;
+      gint n_sent;
+
+      /* Fast path: pass as much of the batch as possible to the kernel with
+       * sendmmsg(). */
+      n_sent = socket_send_messages_mmsg (sock, to, &messages[i],
+          n_messages - i, &blocked);
+
+      if (n_sent < 0) {
+        /* Error. */
+        if (i > 0)
+          break;
+        return n_sent;
+      }
+
+      i += n_sent;
+      if (blocked || i == n_messages)
+        break;
+    }
+#endif
+
+    /* Send a message which can’t be batched on its own. */
+    len = socket_send_message (sock, to, &messages[i]);
 
     if (len < 0) {
       /* Error. */
@@ -308,6 +1130,8 @@ socket_send_messages (NiceSocket *sock, const NiceAddress *to,
       /* EWOULDBLOCK. */
       break;
     }
+
+    i++;
   }
 
   return i;
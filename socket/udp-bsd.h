@@ -46,6 +46,36 @@ G_BEGIN_DECLS
 NiceSocket *
 nice_udp_bsd_socket_new (NiceAddress *addr);
 
+/* Enable or disable UDP generic segmentation offload on @sock, returning
+ * whether it is now in use. Does nothing for sockets of other types. */
+gboolean
+nice_udp_bsd_socket_set_gso (NiceSocket *sock, gboolean enabled);
+
+/* Enable or disable UDP generic receive offload on @sock, returning whether it
+ * is now in use. Coalesced datagrams are still returned one per message. Does
+ * nothing for sockets of other types. */
+gboolean
+nice_udp_bsd_socket_set_gro (NiceSocket *sock, gboolean enabled);
+
+/* Whether @sock holds received segments of a coalesced datagram which haven’t
+ * been returned yet, so reading it may succeed even if its file descriptor
+ * isn’t readable. */
+gboolean
+nice_udp_bsd_socket_has_gro_pending (NiceSocket *sock);
+
+/* Whether @sock receives through its GRO buffer, so that
+ * nice_udp_bsd_socket_recv_gro_segment() can be used on it. */
+gboolean
+nice_udp_bsd_socket_uses_gro (NiceSocket *sock);
+
+/* Receive the next segment of a coalesced datagram on @sock without copying
+ * it: @segment points into the socket’s GRO buffer, and stays valid until
+ * @sock is next read from or closed. Returns 1 on success, 0 if @sock would
+ * block or doesn’t use GRO, or -1 on error. */
+gint
+nice_udp_bsd_socket_recv_gro_segment (NiceSocket *sock, GInputVector *segment,
+    NiceAddress *from);
+
 G_END_DECLS
 
 #endif /* _UDP_BSD_H */
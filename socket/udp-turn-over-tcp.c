@@ -43,6 +43,7 @@
 #endif
 
 #include "udp-turn-over-tcp.h"
+#include "socket-priv.h"
 #include "agent-priv.h"
 
 #include <string.h>
@@ -55,12 +56,7 @@
 
 typedef struct {
   NiceTurnSocketCompatibility compatibility;
-  union {
-    guint8 u8[65536];
-    guint16 u16[32768];
-  } recv_buf;
-  gsize recv_buf_len;  /* in bytes */
-  guint expecting_len;
+  NiceStreamDeframer deframer;
   NiceSocket *base_socket;
 } TurnTcpPriv;
 
@@ -71,6 +67,9 @@ typedef enum {
 
 #define MAX_UDP_MESSAGE_SIZE 65535
 
+/* A STUN header, the longest message and its padding */
+#define MAX_FRAME_SIZE (20 + MAX_UDP_MESSAGE_SIZE + 3)
+
 #define MAGIC_COOKIE_OFFSET \
   STUN_MESSAGE_HEADER_LENGTH + STUN_MESSAGE_TYPE_LEN + \
   STUN_MESSAGE_LENGTH_LEN + sizeof(guint16)
@@ -97,6 +96,7 @@ nice_udp_turn_over_tcp_socket_new (NiceSocket *base_socket,
 
   priv->compatibility = compatibility;
   priv->base_socket = base_socket;
+  nice_stream_deframer_init (&priv->deframer, MAX_FRAME_SIZE);
 
   sock->type = NICE_SOCKET_TYPE_UDP_TURN_OVER_TCP;
   sock->fileno = priv->base_socket->fileno;
@@ -121,117 +121,82 @@ socket_close (NiceSocket *sock)
   if (priv->base_socket)
     nice_socket_free (priv->base_socket);
 
+  nice_stream_deframer_clear (&priv->deframer);
+
   g_slice_free(TurnTcpPriv, sock->priv);
   sock->priv = NULL;
 }
 
 static gssize
-socket_recv_message (NiceSocket *sock, NiceInputMessage *recv_message)
+priv_frame_length (const guint8 *buf, gsize len, gpointer user_data)
 {
-  TurnTcpPriv *priv = sock->priv;
-  gssize ret;
-  guint padlen;
-  GInputVector local_recv_buf;
-  NiceInputMessage local_recv_message;
+  TurnTcpPriv *priv = user_data;
+  guint16 packetlen;
+  gsize frame_len;
 
-  /* Socket has been closed: */
-  if (sock->priv == NULL)
-    return 0;
-
-  if (priv->expecting_len == 0) {
-    guint headerlen = 0;
-
-    if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
-        priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766 ||
-        priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_OC2007)
-      headerlen = 4;
-    else if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_GOOGLE)
-      headerlen = 2;
-    else
-      return -1;
+  if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_GOOGLE) {
+    if (len < 2)
+      return 0;
 
-    local_recv_buf.buffer = priv->recv_buf.u8 + priv->recv_buf_len;
-    local_recv_buf.size = headerlen - priv->recv_buf_len;
-    local_recv_message.buffers = &local_recv_buf;
-    local_recv_message.n_buffers = 1;
-    local_recv_message.from = recv_message->from;
-    local_recv_message.length = 0;
+    return 2 + ((buf[0] << 8) | buf[1]);
+  }
 
-    ret = nice_socket_recv_messages (priv->base_socket, &local_recv_message, 1);
-    if (ret < 0)
-        return ret;
+  if (priv->compatibility != NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 &&
+      priv->compatibility != NICE_TURN_SOCKET_COMPATIBILITY_RFC5766 &&
+      priv->compatibility != NICE_TURN_SOCKET_COMPATIBILITY_OC2007)
+    return -1;
 
-    priv->recv_buf_len += local_recv_message.length;
+  if (len < 4)
+    return 0;
 
-    if (priv->recv_buf_len < headerlen)
-      return 0;
+  packetlen = (buf[2] << 8) | buf[3];
 
-    if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
-        priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
-      guint16 magic = ntohs (*priv->recv_buf.u16);
-      guint16 packetlen = ntohs (*(priv->recv_buf.u16 + 1));
-
-      if (magic < 0x4000) {
-        /* Its STUN */
-        priv->expecting_len = 20 + packetlen;
-      } else {
-        /* Channel data */
-        priv->expecting_len = 4 + packetlen;
-      }
-    }
-    else if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_GOOGLE) {
-      guint compat_len = ntohs (*priv->recv_buf.u16);
-      priv->expecting_len = compat_len;
-      priv->recv_buf_len = 0;
+  if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_OC2007) {
+    if (buf[0] != MS_TURN_CONTROL_MESSAGE &&
+        buf[0] != MS_TURN_END_TO_END_DATA) {
+      /* Unexpected data, error in stream */
+      return -1;
     }
-    else if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_OC2007) {
-      guint8 pt = *priv->recv_buf.u8;
-      guint16 packetlen = ntohs (priv->recv_buf.u16[1]);
-
-      if (pt != MS_TURN_CONTROL_MESSAGE &&
-          pt != MS_TURN_END_TO_END_DATA) {
-        /* Unexpected data, error in stream */
-        return -1;
-      }
 
-      /* Keep the RFC4571 framing for the NiceAgent to unframe */
-      priv->expecting_len = packetlen + sizeof(guint16);
-      priv->recv_buf_len = sizeof(guint16);
-      priv->recv_buf.u16[0] = priv->recv_buf.u16[1];
-    }
+    return 4 + packetlen;
   }
 
-  if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
-      priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766)
-    padlen = (priv->expecting_len % 4) ?  4 - (priv->expecting_len % 4) : 0;
-  else
-    padlen = 0;
-
-  local_recv_buf.buffer = priv->recv_buf.u8 + priv->recv_buf_len;
-  local_recv_buf.size = priv->expecting_len + padlen - priv->recv_buf_len;
-  local_recv_message.buffers = &local_recv_buf;
-  local_recv_message.n_buffers = 1;
-  local_recv_message.from = recv_message->from;
-  local_recv_message.length = 0;
+  if (((buf[0] << 8) | buf[1]) < 0x4000) {
+    /* Its STUN */
+    frame_len = 20 + packetlen;
+  } else {
+    /* Channel data */
+    frame_len = 4 + packetlen;
+  }
 
-  ret = nice_socket_recv_messages (priv->base_socket, &local_recv_message, 1);
-  if (ret < 0)
-      return ret;
+  /* Padding */
+  if (frame_len % 4)
+    frame_len += 4 - (frame_len % 4);
 
-  priv->recv_buf_len += local_recv_message.length;
+  return frame_len;
+}
 
-  if (priv->recv_buf_len == priv->expecting_len + padlen) {
-    /* FIXME: Eliminate this memcpy(). */
-    ret = memcpy_buffer_to_input_message (recv_message,
-        priv->recv_buf.u8, priv->recv_buf_len);
+static gint
+socket_recv_message (NiceSocket *sock, NiceInputMessage *recv_message)
+{
+  TurnTcpPriv *priv = sock->priv;
+  gsize header_len = 0;
 
-    priv->expecting_len = 0;
-    priv->recv_buf_len = 0;
+  /* Socket has been closed: */
+  if (sock->priv == NULL)
+    return 0;
 
-    return ret;
+  if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_GOOGLE) {
+    /* Drop the length header */
+    header_len = 2;
+  } else if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_OC2007) {
+    /* Keep the RFC4571 framing for the NiceAgent to unframe, which is the
+     * length after the payload type */
+    header_len = 2;
   }
 
-  return 0;
+  return nice_stream_deframer_recv_message (&priv->deframer,
+      priv->base_socket, priv_frame_length, priv, header_len, recv_message);
 }
 
 static gint
@@ -246,16 +211,17 @@ socket_recv_messages (NiceSocket *nicesock,
     return 0;
 
   for (i = 0; i < n_recv_messages; i++) {
-    gssize len;
+    gint ret;
 
-    len = socket_recv_message (nicesock, &recv_messages[i]);
-    recv_messages[i].length = MAX (len, 0);
+    ret = socket_recv_message (nicesock, &recv_messages[i]);
 
-    if (len < 0)
+    if (ret < 0)
       error = TRUE;
 
-    if (len <= 0)
+    if (ret <= 0) {
+      recv_messages[i].length = 0;
       break;
+    }
   }
 
   /* Was there an error processing the first message? */
@@ -57,6 +57,10 @@
 #define STUN_PERMISSION_TIMEOUT (300 - STUN_EXPIRE_TIMEOUT) /* 240 s */
 #define STUN_BINDING_TIMEOUT (600 - STUN_EXPIRE_TIMEOUT) /* 540 s */
 
+/* Number of buffers, including the framing, for which messages sent by
+ * reference don't need a heap allocation. */
+#define FRAMED_MAX_STACK_BUFFERS 16
+
 typedef struct {
   StunMessage message;
   uint8_t buffer[STUN_MAX_MESSAGE_SIZE];
@@ -71,9 +75,20 @@ typedef struct {
 } ChannelBinding;
 
 typedef struct {
+  /* Protects the socket's state against its timers, which may be dispatched
+   * in a thread other than the one owning the socket. Recursive, as received
+   * messages are parsed with it held. Always taken after the agent lock. */
+  GRecMutex mutex;
+  /* One reference is held by the socket and one by each timer, so a timer
+   * blocked on @mutex while the socket is closed can still check whether its
+   * source was destroyed. */
+  volatile gint ref_count;
   GMainContext *ctx;
   StunAgent agent;
+  StunAgentSavedIds agent_saved_ids[STUN_AGENT_MAX_SAVED_IDS];
   GList *channels;
+  GHashTable *channels_by_peer;  /* indexes channels, owns nothing */
+  GHashTable *channels_by_number;  /* indexes channels, owns nothing */
   GList *pending_bindings;
   ChannelBinding *current_binding;
   TURNMessage *current_binding_msg;
@@ -92,9 +107,9 @@ typedef struct {
   uint8_t ms_connection_id[20];
   uint32_t ms_sequence_num;
   bool ms_connection_id_valid;
-  GList *permissions;           /* the peers (NiceAddress) for which
+  GHashTable *permissions;      /* the peers (NiceAddress) for which
                                    there is an installed permission */
-  GList *sent_permissions; /* ongoing permission installed */
+  GHashTable *sent_permissions; /* ongoing permission installed */
   GHashTable *send_data_queues; /* stores a send data queue for per peer */
   GSource *permission_timeout_source;      /* timer used to invalidate
                                            permissions */
@@ -104,7 +119,6 @@ typedef struct {
 typedef struct {
   StunTransactionId id;
   GSource *source;
-  UdpTurnPriv *priv;
 } SendRequest;
 
 /* used to store data sent while obtaining a permission */
@@ -140,15 +154,41 @@ static gboolean priv_add_channel_binding (UdpTurnPriv *priv,
     const NiceAddress *peer);
 static gboolean priv_forget_send_request (gpointer pointer);
 static void priv_clear_permissions (UdpTurnPriv *priv);
+static gsize priv_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
+    NiceAddress *from, gsize len, guint8 *buf,
+    NiceAddress *recv_from, guint8 *_recv_buf, gsize recv_len);
 
+/* Hashes the IP address and port, without formatting them as a string
+ * first, as this is done for every packet */
 static guint
 priv_nice_address_hash (gconstpointer data)
 {
-  gchar address[NICE_ADDRESS_STRING_LEN];
+  const NiceAddress *addr = data;
+  const guint8 *bytes;
+  guint hash = nice_address_get_port (addr);
+  gsize len, i;
+
+  if (addr->s.addr.sa_family == AF_INET6) {
+    bytes = (const guint8 *) &addr->s.ip6.sin6_addr;
+    len = sizeof (addr->s.ip6.sin6_addr);
+  } else {
+    bytes = (const guint8 *) &addr->s.ip4.sin_addr;
+    len = sizeof (addr->s.ip4.sin_addr);
+  }
+
+  for (i = 0; i < len; i++)
+    hash = (hash << 5) + hash + bytes[i];
 
-  nice_address_to_string ((NiceAddress *) data, address);
+  return hash;
+}
 
-  return g_str_hash(address);
+/* A set of NiceAddresses, each being its own key and value */
+static GHashTable *
+priv_peer_set_new (void)
+{
+  return g_hash_table_new_full (priv_nice_address_hash,
+      (GEqualFunc) nice_address_equal, (GDestroyNotify) nice_address_free,
+      NULL);
 }
 
 static void
@@ -166,6 +206,25 @@ priv_send_data_queue_destroy (gpointer user_data)
   g_queue_free (send_queue);
 }
 
+static UdpTurnPriv *
+priv_ref (UdpTurnPriv *priv)
+{
+  g_atomic_int_inc (&priv->ref_count);
+
+  return priv;
+}
+
+static void
+priv_unref (gpointer data)
+{
+  UdpTurnPriv *priv = data;
+
+  if (g_atomic_int_dec_and_test (&priv->ref_count)) {
+    g_rec_mutex_clear (&priv->mutex);
+    g_free (priv);
+  }
+}
+
 NiceSocket *
 nice_udp_turn_socket_new (GMainContext *ctx, NiceAddress *addr,
     NiceSocket *base_socket, NiceAddress *server_addr,
@@ -180,6 +239,8 @@ nice_udp_turn_socket_new (GMainContext *ctx, NiceAddress *addr,
   }
 
   priv = g_new0 (UdpTurnPriv, 1);
+  g_rec_mutex_init (&priv->mutex);
+  priv->ref_count = 1;
 
   if (compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
       compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
@@ -202,8 +263,15 @@ nice_udp_turn_socket_new (GMainContext *ctx, NiceAddress *addr,
         STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS |
         STUN_AGENT_USAGE_NO_ALIGNED_ATTRIBUTES);
   }
+  stun_agent_set_transaction_storage (&priv->agent, priv->agent_saved_ids,
+      G_N_ELEMENTS (priv->agent_saved_ids));
 
   priv->channels = NULL;
+  priv->channels_by_peer = g_hash_table_new (priv_nice_address_hash,
+      (GEqualFunc) nice_address_equal);
+  priv->channels_by_number = g_hash_table_new (g_direct_hash, g_direct_equal);
+  priv->permissions = priv_peer_set_new ();
+  priv->sent_permissions = priv_peer_set_new ();
   priv->current_binding = NULL;
   priv->base_socket = base_socket;
   if (ctx)
@@ -257,6 +325,8 @@ socket_close (NiceSocket *sock)
   UdpTurnPriv *priv = (UdpTurnPriv *) sock->priv;
   GList *i = NULL;
 
+  g_rec_mutex_lock (&priv->mutex);
+
   for (i = priv->channels; i; i = i->next) {
     ChannelBinding *b = i->data;
     if (b->timeout_source) {
@@ -266,6 +336,8 @@ socket_close (NiceSocket *sock)
     g_free (b);
   }
   g_list_free (priv->channels);
+  g_hash_table_destroy (priv->channels_by_peer);
+  g_hash_table_destroy (priv->channels_by_number);
 
   g_list_foreach (priv->pending_bindings, (GFunc) nice_address_free,
       NULL);
@@ -297,9 +369,8 @@ socket_close (NiceSocket *sock)
   }
   g_queue_free (priv->send_requests);
 
-  priv_clear_permissions (priv);
-  g_list_foreach (priv->sent_permissions, (GFunc) nice_address_free, NULL);
-  g_list_free (priv->sent_permissions);
+  g_hash_table_destroy (priv->permissions);
+  g_hash_table_destroy (priv->sent_permissions);
   g_hash_table_destroy (priv->send_data_queues);
 
   if (priv->permission_timeout_source) {
@@ -317,9 +388,12 @@ socket_close (NiceSocket *sock)
   g_list_free(priv->pending_permissions);
   g_free (priv->username);
   g_free (priv->password);
-  g_free (priv);
 
   sock->priv = NULL;
+
+  g_rec_mutex_unlock (&priv->mutex);
+
+  priv_unref (priv);
 }
 
 static gint
@@ -419,7 +493,7 @@ socket_recv_messages (NiceSocket *sock,
 
 static GSource *
 priv_timeout_add_with_context (UdpTurnPriv *priv, guint interval,
-    gboolean seconds, GSourceFunc function, gpointer data)
+    gboolean seconds, GSourceFunc function)
 {
   GSource *source;
 
@@ -430,7 +504,7 @@ priv_timeout_add_with_context (UdpTurnPriv *priv, guint interval,
   else
     source = g_timeout_source_new (interval);
 
-  g_source_set_callback (source, function, data, NULL);
+  g_source_set_callback (source, function, priv_ref (priv), priv_unref);
   g_source_attach (source, priv->ctx);
 
   return source;
@@ -463,82 +537,106 @@ stun_message_ensure_ms_realm(StunMessage *msg, uint8_t *realm)
   }
 }
 
-static gboolean
-priv_is_peer_in_list (const GList *list, const NiceAddress *peer)
-{
-  const GList *iter;
-
-  for (iter = list ; iter ; iter = g_list_next (iter)) {
-    NiceAddress *address = (NiceAddress *) iter->data;
-
-    if (nice_address_equal (address, peer))
-      return TRUE;
-  }
-
-  return FALSE;
-}
-
 static gboolean
 priv_has_permission_for_peer (UdpTurnPriv *priv, const NiceAddress *peer)
 {
-  return priv_is_peer_in_list (priv->permissions, peer);
+  return g_hash_table_lookup (priv->permissions, peer) != NULL;
 }
 
 static gboolean
 priv_has_sent_permission_for_peer (UdpTurnPriv *priv, const NiceAddress *peer)
 {
-  return priv_is_peer_in_list (priv->sent_permissions, peer);
+  return g_hash_table_lookup (priv->sent_permissions, peer) != NULL;
 }
 
 static void
 priv_add_permission_for_peer (UdpTurnPriv *priv, const NiceAddress *peer)
 {
-  priv->permissions =
-      g_list_append (priv->permissions, nice_address_dup (peer));
+  NiceAddress *address = nice_address_dup (peer);
+
+  g_hash_table_replace (priv->permissions, address, address);
 }
 
 static void
 priv_add_sent_permission_for_peer (UdpTurnPriv *priv, const NiceAddress *peer)
 {
-  priv->sent_permissions =
-      g_list_append (priv->sent_permissions, nice_address_dup (peer));
+  NiceAddress *address = nice_address_dup (peer);
+
+  g_hash_table_replace (priv->sent_permissions, address, address);
+}
+
+static void
+priv_remove_sent_permission_for_peer (UdpTurnPriv *priv, const NiceAddress *peer)
+{
+  g_hash_table_remove (priv->sent_permissions, peer);
 }
 
-static GList *
-priv_remove_peer_from_list (GList *list, const NiceAddress *peer)
+static void
+priv_clear_permissions (UdpTurnPriv *priv)
 {
-  GList *iter;
+  g_hash_table_remove_all (priv->permissions);
+}
 
-  for (iter = list ; iter ; iter = g_list_next (iter)) {
-    NiceAddress *address = (NiceAddress *) iter->data;
+static ChannelBinding *
+priv_find_channel_binding_by_peer (UdpTurnPriv *priv, const NiceAddress *peer)
+{
+  return g_hash_table_lookup (priv->channels_by_peer, peer);
+}
 
-    if (nice_address_equal (address, peer)) {
-      GList *prev = iter->prev;
+static ChannelBinding *
+priv_find_channel_binding_by_number (UdpTurnPriv *priv, uint16_t channel)
+{
+  return g_hash_table_lookup (priv->channels_by_number,
+      GUINT_TO_POINTER ((guint) channel));
+}
 
-      nice_address_free (address);
-      list = g_list_delete_link (list, iter);
-      iter = prev;
-      if (iter)
-        iter = list;
-    }
-  }
+/* Indexes @binding, unless an earlier binding for the same peer or channel
+ * already is, so that lookups find the first one in priv->channels */
+static void
+priv_index_channel_binding (UdpTurnPriv *priv, ChannelBinding *binding)
+{
+  gpointer channel = GUINT_TO_POINTER ((guint) binding->channel);
 
-  return list;
+  if (g_hash_table_lookup (priv->channels_by_peer, &binding->peer) == NULL)
+    g_hash_table_insert (priv->channels_by_peer, &binding->peer, binding);
+  if (g_hash_table_lookup (priv->channels_by_number, channel) == NULL)
+    g_hash_table_insert (priv->channels_by_number, channel, binding);
 }
 
+/* Appends @binding to priv->channels and indexes it */
 static void
-priv_remove_sent_permission_for_peer (UdpTurnPriv *priv, const NiceAddress *peer)
+priv_insert_channel_binding (UdpTurnPriv *priv, ChannelBinding *binding)
 {
-  priv->sent_permissions =
-      priv_remove_peer_from_list (priv->sent_permissions, peer);
+  priv->channels = g_list_append (priv->channels, binding);
+  priv_index_channel_binding (priv, binding);
 }
 
+/* Removes @binding from priv->channels and its indexes, without freeing it */
 static void
-priv_clear_permissions (UdpTurnPriv *priv)
+priv_remove_channel_binding (UdpTurnPriv *priv, ChannelBinding *binding)
 {
-  g_list_foreach (priv->permissions, (GFunc) nice_address_free, NULL);
-  g_list_free (priv->permissions);
-  priv->permissions = NULL;
+  gpointer channel = GUINT_TO_POINTER ((guint) binding->channel);
+  gboolean reindex = FALSE;
+  GList *i;
+
+  priv->channels = g_list_remove (priv->channels, binding);
+
+  if (g_hash_table_lookup (priv->channels_by_peer, &binding->peer) ==
+      binding) {
+    g_hash_table_remove (priv->channels_by_peer, &binding->peer);
+    reindex = TRUE;
+  }
+  if (g_hash_table_lookup (priv->channels_by_number, channel) == binding) {
+    g_hash_table_remove (priv->channels_by_number, channel);
+    reindex = TRUE;
+  }
+
+  /* If the same peer was bound twice, the other binding takes over. Removals
+   * only happen on timeouts, so a scan is fine here. */
+  if (reindex) {
+    for (i = priv->channels; i; i = i->next)
+      priv_index_channel_binding (priv, i->data);
+  }
 }
 
 static gint
@@ -677,6 +775,117 @@ socket_dequeue_all_data (UdpTurnPriv *priv, const NiceAddress *to)
 }
 
 
+/* Sends @message to the server, with @header_len bytes of @header in front
+ * of it and @padding zero bytes after it, without copying the payload. */
+static gint
+socket_send_framed_by_reference (UdpTurnPriv *priv, const guint8 *header,
+    gsize header_len, const NiceOutputMessage *message, gsize padding,
+    gboolean reliable)
+{
+  static const guint8 padding_bytes[4] = { 0, };
+  GOutputVector stack_bufs[FRAMED_MAX_STACK_BUFFERS];
+  GOutputVector *local_bufs;
+  NiceOutputMessage local_message;
+  guint n_bufs = 0;
+  guint i;
+  gint ret;
+
+  g_assert (padding <= sizeof (padding_bytes));
+
+  /* Count the number of buffers. */
+  if (message->n_buffers == -1) {
+    for (i = 0; message->buffers[i].buffer != NULL; i++)
+      n_bufs++;
+  } else {
+    n_bufs = message->n_buffers;
+  }
+
+  /* Room for the header and padding around the payload buffers. Messages
+   * with more buffers than usual are rare, and take a heap allocation. */
+  if (n_bufs + 2 <= G_N_ELEMENTS (stack_bufs))
+    local_bufs = stack_bufs;
+  else
+    local_bufs = g_new (GOutputVector, n_bufs + 2);
+
+  local_message.buffers = local_bufs;
+  local_message.n_buffers = n_bufs + 1;
+
+  local_bufs[0].buffer = header;
+  local_bufs[0].size = header_len;
+
+  for (i = 0; i < n_bufs; i++) {
+    local_bufs[i + 1].buffer = message->buffers[i].buffer;
+    local_bufs[i + 1].size = message->buffers[i].size;
+  }
+
+  if (padding > 0) {
+    local_bufs[n_bufs + 1].buffer = padding_bytes;
+    local_bufs[n_bufs + 1].size = padding;
+    local_message.n_buffers++;
+  }
+
+  ret = _socket_send_messages_wrapped (priv->base_socket, &priv->server_addr,
+      &local_message, 1, reliable);
+
+  if (local_bufs != stack_bufs)
+    g_free (local_bufs);
+
+  return ret;
+}
+
+/* Sends @message to the server in the Send indication @msg, whose last
+ * attribute is still to be added. Send indications carry neither
+ * MESSAGE-INTEGRITY nor FINGERPRINT, so rather than being copied into @msg,
+ * the payload is sent by reference between the STUN header and the
+ * padding. */
+static gssize
+socket_send_indication_by_reference (UdpTurnPriv *priv, StunMessage *msg,
+    const NiceOutputMessage *message, gboolean reliable)
+{
+  gsize message_len;
+  size_t padding;
+  gint ret;
+
+  message_len = output_message_get_size (message);
+  if (stun_message_append_external (msg, STUN_ATTRIBUTE_DATA, message_len,
+          &padding) != STUN_MESSAGE_RETURN_SUCCESS)
+    return -1;
+
+  ret = socket_send_framed_by_reference (priv, msg->buffer,
+      stun_message_length (msg) - message_len - padding, message, padding,
+      reliable);
+
+  if (ret == 1)
+    return stun_message_length (msg);
+  return ret;
+}
+
+/* Sends @message to the server as ChannelData on @binding. The 4-byte
+ * ChannelData header is sent as a vector of its own in front of the
+ * payload. */
+static gssize
+socket_send_channel_data_by_reference (UdpTurnPriv *priv,
+    const ChannelBinding *binding, const NiceOutputMessage *message,
+    gsize message_len, gboolean reliable)
+{
+  guint8 header[4];
+  uint16_t len16, channel16;
+  gint ret;
+
+  len16 = htons ((uint16_t) message_len);
+  channel16 = htons (binding->channel);
+
+  memcpy (header, &channel16, sizeof(uint16_t));
+  memcpy (header + sizeof(uint16_t), &len16, sizeof(uint16_t));
+
+  ret = socket_send_framed_by_reference (priv, header, sizeof (header),
+      message, 0, reliable);
+
+  if (ret == 1)
+    return message_len + sizeof (header);
+  return ret;
+}
+
 static gssize
 socket_send_message (NiceSocket *sock, const NiceAddress *to,
     const NiceOutputMessage *message, gboolean reliable)
@@ -689,7 +898,6 @@ socket_send_message (NiceSocket *sock, const NiceAddress *to,
     struct sockaddr_storage storage;
     struct sockaddr addr;
   } sa;
-  GList *i;
   ChannelBinding *binding = NULL;
   gint ret;
 
@@ -697,13 +905,7 @@ socket_send_message (NiceSocket *sock, const NiceAddress *to,
   if (sock->priv == NULL)
     return -1;
 
-  for (i = priv->channels; i; i = i->next) {
-    ChannelBinding *b = i->data;
-    if (nice_address_equal (&b->peer, to)) {
-      binding = b;
-      break;
-    }
-  }
+  binding = priv_find_channel_binding_by_peer (priv, to);
 
   nice_address_copy_to_sockaddr (to, &sa.addr);
 
@@ -712,6 +914,16 @@ socket_send_message (NiceSocket *sock, const NiceAddress *to,
         priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
       gsize message_len = output_message_get_size (message);
 
+      if (message_len > G_MAXUINT16)
+        goto error;
+
+      /* Data for a peer without a permission yet is queued, which needs a
+       * copy anyway. */
+      if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
+          priv_has_permission_for_peer (priv, to))
+        return socket_send_channel_data_by_reference (priv, binding, message,
+            message_len, reliable);
+
       if (message_len + sizeof(uint32_t) <= sizeof(buffer)) {
         guint j;
         uint16_t len16, channel16;
@@ -723,9 +935,6 @@ socket_send_message (NiceSocket *sock, const NiceAddress *to,
         memcpy (buffer, &channel16, sizeof(uint16_t));
         memcpy (buffer + sizeof(uint16_t), &len16, sizeof(uint16_t));
 
-        /* FIXME: Slow path! This should be replaced by code which manipulates
-         * the GOutputVector array, rather than the buffer contents
-         * themselves. */
         for (j = 0;
              (message->n_buffers >= 0 && j < (guint) message->n_buffers) ||
              (message->n_buffers < 0 && message->buffers[j].buffer != NULL);
@@ -752,9 +961,6 @@ socket_send_message (NiceSocket *sock, const NiceAddress *to,
       return ret;
     }
   } else {
-    guint8 *compacted_buf;
-    gsize compacted_buf_len;
-
     if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
         priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
       if (!stun_agent_init_indication (&priv->agent, &msg,
@@ -764,6 +970,13 @@ socket_send_message (NiceSocket *sock, const NiceAddress *to,
               &sa.storage, sizeof(sa)) !=
           STUN_MESSAGE_RETURN_SUCCESS)
         goto error;
+
+      /* Data for a peer without a permission yet is queued, which needs a
+       * copy anyway. */
+      if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
+          priv_has_permission_for_peer (priv, to))
+        return socket_send_indication_by_reference (priv, &msg, message,
+            reliable);
     } else {
       if (!stun_agent_init_request (&priv->agent, &msg,
               buffer, sizeof(buffer), STUN_SEND))
@@ -800,18 +1013,11 @@ socket_send_message (NiceSocket *sock, const NiceAddress *to,
       stun_message_ensure_ms_realm(&msg, priv->ms_realm);
     }
 
-    /* Slow path! We have to compact the buffers to append them to the message.
-     * FIXME: This could be improved by adding vectored I/O support to
-      * stun_message_append_bytes(). */
-    compacted_buf = compact_output_message (message, &compacted_buf_len);
-
-    if (stun_message_append_bytes (&msg, STUN_ATTRIBUTE_DATA,
-            compacted_buf, compacted_buf_len) != STUN_MESSAGE_RETURN_SUCCESS) {
-      g_free (compacted_buf);
+    /* GOutputVector and StunInputVector have the same layout. */
+    if (stun_message_append_bytes_vectored (&msg, STUN_ATTRIBUTE_DATA,
+            (const StunInputVector *) message->buffers, message->n_buffers) !=
+        STUN_MESSAGE_RETURN_SUCCESS)
       goto error;
-    }
-
-    g_free (compacted_buf);
 
     /* Finish the message. */
     msg_len = stun_agent_finish_message (&priv->agent, &msg,
@@ -819,10 +1025,9 @@ socket_send_message (NiceSocket *sock, const NiceAddress *to,
     if (msg_len > 0 && stun_message_get_class (&msg) == STUN_REQUEST) {
       SendRequest *req = g_slice_new0 (SendRequest);
 
-      req->priv = priv;
       stun_message_id (&msg, req->id);
       req->source = priv_timeout_add_with_context (priv,
-          STUN_END_TIMEOUT, FALSE, priv_forget_send_request, req);
+          STUN_END_TIMEOUT, FALSE, priv_forget_send_request);
       g_queue_push_tail (priv->send_requests, req);
     }
   }
@@ -866,12 +1071,15 @@ static gint
 socket_send_messages (NiceSocket *sock, const NiceAddress *to,
     const NiceOutputMessage *messages, guint n_messages)
 {
+  UdpTurnPriv *priv = (UdpTurnPriv *) sock->priv;
   guint i;
 
   /* Socket has been closed: */
-  if (sock->priv == NULL)
+  if (priv == NULL)
     return -1;
 
+  g_rec_mutex_lock (&priv->mutex);
+
   for (i = 0; i < n_messages; i++) {
     const NiceOutputMessage *message = &messages[i];
     gssize len;
@@ -882,6 +1090,7 @@ socket_send_messages (NiceSocket *sock, const NiceAddress *to,
       /* Error. */
       if (i > 0)
         break;
+      g_rec_mutex_unlock (&priv->mutex);
       return len;
     } else if (len == 0) {
       /* EWOULDBLOCK. */
@@ -889,6 +1098,8 @@ socket_send_messages (NiceSocket *sock, const NiceAddress *to,
     }
   }
 
+  g_rec_mutex_unlock (&priv->mutex);
+
   return i;
 }
 
@@ -904,9 +1115,12 @@ socket_send_messages_reliable (NiceSocket *sock, const NiceAddress *to,
    * data, then we must be sure that the reliable send will succeed later, so
    * we check for udp-bsd here as the base socket and don't allow it.
    */
-  if (priv->base_socket->type == NICE_SOCKET_TYPE_UDP_BSD)
+  if (priv->base_socket->type == NICE_SOCKET_TYPE_UDP_BSD ||
+      priv->base_socket->type == NICE_SOCKET_TYPE_UDP_URING)
     return -1;
 
+  g_rec_mutex_lock (&priv->mutex);
+
   for (i = 0; i < n_messages; i++) {
     const NiceOutputMessage *message = &messages[i];
     gssize len;
@@ -915,6 +1129,7 @@ socket_send_messages_reliable (NiceSocket *sock, const NiceAddress *to,
 
     if (len < 0) {
       /* Error. */
+      g_rec_mutex_unlock (&priv->mutex);
       return len;
     } else if (len == 0) {
       /* EWOULDBLOCK. */
@@ -922,6 +1137,8 @@ socket_send_messages_reliable (NiceSocket *sock, const NiceAddress *to,
     }
   }
 
+  g_rec_mutex_unlock (&priv->mutex);
+
   return i;
 }
 
@@ -953,28 +1170,43 @@ socket_set_writable_callback (NiceSocket *sock,
 static gboolean
 priv_forget_send_request (gpointer pointer)
 {
-  SendRequest *req = pointer;
+  UdpTurnPriv *priv = pointer;
+  GSource *source;
+  SendRequest *req = NULL;
+  GList *i;
 
-  agent_lock ();
+  g_rec_mutex_lock (&priv->mutex);
 
-  if (g_source_is_destroyed (g_main_current_source ())) {
+  source = g_main_current_source ();
+  if (g_source_is_destroyed (source)) {
     nice_debug ("Source was destroyed. "
         "Avoided race condition in turn.c:priv_forget_send_request");
-    agent_unlock ();
+    g_rec_mutex_unlock (&priv->mutex);
     return FALSE;
   }
 
-  stun_agent_forget_transaction (&req->priv->agent, req->id);
+  /* find the request this timer belongs to */
+  for (i = g_queue_peek_head_link (priv->send_requests); i; i = i->next) {
+    SendRequest *r = i->data;
+    if (r->source == source) {
+      req = r;
+      g_queue_delete_link (priv->send_requests, i);
+      break;
+    }
+  }
 
-  g_queue_remove (req->priv->send_requests, req);
+  if (req) {
+    stun_agent_forget_transaction (&priv->agent, req->id);
 
-  g_source_destroy (req->source);
-  g_source_unref (req->source);
-  req->source = NULL;
+    g_source_destroy (req->source);
+    g_source_unref (req->source);
+    req->source = NULL;
+  }
 
-  agent_unlock ();
+  g_rec_mutex_unlock (&priv->mutex);
 
-  g_slice_free (SendRequest, req);
+  if (req)
+    g_slice_free (SendRequest, req);
 
   return FALSE;
 }
@@ -986,11 +1218,19 @@ priv_permission_timeout (gpointer data)
 
   nice_debug ("Permission is about to timeout, schedule renewal");
 
-  agent_lock ();
+  g_rec_mutex_lock (&priv->mutex);
+
+  if (g_source_is_destroyed (g_main_current_source ())) {
+    nice_debug ("Source was destroyed. "
+        "Avoided race condition in turn.c:priv_permission_timeout");
+    g_rec_mutex_unlock (&priv->mutex);
+    return FALSE;
+  }
+
   /* remove all permissions for this agent (the permission for the peer
      we are sending to will be renewed) */
   priv_clear_permissions (priv);
-  agent_unlock ();
+  g_rec_mutex_unlock (&priv->mutex);
 
   return TRUE;
 }
@@ -1004,13 +1244,13 @@ priv_binding_expired_timeout (gpointer data)
 
   nice_debug ("Permission expired, refresh failed");
 
-  agent_lock ();
+  g_rec_mutex_lock (&priv->mutex);
 
   source = g_main_current_source ();
   if (g_source_is_destroyed (source)) {
     nice_debug ("Source was destroyed. "
         "Avoided race condition in turn.c:priv_binding_expired_timeout");
-    agent_unlock ();
+    g_rec_mutex_unlock (&priv->mutex);
     return FALSE;
   }
 
@@ -1018,7 +1258,7 @@ priv_binding_expired_timeout (gpointer data)
   for (i = priv->channels ; i; i = i->next) {
     ChannelBinding *b = i->data;
     if (b->timeout_source == source) {
-      priv->channels = g_list_remove (priv->channels, b);
+      priv_remove_channel_binding (priv, b);
       /* Make sure we don't free a currently being-refreshed binding */
       if (priv->current_binding_msg && !priv->current_binding) {
         union {
@@ -1050,7 +1290,7 @@ priv_binding_expired_timeout (gpointer data)
     }
   }
 
-  agent_unlock ();
+  g_rec_mutex_unlock (&priv->mutex);
 
   return FALSE;
 }
@@ -1064,13 +1304,13 @@ priv_binding_timeout (gpointer data)
 
   nice_debug ("Permission is about to timeout, sending binding renewal");
 
-  agent_lock ();
+  g_rec_mutex_lock (&priv->mutex);
 
   source = g_main_current_source ();
   if (g_source_is_destroyed (source)) {
     nice_debug ("Source was destroyed. "
         "Avoided race condition in turn.c:priv_binding_timeout");
-    agent_unlock ();
+    g_rec_mutex_unlock (&priv->mutex);
     return FALSE;
   }
 
@@ -1081,7 +1321,7 @@ priv_binding_timeout (gpointer data)
       b->renew = TRUE;
       /* Install timer to expire the permission */
       b->timeout_source = priv_timeout_add_with_context (priv,
-          STUN_EXPIRE_TIMEOUT, TRUE, priv_binding_expired_timeout, priv);
+          STUN_EXPIRE_TIMEOUT, TRUE, priv_binding_expired_timeout);
 
       /* Send renewal */
       if (!priv->current_binding_msg)
@@ -1090,17 +1330,106 @@ priv_binding_timeout (gpointer data)
     }
   }
 
-  agent_unlock ();
+  g_rec_mutex_unlock (&priv->mutex);
 
   return FALSE;
 }
 
+/* Moves the @len bytes at @offset in @message's buffers to the start of
+ * them, walking the buffers in place. */
+static void
+priv_input_message_shift (NiceInputMessage *message, gsize offset, gsize len)
+{
+  GInputVector *dst = message->buffers, *src = message->buffers;
+  gsize dst_pos = 0, src_pos = offset;
+
+  while (len > 0) {
+    gsize chunk;
+
+    while (src_pos >= src->size) {
+      src_pos -= src->size;
+      src++;
+    }
+    while (dst_pos >= dst->size) {
+      dst_pos = 0;
+      dst++;
+    }
+
+    chunk = MIN (len, MIN (src->size - src_pos, dst->size - dst_pos));
+    memmove ((guint8 *) dst->buffer + dst_pos,
+        (guint8 *) src->buffer + src_pos, chunk);
+
+    src_pos += chunk;
+    dst_pos += chunk;
+    len -= chunk;
+  }
+}
+
+/* Unwraps a ChannelData message from the server spread over several
+ * buffers, by moving its payload to the front of them. Anything else is left
+ * for priv_parse_recv(), and FALSE returned. */
+static gboolean
+priv_parse_channel_data_vectored (NiceSocket *sock, NiceSocket **from_sock,
+    NiceInputMessage *message)
+{
+  UdpTurnPriv *priv;
+  ChannelBinding *binding;
+  guint8 header[4];
+  gsize header_len = 0;
+  guint16 channel, data_len;
+  guint i;
+
+  if (message->length < sizeof (header) || nice_socket_is_reliable (sock))
+    return FALSE;
+
+  for (i = 0; header_len < sizeof (header); i++) {
+    gsize chunk = MIN (sizeof (header) - header_len, message->buffers[i].size);
+
+    memcpy (header + header_len, message->buffers[i].buffer, chunk);
+    header_len += chunk;
+  }
+
+  /* Channel numbers start with the bits 01, STUN messages with 00 */
+  if ((header[0] & 0xc0) != 0x40)
+    return FALSE;
+
+  channel = (header[0] << 8) | header[1];
+  data_len = (header[2] << 8) | header[3];
+
+  priv = (UdpTurnPriv *) sock->priv;
+  if (priv == NULL)
+    return FALSE;
+
+  g_rec_mutex_lock (&priv->mutex);
+
+  if ((priv->compatibility != NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 &&
+       priv->compatibility != NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) ||
+      !nice_address_equal (&priv->server_addr, message->from)) {
+    g_rec_mutex_unlock (&priv->mutex);
+    return FALSE;
+  }
+
+  binding = priv_find_channel_binding_by_number (priv, channel);
+  if (binding == NULL) {
+    g_rec_mutex_unlock (&priv->mutex);
+    return FALSE;
+  }
+
+  *message->from = binding->peer;
+  *from_sock = sock;
+
+  g_rec_mutex_unlock (&priv->mutex);
+
+  message->length = MIN (data_len, message->length - sizeof (header));
+  priv_input_message_shift (message, sizeof (header), message->length);
+
+  return TRUE;
+}
+
 guint
 nice_udp_turn_socket_parse_recv_message (NiceSocket *sock, NiceSocket **from_sock,
     NiceInputMessage *message)
 {
-  /* TODO: Speed this up in the common reliable case of having a 24-byte header
-   * buffer to begin with, followed by one or more massive buffers. */
   guint8 *buf;
   gsize buf_len, len;
 
@@ -1120,6 +1449,11 @@ nice_udp_turn_socket_parse_recv_message (NiceSocket *sock, NiceSocket **from_soc
     return (len > 0) ? 1 : 0;
   }
 
+  /* Relayed data over several buffers, such as the header and body buffers
+   * of reliable agents. */
+  if (priv_parse_channel_data_vectored (sock, from_sock, message))
+    return (message->length > 0) ? 1 : 0;
+
   /* Slow path. */
   nice_debug ("%s: **WARNING: SLOW PATH**", G_STRFUNC);
 
@@ -1138,11 +1472,26 @@ nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
     NiceAddress *from, gsize len, guint8 *buf,
     NiceAddress *recv_from, guint8 *_recv_buf, gsize recv_len)
 {
+  UdpTurnPriv *priv = (UdpTurnPriv *) sock->priv;
+  gsize ret;
+
+  g_rec_mutex_lock (&priv->mutex);
+  ret = priv_parse_recv (sock, from_sock, from, len, buf, recv_from,
+      _recv_buf, recv_len);
+  g_rec_mutex_unlock (&priv->mutex);
+
+  return ret;
+}
+
+static gsize
+priv_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
+    NiceAddress *from, gsize len, guint8 *buf,
+    NiceAddress *recv_from, guint8 *_recv_buf, gsize recv_len)
+{
 
   UdpTurnPriv *priv = (UdpTurnPriv *) sock->priv;
   StunValidationStatus valid;
   StunMessage msg;
-  GList *l;
   ChannelBinding *binding = NULL;
 
   union {
@@ -1247,7 +1596,6 @@ nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
               binding = priv->current_binding;
             } else {
               /* Existing binding refresh */
-              GList *i;
               union {
                 struct sockaddr_storage storage;
                 struct sockaddr addr;
@@ -1261,13 +1609,7 @@ nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
                   STUN_ATTRIBUTE_XOR_PEER_ADDRESS, &sa.storage, &sa_len);
               nice_address_set_from_sockaddr (&to, &sa.addr);
 
-              for (i = priv->channels; i; i = i->next) {
-                ChannelBinding *b = i->data;
-                if (nice_address_equal (&b->peer, &to)) {
-                  binding = b;
-                  break;
-                }
-              }
+              binding = priv_find_channel_binding_by_peer (priv, &to);
             }
 
             if (stun_message_get_class (&msg) == STUN_ERROR) {
@@ -1314,8 +1656,7 @@ nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
 
               /* If it's a new channel binding, then add it to the list */
               if (priv->current_binding)
-                priv->channels = g_list_append (priv->channels,
-                    priv->current_binding);
+                priv_insert_channel_binding (priv, priv->current_binding);
               priv->current_binding = NULL;
 
               if (binding) {
@@ -1329,7 +1670,7 @@ nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
                 /* Install timer to schedule refresh of the permission */
                 binding->timeout_source =
                     priv_timeout_add_with_context (priv, STUN_BINDING_TIMEOUT,
-                        TRUE, priv_binding_timeout, priv);
+                        TRUE, priv_binding_timeout);
               }
               priv_process_pending_bindings (priv);
             }
@@ -1413,7 +1754,7 @@ nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
                 !priv->permission_timeout_source) {
               priv->permission_timeout_source =
                   priv_timeout_add_with_context (priv, STUN_PERMISSION_TIMEOUT,
-                      TRUE, priv_permission_timeout, priv);
+                      TRUE, priv_permission_timeout);
             }
 
             /* send enqued data */
@@ -1477,20 +1818,16 @@ nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
   }
 
  recv:
-  for (l = priv->channels; l; l = l->next) {
-    ChannelBinding *b = l->data;
-    if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
-        priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
-      if (b->channel == ntohs(recv_buf.u16[0])) {
-        recv_len = ntohs (recv_buf.u16[1]);
-        recv_buf.u8 += sizeof(uint32_t);
-        binding = b;
-        break;
-      }
-    } else {
-      binding = b;
-      break;
+  if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
+      priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
+    binding = priv_find_channel_binding_by_number (priv,
+        ntohs (recv_buf.u16[0]));
+    if (binding) {
+      recv_len = ntohs (recv_buf.u16[1]);
+      recv_buf.u8 += sizeof(uint32_t);
     }
+  } else if (priv->channels != NULL) {
+    binding = priv->channels->data;
   }
 
   if (binding) {
@@ -1506,13 +1843,12 @@ nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
  msn_google_lock:
 
   if (priv->current_binding) {
-    GList *i = priv->channels;
-    for (; i; i = i->next) {
-      ChannelBinding *b = i->data;
+    while (priv->channels != NULL) {
+      ChannelBinding *b = priv->channels->data;
+      priv_remove_channel_binding (priv, b);
       g_free (b);
     }
-    g_list_free (priv->channels);
-    priv->channels = g_list_append (NULL, priv->current_binding);
+    priv_insert_channel_binding (priv, priv->current_binding);
     priv->current_binding = NULL;
     priv_process_pending_bindings (priv);
   }
@@ -1524,8 +1860,31 @@ gboolean
 nice_udp_turn_socket_set_peer (NiceSocket *sock, NiceAddress *peer)
 {
   UdpTurnPriv *priv = (UdpTurnPriv *) sock->priv;
+  gboolean ret;
+
+  g_rec_mutex_lock (&priv->mutex);
+  ret = priv_add_channel_binding (priv, peer);
+  g_rec_mutex_unlock (&priv->mutex);
 
-  return priv_add_channel_binding (priv, peer);
+  return ret;
+}
+
+/* The server address never changes, so this doesn't take the lock */
+const NiceAddress *
+nice_udp_turn_socket_get_server_addr (NiceSocket *sock)
+{
+  UdpTurnPriv *priv = (UdpTurnPriv *) sock->priv;
+
+  return &priv->server_addr;
+}
+
+/* Nor does the base socket, which is owned by the caller */
+NiceSocket *
+nice_udp_turn_socket_get_base_socket (NiceSocket *sock)
+{
+  UdpTurnPriv *priv = (UdpTurnPriv *) sock->priv;
+
+  return priv->base_socket;
 }
 
 static void
@@ -1670,11 +2029,11 @@ priv_retransmissions_tick (gpointer pointer)
 {
   UdpTurnPriv *priv = pointer;
 
-  agent_lock ();
+  g_rec_mutex_lock (&priv->mutex);
   if (g_source_is_destroyed (g_main_current_source ())) {
     nice_debug ("Source was destroyed. "
         "Avoided race condition in turn.c:priv_retransmissions_tick");
-    agent_unlock ();
+    g_rec_mutex_unlock (&priv->mutex);
     return FALSE;
   }
 
@@ -1685,7 +2044,7 @@ priv_retransmissions_tick (gpointer pointer)
       priv->tick_source_channel_bind = NULL;
     }
   }
-  agent_unlock ();
+  g_rec_mutex_unlock (&priv->mutex);
 
   return FALSE;
 }
@@ -1695,11 +2054,11 @@ priv_retransmissions_create_permission_tick (gpointer pointer)
 {
   UdpTurnPriv *priv = pointer;
 
-  agent_lock ();
+  g_rec_mutex_lock (&priv->mutex);
   if (g_source_is_destroyed (g_main_current_source ())) {
     nice_debug ("Source was destroyed. Avoided race condition in "
                 "turn.c:priv_retransmissions_create_permission_tick");
-    agent_unlock ();
+    g_rec_mutex_unlock (&priv->mutex);
     return FALSE;
   }
 
@@ -1708,7 +2067,7 @@ priv_retransmissions_create_permission_tick (gpointer pointer)
    * if there are pending permissions that require it */
   priv_schedule_tick (priv);
 
-  agent_unlock ();
+  g_rec_mutex_unlock (&priv->mutex);
 
   return FALSE;
 }
@@ -1731,7 +2090,7 @@ priv_schedule_tick (UdpTurnPriv *priv)
     if (timeout > 0) {
       priv->tick_source_channel_bind =
           priv_timeout_add_with_context (priv, timeout, FALSE,
-              priv_retransmissions_tick, priv);
+              priv_retransmissions_tick);
     } else {
       priv_retransmissions_tick_unlocked (priv);
     }
@@ -1770,8 +2129,7 @@ priv_schedule_tick (UdpTurnPriv *priv)
     priv->tick_source_create_permission =
         priv_timeout_add_with_context (priv, FALSE,
             min_timeout,
-            priv_retransmissions_create_permission_tick,
-            priv);
+            priv_retransmissions_create_permission_tick);
   }
 }
 
@@ -1977,15 +2335,10 @@ priv_add_channel_binding (UdpTurnPriv *priv, const NiceAddress *peer)
   if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
       priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
     uint16_t channel = 0x4000;
-    GList *i = priv->channels;
-    for (; i; i = i->next) {
-      ChannelBinding *b = i->data;
-      if (channel == b->channel) {
-        i = priv->channels;
-        channel++;
-        continue;
-      }
-    }
+
+    while (channel < 0xffff &&
+        priv_find_channel_binding_by_number (priv, channel) != NULL)
+      channel++;
 
     if (channel >= 0x4000 && channel < 0xffff) {
       gboolean ret = priv_send_channel_bind (priv, NULL, channel, peer);
@@ -2085,8 +2438,10 @@ nice_udp_turn_socket_set_ms_connection_id (NiceSocket *sock, StunMessage *msg)
       STUN_ATTRIBUTE_MS_SEQUENCE_NUMBER, &alen);
 
   if (ms_seq_num && alen == 24) {
+    g_rec_mutex_lock (&priv->mutex);
     memcpy (priv->ms_connection_id, ms_seq_num, 20);
     priv->ms_sequence_num = ntohl((uint32_t)*(ms_seq_num + 20));
     priv->ms_connection_id_valid = TRUE;
+    g_rec_mutex_unlock (&priv->mutex);
   }
 }
@@ -64,6 +64,12 @@ nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
 gboolean
 nice_udp_turn_socket_set_peer (NiceSocket *sock, NiceAddress *peer);
 
+const NiceAddress *
+nice_udp_turn_socket_get_server_addr (NiceSocket *sock);
+
+NiceSocket *
+nice_udp_turn_socket_get_base_socket (NiceSocket *sock);
+
 NiceSocket *
 nice_udp_turn_socket_new (GMainContext *ctx, NiceAddress *addr,
     NiceSocket *base_socket, NiceAddress *server_addr,
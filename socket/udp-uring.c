@@ -0,0 +1,694 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/*
+ * Implementation of a UDP socket on top of io_uring, wrapping a udp-bsd socket.
+ * A multishot recvmsg keeps filling buffers provided to the kernel, so
+ * receiving only reaps completions from memory shared with the kernel, and the
+ * messages of a send call are submitted with a single io_uring_enter().
+ *
+ * As the kernel drains the socket itself, it is the ring which is polled from
+ * the main loop rather than the socket. Sends use a second ring, so that their
+ * completions never make the socket look readable.
+ */
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+#include <errno.h>
+
+#include "udp-uring.h"
+#include "agent-priv.h"
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+
+/* Buffers provided to the kernel for the multishot receive. Each one holds a
+ * datagram of any size after the header and source address written by the
+ * kernel; only the pages actually written to get backed by memory. There are
+ * as many as component_io_cb() reaps at once: when they run out, the receive
+ * stops and datagrams wait in the socket until it is re-armed, so more would
+ * only cost memory. The number must be a power of 2. */
+#define UDP_URING_N_RECV_BUFS 16
+#define UDP_URING_RECV_BUF_SIZE (sizeof (struct io_uring_recvmsg_out) + \
+    sizeof (struct sockaddr_storage) + 65536)
+#define UDP_URING_BUF_GROUP 0
+
+/* Each filled buffer posts a completion, and a stopped receive and a
+ * cancellation one more each. The completion queue must hold them all, as a
+ * receive whose completion overflows it is ended by the kernel. */
+#define UDP_URING_RECV_CQ_SIZE (2 * UDP_URING_N_RECV_BUFS)
+
+/* Messages are copied into send slots, so that the caller may reuse its
+ * buffers as soon as they have been submitted. Messages which don’t fit in a
+ * slot are sent straight away through the base socket. */
+#define UDP_URING_N_SEND_SLOTS 64
+#define UDP_URING_SEND_SLOT_SIZE 2048
+
+/* user_data of the submissions. Sends carry their slot index instead. */
+#define UDP_URING_TAG_RECV 1
+#define UDP_URING_TAG_CANCEL G_MAXUINT64
+
+static void socket_close (NiceSocket *sock);
+static gint socket_recv_messages (NiceSocket *sock,
+    NiceInputMessage *recv_messages, guint n_recv_messages);
+static gint socket_send_messages (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages);
+static gint socket_send_messages_reliable (NiceSocket *sock,
+    const NiceAddress *to, const NiceOutputMessage *messages, guint n_messages);
+static gboolean socket_is_reliable (NiceSocket *sock);
+static gboolean socket_can_send (NiceSocket *sock, NiceAddress *addr);
+static void socket_set_writable_callback (NiceSocket *sock,
+    NiceSocketWritableCb callback, gpointer user_data);
+static GSource *socket_create_source (NiceSocket *sock);
+
+typedef struct {
+  struct msghdr hdr;
+  struct iovec iov;
+  union {
+    struct sockaddr_storage storage;
+    struct sockaddr addr;
+  } name;
+  guint8 buf[UDP_URING_SEND_SLOT_SIZE];
+} UdpUringSendSlot;
+
+typedef struct {
+  NiceSocket *base_socket;
+
+  /* Receive side, used under the agent lock but also protected here, as
+   * nice_socket_recv_messages() may be called from anywhere. */
+  GMutex recv_mutex;
+  struct io_uring recv_ring;
+  struct io_uring_buf_ring *buf_ring;
+  guint8 *recv_bufs;
+  struct msghdr recv_hdr;  /* layout of the received buffers */
+  gboolean recv_armed;
+
+  /* Send side. The agent may send from several threads at once. */
+  GMutex send_mutex;
+  struct io_uring send_ring;
+  UdpUringSendSlot *send_slots;
+  guint free_slots[UDP_URING_N_SEND_SLOTS];
+  guint n_free_slots;
+} UdpUringPriv;
+
+/* Polls the receive ring, which is readable while it has completions. */
+typedef struct {
+  GSource source;
+  GPollFD pollfd;
+  GSocket *gsock;  /* owned; passed to the callback */
+} UdpUringSource;
+
+static void
+priv_recycle_buf (UdpUringPriv *priv, guint bid)
+{
+  io_uring_buf_ring_add (priv->buf_ring,
+      priv->recv_bufs + bid * UDP_URING_RECV_BUF_SIZE, UDP_URING_RECV_BUF_SIZE,
+      bid, io_uring_buf_ring_mask (UDP_URING_N_RECV_BUFS), 0);
+  io_uring_buf_ring_advance (priv->buf_ring, 1);
+}
+
+/* Queue the multishot receive. It still has to be submitted. */
+static gboolean
+priv_arm_recv (UdpUringPriv *priv)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = io_uring_get_sqe (&priv->recv_ring);
+  if (sqe == NULL)
+    return FALSE;
+
+  io_uring_prep_recvmsg_multishot (sqe,
+      g_socket_get_fd (priv->base_socket->fileno), &priv->recv_hdr, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = UDP_URING_BUF_GROUP;
+  io_uring_sqe_set_data64 (sqe, UDP_URING_TAG_RECV);
+  priv->recv_armed = TRUE;
+
+  return TRUE;
+}
+
+/* Handle a completion of the multishot receive. Returns 1 if a datagram was
+ * copied into @message, 0 if there was none, or -1 on error. */
+static gint
+priv_handle_recv_cqe (UdpUringPriv *priv, struct io_uring_cqe *cqe,
+    NiceInputMessage *message)
+{
+  struct io_uring_recvmsg_out *out;
+  guint bid;
+  gint ret = 0;
+
+  /* The receive has stopped, e.g. for lack of buffers. It is re-armed by the
+   * next receive call, by which time the buffers have been returned. */
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    priv->recv_armed = FALSE;
+
+  if (cqe->res < 0) {
+    if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED)
+      return 0;
+
+    nice_debug ("UDP io_uring socket: receive failed: %s",
+        g_strerror (-cqe->res));
+    return -1;
+  }
+
+  if (!(cqe->flags & IORING_CQE_F_BUFFER))
+    return 0;
+
+  bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  out = io_uring_recvmsg_validate (priv->recv_bufs +
+      bid * UDP_URING_RECV_BUF_SIZE, cqe->res, &priv->recv_hdr);
+
+  if (out == NULL || (out->flags & MSG_TRUNC)) {
+    nice_debug ("UDP io_uring socket: dropping truncated datagram");
+  } else {
+    const guint8 *payload = io_uring_recvmsg_payload (out, &priv->recv_hdr);
+    gsize len = io_uring_recvmsg_payload_length (out, cqe->res,
+        &priv->recv_hdr);
+    guint i;
+
+    /* Empty datagrams are dropped, as by udp-bsd. Anything which doesn’t fit
+     * in @message is lost, as with recvmsg(). */
+    message->length = 0;
+
+    for (i = 0;
+         len > 0 &&
+         ((message->n_buffers >= 0 && i < (guint) message->n_buffers) ||
+          (message->n_buffers < 0 && message->buffers[i].buffer != NULL));
+         i++) {
+      gsize n = MIN (message->buffers[i].size, len);
+
+      memcpy (message->buffers[i].buffer, payload, n);
+      payload += n;
+      len -= n;
+      message->length += n;
+    }
+
+    if (message->length > 0) {
+      if (message->from != NULL)
+        nice_address_set_from_sockaddr (message->from,
+            io_uring_recvmsg_name (out));
+      ret = 1;
+    }
+  }
+
+  priv_recycle_buf (priv, bid);
+
+  return ret;
+}
+
+/* Reap receive completions into @messages, up to @n_messages of them. Returns
+ * the number of messages filled in. */
+static guint
+priv_reap_recv (UdpUringPriv *priv, NiceInputMessage *messages,
+    guint n_messages, gboolean *error)
+{
+  struct io_uring_cqe *cqe;
+  guint n_valid = 0;
+
+  while (n_valid < n_messages &&
+      io_uring_peek_cqe (&priv->recv_ring, &cqe) == 0) {
+    if (io_uring_cqe_get_data64 (cqe) == UDP_URING_TAG_RECV) {
+      gint ret = priv_handle_recv_cqe (priv, cqe, &messages[n_valid]);
+
+      if (ret > 0)
+        n_valid++;
+      else if (ret < 0)
+        *error = TRUE;
+    }
+
+    io_uring_cqe_seen (&priv->recv_ring, cqe);
+  }
+
+  return n_valid;
+}
+
+/* Return the slots of completed sends. */
+static void
+priv_reap_sends (UdpUringPriv *priv)
+{
+  struct io_uring_cqe *cqe;
+
+  while (io_uring_peek_cqe (&priv->send_ring, &cqe) == 0) {
+    if (cqe->res < 0)
+      nice_debug ("UDP io_uring socket: send failed: %s",
+          g_strerror (-cqe->res));
+
+    priv->free_slots[priv->n_free_slots++] = io_uring_cqe_get_data64 (cqe);
+    io_uring_cqe_seen (&priv->send_ring, cqe);
+  }
+}
+
+NiceSocket *
+nice_udp_uring_socket_new (NiceAddress *addr)
+{
+  NiceSocket *base_socket, *sock;
+  UdpUringPriv *priv;
+  struct io_uring_params params;
+  struct io_uring_cqe *cqe;
+  gint ret;
+  guint i;
+
+  base_socket = nice_udp_bsd_socket_new (addr);
+  if (base_socket == NULL)
+    return NULL;
+
+  priv = g_slice_new0 (UdpUringPriv);
+  priv->base_socket = base_socket;
+  g_mutex_init (&priv->recv_mutex);
+  g_mutex_init (&priv->send_mutex);
+
+  memset (&params, 0, sizeof (params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = UDP_URING_RECV_CQ_SIZE;
+  ret = io_uring_queue_init_params (4, &priv->recv_ring, &params);
+  if (ret < 0) {
+    nice_debug ("UDP io_uring socket: io_uring not available: %s",
+        g_strerror (-ret));
+    goto error_recv_ring;
+  }
+
+  ret = io_uring_queue_init (UDP_URING_N_SEND_SLOTS, &priv->send_ring, 0);
+  if (ret < 0)
+    goto error_send_ring;
+
+  priv->buf_ring = io_uring_setup_buf_ring (&priv->recv_ring,
+      UDP_URING_N_RECV_BUFS, UDP_URING_BUF_GROUP, 0, &ret);
+  if (priv->buf_ring == NULL) {
+    nice_debug ("UDP io_uring socket: provided buffers not supported: %s",
+        g_strerror (-ret));
+    goto error_buf_ring;
+  }
+
+  priv->recv_bufs = g_malloc (UDP_URING_N_RECV_BUFS * UDP_URING_RECV_BUF_SIZE);
+  for (i = 0; i < UDP_URING_N_RECV_BUFS; i++)
+    priv_recycle_buf (priv, i);
+
+  priv->recv_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+
+  priv->send_slots = g_new (UdpUringSendSlot, UDP_URING_N_SEND_SLOTS);
+  for (i = 0; i < UDP_URING_N_SEND_SLOTS; i++)
+    priv->free_slots[i] = i;
+  priv->n_free_slots = UDP_URING_N_SEND_SLOTS;
+
+  /* Without data to receive, the multishot receive only completes straight
+   * away if the kernel doesn’t support it. */
+  priv_arm_recv (priv);
+  io_uring_submit (&priv->recv_ring);
+
+  if (io_uring_peek_cqe (&priv->recv_ring, &cqe) == 0 && cqe->res < 0) {
+    nice_debug ("UDP io_uring socket: multishot receive not supported: %s",
+        g_strerror (-cqe->res));
+    goto error_recv;
+  }
+
+  sock = g_slice_new0 (NiceSocket);
+  sock->type = NICE_SOCKET_TYPE_UDP_URING;
+  sock->addr = base_socket->addr;
+  sock->fileno = base_socket->fileno;
+  sock->priv = priv;
+  sock->send_messages = socket_send_messages;
+  sock->send_messages_reliable = socket_send_messages_reliable;
+  sock->recv_messages = socket_recv_messages;
+  sock->is_reliable = socket_is_reliable;
+  sock->can_send = socket_can_send;
+  sock->set_writable_callback = socket_set_writable_callback;
+  sock->create_source = socket_create_source;
+  sock->close = socket_close;
+
+  return sock;
+
+ error_recv:
+  g_free (priv->send_slots);
+  io_uring_free_buf_ring (&priv->recv_ring, priv->buf_ring,
+      UDP_URING_N_RECV_BUFS, UDP_URING_BUF_GROUP);
+  g_free (priv->recv_bufs);
+ error_buf_ring:
+  io_uring_queue_exit (&priv->send_ring);
+ error_send_ring:
+  io_uring_queue_exit (&priv->recv_ring);
+ error_recv_ring:
+  g_mutex_clear (&priv->send_mutex);
+  g_mutex_clear (&priv->recv_mutex);
+  g_slice_free (UdpUringPriv, priv);
+  nice_socket_free (base_socket);
+
+  return NULL;
+}
+
+/* Cancel everything in flight on @ring, and wait until it has completed, so
+ * that the kernel is done with the memory it was given. */
+static void
+priv_cancel_all (struct io_uring *ring, guint n_in_flight,
+    gboolean (*is_done) (struct io_uring_cqe *cqe))
+{
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+
+  if (n_in_flight == 0)
+    return;
+
+  sqe = io_uring_get_sqe (ring);
+  if (sqe != NULL) {
+    io_uring_prep_cancel64 (sqe, 0, IORING_ASYNC_CANCEL_ANY);
+    io_uring_sqe_set_data64 (sqe, UDP_URING_TAG_CANCEL);
+    io_uring_submit (ring);
+  }
+
+  while (n_in_flight > 0 && io_uring_wait_cqe (ring, &cqe) == 0) {
+    if (is_done (cqe))
+      n_in_flight--;
+    io_uring_cqe_seen (ring, cqe);
+  }
+}
+
+static gboolean
+recv_cqe_is_final (struct io_uring_cqe *cqe)
+{
+  return (io_uring_cqe_get_data64 (cqe) == UDP_URING_TAG_RECV &&
+      !(cqe->flags & IORING_CQE_F_MORE));
+}
+
+static gboolean
+send_cqe_is_final (struct io_uring_cqe *cqe)
+{
+  return (io_uring_cqe_get_data64 (cqe) != UDP_URING_TAG_CANCEL);
+}
+
+static void
+socket_close (NiceSocket *sock)
+{
+  UdpUringPriv *priv = sock->priv;
+
+  priv_reap_sends (priv);
+  priv_cancel_all (&priv->send_ring,
+      UDP_URING_N_SEND_SLOTS - priv->n_free_slots, send_cqe_is_final);
+  priv_cancel_all (&priv->recv_ring, priv->recv_armed ? 1 : 0,
+      recv_cqe_is_final);
+
+  io_uring_free_buf_ring (&priv->recv_ring, priv->buf_ring,
+      UDP_URING_N_RECV_BUFS, UDP_URING_BUF_GROUP);
+  io_uring_queue_exit (&priv->recv_ring);
+  io_uring_queue_exit (&priv->send_ring);
+  g_free (priv->recv_bufs);
+  g_free (priv->send_slots);
+
+  g_mutex_clear (&priv->send_mutex);
+  g_mutex_clear (&priv->recv_mutex);
+
+  nice_socket_free (priv->base_socket);
+  g_slice_free (UdpUringPriv, priv);
+
+  sock->priv = NULL;
+  sock->fileno = NULL;
+}
+
+static gint
+socket_recv_messages (NiceSocket *sock,
+    NiceInputMessage *recv_messages, guint n_recv_messages)
+{
+  UdpUringPriv *priv = sock->priv;
+  gboolean error = FALSE;
+  gboolean flushed = FALSE;
+  guint n_valid = 0;
+
+  /* Socket has been closed: */
+  if (priv == NULL)
+    return 0;
+
+  if (n_recv_messages == 0)
+    return 0;
+
+  g_mutex_lock (&priv->recv_mutex);
+
+  while (TRUE) {
+    guint n_reaped;
+
+    n_reaped = priv_reap_recv (priv, &recv_messages[n_valid],
+        n_recv_messages - n_valid, &error);
+    n_valid += n_reaped;
+
+    if (n_valid == n_recv_messages || error)
+      break;
+
+    /* The kernel may not have posted everything it has received yet, as it
+     * hands datagrams over in bursts. Ask it for more, until that brings
+     * nothing new, re-arming the receive first if it stopped. */
+    if (flushed && n_reaped == 0)
+      break;
+
+    if (!priv->recv_armed)
+      priv_arm_recv (priv);
+
+    io_uring_submit_and_get_events (&priv->recv_ring);
+    flushed = TRUE;
+  }
+
+  /* The receive may have stopped on the last completion reaped, after which
+   * the ring wouldn’t become readable again until it is re-armed. */
+  if (!priv->recv_armed && !error && priv_arm_recv (priv))
+    io_uring_submit (&priv->recv_ring);
+
+  g_mutex_unlock (&priv->recv_mutex);
+
+  if (error && n_valid == 0)
+    return -1;
+
+  return n_valid;
+}
+
+/* Copy @message into a free slot and queue it for sending to @sa. Returns
+ * %FALSE if there is no room left. */
+static gboolean
+priv_queue_send (UdpUringPriv *priv, const struct sockaddr *sa,
+    socklen_t namelen, const NiceOutputMessage *message)
+{
+  UdpUringSendSlot *slot;
+  struct io_uring_sqe *sqe;
+  gsize len = 0;
+  guint i, slot_index;
+
+  if (priv->n_free_slots == 0) {
+    /* Send what has been queued so far, and see if that freed anything. */
+    io_uring_submit (&priv->send_ring);
+    priv_reap_sends (priv);
+
+    if (priv->n_free_slots == 0)
+      return FALSE;
+  }
+
+  sqe = io_uring_get_sqe (&priv->send_ring);
+  if (sqe == NULL)
+    return FALSE;
+
+  slot_index = priv->free_slots[--priv->n_free_slots];
+  slot = &priv->send_slots[slot_index];
+
+  for (i = 0;
+       (message->n_buffers >= 0 && i < (guint) message->n_buffers) ||
+       (message->n_buffers < 0 && message->buffers[i].buffer != NULL);
+       i++) {
+    memcpy (slot->buf + len, message->buffers[i].buffer,
+        message->buffers[i].size);
+    len += message->buffers[i].size;
+  }
+
+  memcpy (&slot->name, sa, namelen);
+  slot->iov.iov_base = slot->buf;
+  slot->iov.iov_len = len;
+
+  memset (&slot->hdr, 0, sizeof (slot->hdr));
+  slot->hdr.msg_name = &slot->name.addr;
+  slot->hdr.msg_namelen = namelen;
+  slot->hdr.msg_iov = &slot->iov;
+  slot->hdr.msg_iovlen = 1;
+
+  io_uring_prep_sendmsg (sqe, g_socket_get_fd (priv->base_socket->fileno),
+      &slot->hdr, 0);
+  io_uring_sqe_set_data64 (sqe, slot_index);
+
+  return TRUE;
+}
+
+/* Messages are reported as sent once they have been queued for the kernel. As
+ * with any UDP send, they may still be dropped later on. */
+static gint
+socket_send_messages (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  UdpUringPriv *priv = sock->priv;
+  union {
+    struct sockaddr_storage storage;
+    struct sockaddr addr;
+  } sa;
+  socklen_t namelen;
+  guint i;
+
+  /* Socket has been closed: */
+  if (priv == NULL)
+    return -1;
+
+  nice_address_copy_to_sockaddr (to, &sa.addr);
+  namelen = (sa.addr.sa_family == AF_INET6) ?
+      sizeof (struct sockaddr_in6) : sizeof (struct sockaddr_in);
+
+  g_mutex_lock (&priv->send_mutex);
+
+  priv_reap_sends (priv);
+
+  for (i = 0; i < n_messages; i++) {
+    gsize len = output_message_get_size (&messages[i]);
+    gint ret;
+
+    if (len > 0 && len <= UDP_URING_SEND_SLOT_SIZE) {
+      /* Out of slots: the socket would block. */
+      if (!priv_queue_send (priv, &sa.addr, namelen, &messages[i]))
+        break;
+      continue;
+    }
+
+    /* Empty messages, and ones too large for a slot, go through the base
+     * socket, so they are reported the same way as by udp-bsd. Anything
+     * queued so far goes first, to keep the messages in order. */
+    io_uring_submit (&priv->send_ring);
+    ret = nice_socket_send_messages (priv->base_socket, to, &messages[i], 1);
+
+    if (ret < 0 && i == 0) {
+      g_mutex_unlock (&priv->send_mutex);
+      return -1;
+    } else if (ret <= 0) {
+      break;
+    }
+  }
+
+  io_uring_submit (&priv->send_ring);
+
+  g_mutex_unlock (&priv->send_mutex);
+
+  return i;
+}
+
+static gint
+socket_send_messages_reliable (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  return -1;
+}
+
+static gboolean
+socket_is_reliable (NiceSocket *sock)
+{
+  return FALSE;
+}
+
+static gboolean
+socket_can_send (NiceSocket *sock, NiceAddress *addr)
+{
+  return TRUE;
+}
+
+static void
+socket_set_writable_callback (NiceSocket *sock,
+    NiceSocketWritableCb callback, gpointer user_data)
+{
+}
+
+static gboolean
+uring_source_prepare (GSource *source, gint *timeout)
+{
+  *timeout = -1;
+
+  return FALSE;
+}
+
+static gboolean
+uring_source_check (GSource *source)
+{
+  UdpUringSource *usource = (UdpUringSource *) source;
+
+  return (usource->pollfd.revents & G_IO_IN) != 0;
+}
+
+static gboolean
+uring_source_dispatch (GSource *source, GSourceFunc callback,
+    gpointer user_data)
+{
+  UdpUringSource *usource = (UdpUringSource *) source;
+
+  if (callback == NULL)
+    return G_SOURCE_REMOVE;
+
+  return ((GSocketSourceFunc) callback) (usource->gsock, G_IO_IN, user_data);
+}
+
+static void
+uring_source_finalize (GSource *source)
+{
+  UdpUringSource *usource = (UdpUringSource *) source;
+
+  g_object_unref (usource->gsock);
+}
+
+static GSourceFuncs uring_source_funcs = {
+  uring_source_prepare,
+  uring_source_check,
+  uring_source_dispatch,
+  uring_source_finalize,
+  NULL,
+  NULL
+};
+
+static GSource *
+socket_create_source (NiceSocket *sock)
+{
+  UdpUringPriv *priv = sock->priv;
+  UdpUringSource *usource;
+
+  usource = (UdpUringSource *) g_source_new (&uring_source_funcs,
+      sizeof (UdpUringSource));
+  g_source_set_name ((GSource *) usource, "libnice io_uring source");
+  usource->pollfd.fd = priv->recv_ring.ring_fd;
+  usource->pollfd.events = G_IO_IN;
+  g_source_add_poll ((GSource *) usource, &usource->pollfd);
+  usource->gsock = g_object_ref (sock->fileno);
+
+  return (GSource *) usource;
+}
+
+#else /* !HAVE_LIBURING */
+
+NiceSocket *
+nice_udp_uring_socket_new (NiceAddress *addr)
+{
+  return NULL;
+}
+
+#endif /* HAVE_LIBURING */
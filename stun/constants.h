@@ -174,13 +174,35 @@
 
 #define STUN_ID_LEN 16
 
+/**
+ * STUN_AGENT_DEFAULT_SAVED_IDS:
+ *
+ * Number of simultaneously ongoing STUN transactions which a #StunAgent can
+ * keep track of in its built-in table, unless it is given more storage with
+ * stun_agent_set_transaction_storage().
+ *
+ * Since: 0.1.11
+ */
+#define STUN_AGENT_DEFAULT_SAVED_IDS 32
+
 /**
  * STUN_AGENT_MAX_SAVED_IDS:
  *
- * Maximum number of simultaneously ongoing STUN transactions.
+ * Number of #StunAgentSavedIds entries that libnice gives the #StunAgent of
+ * each of its TURN sockets, and a reasonable size for the transaction storage
+ * of an agent with many requests outstanding.
+ * <para> See also: stun_agent_set_transaction_storage() </para>
  */
 #define STUN_AGENT_MAX_SAVED_IDS 200
 
+/**
+ * STUN_AGENT_MAX_HMAC_KEYS:
+ *
+ * Maximum number of MESSAGE-INTEGRITY keys whose HMAC key schedule is cached
+ * by a #StunAgent.
+ */
+#define STUN_AGENT_MAX_HMAC_KEYS 4
+
 /**
  * STUN_AGENT_MAX_UNKNOWN_ATTRIBUTES:
  *
@@ -12,10 +12,20 @@
  * See README and COPYING for more details.
  */
 
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
 #include "sha1.h"
 
 #include <string.h>
 
+/* The SHA extensions are used if the CPU supports them. configure defines
+ * HAVE_SHA1_SHANI if the compiler can build and detect them. */
+#ifdef HAVE_SHA1_SHANI
+# include <immintrin.h>
+#endif
+
 
 /* ===== start - public domain SHA1 implementation ===== */
 
@@ -122,8 +132,9 @@ A million repetitions of "a"
 	z += (w ^ x ^ y) + blk(i) + 0xCA62C1D6 + rol(v, 5); \
 	w=rol(w, 30);
 
-static void SHA1Transform(uint32_t state[5], const unsigned char buffer[64]);
-/* Hash a single 512-bit block. This is the core of the algorithm. */
+/* Hash @n_blocks 512-bit blocks. This is the core of the algorithm. */
+typedef void (*SHA1TransformFunc)(uint32_t state[5],
+    const unsigned char *buffer, size_t n_blocks);
 
 static int am_big_endian(void)
 {
@@ -139,7 +150,8 @@ static uint32_t blk0_endiansafe (uint32_t l)
     return (rol(l, 24) & 0xFF00FF00) | (rol(l, 8) & 0x00FF00FF);
 }
 
-static void SHA1Transform(uint32_t state[5], const unsigned char buffer[64])
+static void SHA1TransformBlock(uint32_t state[5],
+    const unsigned char buffer[64])
 {
   uint32_t a, b, c, d, e;
   typedef union {
@@ -190,6 +202,227 @@ static void SHA1Transform(uint32_t state[5], const unsigned char buffer[64])
 }
 
 
+static void SHA1TransformGeneric(uint32_t state[5],
+    const unsigned char *buffer, size_t n_blocks)
+{
+  for (; n_blocks > 0; n_blocks--, buffer += 64)
+    SHA1TransformBlock(state, buffer);
+}
+
+
+#ifdef HAVE_SHA1_SHANI
+/* Intel SHA extensions. Each sha1rnds4 does four rounds, while the message
+ * schedule for the next rounds is computed with sha1msg1, xor and sha1msg2
+ * from the previous four groups of words. */
+__attribute__((target("sha,ssse3,sse4.1")))
+static void SHA1TransformShaNi(uint32_t state[5],
+    const unsigned char *data, size_t n_blocks)
+{
+  __m128i ABCD, ABCD_SAVE, E0, E0_SAVE, E1;
+  __m128i MSG0, MSG1, MSG2, MSG3;
+  const __m128i MASK = _mm_set_epi64x(0x0001020304050607ULL,
+      0x08090a0b0c0d0e0fULL);
+
+  ABCD = _mm_loadu_si128((const __m128i *) state);
+  E0 = _mm_set_epi32(state[4], 0, 0, 0);
+  ABCD = _mm_shuffle_epi32(ABCD, 0x1B);
+
+  for (; n_blocks > 0; n_blocks--, data += 64) {
+    ABCD_SAVE = ABCD;
+    E0_SAVE = E0;
+
+    /* Rounds 0-3 */
+    MSG0 = _mm_loadu_si128((const __m128i *) (data + 0));
+    MSG0 = _mm_shuffle_epi8(MSG0, MASK);
+    E0 = _mm_add_epi32(E0, MSG0);
+    E1 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+
+    /* Rounds 4-7 */
+    MSG1 = _mm_loadu_si128((const __m128i *) (data + 16));
+    MSG1 = _mm_shuffle_epi8(MSG1, MASK);
+    E1 = _mm_sha1nexte_epu32(E1, MSG1);
+    E0 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+    MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+
+    /* Rounds 8-11 */
+    MSG2 = _mm_loadu_si128((const __m128i *) (data + 32));
+    MSG2 = _mm_shuffle_epi8(MSG2, MASK);
+    E0 = _mm_sha1nexte_epu32(E0, MSG2);
+    E1 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+    MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+    MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+    /* Rounds 12-15 */
+    MSG3 = _mm_loadu_si128((const __m128i *) (data + 48));
+    MSG3 = _mm_shuffle_epi8(MSG3, MASK);
+    E1 = _mm_sha1nexte_epu32(E1, MSG3);
+    E0 = ABCD;
+    MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+    MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+    MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+    /* Rounds 16-19 */
+    E0 = _mm_sha1nexte_epu32(E0, MSG0);
+    E1 = ABCD;
+    MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+    MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+    MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+    /* Rounds 20-23 */
+    E1 = _mm_sha1nexte_epu32(E1, MSG1);
+    E0 = ABCD;
+    MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 1);
+    MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+    MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+    /* Rounds 24-27 */
+    E0 = _mm_sha1nexte_epu32(E0, MSG2);
+    E1 = ABCD;
+    MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 1);
+    MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+    MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+    /* Rounds 28-31 */
+    E1 = _mm_sha1nexte_epu32(E1, MSG3);
+    E0 = ABCD;
+    MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 1);
+    MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+    MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+    /* Rounds 32-35 */
+    E0 = _mm_sha1nexte_epu32(E0, MSG0);
+    E1 = ABCD;
+    MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 1);
+    MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+    MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+    /* Rounds 36-39 */
+    E1 = _mm_sha1nexte_epu32(E1, MSG1);
+    E0 = ABCD;
+    MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 1);
+    MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+    MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+    /* Rounds 40-43 */
+    E0 = _mm_sha1nexte_epu32(E0, MSG2);
+    E1 = ABCD;
+    MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 2);
+    MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+    MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+    /* Rounds 44-47 */
+    E1 = _mm_sha1nexte_epu32(E1, MSG3);
+    E0 = ABCD;
+    MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 2);
+    MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+    MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+    /* Rounds 48-51 */
+    E0 = _mm_sha1nexte_epu32(E0, MSG0);
+    E1 = ABCD;
+    MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 2);
+    MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+    MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+    /* Rounds 52-55 */
+    E1 = _mm_sha1nexte_epu32(E1, MSG1);
+    E0 = ABCD;
+    MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 2);
+    MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+    MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+    /* Rounds 56-59 */
+    E0 = _mm_sha1nexte_epu32(E0, MSG2);
+    E1 = ABCD;
+    MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 2);
+    MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+    MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+    /* Rounds 60-63 */
+    E1 = _mm_sha1nexte_epu32(E1, MSG3);
+    E0 = ABCD;
+    MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+    MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+    MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+    /* Rounds 64-67 */
+    E0 = _mm_sha1nexte_epu32(E0, MSG0);
+    E1 = ABCD;
+    MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 3);
+    MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+    MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+    /* Rounds 68-71 */
+    E1 = _mm_sha1nexte_epu32(E1, MSG1);
+    E0 = ABCD;
+    MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+    MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+    /* Rounds 72-75 */
+    E0 = _mm_sha1nexte_epu32(E0, MSG2);
+    E1 = ABCD;
+    MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 3);
+
+    /* Rounds 76-79 */
+    E1 = _mm_sha1nexte_epu32(E1, MSG3);
+    E0 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+    E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+    ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+  }
+
+  ABCD = _mm_shuffle_epi32(ABCD, 0x1B);
+  _mm_storeu_si128((__m128i *) state, ABCD);
+  state[4] = _mm_extract_epi32(E0, 3);
+}
+#endif
+
+
+static SHA1TransformFunc SHA1SelectTransform(void)
+{
+#ifdef HAVE_SHA1_SHANI
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+    return SHA1TransformShaNi;
+#endif
+
+  return SHA1TransformGeneric;
+}
+
+
+static void SHA1Transform(uint32_t state[5], const unsigned char *buffer,
+    size_t n_blocks)
+{
+  /* Threads racing to initialise this all store the same value. */
+  static volatile SHA1TransformFunc transform = NULL;
+  SHA1TransformFunc func = transform;
+
+  if (func == NULL)
+    transform = func = SHA1SelectTransform();
+
+  func(state, buffer, n_blocks);
+}
+
+
 /* SHA1Init - Initialize new context */
 
 void SHA1Init(SHA1_CTX* context)
@@ -217,9 +450,10 @@ void SHA1Update(SHA1_CTX* context, const void *_data, uint32_t len)
   context->count[1] += (len >> 29);
   if ((j + len) > 63) {
     memcpy(&context->buffer[j], data, (i = 64-j));
-    SHA1Transform(context->state, context->buffer);
-    for ( ; i + 63 < len; i += 64) {
-      SHA1Transform(context->state, &data[i]);
+    SHA1Transform(context->state, context->buffer, 1);
+    if (len - i >= 64) {
+      SHA1Transform(context->state, &data[i], (len - i) / 64);
+      i += (len - i) & ~63;
     }
     j = 0;
   }
@@ -327,18 +561,17 @@ void HMACFinal(unsigned char digest[20], HMAC_CTX *context)
 
 
 /**
- * hmac_sha1_vector:
+ * hmac_sha1_precompute:
  * @key: Key for HMAC operations
  * @key_len: Length of the key in bytes
- * @num_elem: Number of elements in the data vector
- * @addr: Pointers to the data areas
- * @len: Lengths of the data blocks
- * @mac: Buffer for the hash (20 bytes)
+ * @inner: SHA1 state after absorbing the key XORd with ipad
+ * @outer: SHA1 state after absorbing the key XORd with opad
  *
- * HMAC-SHA1 over data vector (RFC 2104)
+ * Precompute the HMAC-SHA1 key schedule of @key, so that it can be reused for
+ * several messages with hmac_sha1_vector_precomputed()
  */
-void hmac_sha1_vector(const uint8_t *key, size_t key_len, size_t num_elem,
-    const uint8_t *addr[], const size_t *len, uint8_t *mac)
+void hmac_sha1_precompute(const uint8_t *key, size_t key_len,
+    uint32_t inner[5], uint32_t outer[5])
 {
   unsigned char k_pad[64]; /* padding - key XORd with ipad/opad */
   unsigned char tk[20];
@@ -371,12 +604,10 @@ void hmac_sha1_vector(const uint8_t *key, size_t key_len, size_t num_elem,
   for (i = 0; i < 64; i++)
     k_pad[i] ^= 0x36;
 
-  /* perform inner SHA1 */
+  /* absorb the inner key block */
   SHA1Init(&sha1_ctx);
   SHA1Update(&sha1_ctx, k_pad, 64);
-  for (i = 0; i < num_elem; i++)
-    SHA1Update(&sha1_ctx, addr[i], len[i]);
-  SHA1Final(mac, &sha1_ctx);
+  memcpy(inner, sha1_ctx.state, sizeof(sha1_ctx.state));
 
   memset(k_pad, 0, sizeof(k_pad));
   memcpy(k_pad, key, key_len);
@@ -384,14 +615,76 @@ void hmac_sha1_vector(const uint8_t *key, size_t key_len, size_t num_elem,
   for (i = 0; i < 64; i++)
     k_pad[i] ^= 0x5c;
 
-  /* perform outer SHA1 */
+  /* absorb the outer key block */
   SHA1Init(&sha1_ctx);
   SHA1Update(&sha1_ctx, k_pad, 64);
+  memcpy(outer, sha1_ctx.state, sizeof(sha1_ctx.state));
+
+  memset(k_pad, 0, sizeof(k_pad));
+}
+
+
+/* Resume a SHA1 context which has absorbed exactly one block. */
+static void sha1_resume(SHA1_CTX *context, const uint32_t state[5])
+{
+  memcpy(context->state, state, sizeof(context->state));
+  context->count[0] = 64 << 3;
+  context->count[1] = 0;
+}
+
+
+/**
+ * hmac_sha1_vector_precomputed:
+ * @inner: Inner state, from hmac_sha1_precompute()
+ * @outer: Outer state, from hmac_sha1_precompute()
+ * @num_elem: Number of elements in the data vector
+ * @addr: Pointers to the data areas
+ * @len: Lengths of the data blocks
+ * @mac: Buffer for the hash (20 bytes)
+ *
+ * HMAC-SHA1 over data vector (RFC 2104), with a precomputed key schedule
+ */
+void hmac_sha1_vector_precomputed(const uint32_t inner[5],
+    const uint32_t outer[5], size_t num_elem, const uint8_t *addr[],
+    const size_t *len, uint8_t *mac)
+{
+  size_t i;
+  SHA1_CTX sha1_ctx;
+
+  /* perform inner SHA1 */
+  sha1_resume(&sha1_ctx, inner);
+  for (i = 0; i < num_elem; i++)
+    SHA1Update(&sha1_ctx, addr[i], len[i]);
+  SHA1Final(mac, &sha1_ctx);
+
+  /* perform outer SHA1 */
+  sha1_resume(&sha1_ctx, outer);
   SHA1Update(&sha1_ctx, mac, SHA1_MAC_LEN);
   SHA1Final(mac, &sha1_ctx);
 }
 
 
+/**
+ * hmac_sha1_vector:
+ * @key: Key for HMAC operations
+ * @key_len: Length of the key in bytes
+ * @num_elem: Number of elements in the data vector
+ * @addr: Pointers to the data areas
+ * @len: Lengths of the data blocks
+ * @mac: Buffer for the hash (20 bytes)
+ *
+ * HMAC-SHA1 over data vector (RFC 2104)
+ */
+void hmac_sha1_vector(const uint8_t *key, size_t key_len, size_t num_elem,
+    const uint8_t *addr[], const size_t *len, uint8_t *mac)
+{
+  uint32_t inner[5], outer[5];
+
+  hmac_sha1_precompute(key, key_len, inner, outer);
+  hmac_sha1_vector_precomputed(inner, outer, num_elem, addr, len, mac);
+}
+
+
 /**
  * hmac_sha1:
  * @key: Key for HMAC operations
@@ -49,6 +49,11 @@ void HMACFinal(unsigned char digest[20], HMAC_CTX *context);
 
 void sha1_vector(size_t num_elem, const uint8_t *addr[], const size_t *len,
     uint8_t *mac);
+void hmac_sha1_precompute(const uint8_t *key, size_t key_len,
+    uint32_t inner[5], uint32_t outer[5]);
+void hmac_sha1_vector_precomputed(const uint32_t inner[5],
+    const uint32_t outer[5], size_t num_elem, const uint8_t *addr[],
+    const size_t *len, uint8_t *mac);
 void hmac_sha1_vector(const uint8_t *key, size_t key_len, size_t num_elem,
     const uint8_t *addr[], const size_t *len, uint8_t *mac);
 void hmac_sha1(const uint8_t *key, size_t key_len,
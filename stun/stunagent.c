@@ -41,6 +41,7 @@
 #include "stunmessage.h"
 #include "stunagent.h"
 #include "stunhmac.h"
+#include "sha1.h"
 #include "stun5389.h"
 #include "utils.h"
 
@@ -53,6 +54,70 @@ static bool stun_agent_is_unknown (StunAgent *agent, uint16_t type);
 static unsigned stun_agent_find_unknowns (StunAgent *agent,
     const StunMessage * msg, uint16_t *list, unsigned max);
 
+/* The ongoing transactions are kept in an open-addressed hash table with
+ * linear probing, keyed by transaction ID. Entries are removed by shifting
+ * the rest of their probe run back, so the table never fills with
+ * tombstones. */
+static StunAgentSavedIds *stun_agent_saved_ids (StunAgent *agent)
+{
+  return agent->saved_ids ? agent->saved_ids : agent->sent_ids;
+}
+
+static size_t stun_agent_saved_id_slot (StunAgent *agent,
+    const StunTransactionId id)
+{
+  /* The first four bytes are the magic cookie in RFC5389, so hash the last
+   * four, which are random in all compatibility modes. */
+  uint32_t hash = ((uint32_t) id[12] << 24) | ((uint32_t) id[13] << 16) |
+      ((uint32_t) id[14] << 8) | id[15];
+
+  return hash % agent->max_saved_ids;
+}
+
+/* Returns the slot holding @id, or -1 if it is not in the table */
+static int stun_agent_find_saved_id (StunAgent *agent,
+    const StunTransactionId id)
+{
+  StunAgentSavedIds *ids = stun_agent_saved_ids (agent);
+  size_t i, n;
+
+  i = stun_agent_saved_id_slot (agent, id);
+  for (n = 0; n < agent->max_saved_ids && ids[i].valid; n++) {
+    if (memcmp (id, ids[i].id, sizeof(StunTransactionId)) == 0)
+      return i;
+    if (++i == agent->max_saved_ids)
+      i = 0;
+  }
+
+  return -1;
+}
+
+static void stun_agent_remove_saved_id (StunAgent *agent, size_t i)
+{
+  StunAgentSavedIds *ids = stun_agent_saved_ids (agent);
+  size_t j = i, home;
+
+  ids[i].valid = FALSE;
+  agent->n_saved_ids--;
+
+  for (;;) {
+    if (++j == agent->max_saved_ids)
+      j = 0;
+    if (!ids[j].valid)
+      break;
+
+    /* Move the entry in j to the hole in i unless its home slot lies
+     * cyclically in (i, j], where the hole doesn't break its probe run. */
+    home = stun_agent_saved_id_slot (agent, ids[j].id);
+    if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+      continue;
+
+    ids[i] = ids[j];
+    ids[j].valid = FALSE;
+    i = j;
+  }
+}
+
 void stun_agent_init (StunAgent *agent, const uint16_t *known_attributes,
     StunCompatibility compatibility, StunAgentUsageFlags usage_flags)
 {
@@ -63,9 +128,71 @@ void stun_agent_init (StunAgent *agent, const uint16_t *known_attributes,
   agent->usage_flags = usage_flags;
   agent->software_attribute = NULL;
 
-  for (i = 0; i < STUN_AGENT_MAX_SAVED_IDS; i++) {
-    agent->sent_ids[i].valid = FALSE;
+  stun_agent_set_transaction_storage (agent, NULL, 0);
+
+  for (i = 0; i < STUN_AGENT_MAX_HMAC_KEYS; i++) {
+    agent->hmac_keys[i].key_len = 0;
+  }
+  agent->next_hmac_key = 0;
+}
+
+void stun_agent_set_transaction_storage (StunAgent *agent,
+    StunAgentSavedIds *storage, size_t n_entries)
+{
+  size_t i;
+
+  if (storage == NULL || n_entries == 0) {
+    /* The built-in table is found through a NULL pointer, so that a copy of
+     * the agent does not point into the original. */
+    agent->saved_ids = NULL;
+    agent->max_saved_ids = STUN_AGENT_DEFAULT_SAVED_IDS;
+  } else {
+    agent->saved_ids = storage;
+    agent->max_saved_ids = n_entries;
   }
+  agent->n_saved_ids = 0;
+
+  storage = stun_agent_saved_ids (agent);
+  for (i = 0; i < agent->max_saved_ids; i++)
+    storage[i].valid = FALSE;
+}
+
+/* Computes the MESSAGE-INTEGRITY hash like stun_sha1(). The key is normally a
+ * password which is used for the whole ICE session, so its HMAC key schedule
+ * is cached in @agent rather than recomputed for every message. Keys which
+ * are empty or longer than a SHA1 block are not cached. */
+static void stun_agent_sha1 (StunAgent *agent, const uint8_t *msg, size_t len,
+    size_t msg_len, uint8_t *sha, const uint8_t *key, size_t key_len,
+    int padding)
+{
+  StunAgentHmacKey *cached = NULL;
+  int i;
+
+  if (key_len == 0 || key_len > sizeof (agent->hmac_keys[0].key)) {
+    stun_sha1 (msg, len, msg_len, sha, key, key_len, padding);
+    return;
+  }
+
+  for (i = 0; i < STUN_AGENT_MAX_HMAC_KEYS; i++) {
+    if (agent->hmac_keys[i].key_len == key_len &&
+        memcmp (agent->hmac_keys[i].key, key, key_len) == 0) {
+      cached = &agent->hmac_keys[i];
+      break;
+    }
+  }
+
+  if (cached == NULL) {
+    cached = &agent->hmac_keys[agent->next_hmac_key];
+    agent->next_hmac_key = (agent->next_hmac_key + 1) %
+        STUN_AGENT_MAX_HMAC_KEYS;
+
+    memcpy (cached->key, key, key_len);
+    cached->key_len = key_len;
+    hmac_sha1_precompute (key, key_len, cached->inner, cached->outer);
+  }
+
+  stun_sha1_precomputed (msg, len, msg_len, sha, cached->inner, cached->outer,
+      padding);
 }
 
 
@@ -136,6 +263,7 @@ StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
   msg->key = NULL;
   msg->key_len = 0;
   msg->long_term_valid = FALSE;
+  stun_message_index_attributes (msg);
 
   /* TODO: reject it or not ? */
   if ((agent->compatibility == STUN_COMPATIBILITY_RFC5389 ||
@@ -169,24 +297,22 @@ StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
 
   if (stun_message_get_class (msg) == STUN_RESPONSE ||
       stun_message_get_class (msg) == STUN_ERROR) {
+    StunAgentSavedIds *sent_id;
+
     stun_message_id (msg, msg_id);
-    for (sent_id_idx = 0; sent_id_idx < STUN_AGENT_MAX_SAVED_IDS; sent_id_idx++) {
-      if (agent->sent_ids[sent_id_idx].valid == TRUE &&
-          agent->sent_ids[sent_id_idx].method == stun_message_get_method (msg) &&
-          memcmp (msg_id, agent->sent_ids[sent_id_idx].id,
-              sizeof(StunTransactionId)) == 0) {
-
-        key = agent->sent_ids[sent_id_idx].key;
-        key_len = agent->sent_ids[sent_id_idx].key_len;
-        memcpy (long_term_key, agent->sent_ids[sent_id_idx].long_term_key,
-            sizeof(long_term_key));
-        long_term_key_valid = agent->sent_ids[sent_id_idx].long_term_valid;
-        break;
-      }
+    sent_id_idx = stun_agent_find_saved_id (agent, msg_id);
+    if (sent_id_idx == -1) {
+      return STUN_VALIDATION_UNMATCHED_RESPONSE;
     }
-    if (sent_id_idx == STUN_AGENT_MAX_SAVED_IDS) {
+    sent_id = &stun_agent_saved_ids (agent)[sent_id_idx];
+    if (sent_id->method != stun_message_get_method (msg)) {
       return STUN_VALIDATION_UNMATCHED_RESPONSE;
     }
+
+    key = sent_id->key;
+    key_len = sent_id->key_len;
+    memcpy (long_term_key, sent_id->long_term_key, sizeof(long_term_key));
+    long_term_key_valid = sent_id->long_term_valid;
   }
 
   ignore_credentials =
@@ -262,25 +388,25 @@ StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
 
         if (agent->compatibility == STUN_COMPATIBILITY_RFC3489 ||
             agent->compatibility == STUN_COMPATIBILITY_OC2007) {
-          stun_sha1 (msg->buffer, hash + 20 - msg->buffer, hash - msg->buffer,
-              sha, md5, sizeof(md5), TRUE);
+          stun_agent_sha1 (agent, msg->buffer, hash + 20 - msg->buffer,
+              hash - msg->buffer, sha, md5, sizeof(md5), TRUE);
         } else if (agent->compatibility == STUN_COMPATIBILITY_WLM2009) {
-          stun_sha1 (msg->buffer, hash + 20 - msg->buffer,
+          stun_agent_sha1 (agent, msg->buffer, hash + 20 - msg->buffer,
               stun_message_length (msg) - 20, sha, md5, sizeof(md5), TRUE);
         } else {
-          stun_sha1 (msg->buffer, hash + 20 - msg->buffer,
+          stun_agent_sha1 (agent, msg->buffer, hash + 20 - msg->buffer,
               hash - msg->buffer, sha, md5, sizeof(md5), FALSE);
         }
       } else {
         if (agent->compatibility == STUN_COMPATIBILITY_RFC3489 ||
             agent->compatibility == STUN_COMPATIBILITY_OC2007) {
-          stun_sha1 (msg->buffer, hash + 20 - msg->buffer, hash - msg->buffer,
-              sha, key, key_len, TRUE);
+          stun_agent_sha1 (agent, msg->buffer, hash + 20 - msg->buffer,
+              hash - msg->buffer, sha, key, key_len, TRUE);
         } else if (agent->compatibility == STUN_COMPATIBILITY_WLM2009) {
-          stun_sha1 (msg->buffer, hash + 20 - msg->buffer,
+          stun_agent_sha1 (agent, msg->buffer, hash + 20 - msg->buffer,
               stun_message_length (msg) - 20, sha, key, key_len, TRUE);
         } else {
-          stun_sha1 (msg->buffer, hash + 20 - msg->buffer,
+          stun_agent_sha1 (agent, msg->buffer, hash + 20 - msg->buffer,
               hash - msg->buffer, sha, key, key_len, FALSE);
         }
       }
@@ -308,8 +434,8 @@ StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
   }
 
 
-  if (sent_id_idx != -1 && sent_id_idx < STUN_AGENT_MAX_SAVED_IDS) {
-    agent->sent_ids[sent_id_idx].valid = FALSE;
+  if (sent_id_idx != -1) {
+    stun_agent_remove_saved_id (agent, sent_id_idx);
   }
 
   if (stun_agent_find_unknowns (agent, msg, &unknown, 1) > 0) {
@@ -324,18 +450,13 @@ StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
 
 bool stun_agent_forget_transaction (StunAgent *agent, StunTransactionId id)
 {
-  int i;
+  int i = stun_agent_find_saved_id (agent, id);
 
-  for (i = 0; i < STUN_AGENT_MAX_SAVED_IDS; i++) {
-    if (agent->sent_ids[i].valid == TRUE &&
-        memcmp (id, agent->sent_ids[i].id,
-            sizeof(StunTransactionId)) == 0) {
-      agent->sent_ids[i].valid = FALSE;
-      return TRUE;
-    }
-  }
+  if (i == -1)
+    return FALSE;
 
-  return FALSE;
+  stun_agent_remove_saved_id (agent, i);
+  return TRUE;
 }
 
 bool stun_agent_init_request (StunAgent *agent, StunMessage *msg,
@@ -372,6 +493,56 @@ bool stun_agent_init_request (StunAgent *agent, StunMessage *msg,
   return ret;
 }
 
+bool stun_agent_init_request_from_template (StunAgent *agent,
+    StunMessage *msg, uint8_t *buffer, size_t buffer_len,
+    const StunMessage *tmpl)
+{
+  const uint8_t *src = tmpl->buffer;
+  const uint8_t *attr;
+  uint16_t attr_len;
+  size_t len;
+  StunTransactionId id;
+
+  if (stun_message_get_class (tmpl) != STUN_REQUEST)
+    return FALSE;
+
+  /* Drop the attributes which stun_agent_finish_message() adds */
+  len = stun_message_length (tmpl);
+  attr = stun_message_find (tmpl, STUN_ATTRIBUTE_MESSAGE_INTEGRITY, &attr_len);
+  if (attr != NULL)
+    len = attr - STUN_ATTRIBUTE_HEADER_LENGTH - src;
+  attr = stun_message_find (tmpl, STUN_ATTRIBUTE_FINGERPRINT, &attr_len);
+  if (attr != NULL && (size_t) (attr - STUN_ATTRIBUTE_HEADER_LENGTH - src) < len)
+    len = attr - STUN_ATTRIBUTE_HEADER_LENGTH - src;
+
+  if (len > buffer_len)
+    return FALSE;
+
+  msg->buffer = buffer;
+  msg->buffer_len = buffer_len;
+  msg->agent = agent;
+  msg->key = NULL;
+  msg->key_len = 0;
+  msg->long_term_valid = FALSE;
+  msg->indexed_buffer = NULL;
+
+  /* @tmpl may be the previous request in @buffer */
+  memmove (buffer, src, len);
+  stun_setw (buffer + STUN_MESSAGE_LENGTH_POS,
+      len - STUN_MESSAGE_HEADER_LENGTH);
+
+  /* Keep the magic cookie, if any */
+  stun_make_transid (id);
+  if (agent->compatibility == STUN_COMPATIBILITY_RFC5389 ||
+      agent->compatibility == STUN_COMPATIBILITY_WLM2009)
+    memcpy (buffer + STUN_MESSAGE_TRANS_ID_POS + 4, id + 4,
+        STUN_MESSAGE_TRANS_ID_LEN - 4);
+  else
+    memcpy (buffer + STUN_MESSAGE_TRANS_ID_POS, id, STUN_MESSAGE_TRANS_ID_LEN);
+
+  return TRUE;
+}
+
 
 bool stun_agent_init_indication (StunAgent *agent, StunMessage *msg,
     uint8_t *buffer, size_t buffer_len, StunMethod m)
@@ -511,19 +682,28 @@ size_t stun_agent_finish_message (StunAgent *agent, StunMessage *msg,
 {
   uint8_t *ptr;
   uint32_t fpr;
-  int saved_id_idx = 0;
+  StunAgentSavedIds *saved_id = NULL;
   uint8_t md5[16];
 
   if (stun_message_get_class (msg) == STUN_REQUEST) {
-    for (saved_id_idx = 0; saved_id_idx < STUN_AGENT_MAX_SAVED_IDS; saved_id_idx++) {
-      if (agent->sent_ids[saved_id_idx].valid == FALSE) {
-        break;
-      }
+    StunAgentSavedIds *ids = stun_agent_saved_ids (agent);
+    StunTransactionId id;
+    size_t i;
+
+    if (agent->n_saved_ids == agent->max_saved_ids) {
+      stun_debug ("WARNING: Saved IDs full. STUN message dropped.");
+      return 0;
     }
-  }
-  if (saved_id_idx == STUN_AGENT_MAX_SAVED_IDS) {
-    stun_debug ("WARNING: Saved IDs full. STUN message dropped.");
-    return 0;
+
+    /* A request finished more than once gets an entry each time. They
+     * share a probe run, so the oldest one is matched first. */
+    stun_message_id (msg, id);
+    i = stun_agent_saved_id_slot (agent, id);
+    while (ids[i].valid) {
+      if (++i == agent->max_saved_ids)
+        i = 0;
+    }
+    saved_id = &ids[i];
   }
 
   if (msg->key != NULL) {
@@ -567,33 +747,33 @@ size_t stun_agent_finish_message (StunAgent *agent, StunMessage *msg,
       if (agent->usage_flags & STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS) {
         if (agent->compatibility == STUN_COMPATIBILITY_RFC3489 ||
             agent->compatibility == STUN_COMPATIBILITY_OC2007) {
-          stun_sha1 (msg->buffer, stun_message_length (msg),
+          stun_agent_sha1 (agent, msg->buffer, stun_message_length (msg),
               stun_message_length (msg) - 20, ptr, md5, sizeof(md5), TRUE);
         } else if (agent->compatibility == STUN_COMPATIBILITY_WLM2009) {
           size_t minus = 20;
           if (agent->usage_flags & STUN_AGENT_USAGE_USE_FINGERPRINT)
             minus -= 8;
 
-          stun_sha1 (msg->buffer, stun_message_length (msg),
+          stun_agent_sha1 (agent, msg->buffer, stun_message_length (msg),
               stun_message_length (msg) - minus, ptr, md5, sizeof(md5), TRUE);
         } else {
-          stun_sha1 (msg->buffer, stun_message_length (msg),
+          stun_agent_sha1 (agent, msg->buffer, stun_message_length (msg),
               stun_message_length (msg) - 20, ptr, md5, sizeof(md5), FALSE);
         }
       } else {
         if (agent->compatibility == STUN_COMPATIBILITY_RFC3489 ||
             agent->compatibility == STUN_COMPATIBILITY_OC2007) {
-          stun_sha1 (msg->buffer, stun_message_length (msg),
+          stun_agent_sha1 (agent, msg->buffer, stun_message_length (msg),
               stun_message_length (msg) - 20, ptr, key, key_len, TRUE);
         } else if (agent->compatibility == STUN_COMPATIBILITY_WLM2009) {
           size_t minus = 20;
           if (agent->usage_flags & STUN_AGENT_USAGE_USE_FINGERPRINT)
             minus -= 8;
 
-          stun_sha1 (msg->buffer, stun_message_length (msg),
+          stun_agent_sha1 (agent, msg->buffer, stun_message_length (msg),
               stun_message_length (msg) - minus, ptr, key, key_len, TRUE);
         } else {
-          stun_sha1 (msg->buffer, stun_message_length (msg),
+          stun_agent_sha1 (agent, msg->buffer, stun_message_length (msg),
               stun_message_length (msg) - 20, ptr, key, key_len, FALSE);
         }
       }
@@ -620,15 +800,16 @@ size_t stun_agent_finish_message (StunAgent *agent, StunMessage *msg,
   }
 
 
-  if (stun_message_get_class (msg) == STUN_REQUEST) {
-    stun_message_id (msg, agent->sent_ids[saved_id_idx].id);
-    agent->sent_ids[saved_id_idx].method = stun_message_get_method (msg);
-    agent->sent_ids[saved_id_idx].key = (uint8_t *) key;
-    agent->sent_ids[saved_id_idx].key_len = key_len;
-    memcpy (agent->sent_ids[saved_id_idx].long_term_key, msg->long_term_key,
+  if (saved_id != NULL) {
+    agent->n_saved_ids++;
+    stun_message_id (msg, saved_id->id);
+    saved_id->method = stun_message_get_method (msg);
+    saved_id->key = (uint8_t *) key;
+    saved_id->key_len = key_len;
+    memcpy (saved_id->long_term_key, msg->long_term_key,
         sizeof(msg->long_term_key));
-    agent->sent_ids[saved_id_idx].long_term_valid = msg->long_term_valid;
-    agent->sent_ids[saved_id_idx].valid = TRUE;
+    saved_id->long_term_valid = msg->long_term_valid;
+    saved_id->valid = TRUE;
   }
 
   msg->key = (uint8_t *) key;
@@ -182,6 +182,13 @@ typedef enum {
 } StunAgentUsageFlags;
 
 
+/**
+ * StunAgentSavedIds:
+ *
+ * An entry in the table of ongoing transactions of a #StunAgent. Its contents
+ * are private.
+ * <para> See also: stun_agent_set_transaction_storage() </para>
+ */
 typedef struct {
   StunTransactionId id;
   StunMethod method;
@@ -192,12 +199,33 @@ typedef struct {
   bool valid;
 } StunAgentSavedIds;
 
+/**
+ * StunAgentHmacKey:
+ *
+ * The HMAC-SHA1 key schedule of a MESSAGE-INTEGRITY key, cached by a
+ * #StunAgent for its last %STUN_AGENT_MAX_HMAC_KEYS keys. Its contents are
+ * private.
+ *
+ * Since: 0.1.11
+ */
+typedef struct {
+  uint8_t key[64];
+  size_t key_len;
+  uint32_t inner[5];
+  uint32_t outer[5];
+} StunAgentHmacKey;
+
 struct stun_agent_t {
   StunCompatibility compatibility;
-  StunAgentSavedIds sent_ids[STUN_AGENT_MAX_SAVED_IDS];
+  StunAgentSavedIds sent_ids[STUN_AGENT_DEFAULT_SAVED_IDS];
+  StunAgentSavedIds *saved_ids;
+  size_t max_saved_ids;
+  size_t n_saved_ids;
   uint16_t *known_attributes;
   StunAgentUsageFlags usage_flags;
   const char *software_attribute;
+  StunAgentHmacKey hmac_keys[STUN_AGENT_MAX_HMAC_KEYS];
+  unsigned int next_hmac_key;
 };
 
 /**
@@ -283,6 +311,9 @@ bool stun_agent_default_validater (StunAgent *agent,
  * STUN usages the agent should use.
  *
  * This function must be called to initialize an agent before it is being used.
+ * The agent keeps track of up to %STUN_AGENT_DEFAULT_SAVED_IDS ongoing
+ * transactions in a built-in table; an agent with more requests outstanding
+ * can be given larger storage with stun_agent_set_transaction_storage().
  *
  <note>
    <para>
@@ -303,6 +334,25 @@ bool stun_agent_default_validater (StunAgent *agent,
 void stun_agent_init (StunAgent *agent, const uint16_t *known_attributes,
     StunCompatibility compatibility, StunAgentUsageFlags usage_flags);
 
+/**
+ * stun_agent_set_transaction_storage:
+ * @agent: The #StunAgent
+ * @storage: (allow-none): An array of @n_entries #StunAgentSavedIds, or %NULL
+ * @n_entries: The number of elements in @storage
+ *
+ * Makes the #StunAgent keep track of its ongoing transactions in @storage
+ * rather than in its built-in table of %STUN_AGENT_DEFAULT_SAVED_IDS entries,
+ * so that it can have up to @n_entries requests outstanding. Passing %NULL
+ * goes back to the built-in table.
+ * <para>
+ * @storage is owned by the caller and must stay valid for as long as @agent
+ * is used. Any transaction previously created by @agent is forgotten.
+ * </para>
+ * Since: 0.1.11
+ */
+void stun_agent_set_transaction_storage (StunAgent *agent,
+    StunAgentSavedIds *storage, size_t n_entries);
+
 /**
  * stun_agent_validate:
  * @agent: The #StunAgent
@@ -358,6 +408,26 @@ StunValidationStatus stun_agent_validate (StunAgent *agent, StunMessage *msg,
 bool stun_agent_init_request (StunAgent *agent, StunMessage *msg,
     uint8_t *buffer, size_t buffer_len, StunMethod m);
 
+/**
+ * stun_agent_init_request_from_template:
+ * @agent: The #StunAgent
+ * @msg: The #StunMessage to build
+ * @buffer: The buffer to use in the #StunMessage
+ * @buffer_len: The length of the buffer
+ * @tmpl: A request previously created by @agent, finished or not
+ *
+ * Creates a new STUN request which is a copy of @tmpl with a new transaction
+ * ID, and without the MESSAGE-INTEGRITY and FINGERPRINT attributes of @tmpl.
+ * It can then be finished with stun_agent_finish_message() like any other
+ * request. This saves building the attributes of a request which is sent
+ * over and over, such as a keepalive, from scratch each time.
+ * Returns: %TRUE if the message was initialized correctly, %FALSE otherwise
+ * Since: 0.1.11
+ */
+bool stun_agent_init_request_from_template (StunAgent *agent,
+    StunMessage *msg, uint8_t *buffer, size_t buffer_len,
+    const StunMessage *tmpl);
+
 /**
  * stun_agent_init_indication:
  * @agent: The #StunAgent
@@ -52,6 +52,16 @@
 
 void stun_sha1 (const uint8_t *msg, size_t len, size_t msg_len, uint8_t *sha,
     const void *key, size_t keylen, int padding)
+{
+  uint32_t inner[5], outer[5];
+
+  hmac_sha1_precompute (key, keylen, inner, outer);
+  stun_sha1_precomputed (msg, len, msg_len, sha, inner, outer, padding);
+}
+
+void stun_sha1_precomputed (const uint8_t *msg, size_t len, size_t msg_len,
+    uint8_t *sha, const uint32_t inner[5], const uint32_t outer[5],
+    int padding)
 {
   uint16_t fakelen = htons (msg_len);
   const uint8_t *vector[4];
@@ -79,7 +89,8 @@ void stun_sha1 (const uint8_t *msg, size_t len, size_t msg_len, uint8_t *sha,
     num_elements++;
   }
 
-  hmac_sha1_vector(key, keylen, num_elements, vector, lengths, sha);
+  hmac_sha1_vector_precomputed (inner, outer, num_elements, vector, lengths,
+      sha);
 }
 
 static const uint8_t *priv_trim_var (const uint8_t *var, size_t *var_len)
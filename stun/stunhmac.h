@@ -53,6 +53,14 @@
 void stun_sha1 (const uint8_t *msg, size_t len, size_t msg_len,
     uint8_t *sha, const void *key, size_t keylen, int padding);
 
+/*
+ * Same as stun_sha1(), with the HMAC key schedule precomputed by
+ * hmac_sha1_precompute().
+ */
+void stun_sha1_precomputed (const uint8_t *msg, size_t len, size_t msg_len,
+    uint8_t *sha, const uint32_t inner[5], const uint32_t outer[5],
+    int padding);
+
 /*
  * SIP H(A1) computation
  */
@@ -60,6 +60,8 @@ bool stun_message_init (StunMessage *msg, StunClass c, StunMethod m,
     const StunTransactionId id)
 {
 
+  msg->indexed_buffer = NULL;
+
   if (msg->buffer_len < STUN_MESSAGE_HEADER_LENGTH)
     return FALSE;
 
@@ -81,6 +83,70 @@ uint16_t stun_message_length (const StunMessage *msg)
 
 
 
+static unsigned int
+stun_message_index_slot (uint16_t type)
+{
+  return (type ^ (type >> 8) ^ (type >> 12)) & (STUN_MESSAGE_INDEX_SIZE - 1);
+}
+
+bool stun_message_index_attributes (StunMessage *msg)
+{
+  size_t length = stun_message_length (msg);
+  size_t offset = STUN_MESSAGE_ATTRIBUTES_POS;
+  unsigned int n_entries = 0;
+  bool after_integrity = false;
+
+  msg->indexed_buffer = NULL;
+  memset (msg->index, 0, sizeof (msg->index));
+
+  /* Offsets are stored in 16 bits */
+  if (length > UINT16_MAX)
+    return false;
+
+  while (offset < length)
+  {
+    uint16_t atype = stun_getw (msg->buffer + offset);
+    size_t alen = stun_getw (msg->buffer + offset + STUN_ATTRIBUTE_TYPE_LEN);
+    unsigned int slot;
+
+    /* Mirror what stun_message_find() would find: only FINGERPRINT may come
+     * after MESSAGE-INTEGRITY, and nothing after FINGERPRINT. */
+    if (!after_integrity || atype == STUN_ATTRIBUTE_FINGERPRINT)
+    {
+      slot = stun_message_index_slot (atype);
+      while (msg->index[slot].offset != 0 && msg->index[slot].type != atype)
+        slot = (slot + 1) & (STUN_MESSAGE_INDEX_SIZE - 1);
+
+      if (msg->index[slot].offset == 0)
+      {
+        if (++n_entries > STUN_MESSAGE_INDEX_SIZE * 3 / 4)
+        {
+          memset (msg->index, 0, sizeof (msg->index));
+          return false;
+        }
+
+        msg->index[slot].type = atype;
+        msg->index[slot].offset = offset;
+      }
+    }
+
+    if (atype == STUN_ATTRIBUTE_FINGERPRINT)
+      break;
+    if (atype == STUN_ATTRIBUTE_MESSAGE_INTEGRITY)
+      after_integrity = true;
+
+    if (!(msg->agent &&
+            (msg->agent->usage_flags & STUN_AGENT_USAGE_NO_ALIGNED_ATTRIBUTES)))
+      alen = stun_align (alen);
+
+    offset += STUN_ATTRIBUTE_VALUE_POS + alen;
+  }
+
+  msg->indexed_buffer = msg->buffer;
+
+  return true;
+}
+
 const void *
 stun_message_find (const StunMessage *msg, StunAttribute type,
     uint16_t *palen)
@@ -97,6 +163,25 @@ stun_message_find (const StunMessage *msg, StunAttribute type,
       type = STUN_ATTRIBUTE_REALM;
   }
 
+  if (msg->buffer != NULL && msg->indexed_buffer == msg->buffer)
+  {
+    unsigned int slot;
+
+    for (slot = stun_message_index_slot (type);
+         msg->index[slot].offset != 0;
+         slot = (slot + 1) & (STUN_MESSAGE_INDEX_SIZE - 1))
+    {
+      if (msg->index[slot].type == type)
+      {
+        offset = msg->index[slot].offset;
+        *palen = stun_getw (msg->buffer + offset + STUN_ATTRIBUTE_TYPE_LEN);
+        return msg->buffer + offset + STUN_ATTRIBUTE_VALUE_POS;
+      }
+    }
+
+    return NULL;
+  }
+
   offset = STUN_MESSAGE_ATTRIBUTES_POS;
 
   while (offset < length)
@@ -325,11 +410,17 @@ stun_message_find_error (const StunMessage *msg, int *code)
   return STUN_MESSAGE_RETURN_SUCCESS;
 }
 
-void *
-stun_message_append (StunMessage *msg, StunAttribute type, size_t length)
+/* Writes the header of an attribute of @length bytes at the end of @msg,
+ * without updating the message length. Returns where its value goes, and the
+ * number of padding bytes which must follow the value in @padding. */
+static uint8_t *
+stun_message_append_header (StunMessage *msg, StunAttribute type,
+    size_t length, size_t *padding)
 {
   uint8_t *a;
-  uint16_t mlen = stun_message_length (msg);
+
+  /* The message is changing under the index */
+  msg->indexed_buffer = NULL;
 
   /* In MS-TURN, IDs of REALM and NONCE STUN attributes are swapped. */
   if (msg->agent && msg->agent->compatibility == STUN_COMPATIBILITY_OC2007)
@@ -340,26 +431,39 @@ stun_message_append (StunMessage *msg, StunAttribute type, size_t length)
       type = STUN_ATTRIBUTE_NONCE;
   }
 
-  if ((size_t)mlen + STUN_ATTRIBUTE_HEADER_LENGTH + length > msg->buffer_len)
-    return NULL;
-
-
-  a = msg->buffer + mlen;
+  a = msg->buffer + stun_message_length (msg);
   a = stun_setw (a, type);
   if (msg->agent &&
       (msg->agent->usage_flags & STUN_AGENT_USAGE_NO_ALIGNED_ATTRIBUTES))
   {
     a = stun_setw (a, length);
+    *padding = 0;
   } else {
     /* NOTE: If cookie is not present, we need to force the attribute length
      * to a multiple of 4 for compatibility with old RFC3489 */
     a = stun_setw (a, stun_message_has_cookie (msg) ? length : stun_align (length));
+    *padding = stun_padding (length);
+  }
 
-    /* Add padding if needed. Avoid a zero-length memset() call. */
-    if (stun_padding (length) > 0) {
-      memset (a + length, ' ', stun_padding (length));
-      mlen += stun_padding (length);
-    }
+  return a;
+}
+
+void *
+stun_message_append (StunMessage *msg, StunAttribute type, size_t length)
+{
+  uint8_t *a;
+  uint16_t mlen = stun_message_length (msg);
+  size_t padding;
+
+  if ((size_t)mlen + STUN_ATTRIBUTE_HEADER_LENGTH + length > msg->buffer_len)
+    return NULL;
+
+  a = stun_message_append_header (msg, type, length, &padding);
+
+  /* Add padding if needed. Avoid a zero-length memset() call. */
+  if (padding > 0) {
+    memset (a + length, ' ', padding);
+    mlen += padding;
   }
 
   mlen +=  4 + length;
@@ -369,6 +473,29 @@ stun_message_append (StunMessage *msg, StunAttribute type, size_t length)
 }
 
 
+StunMessageReturn
+stun_message_append_external (StunMessage *msg, StunAttribute type,
+    size_t length, size_t *padding)
+{
+  size_t mlen = stun_message_length (msg);
+  size_t pad = stun_padding (length);
+
+  if (mlen + STUN_ATTRIBUTE_HEADER_LENGTH > msg->buffer_len ||
+      mlen + STUN_ATTRIBUTE_HEADER_LENGTH + length + pad > 0xffff)
+    return STUN_MESSAGE_RETURN_NOT_ENOUGH_SPACE;
+
+  stun_message_append_header (msg, type, length, &pad);
+  mlen += STUN_ATTRIBUTE_HEADER_LENGTH + length + pad;
+
+  stun_setw (msg->buffer + STUN_MESSAGE_LENGTH_POS,
+      mlen - STUN_MESSAGE_HEADER_LENGTH);
+  if (padding != NULL)
+    *padding = pad;
+
+  return STUN_MESSAGE_RETURN_SUCCESS;
+}
+
+
 StunMessageReturn
 stun_message_append_bytes (StunMessage *msg, StunAttribute type,
     const void *data, size_t len)
@@ -384,6 +511,33 @@ stun_message_append_bytes (StunMessage *msg, StunAttribute type,
 }
 
 
+StunMessageReturn
+stun_message_append_bytes_vectored (StunMessage *msg, StunAttribute type,
+    const StunInputVector *buffers, int n_buffers)
+{
+  uint8_t *ptr;
+  size_t len = 0;
+  int i;
+
+  for (i = 0; (n_buffers >= 0 && i < n_buffers) ||
+           (n_buffers < 0 && buffers[i].buffer != NULL); i++)
+    len += buffers[i].size;
+
+  ptr = stun_message_append (msg, type, len);
+  if (ptr == NULL)
+    return STUN_MESSAGE_RETURN_NOT_ENOUGH_SPACE;
+
+  for (i = 0; (n_buffers >= 0 && i < n_buffers) ||
+           (n_buffers < 0 && buffers[i].buffer != NULL); i++) {
+    if (buffers[i].size > 0)
+      memcpy (ptr, buffers[i].buffer, buffers[i].size);
+    ptr += buffers[i].size;
+  }
+
+  return STUN_MESSAGE_RETURN_SUCCESS;
+}
+
+
 StunMessageReturn
 stun_message_append_flag (StunMessage *msg, StunAttribute type)
 {
@@ -605,43 +759,122 @@ ssize_t stun_message_validate_buffer_length_fast (StunInputVector *buffers,
 
 int stun_message_validate_buffer_length (const uint8_t *msg, size_t length,
     bool has_padding)
+{
+  StunInputVector input_buffer = { msg, length };
+
+  return stun_message_validate_buffer_length_vectored (&input_buffer, 1,
+      length, has_padding);
+}
+
+/* Position in a message spread over several #StunInputVectors. The caller
+ * guarantees that the bytes it reads through it are within @total_length, so
+ * no bounds are checked here. */
+typedef struct {
+  const StunInputVector *buffers;
+  unsigned int index;
+  size_t offset;
+} StunInputCursor;
+
+static void
+stun_input_cursor_skip (StunInputCursor *cursor, size_t len)
+{
+  /* Stop at the end of a buffer rather than at the start of the next one, as
+   * there might not be a next one. */
+  while (len > cursor->buffers[cursor->index].size - cursor->offset)
+  {
+    len -= cursor->buffers[cursor->index].size - cursor->offset;
+    cursor->index++;
+    cursor->offset = 0;
+  }
+
+  cursor->offset += len;
+}
+
+/* Return the @len bytes at @cursor, pointing into the buffers if they are
+ * contiguous, or copied into @storage otherwise. Returns NULL if they would
+ * not fit in @storage. Does not move @cursor. */
+static const uint8_t *
+stun_input_cursor_peek (const StunInputCursor *cursor, size_t len,
+    uint8_t *storage, size_t storage_len)
+{
+  unsigned int index = cursor->index;
+  size_t offset = cursor->offset;
+  size_t copied = 0;
+
+  if (len == 0)
+    return cursor->buffers[index].buffer + offset;
+
+  while (offset == cursor->buffers[index].size)
+  {
+    index++;
+    offset = 0;
+  }
+
+  if (cursor->buffers[index].size - offset >= len)
+    return cursor->buffers[index].buffer + offset;
+
+  if (len > storage_len)
+    return NULL;
+
+  while (copied < len)
+  {
+    size_t n = cursor->buffers[index].size - offset;
+
+    if (n > len - copied)
+      n = len - copied;
+
+    memcpy (storage + copied, cursor->buffers[index].buffer + offset, n);
+    copied += n;
+    index++;
+    offset = 0;
+  }
+
+  return storage;
+}
+
+int stun_message_validate_buffer_length_vectored (
+    const StunInputVector *buffers, int n_buffers, size_t total_length,
+    bool has_padding)
 {
   ssize_t fast_retval;
   size_t mlen;
   size_t len;
-  StunInputVector input_buffer = { msg, length };
+  StunInputCursor cursor = { buffers, 0, 0 };
 
   /* Fast pre-check first. */
-  fast_retval = stun_message_validate_buffer_length_fast (&input_buffer, 1,
-      length, has_padding);
+  fast_retval = stun_message_validate_buffer_length_fast (
+      (StunInputVector *) buffers, n_buffers, total_length, has_padding);
   if (fast_retval <= 0)
     return fast_retval;
 
   mlen = fast_retval;
 
   /* Skip past the header (validated above). */
-  msg += 20;
-  len = mlen - 20;
+  stun_input_cursor_skip (&cursor, STUN_MESSAGE_HEADER_LENGTH);
+  len = mlen - STUN_MESSAGE_HEADER_LENGTH;
 
-  /* from then on, we know we have the entire packet in buffer */
+  /* from then on, we know we have the entire packet in buffers */
   while (len > 0)
   {
+    uint8_t header[STUN_ATTRIBUTE_VALUE_POS];
     size_t alen;
 
-    if (len < 4)
+    if (len < STUN_ATTRIBUTE_VALUE_POS)
     {
       stun_debug ("STUN error: Incomplete STUN attribute header of length "
           "%u bytes!", (unsigned)len);
       return STUN_MESSAGE_BUFFER_INVALID;
     }
 
-    alen = stun_getw (msg + STUN_ATTRIBUTE_TYPE_LEN);
+    alen = stun_getw (stun_input_cursor_peek (&cursor,
+            STUN_ATTRIBUTE_VALUE_POS, header, sizeof (header)) +
+        STUN_ATTRIBUTE_TYPE_LEN);
     if (has_padding)
       alen = stun_align (alen);
 
     /* thanks to padding check, if (end > msg) then there is not only one
      * but at least 4 bytes left */
-    len -= 4;
+    len -= STUN_ATTRIBUTE_VALUE_POS;
 
     if (len < alen)
     {
@@ -651,7 +884,7 @@ int stun_message_validate_buffer_length (const uint8_t *msg, size_t length,
     }
 
     len -= alen;
-    msg += 4 + alen;
+    stun_input_cursor_skip (&cursor, STUN_ATTRIBUTE_VALUE_POS + alen);
   }
 
   return mlen;
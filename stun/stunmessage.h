@@ -502,6 +502,32 @@ typedef enum
  */
 #define STUN_MAX_MESSAGE_SIZE 65552
 
+/**
+ * STUN_MESSAGE_INDEX_SIZE:
+ *
+ * Number of slots in the attribute index of a #StunMessage. This is a power of
+ * two, and messages with more than 3/4 of this many distinct attributes are
+ * not indexed.
+ *
+ * Since: 0.1.11
+ */
+#define STUN_MESSAGE_INDEX_SIZE 32
+
+/**
+ * StunMessageIndexEntry:
+ * @type: The type of the attribute (host byte order)
+ * @offset: The offset of the first attribute of this type in the message, or 0
+ * if the slot is free
+ *
+ * A slot of the attribute index of a #StunMessage
+ *
+ * Since: 0.1.11
+ */
+typedef struct {
+  uint16_t type;
+  uint16_t offset;
+} StunMessageIndexEntry;
+
 /**
  * StunMessage:
  * @agent: The agent that created or validated this message
@@ -514,6 +540,11 @@ typedef enum
  * validation or that was used to finalize this message
  * @long_term_valid: Whether or not the #long_term_key variable contains valid
  * data
+ * @indexed_buffer: The buffer @index was built for by
+ * stun_message_index_attributes(), or %NULL if there is no valid index. The
+ * index is only used while this is equal to @buffer.
+ * @index: Open-addressed hash table of the attributes of the message, keyed by
+ * attribute type
  *
  * This structure represents a STUN message
  */
@@ -525,6 +556,8 @@ struct _StunMessage {
   size_t key_len;
   uint8_t long_term_key[16];
   bool long_term_valid;
+  const uint8_t *indexed_buffer;
+  StunMessageIndexEntry index[STUN_MESSAGE_INDEX_SIZE];
 };
 
 /**
@@ -550,6 +583,27 @@ bool stun_message_init (StunMessage *msg, StunClass c, StunMethod m,
  */
 uint16_t stun_message_length (const StunMessage *msg);
 
+/**
+ * stun_message_index_attributes:
+ * @msg: The #StunMessage, which must hold a complete message validated with
+ * stun_message_validate_buffer_length()
+ *
+ * Builds an index of the attributes of @msg in a single pass, so that
+ * stun_message_find() and the functions built on it look attributes up
+ * directly rather than walking the message every time. The index follows the
+ * same rules as walking the message: the first instance of an attribute wins,
+ * and only FINGERPRINT is found after MESSAGE-INTEGRITY.
+ *
+ * The index is dropped when @msg is modified with stun_message_append() or
+ * reinitialised. stun_agent_validate() indexes the messages it validates.
+ *
+ * Returns: %TRUE if the index was built, %FALSE if @msg has too many
+ * attributes, in which case lookups keep walking the message
+ *
+ * Since: 0.1.11
+ */
+bool stun_message_index_attributes (StunMessage *msg);
+
 /**
  * stun_message_find:
  * @msg: The #StunMessage
@@ -931,6 +985,79 @@ typedef struct {
 ssize_t stun_message_validate_buffer_length_fast (StunInputVector *buffers,
     int n_buffers, size_t total_length, bool has_padding);
 
+/**
+ * stun_message_validate_buffer_length_vectored:
+ * @buffers: (array length=n_buffers) (in caller-allocated): array of contiguous
+ * #StunInputVectors containing already-received message data
+ * @n_buffers: number of entries in @buffers or if -1 , then buffers is
+ *  terminated by a #StunInputVector with the buffer pointer being %NULL.
+ * @total_length: total number of valid bytes stored consecutively in @buffers
+ * @has_padding: %TRUE if attributes should be padded to 4-byte boundaries
+ *
+ * Validate whether the message in the given @buffers is a complete, valid
+ * STUN message, including its attribute lengths. This is the vectored
+ * equivalent of stun_message_validate_buffer_length(), and walks the
+ * attributes in place rather than requiring the buffers to be compacted first.
+ *
+ * Returns: The length of the valid STUN message in the buffer, or zero or -1 on
+ * failure
+ * <para> See also: #STUN_MESSAGE_BUFFER_INCOMPLETE </para>
+ * <para> See also: #STUN_MESSAGE_BUFFER_INVALID </para>
+ *
+ * Since: 0.1.11
+ */
+int stun_message_validate_buffer_length_vectored (
+    const StunInputVector *buffers, int n_buffers, size_t total_length,
+    bool has_padding);
+
+/**
+ * stun_message_append_bytes_vectored:
+ * @msg: The #StunMessage
+ * @type: The #StunAttribute to append
+ * @buffers: (array length=n_buffers): array of #StunInputVectors holding the
+ * value of the attribute
+ * @n_buffers: number of entries in @buffers or if -1 , then buffers is
+ *  terminated by a #StunInputVector with the buffer pointer being %NULL.
+ *
+ * Appends a binary value which is split over several buffers to a STUN
+ * message, as stun_message_append_bytes() would after compacting them.
+ *
+ * Returns: A #StunMessageReturn value.
+ *
+ * Since: 0.1.11
+ */
+StunMessageReturn stun_message_append_bytes_vectored (StunMessage *msg,
+    StunAttribute type, const StunInputVector *buffers, int n_buffers);
+
+/**
+ * stun_message_append_external:
+ * @msg: The #StunMessage
+ * @type: The #StunAttribute to append
+ * @length: The length of the attribute value
+ * @padding: (out) (allow-none): return location for the number of padding
+ * bytes which must follow the value
+ *
+ * Appends the header of an attribute whose value is not copied into the
+ * message buffer, so that a large payload can be sent by reference. The
+ * message length accounts for the value and its padding.
+ * <para>
+ * On the wire, the first stun_message_length() - @length - @padding bytes of
+ * the message buffer must be followed by the @length bytes of the value and
+ * then @padding bytes of padding, typically as separate vectors of one
+ * message. This must be the last attribute of the message: it can neither be
+ * finished with stun_agent_finish_message() nor parsed afterwards, so it is
+ * only suitable for messages which need no MESSAGE-INTEGRITY or FINGERPRINT.
+ * </para>
+ *
+ * Returns: A #StunMessageReturn value.
+ * %STUN_MESSAGE_RETURN_NOT_ENOUGH_SPACE is returned if the header does not
+ * fit in the buffer or the value does not fit in a STUN message.
+ *
+ * Since: 0.1.11
+ */
+StunMessageReturn stun_message_append_external (StunMessage *msg,
+    StunAttribute type, size_t length, size_t *padding);
+
 /**
  * stun_message_id:
  * @msg: The #StunMessage
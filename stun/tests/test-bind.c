@@ -187,6 +187,7 @@ static void bad_responses (void)
   uint8_t req[STUN_MAX_MESSAGE_SIZE];
   size_t req_len;
   StunAgent agent;
+  StunAgentSavedIds agent_ids[16];
   StunMessage msg;
   StunMessage req_msg;
   int servfd, fd;
@@ -201,6 +202,8 @@ static void bad_responses (void)
 
   stun_agent_init (&agent, known_attributes,
       STUN_COMPATIBILITY_RFC5389, 0);
+  stun_agent_set_transaction_storage (&agent, agent_ids,
+      sizeof (agent_ids) / sizeof (agent_ids[0]));
 
   /* Allocate a local UDP port */
   servfd = listen_dgram ();
@@ -262,6 +265,7 @@ static void responses (void)
   uint8_t req[STUN_MAX_MESSAGE_SIZE];
   size_t req_len;
   StunAgent agent;
+  StunAgentSavedIds agent_ids[16];
   StunMessage msg;
   StunMessage req_msg;
 
@@ -275,6 +279,8 @@ static void responses (void)
 
   stun_agent_init (&agent, known_attributes,
       STUN_COMPATIBILITY_RFC5389, 0);
+  stun_agent_set_transaction_storage (&agent, agent_ids,
+      sizeof (agent_ids) / sizeof (agent_ids[0]));
 
   /* Allocate a local UDP port for server */
   servfd = listen_dgram ();
@@ -396,6 +402,7 @@ static void keepalive (void)
   uint8_t buf[STUN_MAX_MESSAGE_SIZE];
   size_t len;
   StunAgent agent;
+  StunAgentSavedIds agent_ids[16];
   StunMessage msg;
 
   uint16_t known_attributes[] = {
@@ -408,6 +415,8 @@ static void keepalive (void)
 
   stun_agent_init (&agent, known_attributes,
       STUN_COMPATIBILITY_RFC5389, 0);
+  stun_agent_set_transaction_storage (&agent, agent_ids,
+      sizeof (agent_ids) / sizeof (agent_ids[0]));
 
   /* Allocate a local UDP port for server */
   servfd = listen_dgram ();
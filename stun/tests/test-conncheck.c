@@ -86,6 +86,7 @@ int main (void)
   int code;
   bool control = false;
   StunAgent agent;
+  StunAgentSavedIds agent_ids[16];
   StunMessage req;
   StunMessage resp;
   StunDefaultValidaterData validater_data[] = {
@@ -98,6 +99,8 @@ int main (void)
       STUN_COMPATIBILITY_RFC5389,
       STUN_AGENT_USAGE_USE_FINGERPRINT |
       STUN_AGENT_USAGE_SHORT_TERM_CREDENTIALS);
+  stun_agent_set_transaction_storage (&agent, agent_ids,
+      sizeof (agent_ids) / sizeof (agent_ids[0]));
 
   memset (&addr, 0, sizeof (addr));
   addr.ip4.sin_family = AF_INET;
@@ -257,6 +260,40 @@ int main (void)
   stun_message_find_error (&resp, &code);
   assert (code == STUN_ERROR_ROLE_CONFLICT);
 
+  /* Request resent from a template, in place */
+  {
+    StunTransactionId id1, id2;
+    uint64_t q;
+
+    rlen = stun_usage_ice_conncheck_create (&agent, &req, req_buf,
+        sizeof (req_buf), ufrag, ufrag_len, pass, pass_len, true, true,
+        0x12345678, tie, NULL, STUN_USAGE_ICE_COMPATIBILITY_RFC5245);
+    assert (rlen > 0);
+    stun_message_id (&req, id1);
+
+    assert (stun_agent_init_request_from_template (&agent, &req, req_buf,
+            sizeof (req_buf), &req));
+    /* MESSAGE-INTEGRITY and FINGERPRINT are gone */
+    assert (stun_message_length (&req) == rlen - 24 - 8);
+    len = stun_agent_finish_message (&agent, &req, pass, pass_len);
+    assert (len == rlen);
+    stun_message_id (&req, id2);
+    assert (memcmp (id1, id2, 4) == 0);
+    assert (memcmp (id1, id2, sizeof (id1)) != 0);
+
+    valid = stun_agent_validate (&agent, &req, req_buf, len,
+        stun_agent_default_validater, validater_data);
+    assert (valid == STUN_VALIDATION_SUCCESS);
+    assert (stun_usage_ice_conncheck_priority (&req) == 0x12345678);
+    assert (stun_usage_ice_conncheck_use_candidate (&req) == true);
+    assert (stun_message_find64 (&req, STUN_ATTRIBUTE_ICE_CONTROLLING, &q) ==
+        STUN_MESSAGE_RETURN_SUCCESS);
+    assert (q == tie);
+
+    /* Only requests make templates */
+    assert (!stun_agent_init_request_from_template (&agent, &req, req_buf,
+            sizeof (req_buf), &resp));
+  }
 
   return 0;
 }
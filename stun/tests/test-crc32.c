@@ -0,0 +1,172 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/*
+ * Check stun_crc32(), whichever implementation it picks on this machine,
+ * against a bit-at-a-time reference, then time it on typical STUN message
+ * sizes. The timings are printed, not checked.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "stun/stuncrc32.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MAX_LEN 1500
+
+static void fatal (const char *msg, ...)
+{
+  fprintf (stderr, "%s\n", msg);
+  exit (1);
+}
+
+static uint32_t reference_crc32 (const uint8_t *buf, size_t len,
+    bool wlm2009_stupid_crc32_typo)
+{
+  uint32_t crc = 0xffffffff;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+  {
+    uint32_t lkp = (crc ^ buf[i]) & 0xff;
+    int bit;
+
+    for (bit = 0; bit < 8; bit++)
+      lkp = (lkp >> 1) ^ ((lkp & 1) ? 0xedb88320 : 0);
+    if (lkp == 0x8bbeb8ea && wlm2009_stupid_crc32_typo)
+      lkp = 0x8bbe8ea;
+    crc = lkp ^ (crc >> 8);
+  }
+
+  return crc ^ 0xffffffff;
+}
+
+static void test_lengths (const uint8_t *buf)
+{
+  size_t len, offset;
+  bool typo_hit = false;
+
+  puts ("Checking all lengths and alignments...");
+
+  for (offset = 0; offset < 16; offset++)
+  {
+    for (len = 0; len <= 300; len++)
+    {
+      crc_data data = { (uint8_t *) buf + offset, len };
+
+      if (stun_crc32 (&data, 1, false) !=
+          reference_crc32 (buf + offset, len, false))
+        fatal ("CRC mismatch");
+      if (stun_crc32 (&data, 1, true) !=
+          reference_crc32 (buf + offset, len, true))
+        fatal ("WLM2009 CRC mismatch");
+
+      if (reference_crc32 (buf + offset, len, true) !=
+          reference_crc32 (buf + offset, len, false))
+        typo_hit = true;
+    }
+  }
+
+  /* Make sure the data goes through the entry which WLM2009 got wrong. */
+  if (!typo_hit)
+    fatal ("WLM2009 typo not exercised");
+
+  puts ("Done.");
+}
+
+static void test_split (const uint8_t *buf)
+{
+  size_t split1, split2;
+  uint32_t expected = reference_crc32 (buf, 200, false);
+
+  puts ("Checking data split over several chunks...");
+
+  for (split1 = 0; split1 <= 200; split1 += 3)
+  {
+    for (split2 = split1; split2 <= 200; split2 += 7)
+    {
+      crc_data data[3] = {
+        { (uint8_t *) buf, split1 },
+        { (uint8_t *) buf + split1, split2 - split1 },
+        { (uint8_t *) buf + split2, 200 - split2 },
+      };
+
+      if (stun_crc32 (data, 3, false) != expected)
+        fatal ("Split CRC mismatch");
+    }
+  }
+
+  puts ("Done.");
+}
+
+static void benchmark (const uint8_t *buf, size_t len, unsigned int n)
+{
+  crc_data data = { (uint8_t *) buf, len };
+  volatile uint32_t sink = 0;
+  clock_t start, end;
+  unsigned int i;
+  double secs;
+
+  start = clock ();
+  for (i = 0; i < n; i++)
+    sink ^= stun_crc32 (&data, 1, false);
+  end = clock ();
+
+  secs = (double) (end - start) / CLOCKS_PER_SEC;
+  if (secs <= 0)
+    secs = 1.0 / CLOCKS_PER_SEC;
+
+  printf ("%4u bytes: %.0f CRCs/s, %.1f MB/s\n", (unsigned) len, n / secs,
+      len * (double) n / secs / 1000000);
+}
+
+int main (void)
+{
+  uint8_t buf[MAX_LEN + 16];
+  size_t i;
+
+  srand (42);
+  for (i = 0; i < sizeof (buf); i++)
+    buf[i] = rand ();
+
+  test_lengths (buf);
+  test_split (buf);
+
+  /* A binding request with ICE attributes, a typical response, and the
+   * largest payload of a relayed media packet. */
+  benchmark (buf, 100, 1000000);
+  benchmark (buf, 200, 500000);
+  benchmark (buf, MAX_LEN, 100000);
+
+  return 0;
+}
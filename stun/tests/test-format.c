@@ -134,11 +134,14 @@ check_af (const char *name, int family, socklen_t addrlen)
   struct sockaddr_storage addr;
   uint8_t buf[100];
   StunAgent agent;
+  StunAgentSavedIds agent_ids[16];
   StunMessage msg;
   uint16_t known_attributes[] = {STUN_ATTRIBUTE_USERNAME, STUN_ATTRIBUTE_MESSAGE_INTEGRITY, STUN_ATTRIBUTE_ERROR_CODE, 0};
 
   stun_agent_init (&agent, known_attributes,
       STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_USE_FINGERPRINT);
+  stun_agent_set_transaction_storage (&agent, agent_ids,
+      sizeof (agent_ids) / sizeof (agent_ids[0]));
 
   assert (addrlen <= sizeof (addr));
 
@@ -173,6 +176,73 @@ check_af (const char *name, int family, socklen_t addrlen)
     fatal ("%s sockaddr xor test failed", name);
 }
 
+
+/* Appending a value split over several buffers, or sending it by reference,
+ * gives the same message as appending it in one piece */
+static void
+check_vectored_append (StunAgentUsageFlags usage_flags)
+{
+  static const uint8_t payload[] = "hello world";
+  const StunInputVector buffers[] = {
+    { payload, 2 }, { payload + 2, 0 }, { payload + 2, 9 }, { NULL, 0 } };
+  uint8_t buf1[100], buf2[100], wire[100];
+  StunAgent agent;
+  StunAgentSavedIds agent_ids[16];
+  StunMessage msg1, msg2, msg3;
+  size_t len, header_len, padding;
+  const uint8_t *data;
+  uint16_t data_len;
+
+  stun_agent_init (&agent, STUN_ALL_KNOWN_ATTRIBUTES,
+      STUN_COMPATIBILITY_RFC5389, usage_flags);
+  stun_agent_set_transaction_storage (&agent, agent_ids,
+      sizeof (agent_ids) / sizeof (agent_ids[0]));
+
+  stun_agent_init_indication (&agent, &msg1, buf1, sizeof (buf1),
+      STUN_IND_SEND);
+  memcpy (buf2, buf1, sizeof (buf1));
+  msg2 = msg1;
+  msg2.buffer = buf2;
+
+  if (stun_message_append_bytes (&msg1, STUN_ATTRIBUTE_DATA, payload, 11) !=
+      STUN_MESSAGE_RETURN_SUCCESS)
+    fatal ("Contiguous append failed");
+  if (stun_message_append_bytes_vectored (&msg2, STUN_ATTRIBUTE_DATA,
+          buffers, -1) != STUN_MESSAGE_RETURN_SUCCESS)
+    fatal ("Vectored append failed");
+  len = stun_message_length (&msg1);
+  if (stun_message_length (&msg2) != len || memcmp (buf1, buf2, len))
+    fatal ("Vectored append mismatch");
+
+  /* Start again and send the payload by reference */
+  stun_agent_init_indication (&agent, &msg2, buf2, sizeof (buf2),
+      STUN_IND_SEND);
+  memcpy (buf2 + STUN_MESSAGE_TRANS_ID_POS, buf1 + STUN_MESSAGE_TRANS_ID_POS,
+      STUN_MESSAGE_TRANS_ID_LEN);
+  if (stun_message_append_external (&msg2, STUN_ATTRIBUTE_DATA,
+          0x10000, &padding) != STUN_MESSAGE_RETURN_NOT_ENOUGH_SPACE)
+    fatal ("External append overflow test failed");
+  if (stun_message_append_external (&msg2, STUN_ATTRIBUTE_DATA, 11,
+          &padding) != STUN_MESSAGE_RETURN_SUCCESS)
+    fatal ("External append failed");
+  if (stun_message_length (&msg2) != len)
+    fatal ("External append length mismatch");
+
+  header_len = len - 11 - padding;
+  memcpy (wire, buf2, header_len);
+  memcpy (wire + header_len, payload, 11);
+  memset (wire + header_len + 11, 0, padding);
+  if (memcmp (wire, buf1, header_len + 11))
+    fatal ("External append mismatch");
+
+  if (stun_agent_validate (&agent, &msg3, wire, len, NULL, NULL) !=
+      STUN_VALIDATION_SUCCESS)
+    fatal ("External append validation failed");
+  data = stun_message_find (&msg3, STUN_ATTRIBUTE_DATA, &data_len);
+  if (data == NULL || data_len != 11 || memcmp (data, payload, 11))
+    fatal ("External append payload mismatch");
+}
+
 int main (void)
 {
   uint8_t buf[100];
@@ -183,6 +253,7 @@ int main (void)
   } addr;
 
   StunAgent agent;
+  StunAgentSavedIds agent_ids[16];
   StunMessage msg;
   uint16_t known_attributes[] = {STUN_ATTRIBUTE_USERNAME,
                                  STUN_ATTRIBUTE_MESSAGE_INTEGRITY,
@@ -191,6 +262,8 @@ int main (void)
 
   stun_agent_init (&agent, known_attributes,
       STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_USE_FINGERPRINT);
+  stun_agent_set_transaction_storage (&agent, agent_ids,
+      sizeof (agent_ids) / sizeof (agent_ids[0]));
 
   /* Request formatting test */
   stun_agent_init_request (&agent, &msg, buf, sizeof(buf), STUN_BINDING);
@@ -263,5 +336,8 @@ int main (void)
   check_af ("IPv6", AF_INET6, sizeof (struct sockaddr_in6));
 #endif
 
+  check_vectored_append (0);
+  check_vectored_append (STUN_AGENT_USAGE_NO_ALIGNED_ATTRIBUTES);
+
   return 0;
 }
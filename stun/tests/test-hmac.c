@@ -40,10 +40,13 @@
 
 #include "stun/sha1.h"
 #include "stun/md5.h"
+#include "stun/stunagent.h"
+#include "stun/stunhmac.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <time.h>
 
 static void print_bytes (const uint8_t *bytes, int len)
 {
@@ -87,6 +90,154 @@ static void test_hmac (const uint8_t *key, const uint8_t *str,
     exit (1);
 }
 
+static void test_sha1_million (void) {
+  /* A million repetitions of "a", fed in uneven chunks so that both the
+   * buffered and the multi-block paths are used. */
+  const uint8_t expected[] = {0x34, 0xaa, 0x97, 0x3c, 0xd4,
+                              0xc4, 0xda, 0xa4, 0xf6, 0x1e,
+                              0xeb, 0x2b, 0xdb, 0xad, 0x27,
+                              0x31, 0x65, 0x34, 0x01, 0x6f};
+  uint8_t a[1000];
+  uint8_t sha1[20];
+  SHA1_CTX ctx;
+  uint32_t done = 0, chunk = 1;
+
+  memset (a, 'a', sizeof (a));
+
+  SHA1Init (&ctx);
+  while (done < 1000000) {
+    uint32_t len = chunk;
+
+    if (len > 1000000 - done)
+      len = 1000000 - done;
+    SHA1Update (&ctx, a, len);
+    done += len;
+    chunk = (chunk * 7 + 3) % sizeof (a);
+  }
+  SHA1Final (sha1, &ctx);
+
+  printf ("SHA1 of a million 'a' : ");
+  print_bytes (sha1, SHA1_MAC_LEN);
+  printf ("Expected : ");
+  print_bytes (expected, SHA1_MAC_LEN);
+
+  if (memcmp (sha1, expected, SHA1_MAC_LEN))
+    exit (1);
+}
+
+/* Print the throughput of HMAC-SHA1 over typical STUN messages, and of SHA1
+ * over large buffers. The results are not checked. */
+static void benchmark_sha1 (void) {
+  static uint8_t buf[65536];
+  const uint8_t *addr = buf;
+  size_t len = 100;
+  uint32_t inner[5], outer[5];
+  uint8_t mac[20];
+  SHA1_CTX ctx;
+  clock_t start;
+  double secs;
+  unsigned int i;
+
+  hmac_sha1_precompute ((const uint8_t *) "password", 8, inner, outer);
+
+  start = clock ();
+  for (i = 0; i < 1000000; i++)
+    hmac_sha1_vector_precomputed (inner, outer, 1, &addr, &len, mac);
+  secs = (double) (clock () - start) / CLOCKS_PER_SEC;
+  printf ("HMAC-SHA1 of 100 bytes: %.0f/s\n", 1000000 / (secs > 0 ? secs : 1));
+
+  start = clock ();
+  SHA1Init (&ctx);
+  for (i = 0; i < 4096; i++)
+    SHA1Update (&ctx, buf, sizeof (buf));
+  SHA1Final (mac, &ctx);
+  secs = (double) (clock () - start) / CLOCKS_PER_SEC;
+  printf ("SHA1: %.1f MB/s\n",
+      4096 * (double) sizeof (buf) / 1000000 / (secs > 0 ? secs : 1));
+}
+
+static void test_hmac_long_key (void) {
+  /* Test case 6 from RFC 2202: the key is hashed first. */
+  uint8_t key[80];
+  const char *str = "Test Using Larger Than Block-Size Key - Hash Key First";
+  const uint8_t expected[] = {0xaa, 0x4a, 0xe5, 0xe1, 0x52,
+                              0x72, 0xd0, 0x0e, 0x95, 0x70,
+                              0x56, 0x37, 0xce, 0x8a, 0x3b,
+                              0x55, 0xed, 0x40, 0x21, 0x12};
+  const uint8_t *addr = (const uint8_t *) str;
+  size_t len = strlen (str);
+  uint32_t inner[5], outer[5];
+  uint8_t hmac[20];
+
+  memset (key, 0xaa, sizeof (key));
+
+  hmac_sha1 (key, sizeof (key), addr, len, hmac);
+  printf ("HMAC with an 80-byte key is : ");
+  print_bytes (hmac, SHA1_MAC_LEN);
+  printf ("Expected : ");
+  print_bytes (expected, SHA1_MAC_LEN);
+
+  if (memcmp (hmac, expected, SHA1_MAC_LEN))
+    exit (1);
+
+  /* The key schedule must be reusable. */
+  hmac_sha1_precompute (key, sizeof (key), inner, outer);
+  hmac_sha1_vector_precomputed (inner, outer, 1, &addr, &len, hmac);
+  hmac_sha1_vector_precomputed (inner, outer, 1, &addr, &len, hmac);
+
+  if (memcmp (hmac, expected, SHA1_MAC_LEN))
+    exit (1);
+}
+
+/* Sign messages with more keys than the agent caches, in turn, and check the
+ * MESSAGE-INTEGRITY against an uncached computation. */
+static void test_agent_key_cache (void) {
+  static const uint16_t known_attributes[] = { 0 };
+  const char *keys[] = { "a", "password1", "password2", "password3",
+                         "a much longer password which does not fit in a "
+                         "single SHA1 block, and cannot be cached" };
+  StunAgent agent;
+  StunAgentSavedIds agent_ids[16];
+  unsigned int i;
+
+  printf ("Checking MESSAGE-INTEGRITY with cached keys...\n");
+
+  stun_agent_init (&agent, known_attributes, STUN_COMPATIBILITY_RFC5389,
+      STUN_AGENT_USAGE_SHORT_TERM_CREDENTIALS);
+  stun_agent_set_transaction_storage (&agent, agent_ids,
+      sizeof (agent_ids) / sizeof (agent_ids[0]));
+
+  for (i = 0; i < 3 * (sizeof (keys) / sizeof (keys[0])); i++) {
+    const uint8_t *key = (const uint8_t *) keys[i % (sizeof (keys) /
+        sizeof (keys[0]))];
+    size_t key_len = strlen ((const char *) key);
+    uint8_t buf[STUN_MAX_MESSAGE_SIZE];
+    uint8_t sha[20];
+    StunMessage msg;
+    const uint8_t *hash;
+    uint16_t hlen;
+    size_t len;
+
+    stun_agent_init_request (&agent, &msg, buf, sizeof (buf), STUN_BINDING);
+    if (stun_message_append_string (&msg, STUN_ATTRIBUTE_USERNAME,
+            "user") != STUN_MESSAGE_RETURN_SUCCESS)
+      exit (1);
+    len = stun_agent_finish_message (&agent, &msg, key, key_len);
+    if (len == 0)
+      exit (1);
+
+    hash = stun_message_find (&msg, STUN_ATTRIBUTE_MESSAGE_INTEGRITY, &hlen);
+    if (hash == NULL || hlen != 20)
+      exit (1);
+
+    stun_sha1 (buf, len, len - 20, sha, key, key_len, 0);
+    if (memcmp (sha, hash, sizeof (sha)))
+      exit (1);
+  }
+
+  printf ("Done.\n");
+}
+
 static void test_md5 (const uint8_t *str,  const uint8_t *expected) {
   MD5_CTX ctx;
   uint8_t md5[20];
@@ -131,6 +282,10 @@ int main (void)
   test_hmac ((const uint8_t *) "hello", (const uint8_t*) "world",
       hello_world_hmac);
 
+  test_hmac_long_key ();
+  test_agent_key_cache ();
+  test_sha1_million ();
+
   test_sha1 ((const uint8_t *) "abc", abc_sha1);
   test_md5 ((const uint8_t *) "abc", abc_md5);
 
@@ -139,5 +294,7 @@ int main (void)
   test_md5 ((const uint8_t *)
       "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", abcd_etc_md5);
 
+  benchmark_sha1 ();
+
   return 0;
 }
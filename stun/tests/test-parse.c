@@ -209,7 +209,9 @@ static void test_message (void)
        0xb1, 0xad, 0xa4, 0x8a};
 
   StunAgent agent;
+  StunAgentSavedIds agent_ids[16];
   StunAgent agent2;
+  StunAgentSavedIds agent2_ids[16];
   StunMessage msg;
   uint16_t known_attributes[] = {STUN_ATTRIBUTE_USERNAME,
                                  STUN_ATTRIBUTE_ERROR_CODE,
@@ -231,8 +233,12 @@ static void test_message (void)
 
   stun_agent_init (&agent, known_attributes,
       STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_USE_FINGERPRINT);
+  stun_agent_set_transaction_storage (&agent, agent_ids,
+      sizeof (agent_ids) / sizeof (agent_ids[0]));
   stun_agent_init (&agent2, known_attributes,
       STUN_COMPATIBILITY_RFC3489, STUN_AGENT_USAGE_SHORT_TERM_CREDENTIALS);
+  stun_agent_set_transaction_storage (&agent2, agent2_ids,
+      sizeof (agent2_ids) / sizeof (agent2_ids[0]));
 
 
   stun_agent_validate (&agent2, &msg, req, sizeof(req),  NULL, NULL);
@@ -365,6 +371,7 @@ static void test_attribute (void)
   char str[STUN_MAX_STR];
 
   StunAgent agent;
+  StunAgentSavedIds agent_ids[16];
   StunMessage msg;
   uint16_t known_attributes[] = {STUN_ATTRIBUTE_MESSAGE_INTEGRITY, STUN_ATTRIBUTE_USERNAME, 0};
 
@@ -372,6 +379,8 @@ static void test_attribute (void)
 
   stun_agent_init (&agent, known_attributes,
       STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_SHORT_TERM_CREDENTIALS);
+  stun_agent_set_transaction_storage (&agent, agent_ids,
+      sizeof (agent_ids) / sizeof (agent_ids[0]));
 
   if (stun_agent_validate (&agent, &msg, acme, sizeof(acme),
           NULL, NULL) != STUN_VALIDATION_UNAUTHORIZED)
@@ -606,6 +615,7 @@ static void test_vectors (void)
   socklen_t addrlen;
 
   StunAgent agent;
+  StunAgentSavedIds agent_ids[16];
   StunMessage msg;
   StunMessage msg2;
   uint16_t known_attributes[] = {
@@ -618,6 +628,8 @@ static void test_vectors (void)
       STUN_COMPATIBILITY_RFC5389,
       STUN_AGENT_USAGE_SHORT_TERM_CREDENTIALS |
       STUN_AGENT_USAGE_USE_FINGERPRINT);
+  stun_agent_set_transaction_storage (&agent, agent_ids,
+      sizeof (agent_ids) / sizeof (agent_ids[0]));
 
   memset (&addr, 0, sizeof (addr));
 
@@ -701,6 +713,192 @@ static void test_vectors (void)
   puts ("Done.");
 }
 
+/* Tests for the attribute index, which must find the same attributes as
+ * walking the message */
+static void test_index (void)
+{
+  static const uint8_t msg_bytes[] =
+      {0x00, 0x01, 0x00, 0x40,
+       0x21, 0x12, 0xA4, 0x42, // cookie
+       0x76, 0x54, 0x32, 0x10,
+       0xfe, 0xdc, 0xba, 0x98,
+       0x76, 0x54, 0x32, 0x10,
+
+       /* USERNAME */
+       0x00, 0x06, 0x00, 0x04,
+       0x41, 0x42, 0x43, 0x44,
+
+       /* USERNAME again, ignored */
+       0x00, 0x06, 0x00, 0x04,
+       0x45, 0x46, 0x47, 0x48,
+
+       /* NONCE, which is REALM in OC2007 */
+       0x00, 0x15, 0x00, 0x01,
+       0x4e, 0x00, 0x00, 0x00,
+
+       /* MESSAGE-INTEGRITY */
+       0x00, 0x08, 0x00, 0x14,
+       0x00, 0x00, 0x00, 0x00,
+       0x00, 0x00, 0x00, 0x00,
+       0x00, 0x00, 0x00, 0x00,
+       0x00, 0x00, 0x00, 0x00,
+       0x00, 0x00, 0x00, 0x00,
+
+       /* PRIORITY, misordered after MESSAGE-INTEGRITY */
+       0x00, 0x24, 0x00, 0x04,
+       0x00, 0x00, 0x00, 0x01,
+
+       /* FINGERPRINT */
+       0x80, 0x28, 0x00, 0x04,
+       0x00, 0x00, 0x00, 0x00};
+  static const uint16_t types[] = {
+    STUN_ATTRIBUTE_USERNAME, STUN_ATTRIBUTE_NONCE, STUN_ATTRIBUTE_REALM,
+    STUN_ATTRIBUTE_MESSAGE_INTEGRITY, STUN_ATTRIBUTE_PRIORITY,
+    STUN_ATTRIBUTE_FINGERPRINT, STUN_ATTRIBUTE_SOFTWARE,
+  };
+  static const uint16_t known_attributes[] = { 0 };
+  uint8_t buf[STUN_MAX_MESSAGE_SIZE];
+  StunAgent agent, oc2007_agent;
+  StunAgentSavedIds agent_ids[16];
+  StunAgentSavedIds oc2007_agent_ids[16];
+  StunMessage msg = {0};
+  uint16_t len;
+  unsigned i, pass;
+
+  puts ("Attribute index...");
+
+  stun_agent_init (&agent, known_attributes, STUN_COMPATIBILITY_RFC5389, 0);
+  stun_agent_set_transaction_storage (&agent, agent_ids,
+      sizeof (agent_ids) / sizeof (agent_ids[0]));
+  stun_agent_init (&oc2007_agent, known_attributes,
+      STUN_COMPATIBILITY_OC2007, 0);
+  stun_agent_set_transaction_storage (&oc2007_agent, oc2007_agent_ids,
+      sizeof (oc2007_agent_ids) / sizeof (oc2007_agent_ids[0]));
+
+  if (stun_message_validate_buffer_length (msg_bytes, sizeof (msg_bytes),
+          TRUE) != sizeof (msg_bytes))
+    fatal ("Index test message is invalid");
+
+  memcpy (buf, msg_bytes, sizeof (msg_bytes));
+  msg.buffer = buf;
+  msg.buffer_len = sizeof (buf);
+
+  for (pass = 0; pass < 2; pass++)
+  {
+    msg.agent = (pass == 0) ? &agent : &oc2007_agent;
+
+    for (i = 0; i < sizeof (types) / sizeof (types[0]); i++)
+    {
+      const void *walked, *indexed;
+      uint16_t walked_len = 0, indexed_len = 0;
+
+      msg.indexed_buffer = NULL;
+      walked = stun_message_find (&msg, types[i], &walked_len);
+
+      if (!stun_message_index_attributes (&msg))
+        fatal ("Indexing failed");
+      indexed = stun_message_find (&msg, types[i], &indexed_len);
+
+      if (walked != indexed || walked_len != indexed_len)
+        fatal ("Indexed lookup of 0x%04x differs", types[i]);
+    }
+  }
+
+  msg.agent = &agent;
+
+  if (stun_message_find (&msg, STUN_ATTRIBUTE_PRIORITY, &len) != NULL)
+    fatal ("Misordered attribute found");
+  if (stun_message_find (&msg, STUN_ATTRIBUTE_USERNAME, &len) != buf + 24)
+    fatal ("Duplicate attribute found");
+
+  /* Reinitialising and appending drop the index. */
+  stun_message_init (&msg, STUN_REQUEST, STUN_BINDING, msg_bytes + 8);
+  if (stun_message_find (&msg, STUN_ATTRIBUTE_USERNAME, &len) != NULL)
+    fatal ("Stale index after init");
+
+  for (i = 0; i < STUN_MESSAGE_INDEX_SIZE; i++)
+  {
+    if (stun_message_index_attributes (&msg) !=
+        (i <= STUN_MESSAGE_INDEX_SIZE * 3 / 4))
+      fatal ("Indexing %u attributes failed", i);
+    if (stun_message_append32 (&msg, 0x8000 + i, i) !=
+        STUN_MESSAGE_RETURN_SUCCESS)
+      fatal ("Cannot append attribute");
+    if (stun_message_find (&msg, 0x8000 + i, &len) == NULL)
+      fatal ("Stale index after append");
+  }
+
+  /* Too many attributes to index, lookups still work. */
+  if (stun_message_index_attributes (&msg))
+    fatal ("Indexed too many attributes");
+  if (stun_message_find (&msg, 0x8000 + STUN_MESSAGE_INDEX_SIZE - 1, &len) ==
+      NULL)
+    fatal ("Lookup in unindexed message failed");
+
+  puts ("Done.");
+}
+
+/* Tests for validating and parsing a message split over several buffers */
+static void test_vectored (void)
+{
+  static const uint8_t msg[] =
+      {0x00, 0x01, 0x00, 0x24,
+       0x21, 0x12, 0xA4, 0x42, // cookie
+       0x76, 0x54, 0x32, 0x10,
+       0xfe, 0xdc, 0xba, 0x98,
+       0x76, 0x54, 0x32, 0x10,
+
+       /* USERNAME, padded */
+       0x00, 0x06, 0x00, 0x05,
+       0x65, 0x76, 0x74, 0x6a,
+       0x3a, 0x00, 0x00, 0x00,
+
+       /* FF06: 160-bits */
+       0xff, 0x06, 0x00, 0x14,
+       0x00, 0x02, 0x12, 0x34,
+       0x01, 0x13, 0xa9, 0xfa,
+       0xa8, 0xf9, 0x8c, 0xff,
+       0x20, 0x26, 0x74, 0x48,
+       0x8c, 0x9a, 0xec, 0xfd};
+  uint8_t bad[sizeof (msg)];
+  StunInputVector buffers[sizeof (msg)];
+  unsigned chunk;
+
+  puts ("Vectored message validation...");
+
+  memcpy (bad, msg, sizeof (msg));
+  bad[23] = 0x40; /* USERNAME overflows the message */
+
+  for (chunk = 1; chunk <= sizeof (msg); chunk++)
+  {
+    unsigned n_buffers = 0, offset;
+
+    for (offset = 0; offset < sizeof (msg); offset += chunk)
+    {
+      buffers[n_buffers].buffer = msg + offset;
+      buffers[n_buffers].size = sizeof (msg) - offset < chunk ?
+          sizeof (msg) - offset : chunk;
+      n_buffers++;
+    }
+
+    if (stun_message_validate_buffer_length_vectored (buffers, n_buffers,
+            sizeof (msg), TRUE) != sizeof (msg))
+      fatal ("%u-byte chunks validation failed", chunk);
+    if (stun_message_validate_buffer_length_vectored (buffers, n_buffers,
+            sizeof (msg) - 1, TRUE) != STUN_MESSAGE_BUFFER_INCOMPLETE)
+      fatal ("%u-byte chunks incomplete validation failed", chunk);
+
+    for (offset = 0; offset < n_buffers; offset++)
+      buffers[offset].buffer = bad + (buffers[offset].buffer - msg);
+
+    if (stun_message_validate_buffer_length_vectored (buffers, n_buffers,
+            sizeof (bad), TRUE) != STUN_MESSAGE_BUFFER_INVALID)
+      fatal ("%u-byte chunks invalid validation failed", chunk);
+  }
+
+  puts ("Done.");
+}
+
 static void test_hash_creds (void)
 {
   uint8_t md5[16];
@@ -733,6 +931,8 @@ int main (void)
   test_message ();
   test_attribute ();
   test_vectors ();
+  test_vectored ();
+  test_index ();
   test_hash_creds ();
   return 0;
 }
@@ -0,0 +1,209 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "stun/stunagent.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#undef NDEBUG /* ensure assertions are built-in */
+#include <assert.h>
+
+#define N_REQUESTS 1000
+#define BUF_SIZE 64
+
+static StunAgent client, server;
+static uint8_t requests[N_REQUESTS + 1][BUF_SIZE];
+static size_t request_lens[N_REQUESTS + 1];
+
+/* Creates request @i. If @collide is set, all requests share the bytes of
+ * the transaction ID which the agent hashes. */
+static size_t make_request (int i, bool collide)
+{
+  StunMessage msg;
+
+  assert (stun_agent_init_request (&client, &msg, requests[i], BUF_SIZE,
+          STUN_BINDING));
+  if (collide) {
+    memset (requests[i] + 16, 0xff, 4);
+    memcpy (requests[i] + 8, &i, sizeof (i));
+  }
+  request_lens[i] = stun_agent_finish_message (&client, &msg, NULL, 0);
+  return request_lens[i];
+}
+
+/* Answers request @i and feeds the response back to the client */
+static StunValidationStatus respond (int i)
+{
+  StunMessage req, resp, msg;
+  uint8_t buf[BUF_SIZE];
+  size_t len;
+
+  assert (stun_agent_validate (&server, &req, requests[i], request_lens[i],
+          NULL, NULL) == STUN_VALIDATION_SUCCESS);
+  assert (stun_agent_init_response (&server, &resp, buf, sizeof (buf), &req));
+  len = stun_agent_finish_message (&server, &resp, NULL, 0);
+  assert (len > 0);
+
+  return stun_agent_validate (&client, &msg, buf, len, NULL, NULL);
+}
+
+static void forget (int i)
+{
+  StunTransactionId id;
+
+  memcpy (id, requests[i] + 4, sizeof (id));
+  assert (stun_agent_forget_transaction (&client, id));
+  assert (!stun_agent_forget_transaction (&client, id));
+}
+
+static void shuffle (int *order, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    order[i] = i;
+  for (i = n - 1; i > 0; i--) {
+    int j = rand () % (i + 1);
+    int tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+}
+
+/* An agent refuses requests once its built-in table is full */
+static void test_builtin (void)
+{
+  int i;
+
+  stun_agent_init (&client, STUN_ALL_KNOWN_ATTRIBUTES,
+      STUN_COMPATIBILITY_RFC5389, 0);
+  for (i = 0; i < STUN_AGENT_DEFAULT_SAVED_IDS; i++)
+    assert (make_request (i, false) > 0);
+  assert (make_request (i, false) == 0);
+
+  forget (0);
+  assert (make_request (0, false) > 0);
+
+  for (i = STUN_AGENT_DEFAULT_SAVED_IDS - 1; i >= 0; i--) {
+    assert (respond (i) == STUN_VALIDATION_SUCCESS);
+    assert (respond (i) == STUN_VALIDATION_UNMATCHED_RESPONSE);
+  }
+}
+
+/* An agent refuses requests once the storage it is given is full, and goes
+ * back to its built-in table when the storage is taken away */
+static void test_full (void)
+{
+  static StunAgentSavedIds storage[STUN_AGENT_MAX_SAVED_IDS];
+  int i;
+
+  stun_agent_init (&client, STUN_ALL_KNOWN_ATTRIBUTES,
+      STUN_COMPATIBILITY_RFC5389, 0);
+  stun_agent_set_transaction_storage (&client, storage,
+      STUN_AGENT_MAX_SAVED_IDS);
+  for (i = 0; i < STUN_AGENT_MAX_SAVED_IDS; i++)
+    assert (make_request (i, false) > 0);
+  assert (make_request (i, false) == 0);
+
+  forget (0);
+  assert (make_request (0, false) > 0);
+
+  for (i = 0; i < STUN_AGENT_MAX_SAVED_IDS; i++) {
+    assert (respond (i) == STUN_VALIDATION_SUCCESS);
+    assert (respond (i) == STUN_VALIDATION_UNMATCHED_RESPONSE);
+  }
+
+  stun_agent_set_transaction_storage (&client, NULL, 0);
+  for (i = 0; i < STUN_AGENT_DEFAULT_SAVED_IDS; i++)
+    assert (make_request (i, false) > 0);
+  assert (make_request (i, false) == 0);
+}
+
+/* Caller-provided storage holds more transactions, answered out of order.
+ * If @collide is set, they all hash to the same slot. */
+static void test_storage (bool collide)
+{
+  static StunAgentSavedIds storage[N_REQUESTS];
+  bool forgotten[N_REQUESTS];
+  int order[N_REQUESTS];
+  int n = collide ? 64 : N_REQUESTS;
+  int i;
+
+  stun_agent_init (&client, STUN_ALL_KNOWN_ATTRIBUTES,
+      STUN_COMPATIBILITY_RFC5389, 0);
+  stun_agent_set_transaction_storage (&client, storage, n);
+
+  for (i = 0; i < n; i++)
+    assert (make_request (i, collide) > 0);
+  assert (make_request (n, collide) == 0);
+
+  /* Forgetting a third of the transactions leaves holes in the probe runs
+   * of the others */
+  memset (forgotten, 0, sizeof (forgotten));
+  shuffle (order, n);
+  for (i = 0; i < n; i += 3) {
+    forget (order[i]);
+    forgotten[order[i]] = true;
+  }
+
+  shuffle (order, n);
+  for (i = 0; i < n; i++) {
+    assert (respond (order[i]) == (forgotten[order[i]] ?
+            STUN_VALIDATION_UNMATCHED_RESPONSE : STUN_VALIDATION_SUCCESS));
+    assert (respond (order[i]) == STUN_VALIDATION_UNMATCHED_RESPONSE);
+  }
+
+  /* Everything has been answered or forgotten, so the table is empty */
+  for (i = 0; i < n; i++)
+    assert (make_request (i, collide) > 0);
+  for (i = n - 1; i >= 0; i--)
+    assert (respond (i) == STUN_VALIDATION_SUCCESS);
+}
+
+int main (void)
+{
+  srand (time (NULL));
+
+  stun_agent_init (&server, STUN_ALL_KNOWN_ATTRIBUTES,
+      STUN_COMPATIBILITY_RFC5389, 0);
+
+  test_builtin ();
+  test_full ();
+  test_storage (false);
+  test_storage (true);
+
+  return 0;
+}
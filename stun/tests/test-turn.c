@@ -131,6 +131,7 @@ static void test_turn (char *username, char *password, char *hostname, int port)
   uint8_t refresh[STUN_MAX_MESSAGE_SIZE];
   size_t req_len;
   StunAgent agent;
+  StunAgentSavedIds agent_ids[16];
   StunMessage msg;
   StunMessage req_msg;
   StunMessage refresh_msg;
@@ -148,6 +149,8 @@ static void test_turn (char *username, char *password, char *hostname, int port)
 
   stun_agent_init (&agent, STUN_ALL_KNOWN_ATTRIBUTES,
       STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS);
+  stun_agent_set_transaction_storage (&agent, agent_ids,
+      sizeof (agent_ids) / sizeof (agent_ids[0]));
 
   /* Allocate a client socket and connect to server */
   fd = socket (AF_INET, SOCK_DGRAM, 0);
@@ -459,6 +459,7 @@ StunUsageBindReturn stun_usage_bind_run (const struct sockaddr *srv,
   StunTimer timer;
   StunTransport trans;
   StunAgent agent;
+  StunAgentSavedIds saved_ids[1];
   StunMessage req;
   uint8_t req_buf[STUN_MAX_MESSAGE_SIZE];
   StunMessage msg;
@@ -473,6 +474,7 @@ StunUsageBindReturn stun_usage_bind_run (const struct sockaddr *srv,
 
   stun_agent_init (&agent, STUN_ALL_KNOWN_ATTRIBUTES,
       STUN_COMPATIBILITY_RFC3489, 0);
+  stun_agent_set_transaction_storage (&agent, saved_ids, 1);
 
   len = stun_usage_bind_create (&agent, &req, req_buf, sizeof(req_buf));
 
@@ -0,0 +1,6 @@
+#! /bin/sh
+
+# Sockets silently fall back to udp-bsd where io_uring isn’t available.
+echo "Running the send()/recv() tests on io_uring sockets."
+
+NICE_TEST_IO_URING=1 exec ./test-send-recv
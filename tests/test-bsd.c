@@ -43,6 +43,9 @@
 
 #include "socket.h"
 
+/* The tests are run against each UDP socket implementation in turn. */
+static NiceSocket *(*socket_new) (NiceAddress *addr) = nice_udp_bsd_socket_new;
+
 static gssize
 socket_recv (NiceSocket *sock, NiceAddress *addr, gsize buf_len, gchar *buf)
 {
@@ -62,7 +65,7 @@ test_socket_initial_properties (void)
 {
   NiceSocket *sock;
 
-  sock = nice_udp_bsd_socket_new (NULL);
+  sock = socket_new (NULL);
   g_assert (sock != NULL);
 
   // not bound to a particular interface
@@ -79,7 +82,7 @@ test_socket_address_properties (void)
   NiceSocket *sock;
   NiceAddress tmp;
 
-  sock = nice_udp_bsd_socket_new (NULL);
+  sock = socket_new (NULL);
   g_assert (sock != NULL);
 
   g_assert (nice_address_set_from_string (&tmp, "127.0.0.1"));
@@ -98,10 +101,10 @@ test_simple_send_recv (void)
   NiceAddress tmp;
   gchar buf[5];
 
-  server = nice_udp_bsd_socket_new (NULL);
+  server = socket_new (NULL);
   g_assert (server != NULL);
 
-  client = nice_udp_bsd_socket_new (NULL);
+  client = socket_new (NULL);
   g_assert (client != NULL);
 
   g_assert (nice_address_set_from_string (&tmp, "127.0.0.1"));
@@ -133,7 +136,7 @@ test_zero_send_recv (void)
   NiceOutputMessage local_out_message;
   NiceInputMessage local_in_message;
 
-  sock = nice_udp_bsd_socket_new (NULL);
+  sock = socket_new (NULL);
   g_assert (sock != NULL);
 
   g_assert (nice_address_set_from_string (&tmp, "127.0.0.1"));
@@ -169,10 +172,10 @@ test_multi_buffer_recv (void)
   guint8 buf[20];
   guint8 dummy_buf[9];
 
-  server = nice_udp_bsd_socket_new (NULL);
+  server = socket_new (NULL);
   g_assert (server != NULL);
 
-  client = nice_udp_bsd_socket_new (NULL);
+  client = socket_new (NULL);
   g_assert (client != NULL);
 
   g_assert (nice_address_set_from_string (&tmp, "127.0.0.1"));
@@ -217,6 +220,177 @@ test_multi_buffer_recv (void)
   nice_socket_free (server);
 }
 
+#ifdef HAVE_RECVMMSG
+/* Test that empty datagrams dequeued in the middle of a batch are dropped
+ * without losing the messages which follow them. */
+static void
+test_empty_datagram_batch_recv (void)
+{
+  NiceSocket *server;
+  NiceSocket *client;
+  NiceAddress tmp;
+  guint8 buf[3][10];
+  GInputVector bufs[3] = {
+    { buf[0], sizeof (buf[0]) },
+    { buf[1], sizeof (buf[1]) },
+    { buf[2], sizeof (buf[2]) },
+  };
+  NiceInputMessage messages[3] = {
+    { &bufs[0], 1, NULL, 0 },
+    { &bufs[1], 1, NULL, 0 },
+    { &bufs[2], 1, NULL, 0 },
+  };
+
+  server = socket_new (NULL);
+  g_assert (server != NULL);
+
+  client = socket_new (NULL);
+  g_assert (client != NULL);
+
+  g_assert (nice_address_set_from_string (&tmp, "127.0.0.1"));
+  nice_address_set_port (&tmp, nice_address_get_port (&server->addr));
+
+  /* Sending an empty datagram is reported as zero messages sent. */
+  g_assert_cmpint (nice_socket_send (client, &tmp, 5, "hello"), ==, 5);
+  g_assert_cmpint (nice_socket_send (client, &tmp, 0, ""), ==, 0);
+  g_assert_cmpint (nice_socket_send (client, &tmp, 5, "world"), ==, 5);
+
+  g_assert_cmpint (nice_socket_recv_messages (server, messages, 3), ==, 2);
+  g_assert_cmpuint (messages[0].length, ==, 5);
+  g_assert_cmpint (strncmp ((gchar *) buf[0], "hello", 5), ==, 0);
+  g_assert_cmpuint (messages[1].length, ==, 5);
+  g_assert_cmpint (strncmp ((gchar *) buf[1], "world", 5), ==, 0);
+
+  nice_socket_free (client);
+  nice_socket_free (server);
+}
+#endif
+
+/* Check that runs of equal-sized messages sent with GSO arrive as separate
+ * datagrams, including a shorter one at the end of a run. */
+static void
+test_gso_send (void)
+{
+  NiceSocket *server;
+  NiceSocket *client;
+  NiceAddress tmp;
+  const gsize send_lens[] = { 10, 10, 10, 10, 3, 10, 10 };
+  guint8 send_buf[G_N_ELEMENTS (send_lens)][10];
+  GOutputVector send_bufs[G_N_ELEMENTS (send_lens)];
+  NiceOutputMessage send_messages[G_N_ELEMENTS (send_lens)];
+  guint8 recv_buf[G_N_ELEMENTS (send_lens)][20];
+  GInputVector recv_bufs[G_N_ELEMENTS (send_lens)];
+  NiceInputMessage recv_messages[G_N_ELEMENTS (send_lens)];
+  guint i;
+
+  server = socket_new (NULL);
+  g_assert (server != NULL);
+
+  client = socket_new (NULL);
+  g_assert (client != NULL);
+
+  /* Not supported on this platform or kernel. */
+  if (!nice_udp_bsd_socket_set_gso (client, TRUE))
+    goto done;
+
+  g_assert (nice_address_set_from_string (&tmp, "127.0.0.1"));
+  nice_address_set_port (&tmp, nice_address_get_port (&server->addr));
+
+  for (i = 0; i < G_N_ELEMENTS (send_lens); i++) {
+    memset (send_buf[i], 'a' + i, sizeof (send_buf[i]));
+    send_bufs[i].buffer = send_buf[i];
+    send_bufs[i].size = send_lens[i];
+    send_messages[i].buffers = &send_bufs[i];
+    send_messages[i].n_buffers = 1;
+
+    recv_bufs[i].buffer = recv_buf[i];
+    recv_bufs[i].size = sizeof (recv_buf[i]);
+    recv_messages[i].buffers = &recv_bufs[i];
+    recv_messages[i].n_buffers = 1;
+    recv_messages[i].from = NULL;
+    recv_messages[i].length = 0;
+  }
+
+  g_assert_cmpint (nice_socket_send_messages (client, &tmp, send_messages,
+      G_N_ELEMENTS (send_messages)), ==, G_N_ELEMENTS (send_messages));
+  g_assert_cmpint (nice_socket_recv_messages (server, recv_messages,
+      G_N_ELEMENTS (recv_messages)), ==, G_N_ELEMENTS (recv_messages));
+
+  for (i = 0; i < G_N_ELEMENTS (send_lens); i++) {
+    g_assert_cmpuint (recv_messages[i].length, ==, send_lens[i]);
+    g_assert (memcmp (recv_buf[i], send_buf[i], send_lens[i]) == 0);
+  }
+
+done:
+  nice_socket_free (client);
+  nice_socket_free (server);
+}
+
+/* Check that datagrams coalesced by GRO are returned one per message, and that
+ * segments which don’t fit are returned by the next receive. */
+static void
+test_gro_recv (void)
+{
+  NiceSocket *server;
+  NiceSocket *client;
+  NiceAddress tmp;
+  guint8 send_buf[7][10];
+  GOutputVector send_bufs[7];
+  NiceOutputMessage send_messages[7];
+  guint8 recv_buf[7][20];
+  GInputVector recv_bufs[7];
+  NiceInputMessage recv_messages[7];
+  guint i;
+
+  server = socket_new (NULL);
+  g_assert (server != NULL);
+
+  client = socket_new (NULL);
+  g_assert (client != NULL);
+
+  /* Not supported on this platform or kernel. */
+  if (!nice_udp_bsd_socket_set_gro (server, TRUE))
+    goto done;
+
+  /* Sending with GSO makes sure the datagrams are coalesced on loopback. */
+  nice_udp_bsd_socket_set_gso (client, TRUE);
+
+  g_assert (nice_address_set_from_string (&tmp, "127.0.0.1"));
+  nice_address_set_port (&tmp, nice_address_get_port (&server->addr));
+
+  for (i = 0; i < G_N_ELEMENTS (send_messages); i++) {
+    memset (send_buf[i], 'a' + i, sizeof (send_buf[i]));
+    send_bufs[i].buffer = send_buf[i];
+    send_bufs[i].size = (i == G_N_ELEMENTS (send_messages) - 1) ? 4 : 10;
+    send_messages[i].buffers = &send_bufs[i];
+    send_messages[i].n_buffers = 1;
+
+    recv_bufs[i].buffer = recv_buf[i];
+    recv_bufs[i].size = sizeof (recv_buf[i]);
+    recv_messages[i].buffers = &recv_bufs[i];
+    recv_messages[i].n_buffers = 1;
+    recv_messages[i].from = NULL;
+    recv_messages[i].length = 0;
+  }
+
+  g_assert_cmpint (nice_socket_send_messages (client, &tmp, send_messages,
+      G_N_ELEMENTS (send_messages)), ==, G_N_ELEMENTS (send_messages));
+
+  g_assert_cmpint (nice_socket_recv_messages (server, recv_messages, 2), ==, 2);
+  g_assert_cmpint (nice_socket_recv_messages (server, recv_messages + 2,
+      G_N_ELEMENTS (recv_messages) - 2), ==, G_N_ELEMENTS (recv_messages) - 2);
+  g_assert (!nice_udp_bsd_socket_has_gro_pending (server));
+
+  for (i = 0; i < G_N_ELEMENTS (send_messages); i++) {
+    g_assert_cmpuint (recv_messages[i].length, ==, send_bufs[i].size);
+    g_assert (memcmp (recv_buf[i], send_buf[i], send_bufs[i].size) == 0);
+  }
+
+done:
+  nice_socket_free (client);
+  nice_socket_free (server);
+}
+
 /* Fill a buffer with deterministic but non-repeated data, so that transmission
  * and reception corruption is more likely to be detected. */
 static void
@@ -240,10 +414,10 @@ test_multi_message_recv (guint n_sends, guint n_receives,
   NiceSocket *client;
   NiceAddress tmp;
 
-  server = nice_udp_bsd_socket_new (NULL);
+  server = socket_new (NULL);
   g_assert (server != NULL);
 
-  client = nice_udp_bsd_socket_new (NULL);
+  client = socket_new (NULL);
   g_assert (client != NULL);
 
   g_assert (nice_address_set_from_string (&tmp, "127.0.0.1"));
@@ -365,16 +539,19 @@ test_multi_message_recv (guint n_sends, guint n_receives,
   nice_socket_free (server);
 }
 
-int
-main (void)
+static void
+run_tests (void)
 {
-  g_type_init ();
-
   test_socket_initial_properties ();
   test_socket_address_properties ();
   test_simple_send_recv ();
   test_zero_send_recv ();
   test_multi_buffer_recv ();
+#ifdef HAVE_RECVMMSG
+  test_empty_datagram_batch_recv ();
+#endif
+  test_gso_send ();
+  test_gro_recv ();
 
   /* Multi-message testing. Serious business. */
   {
@@ -400,6 +577,8 @@ main (void)
       { 100, 100, 100, 100,   1, 100,  64 },  /* send 10000B, receive 6400B */
       /* small receive buffers (data loss) */
       {  50,  50,  50,  50,  10, 100,   8 },  /* send 50000B, receive 4000B */
+      /* more messages than are passed to the kernel in one batch */
+      {  70,  70,  70,  70,   4,  10,  10 },  /* send 2800B, receive 2800B */
     };
 
     for (i = 0; i < G_N_ELEMENTS (test_cases); i++) {
@@ -410,6 +589,25 @@ main (void)
           test_cases[i].expected_n_sent_messages);
     }
   }
+}
+
+int
+main (void)
+{
+  NiceSocket *sock;
+
+  g_type_init ();
+
+  run_tests ();
+
+  /* io_uring may not be built in, or supported by the kernel. */
+  sock = nice_udp_uring_socket_new (NULL);
+  if (sock != NULL) {
+    nice_socket_free (sock);
+
+    socket_new = nice_udp_uring_socket_new;
+    run_tests ();
+  }
 
   return 0;
 }
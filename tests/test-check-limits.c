@@ -0,0 +1,313 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/*
+ * Checks the limits on the work done for inbound connectivity checks: cached
+ * responses to retransmitted requests, the token buckets dropping floods of
+ * requests, and the bound on the checks stored before the remote candidates
+ * are known.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include "agent.h"
+#include "agent-priv.h" /* for testing purposes */
+
+static NiceAgent *agent;
+static guint stream_id;
+static Stream *stream;
+static Component *component;
+static NiceSocket *local_socket;
+static NiceSocket *remote_socket;
+static gchar *local_ufrag;
+static gchar *local_password;
+
+/* Build a connectivity check from the remote agent, as a peer using the same
+ * compatibility would. Each has a new transaction ID. */
+static gsize
+build_check (guint8 *buf, gsize buf_len, gboolean use_candidate)
+{
+  StunAgent stun_agent;
+  StunAgentSavedIds saved_ids[1];
+  StunMessage msg;
+  gchar *username;
+  gsize len;
+
+  stun_agent_init (&stun_agent, STUN_ALL_KNOWN_ATTRIBUTES,
+      STUN_COMPATIBILITY_RFC5389,
+      STUN_AGENT_USAGE_SHORT_TERM_CREDENTIALS |
+      STUN_AGENT_USAGE_USE_FINGERPRINT);
+  stun_agent_set_transaction_storage (&stun_agent, saved_ids,
+      G_N_ELEMENTS (saved_ids));
+
+  username = g_strconcat (local_ufrag, ":remote", NULL);
+  len = stun_usage_ice_conncheck_create (&stun_agent, &msg, buf, buf_len,
+      (const uint8_t *) username, strlen (username),
+      (const uint8_t *) local_password, strlen (local_password),
+      use_candidate, TRUE, 0x6e0001ff, 42, NULL,
+      STUN_USAGE_ICE_COMPATIBILITY_RFC5245);
+  g_assert_cmpuint (len, >, 0);
+  g_free (username);
+
+  return len;
+}
+
+/* Hand @buf to the agent as if it had been received from @from. */
+static void
+handle_check (const NiceAddress *from, guint8 *buf, gsize len)
+{
+  agent_lock (agent);
+  conn_check_handle_inbound_stun (agent, stream, component, local_socket,
+      from, (gchar *) buf, len);
+  agent_unlock_and_emit (agent);
+}
+
+/* Receive the agent's answer on the remote socket, if it sent one. */
+static gssize
+recv_response (guint8 *buf, gsize buf_len)
+{
+  GInputVector local_buf = { buf, buf_len };
+  NiceInputMessage local_message = { &local_buf, 1, NULL, 0 };
+  gint ret;
+
+  ret = nice_socket_recv_messages (remote_socket, &local_message, 1);
+  if (ret <= 0)
+    return ret;
+
+  return local_message.length;
+}
+
+/* Empty the bucket for the whole component, so that the next new check is
+ * dropped. It refills at COMPONENT_CHECK_RATE, so the check must follow
+ * immediately. */
+static void
+drain_component_bucket (void)
+{
+  component->check_rate_limit.tokens = 0;
+  component->check_rate_limit.updated = g_get_monotonic_time ();
+}
+
+static void
+reset_rate_limits (void)
+{
+  memset (component->source_rate_limits, 0,
+      sizeof (component->source_rate_limits));
+  memset (&component->check_rate_limit, 0,
+      sizeof (component->check_rate_limit));
+  component->n_rate_limited_checks = 0;
+}
+
+/* Retransmissions of a check and checks with or without USE-CANDIDATE from one
+ * source take a single entry, which stays nominated. */
+static void
+test_pending_check_dedup (void)
+{
+  guint8 buf[STUN_MAX_MESSAGE_SIZE];
+  gsize len;
+  IncomingCheck *icheck;
+
+  len = build_check (buf, sizeof (buf), TRUE);
+  handle_check (&remote_socket->addr, buf, len);
+  handle_check (&remote_socket->addr, buf, len);
+  len = build_check (buf, sizeof (buf), FALSE);
+  handle_check (&remote_socket->addr, buf, len);
+
+  g_assert_cmpuint (g_slist_length (component->incoming_checks), ==, 1);
+  icheck = component->incoming_checks->data;
+  g_assert (nice_address_equal (&icheck->from, &remote_socket->addr));
+  g_assert (icheck->local_socket == local_socket);
+  g_assert (icheck->use_candidate);
+}
+
+/* Checks from more sources than there can be remote candidates are dropped,
+ * and counted. */
+static void
+test_pending_check_bound (void)
+{
+  guint8 buf[STUN_MAX_MESSAGE_SIZE];
+  NiceAddress from;
+  guint64 n_unstored = 0;
+  guint i;
+
+  from = remote_socket->addr;
+
+  for (i = 1; i < NICE_AGENT_MAX_REMOTE_CANDIDATES + 5; i++) {
+    gsize len = build_check (buf, sizeof (buf), FALSE);
+
+    nice_address_set_port (&from, nice_address_get_port (&remote_socket->addr)
+        + i);
+    handle_check (&from, buf, len);
+  }
+
+  g_assert_cmpuint (g_slist_length (component->incoming_checks), ==,
+      NICE_AGENT_MAX_REMOTE_CANDIDATES);
+  g_assert (nice_agent_get_dropped_checks (agent, stream_id, 1, NULL,
+      &n_unstored));
+  g_assert_cmpuint (n_unstored, ==, 5);
+}
+
+/* A retransmitted check is answered from the cache, even when new checks from
+ * its source are being dropped, until its cache entry expires. */
+static void
+test_cached_response (void)
+{
+  guint8 buf[STUN_MAX_MESSAGE_SIZE], other_buf[STUN_MAX_MESSAGE_SIZE];
+  guint8 response[STUN_MAX_MESSAGE_SIZE], replay[STUN_MAX_MESSAGE_SIZE];
+  gsize len, other_len;
+  gssize response_len;
+  CachedStunResponse *cached;
+  guint64 n_rate_limited = 0;
+
+  reset_rate_limits ();
+
+  /* Skip the answers to earlier tests. */
+  while (recv_response (response, sizeof (response)) > 0)
+    continue;
+
+  len = build_check (buf, sizeof (buf), FALSE);
+  handle_check (&remote_socket->addr, buf, len);
+  response_len = recv_response (response, sizeof (response));
+  g_assert_cmpint (response_len, >, 0);
+
+  /* The retransmission gets the same response... */
+  drain_component_bucket ();
+  handle_check (&remote_socket->addr, buf, len);
+  g_assert_cmpint (recv_response (replay, sizeof (replay)), ==, response_len);
+  g_assert (memcmp (replay, response, response_len) == 0);
+
+  /* ...while a new check is dropped unanswered. */
+  other_len = build_check (other_buf, sizeof (other_buf), FALSE);
+  drain_component_bucket ();
+  handle_check (&remote_socket->addr, other_buf, other_len);
+  g_assert_cmpint (recv_response (replay, sizeof (replay)), ==, 0);
+  g_assert (nice_agent_get_dropped_checks (agent, stream_id, 1,
+      &n_rate_limited, NULL));
+  g_assert_cmpuint (n_rate_limited, ==, 1);
+
+  /* Only byte-identical requests from the same source and socket hit. */
+  g_assert (component_find_cached_response (component, local_socket,
+      &remote_socket->addr, other_buf, other_len) == NULL);
+  g_assert (component_find_cached_response (component, remote_socket,
+      &remote_socket->addr, buf, len) == NULL);
+
+  /* Once the peer has stopped retransmitting, the entry expires. */
+  cached = (CachedStunResponse *) component_find_cached_response (component,
+      local_socket, &remote_socket->addr, buf, len);
+  g_assert (cached != NULL);
+  cached->expiry = g_get_monotonic_time () - 1;
+  g_assert (component_find_cached_response (component, local_socket,
+      &remote_socket->addr, buf, len) == NULL);
+
+  drain_component_bucket ();
+  handle_check (&remote_socket->addr, buf, len);
+  g_assert_cmpint (recv_response (replay, sizeof (replay)), ==, 0);
+  g_assert_cmpuint (component->n_rate_limited_checks, ==, 2);
+}
+
+/* A burst of checks from one source is cut off by its own bucket, and checks
+ * from many sources by the bucket for the whole component. The buckets refill
+ * while this runs, so allow for a few more checks getting through. */
+static void
+test_token_buckets (void)
+{
+  NiceAddress from;
+  guint n_admitted, i;
+
+  reset_rate_limits ();
+
+  for (i = 0, n_admitted = 0; i < COMPONENT_SOURCE_CHECK_BURST * 2; i++) {
+    if (component_admit_inbound_check (component, &remote_socket->addr))
+      n_admitted++;
+  }
+
+  g_assert_cmpuint (n_admitted, >=, COMPONENT_SOURCE_CHECK_BURST);
+  g_assert_cmpuint (n_admitted, <, COMPONENT_SOURCE_CHECK_BURST * 2);
+  g_assert_cmpuint (component->n_rate_limited_checks, ==,
+      COMPONENT_SOURCE_CHECK_BURST * 2 - n_admitted);
+
+  reset_rate_limits ();
+
+  from = remote_socket->addr;
+
+  for (i = 0, n_admitted = 0; i < COMPONENT_CHECK_BURST * 2; i++) {
+    nice_address_set_port (&from, 1024 + i);
+    if (component_admit_inbound_check (component, &from))
+      n_admitted++;
+  }
+
+  g_assert_cmpuint (n_admitted, >=, COMPONENT_CHECK_BURST);
+  g_assert_cmpuint (n_admitted, <, COMPONENT_CHECK_BURST * 2);
+  g_assert_cmpuint (component->n_rate_limited_checks, ==,
+      COMPONENT_CHECK_BURST * 2 - n_admitted);
+}
+
+int
+main (void)
+{
+  NiceAddress addr;
+  NiceCandidate *local_candidate;
+
+  g_type_init ();
+
+  g_assert (nice_address_set_from_string (&addr, "127.0.0.1"));
+
+  agent = nice_agent_new (NULL, NICE_COMPATIBILITY_RFC5245);
+  g_object_set (G_OBJECT (agent), "controlling-mode", FALSE, "ice-tcp", FALSE,
+      NULL);
+  nice_agent_add_local_address (agent, &addr);
+
+  stream_id = nice_agent_add_stream (agent, 1);
+  g_assert (stream_id > 0);
+  g_assert (nice_agent_gather_candidates (agent, stream_id));
+  g_assert (nice_agent_get_local_credentials (agent, stream_id, &local_ufrag,
+      &local_password));
+
+  g_assert (agent_find_component (agent, stream_id, 1, &stream, &component));
+  g_assert (component->local_candidates != NULL);
+  local_candidate = component->local_candidates->data;
+  local_socket = local_candidate->sockptr;
+
+  remote_socket = nice_udp_bsd_socket_new (&addr);
+  g_assert (remote_socket != NULL);
+
+  test_pending_check_dedup ();
+  test_pending_check_bound ();
+  test_cached_response ();
+  test_token_buckets ();
+
+  nice_socket_free (remote_socket);
+  g_free (local_ufrag);
+  g_free (local_password);
+  g_object_unref (agent);
+
+  return 0;
+}
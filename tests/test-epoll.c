@@ -0,0 +1,140 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/*
+ * Check that an agent polling its sockets through epoll receives on all of
+ * them, and that removing a stream from within a receive callback stops its
+ * sockets from being dispatched.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include "agent.h"
+#include "socket/socket.h"
+
+#define N_STREAMS 4
+
+static GMainLoop *loop = NULL;
+static guint n_received = 0;
+
+static void
+recv_cb (NiceAgent *agent, guint stream_id, guint component_id, guint len,
+    gchar *buf, gpointer data)
+{
+  g_assert_cmpuint (len, ==, 6);
+  g_assert (strncmp (buf, "\x80hello", len) == 0);
+
+  n_received++;
+
+  /* Removing the stream destroys the watch being dispatched. */
+  if (GPOINTER_TO_UINT (data))
+    nice_agent_remove_stream (agent, stream_id);
+
+  if (n_received == N_STREAMS)
+    g_main_loop_quit (loop);
+}
+
+static void
+send_to_local_candidate (NiceAgent *agent, guint stream_id)
+{
+  NiceCandidate *candidate;
+  GSList *candidates, *i;
+
+  candidates = nice_agent_get_local_candidates (agent, stream_id, 1);
+  g_assert (candidates != NULL);
+  candidate = candidates->data;
+
+  g_assert_cmpint (nice_socket_send (candidate->sockptr, &candidate->addr, 6,
+          "\x80hello"), ==, 6);
+
+  for (i = candidates; i; i = i->next)
+    nice_candidate_free ((NiceCandidate *) i->data);
+  g_slist_free (candidates);
+}
+
+int
+main (void)
+{
+  NiceAgent *agent;
+  NiceAddress addr;
+  guint streams[N_STREAMS];
+  gboolean use_epoll;
+  guint i;
+
+  g_type_init ();
+#if !GLIB_CHECK_VERSION(2,31,8)
+  g_thread_init (NULL);
+#endif
+
+  loop = g_main_loop_new (NULL, FALSE);
+
+  agent = g_object_new (NICE_TYPE_AGENT,
+      "compatibility", NICE_COMPATIBILITY_RFC5245,
+      "main-context", g_main_loop_get_context (loop),
+      "epoll", TRUE,
+      NULL);
+  g_object_get (agent, "epoll", &use_epoll, NULL);
+  g_assert (use_epoll);
+
+  nice_address_init (&addr);
+  nice_address_set_ipv4 (&addr, 0x7f000001);
+  nice_agent_add_local_address (agent, &addr);
+
+  for (i = 0; i < N_STREAMS; i++) {
+    streams[i] = nice_agent_add_stream (agent, 1);
+    g_assert (nice_agent_gather_candidates (agent, streams[i]));
+    /* Odd streams remove themselves once they have received. */
+    nice_agent_attach_recv (agent, streams[i], NICE_COMPONENT_TYPE_RTP,
+        g_main_loop_get_context (loop), recv_cb, GUINT_TO_POINTER (i % 2));
+  }
+
+  for (i = 0; i < N_STREAMS; i++)
+    send_to_local_candidate (agent, streams[i]);
+
+  g_main_loop_run (loop);
+  g_assert_cmpuint (n_received, ==, N_STREAMS);
+
+  /* The remaining streams still receive. */
+  n_received = N_STREAMS - 2;
+  for (i = 0; i < N_STREAMS; i += 2)
+    send_to_local_candidate (agent, streams[i]);
+
+  g_main_loop_run (loop);
+  g_assert_cmpuint (n_received, ==, N_STREAMS);
+
+  for (i = 0; i < N_STREAMS; i += 2)
+    nice_agent_remove_stream (agent, streams[i]);
+  g_object_unref (agent);
+  g_main_loop_unref (loop);
+
+  return 0;
+}
@@ -283,6 +283,10 @@ create_agent (gboolean controlling_mode, TestIOStreamThreadData *data,
     data->stream_open = TRUE;
   }
 
+  /* Run the tests against io_uring sockets if asked. */
+  if (g_getenv ("NICE_TEST_IO_URING") != NULL)
+    g_object_set (G_OBJECT (agent), "io-uring", TRUE, NULL);
+
   /* Configure the STUN server. */
   stun_server = g_getenv ("NICE_STUN_SERVER");
   stun_server_port = g_getenv ("NICE_STUN_SERVER_PORT");
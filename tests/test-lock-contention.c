@@ -0,0 +1,125 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/*
+ * Lock contention benchmark: N threads each hammer nice_agent_send() on their
+ * own agent. As the agents share no state, the throughput should grow with N
+ * up to the number of cores. The results are printed, not checked, as they
+ * depend on the machine.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "agent.h"
+
+#include <string.h>
+
+#define N_ITERATIONS 200000
+#define MAX_THREADS 8
+
+typedef struct {
+  NiceAgent *agent;
+  guint stream_id;
+} ThreadData;
+
+static gpointer
+send_thread_cb (gpointer user_data)
+{
+  ThreadData *data = user_data;
+  guint i;
+
+  /* No pair has been selected, so each send takes the agent lock, looks up
+   * the component and fails with EWOULDBLOCK. */
+  for (i = 0; i < N_ITERATIONS; i++)
+    nice_agent_send (data->agent, data->stream_id, 1, 5, "hello");
+
+  return NULL;
+}
+
+static void
+run_benchmark (guint n_threads)
+{
+  ThreadData data[MAX_THREADS];
+  GThread *threads[MAX_THREADS];
+  gint64 start, end;
+  guint i;
+
+  for (i = 0; i < n_threads; i++) {
+    data[i].agent = nice_agent_new (NULL, NICE_COMPATIBILITY_RFC5245);
+    data[i].stream_id = nice_agent_add_stream (data[i].agent, 1);
+    g_assert (data[i].stream_id > 0);
+  }
+
+  start = g_get_monotonic_time ();
+
+  for (i = 0; i < n_threads; i++) {
+#if !GLIB_CHECK_VERSION(2, 31, 8)
+    threads[i] = g_thread_create (send_thread_cb, &data[i], TRUE, NULL);
+#else
+    threads[i] = g_thread_new ("sender", send_thread_cb, &data[i]);
+#endif
+    g_assert (threads[i]);
+  }
+
+  for (i = 0; i < n_threads; i++)
+    g_thread_join (threads[i]);
+
+  end = g_get_monotonic_time ();
+
+  g_print ("%u agent(s) on %u thread(s): %.0f sends/s\n", n_threads,
+      n_threads, (gdouble) N_ITERATIONS * n_threads * G_USEC_PER_SEC /
+      MAX (end - start, 1));
+
+  for (i = 0; i < n_threads; i++)
+    g_object_unref (data[i].agent);
+}
+
+int
+main (void)
+{
+  guint n_threads;
+
+#ifdef G_OS_WIN32
+  WSADATA w;
+  WSAStartup(0x0202, &w);
+#endif
+  g_type_init ();
+#if !GLIB_CHECK_VERSION(2,31,8)
+  g_thread_init (NULL);
+#endif
+
+  for (n_threads = 1; n_threads <= MAX_THREADS; n_threads *= 2)
+    run_benchmark (n_threads);
+
+#ifdef G_OS_WIN32
+  WSACleanup();
+#endif
+  return 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/*
+ * Checks that the lock-free send path on a relayed TURN-UDP pair keeps the
+ * base socket the TURN socket sends on alive, by racing the removal of the
+ * stream against threads sending on it, and that detaching the base socket
+ * withdraws the path.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include "agent.h"
+#include "agent-priv.h" /* for testing purposes */
+
+#define N_SENDERS 4
+#define N_ITERATIONS 50
+
+static NiceAgent *agent;
+static NiceSocket *server;
+static NiceAddress peer;
+
+typedef struct {
+  guint stream_id;
+  volatile gint *stop;
+} SenderData;
+
+static gssize
+socket_recv (NiceSocket *sock, NiceAddress *addr, gsize buf_len, guint8 *buf)
+{
+  GInputVector local_buf = { buf, buf_len };
+  NiceInputMessage local_message = { &local_buf, 1, addr, 0 };
+  gint ret;
+
+  ret = nice_socket_recv_messages (sock, &local_message, 1);
+  if (ret <= 0)
+    return ret;
+
+  return local_message.length;
+}
+
+/* Create a TURN socket over @base, and bind a channel to the peer on it by
+ * answering its ChannelBind request from the server. */
+static NiceSocket *
+turn_socket_new_with_channel (NiceSocket *base)
+{
+  NiceSocket *turn, *from_sock = NULL;
+  StunAgent stun_agent;
+  StunMessage req, resp;
+  guint8 buf[STUN_MAX_MESSAGE_SIZE], resp_buf[STUN_MAX_MESSAGE_SIZE];
+  GInputVector local_buf = { buf, sizeof (buf) };
+  NiceInputMessage local_message = { &local_buf, 1, NULL, 0 };
+  NiceAddress from;
+  gssize len;
+  gsize resp_len;
+
+  turn = nice_udp_turn_socket_new (NULL, &base->addr, base, &server->addr,
+      (gchar *) "", (gchar *) "", NICE_TURN_SOCKET_COMPATIBILITY_RFC5766);
+  g_assert (turn != NULL);
+
+  g_assert (nice_udp_turn_socket_set_peer (turn, &peer));
+
+  stun_agent_init (&stun_agent, STUN_ALL_KNOWN_ATTRIBUTES,
+      STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_IGNORE_CREDENTIALS);
+
+  len = socket_recv (server, &from, sizeof (buf), buf);
+  g_assert_cmpint (len, >, 0);
+  g_assert_cmpint (stun_agent_validate (&stun_agent, &req, buf, len, NULL,
+      NULL), ==, STUN_VALIDATION_SUCCESS);
+  g_assert_cmpint (stun_message_get_method (&req), ==, STUN_CHANNELBIND);
+
+  g_assert (stun_agent_init_response (&stun_agent, &resp, resp_buf,
+      sizeof (resp_buf), &req));
+  resp_len = stun_agent_finish_message (&stun_agent, &resp, NULL, 0);
+  g_assert_cmpuint (resp_len, >, 0);
+  g_assert_cmpint (nice_socket_send (server, &from, resp_len,
+      (gchar *) resp_buf), ==, resp_len);
+
+  local_message.from = &from;
+  local_message.length = socket_recv (base, &from, sizeof (buf), buf);
+  g_assert_cmpint (local_message.length, ==, resp_len);
+  g_assert_cmpuint (nice_udp_turn_socket_parse_recv_message (turn, &from_sock,
+      &local_message), ==, 0);
+
+  return turn;
+}
+
+/* Add a stream whose selected pair is relayed through a TURN socket over its
+ * host socket, and return its component and base socket. */
+static guint
+add_relayed_stream (Component **component, NiceSocket **base)
+{
+  Stream *stream;
+  NiceCandidate *host, *local, *remote;
+  NiceSocket *turn;
+  CandidatePair pair;
+  guint stream_id;
+
+  stream_id = nice_agent_add_stream (agent, 1);
+  g_assert (stream_id > 0);
+  g_assert (nice_agent_gather_candidates (agent, stream_id));
+
+  agent_lock (agent);
+
+  g_assert (agent_find_component (agent, stream_id, 1, &stream, component));
+  g_assert ((*component)->local_candidates != NULL);
+  host = (*component)->local_candidates->data;
+  *base = host->sockptr;
+
+  turn = turn_socket_new_with_channel (*base);
+  component_attach_socket (*component, turn);
+
+  local = nice_candidate_new (NICE_CANDIDATE_TYPE_RELAYED);
+  local->stream_id = stream_id;
+  local->component_id = 1;
+  local->addr = turn->addr;
+  local->base_addr = host->addr;
+  local->sockptr = turn;
+  local->turn = turn_server_new ("127.0.0.1",
+      nice_address_get_port (&server->addr), "", "",
+      NICE_RELAY_TYPE_TURN_UDP);
+  (*component)->local_candidates =
+      g_slist_append ((*component)->local_candidates, local);
+
+  remote = nice_candidate_new (NICE_CANDIDATE_TYPE_HOST);
+  remote->stream_id = stream_id;
+  remote->component_id = 1;
+  remote->addr = peer;
+  (*component)->remote_candidates =
+      g_slist_append ((*component)->remote_candidates, remote);
+
+  memset (&pair, 0, sizeof (pair));
+  pair.local = local;
+  pair.remote = remote;
+  component_update_selected_pair (*component, &pair);
+
+  agent_unlock_and_emit (agent);
+
+  return stream_id;
+}
+
+static ComponentSendPath *
+lookup_send_path (guint stream_id)
+{
+  ComponentSendPath *path;
+  gint64 id = COMPONENT_SEND_PATH_ID (stream_id, 1);
+
+  g_rw_lock_reader_lock (&agent->send_paths_lock);
+  path = g_hash_table_lookup (agent->send_paths, &id);
+  g_rw_lock_reader_unlock (&agent->send_paths_lock);
+
+  return path;
+}
+
+static gpointer
+send_thread_cb (gpointer user_data)
+{
+  SenderData *data = user_data;
+  static const gchar payload[] = "Hello, world!";
+
+  while (!g_atomic_int_get (data->stop))
+    nice_agent_send (agent, data->stream_id, 1, sizeof (payload), payload);
+
+  return NULL;
+}
+
+/* The path holds a use of the base socket, and is withdrawn when the base
+ * socket is detached, rather than left sending on it. */
+static void
+test_detach_base_socket (void)
+{
+  Component *component;
+  NiceSocket *base;
+  ComponentSendPath *path;
+  guint stream_id;
+
+  stream_id = add_relayed_stream (&component, &base);
+
+  path = lookup_send_path (stream_id);
+  g_assert (path != NULL);
+  g_assert (path->socket->type == NICE_SOCKET_TYPE_UDP_TURN);
+  g_assert (path->base_socket_source != NULL);
+  g_assert (path->base_socket_source->socket == base);
+
+  agent_lock (agent);
+  component_detach_socket (component, base);
+  agent_unlock_and_emit (agent);
+
+  g_assert (lookup_send_path (stream_id) == NULL);
+
+  nice_agent_remove_stream (agent, stream_id);
+}
+
+/* Removing the stream frees the TURN socket and its base socket while senders
+ * are still using the path. */
+static void
+test_remove_stream_while_sending (void)
+{
+  GThread *threads[N_SENDERS];
+  SenderData data;
+  volatile gint stop;
+  Component *component;
+  NiceSocket *base;
+  guint i, j;
+
+  for (i = 0; i < N_ITERATIONS; i++) {
+    stop = 0;
+    data.stream_id = add_relayed_stream (&component, &base);
+    data.stop = &stop;
+    g_assert (lookup_send_path (data.stream_id) != NULL);
+
+    for (j = 0; j < N_SENDERS; j++)
+      threads[j] = g_thread_new ("sender", send_thread_cb, &data);
+
+    g_usleep (1000);
+    nice_agent_remove_stream (agent, data.stream_id);
+    g_usleep (1000);
+
+    g_atomic_int_set (&stop, 1);
+    for (j = 0; j < N_SENDERS; j++)
+      g_thread_join (threads[j]);
+
+    g_assert (lookup_send_path (data.stream_id) == NULL);
+  }
+}
+
+int
+main (void)
+{
+  NiceAddress addr;
+
+  g_type_init ();
+
+  g_assert (nice_address_set_from_string (&addr, "127.0.0.1"));
+  server = nice_udp_bsd_socket_new (&addr);
+  g_assert (server != NULL);
+
+  g_assert (nice_address_set_from_string (&peer, "192.0.2.1"));
+  nice_address_set_port (&peer, 4242);
+
+  agent = nice_agent_new (NULL, NICE_COMPATIBILITY_RFC5245);
+  g_object_set (G_OBJECT (agent), "ice-tcp", FALSE, NULL);
+  nice_agent_add_local_address (agent, &addr);
+
+  test_detach_base_socket ();
+  test_remove_stream_while_sending ();
+
+  g_object_unref (agent);
+  nice_socket_free (server);
+
+  return 0;
+}
@@ -0,0 +1,220 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/*
+ * Checks that ChannelData messages relayed by a TURN server are unwrapped in
+ * place when they are received over several buffers, however the header and
+ * payload are split between them.
+ */
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+
+#include "socket.h"
+#include "stun/stunagent.h"
+
+#define PAYLOAD "Hello, world!"
+#define CHANNEL 0x4000
+
+static gssize
+socket_recv (NiceSocket *sock, NiceAddress *addr, gsize buf_len, guint8 *buf)
+{
+  GInputVector local_buf = { buf, buf_len };
+  NiceInputMessage local_message = { &local_buf, 1, addr, 0 };
+  gint ret;
+
+  ret = nice_socket_recv_messages (sock, &local_message, 1);
+  if (ret <= 0)
+    return ret;
+
+  return local_message.length;
+}
+
+/* Create a TURN socket over @base, and bind a channel to @peer on it by
+ * answering its ChannelBind request from @server. */
+static NiceSocket *
+turn_socket_new_with_channel (NiceSocket *base, NiceSocket *server,
+    NiceAddress *peer)
+{
+  NiceSocket *turn, *from_sock = NULL;
+  StunAgent agent;
+  StunMessage req, resp;
+  guint8 buf[STUN_MAX_MESSAGE_SIZE], resp_buf[STUN_MAX_MESSAGE_SIZE];
+  GInputVector local_buf = { buf, sizeof (buf) };
+  NiceInputMessage local_message = { &local_buf, 1, NULL, 0 };
+  NiceAddress from;
+  gssize len;
+  gsize resp_len;
+
+  turn = nice_udp_turn_socket_new (NULL, &base->addr, base, &server->addr,
+      (gchar *) "", (gchar *) "", NICE_TURN_SOCKET_COMPATIBILITY_RFC5766);
+  g_assert (turn != NULL);
+
+  g_assert (nice_udp_turn_socket_set_peer (turn, peer));
+
+  /* Answer the ChannelBind request as the server would. */
+  stun_agent_init (&agent, STUN_ALL_KNOWN_ATTRIBUTES,
+      STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_IGNORE_CREDENTIALS);
+
+  len = socket_recv (server, &from, sizeof (buf), buf);
+  g_assert_cmpint (len, >, 0);
+  g_assert (nice_address_equal (&from, &base->addr));
+  g_assert_cmpint (stun_agent_validate (&agent, &req, buf, len, NULL, NULL),
+      ==, STUN_VALIDATION_SUCCESS);
+  g_assert_cmpint (stun_message_get_method (&req), ==, STUN_CHANNELBIND);
+
+  g_assert (stun_agent_init_response (&agent, &resp, resp_buf,
+      sizeof (resp_buf), &req));
+  resp_len = stun_agent_finish_message (&agent, &resp, NULL, 0);
+  g_assert_cmpuint (resp_len, >, 0);
+  g_assert_cmpint (nice_socket_send (server, &base->addr, resp_len,
+      (gchar *) resp_buf), ==, resp_len);
+
+  /* Hand the response to the TURN socket, as the agent would. */
+  local_message.from = &from;
+  local_message.length = socket_recv (base, &from, sizeof (buf), buf);
+  g_assert_cmpint (local_message.length, ==, resp_len);
+  g_assert_cmpuint (nice_udp_turn_socket_parse_recv_message (turn, &from_sock,
+      &local_message), ==, 0);
+
+  return turn;
+}
+
+/* Scatter a ChannelData message for @CHANNEL, followed by @padding bytes, over
+ * buffers of @buf_sizes, as the kernel would, then check it's unwrapped to
+ * its payload at the start of them. If @terminated, the buffers are passed as
+ * a %NULL-terminated array rather than with their number. */
+static void
+test_channel_data_split (NiceSocket *turn, const NiceAddress *peer,
+    const gsize *buf_sizes, guint n_bufs, gsize padding, gboolean terminated)
+{
+  guint8 datagram[4 + sizeof (PAYLOAD) - 1 + 4];
+  guint8 recv_buf[8][sizeof (datagram)];
+  GInputVector recv_bufs[G_N_ELEMENTS (recv_buf) + 1];
+  NiceInputMessage message;
+  NiceSocket *from_sock = NULL;
+  NiceAddress from;
+  guint8 payload[sizeof (datagram)];
+  gsize datagram_len, offset, payload_len;
+  guint i;
+
+  g_assert_cmpuint (n_bufs, <=, G_N_ELEMENTS (recv_buf));
+  g_assert_cmpuint (padding, <=, 4);
+
+  datagram[0] = CHANNEL >> 8;
+  datagram[1] = CHANNEL & 0xff;
+  datagram[2] = 0;
+  datagram[3] = sizeof (PAYLOAD) - 1;
+  memcpy (datagram + 4, PAYLOAD, sizeof (PAYLOAD) - 1);
+  memset (datagram + 4 + sizeof (PAYLOAD) - 1, 0, padding);
+  datagram_len = 4 + sizeof (PAYLOAD) - 1 + padding;
+
+  for (i = 0, offset = 0; i < n_bufs; i++) {
+    gsize len = MIN (buf_sizes[i], datagram_len - offset);
+
+    g_assert_cmpuint (buf_sizes[i], <=, sizeof (recv_buf[i]));
+    memset (recv_buf[i], 0xaa, sizeof (recv_buf[i]));
+    memcpy (recv_buf[i], datagram + offset, len);
+    offset += len;
+
+    recv_bufs[i].buffer = recv_buf[i];
+    recv_bufs[i].size = buf_sizes[i];
+  }
+  g_assert_cmpuint (offset, ==, datagram_len);
+
+  recv_bufs[n_bufs].buffer = NULL;
+  recv_bufs[n_bufs].size = 0;
+
+  from = *nice_udp_turn_socket_get_server_addr (turn);
+  message.buffers = recv_bufs;
+  message.n_buffers = terminated ? -1 : (gint) n_bufs;
+  message.from = &from;
+  message.length = datagram_len;
+
+  g_assert_cmpuint (nice_udp_turn_socket_parse_recv_message (turn, &from_sock,
+      &message), ==, 1);
+
+  g_assert (from_sock == turn);
+  g_assert (nice_address_equal (&from, peer));
+  g_assert_cmpuint (message.length, ==, sizeof (PAYLOAD) - 1);
+
+  for (i = 0, payload_len = 0; payload_len < message.length; i++) {
+    gsize len = MIN (recv_bufs[i].size, message.length - payload_len);
+
+    memcpy (payload + payload_len, recv_bufs[i].buffer, len);
+    payload_len += len;
+  }
+  g_assert (memcmp (payload, PAYLOAD, sizeof (PAYLOAD) - 1) == 0);
+}
+
+int
+main (void)
+{
+  NiceSocket *base, *server, *turn;
+  NiceAddress addr, peer;
+  static const gsize header_split[] = { 1, 1, 1, 1, 32 };
+  static const gsize header_and_payload_split[] = { 3, 2, 4, 1, 32 };
+  static const gsize small_bufs[] = { 2, 3, 3, 3, 3, 3, 3 };
+
+  g_type_init ();
+
+  g_assert (nice_address_set_from_string (&addr, "127.0.0.1"));
+  base = nice_udp_bsd_socket_new (&addr);
+  server = nice_udp_bsd_socket_new (&addr);
+  g_assert (base != NULL && server != NULL);
+
+  g_assert (nice_address_set_from_string (&peer, "192.0.2.1"));
+  nice_address_set_port (&peer, 4242);
+
+  turn = turn_socket_new_with_channel (base, server, &peer);
+
+  test_channel_data_split (turn, &peer, header_split,
+      G_N_ELEMENTS (header_split), 0, FALSE);
+  test_channel_data_split (turn, &peer, header_and_payload_split,
+      G_N_ELEMENTS (header_and_payload_split), 0, FALSE);
+  test_channel_data_split (turn, &peer, small_bufs,
+      G_N_ELEMENTS (small_bufs), 0, FALSE);
+
+  /* With trailing padding, which isn't part of the payload. */
+  test_channel_data_split (turn, &peer, header_and_payload_split,
+      G_N_ELEMENTS (header_and_payload_split), 3, FALSE);
+  test_channel_data_split (turn, &peer, small_bufs,
+      G_N_ELEMENTS (small_bufs), 3, TRUE);
+
+  test_channel_data_split (turn, &peer, header_split,
+      G_N_ELEMENTS (header_split), 0, TRUE);
+
+  nice_socket_free (turn);
+  nice_socket_free (base);
+  nice_socket_free (server);
+
+  return 0;
+}
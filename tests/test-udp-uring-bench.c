@@ -0,0 +1,145 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/*
+ * UDP benchmark: a client sends batches of datagrams to a server over
+ * loopback, which receives them in batches too, first with udp-bsd sockets
+ * and then with io_uring ones. The results are printed, not checked, as they
+ * depend on the machine.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include "socket.h"
+
+#define N_BATCHES 20000
+#define BATCH_SIZE 32
+#define DATAGRAM_SIZE 1200
+
+/* How long to wait for a batch before counting what's missing as dropped. */
+#define BATCH_TIMEOUT (G_USEC_PER_SEC / 2)
+
+static void
+run_benchmark (const gchar *name, NiceSocket *(*socket_new) (NiceAddress *))
+{
+  NiceSocket *server, *client;
+  NiceAddress to;
+  static guint8 send_buf[BATCH_SIZE][DATAGRAM_SIZE];
+  static guint8 recv_buf[BATCH_SIZE][DATAGRAM_SIZE];
+  GOutputVector send_bufs[BATCH_SIZE];
+  NiceOutputMessage send_messages[BATCH_SIZE];
+  GInputVector recv_bufs[BATCH_SIZE];
+  NiceInputMessage recv_messages[BATCH_SIZE];
+  guint64 n_received = 0, n_dropped = 0;
+  gint64 start, end;
+  guint i;
+
+  server = socket_new (NULL);
+  client = socket_new (NULL);
+  g_assert (server != NULL && client != NULL);
+
+  g_assert (nice_address_set_from_string (&to, "127.0.0.1"));
+  nice_address_set_port (&to, nice_address_get_port (&server->addr));
+
+  for (i = 0; i < BATCH_SIZE; i++) {
+    memset (send_buf[i], i, DATAGRAM_SIZE);
+    send_bufs[i].buffer = send_buf[i];
+    send_bufs[i].size = DATAGRAM_SIZE;
+    send_messages[i].buffers = &send_bufs[i];
+    send_messages[i].n_buffers = 1;
+
+    recv_bufs[i].buffer = recv_buf[i];
+    recv_bufs[i].size = DATAGRAM_SIZE;
+    recv_messages[i].buffers = &recv_bufs[i];
+    recv_messages[i].n_buffers = 1;
+    recv_messages[i].from = NULL;
+  }
+
+  start = g_get_monotonic_time ();
+
+  /* Receive each batch before sending the next one, so that nothing is
+   * dropped for lack of socket buffer space. */
+  for (i = 0; i < N_BATCHES; i++) {
+    gint n_sent, n;
+    gint64 deadline;
+
+    n_sent = nice_socket_send_messages (client, &to, send_messages,
+        BATCH_SIZE);
+    g_assert_cmpint (n_sent, >, 0);
+
+    /* Loopback shouldn't drop anything, but don't spin forever if it does:
+     * the sockets are non-blocking. */
+    deadline = g_get_monotonic_time () + BATCH_TIMEOUT;
+
+    while (n_sent > 0) {
+      n = nice_socket_recv_messages (server, recv_messages, n_sent);
+      g_assert_cmpint (n, >=, 0);
+      n_sent -= n;
+      n_received += n;
+
+      if (n == 0 && g_get_monotonic_time () > deadline) {
+        n_dropped += n_sent;
+        break;
+      }
+    }
+  }
+
+  end = g_get_monotonic_time ();
+
+  g_print ("%s: %.0f datagrams/s, %" G_GUINT64_FORMAT " dropped\n", name,
+      (gdouble) n_received * G_USEC_PER_SEC / MAX (end - start, 1),
+      n_dropped);
+
+  nice_socket_free (client);
+  nice_socket_free (server);
+}
+
+int
+main (void)
+{
+  NiceSocket *sock;
+
+  g_type_init ();
+
+  run_benchmark ("udp-bsd", nice_udp_bsd_socket_new);
+
+  /* io_uring may not be built in, or supported by the kernel. */
+  sock = nice_udp_uring_socket_new (NULL);
+  if (sock != NULL) {
+    nice_socket_free (sock);
+    run_benchmark ("udp-uring", nice_udp_uring_socket_new);
+  } else {
+    g_print ("udp-uring: not available\n");
+  }
+
+  return 0;
+}
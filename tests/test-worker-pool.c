@@ -0,0 +1,125 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include <nice/nice.h>
+#include "socket/socket.h"
+
+#define N_STREAMS 4
+
+static GMutex mutex;
+static GCond cond;
+static guint n_received = 0;
+static GThread *main_thread = NULL;
+
+static void
+recv_cb (
+  NiceAgent *agent,
+  guint stream_id,
+  guint component_id,
+  guint len,
+  gchar *buf,
+  gpointer data)
+{
+  g_assert (agent != NULL);
+  g_assert (component_id == 1);
+  g_assert (len == 6);
+  g_assert (0 == strncmp (buf,  "\x80hello", len));
+  g_assert (42 == GPOINTER_TO_UINT (data));
+
+  /* Received in one of the agent’s workers. */
+  g_assert (g_thread_self () != main_thread);
+
+  g_mutex_lock (&mutex);
+  n_received++;
+  g_cond_signal (&cond);
+  g_mutex_unlock (&mutex);
+}
+
+int
+main (void)
+{
+  NiceAgent *agent;
+  NiceAddress addr;
+  guint streams[N_STREAMS];
+  guint n_workers;
+  guint i;
+
+  nice_address_init (&addr);
+  g_type_init ();
+#if !GLIB_CHECK_VERSION(2,31,8)
+  g_thread_init (NULL);
+#endif
+
+  main_thread = g_thread_self ();
+
+  agent = nice_agent_new_with_pool (NULL, NICE_COMPATIBILITY_RFC5245, 2);
+  g_object_get (agent, "worker-threads", &n_workers, NULL);
+  g_assert_cmpuint (n_workers, ==, 2);
+
+  nice_address_set_ipv4 (&addr, 0x7f000001);
+  nice_agent_add_local_address (agent, &addr);
+
+  for (i = 0; i < N_STREAMS; i++) {
+    streams[i] = nice_agent_add_stream (agent, 1);
+    nice_agent_gather_candidates (agent, streams[i]);
+
+    /* A NULL context selects the stream’s worker. */
+    nice_agent_attach_recv (agent, streams[i], NICE_COMPONENT_TYPE_RTP,
+        NULL, recv_cb, GUINT_TO_POINTER (42));
+  }
+
+  for (i = 0; i < N_STREAMS; i++) {
+    NiceCandidate *candidate;
+    GSList *candidates, *j;
+
+    candidates = nice_agent_get_local_candidates (agent, streams[i], 1);
+    candidate = candidates->data;
+
+    nice_socket_send (candidate->sockptr, &(candidate->addr), 6, "\x80hello");
+    for (j = candidates; j; j = j->next)
+      nice_candidate_free ((NiceCandidate *) j->data);
+    g_slist_free (candidates);
+  }
+
+  g_mutex_lock (&mutex);
+  while (n_received < N_STREAMS)
+    g_cond_wait (&cond, &mutex);
+  g_mutex_unlock (&mutex);
+
+  for (i = 0; i < N_STREAMS; i++)
+    nice_agent_remove_stream (agent, streams[i]);
+  g_object_unref (agent);
+
+  return 0;
+}